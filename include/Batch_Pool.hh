@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <utility>
+
+// A thread-safe pool of batch objects that keep their buffers between uses. The reading thread takes
+// an empty batch with get, fills it and hands it to a worker, and the worker gives it back when done.
+// Since give_back only clears the batch, its vectors keep their capacity, so once there are as many
+// batches as the work queue can hold, filling a batch does not allocate. T must be movable and have a
+// clear() method that empties it without releasing memory.
+template<typename T>
+class Batch_Pool{
+
+    std::mutex mutex;
+    std::vector<T> free_batches;
+
+public:
+
+    // An empty batch. Reuses a returned batch if there is one.
+    T get(){
+        std::lock_guard<std::mutex> lock(mutex);
+        if(free_batches.empty()) return T();
+        T batch = std::move(free_batches.back());
+        free_batches.pop_back();
+        return batch;
+    }
+
+    void give_back(T&& batch){
+        batch.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        free_batches.push_back(std::move(batch));
+    }
+
+    int64_t n_free() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return free_batches.size();
+    }
+
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "color_counting.hh"
+
+// Per-read color counters for the threshold pseudoalignment mode. The memory scales with the number
+// of colors that the reads touch instead of with the number of colors in the index: a read that
+// touches few colors is counted in a small open-addressing hash table, and only when the table grows
+// past a fraction of the number of colors, or a bitmap color set is added, are the counts moved to a
+// dense array of 32-bit counters. The dense array covers only the colors up to the largest one counted
+// in it so far, so bitmaps of small colors do not allocate a counter for every color of the index. It
+// grows when needed and is kept for later reads. Every read starts again in the hash table, and all
+// storage keeps its capacity between reads, so the steady state does not allocate.
+class Color_Counters{
+
+    struct Entry{
+        int64_t color; // -1 if empty
+        uint32_t count;
+    };
+
+    int64_t n_colors;
+    int64_t dense_switch_size; // Switch to the dense array when the hash table has more colors than this
+
+    // Hash table mode
+    std::vector<Entry> table; // Size is a power of two
+    std::vector<int64_t> used_slots; // Slots of table that are in use
+
+    // Dense mode. counts has one counter for each of the colors 0, 1, ..., counts.size() - 1, where the
+    // size is a multiple of 64 and grows as larger colors are counted.
+    bool dense = false;
+    std::vector<uint32_t> counts;
+    std::vector<int64_t> nonzero_colors; // Colors with a non-zero count, except those in touched words
+    std::vector<char> word_is_touched; // word_is_touched[w] = 1 if counts[64w..64w+63] may have non-zero values
+    std::vector<int64_t> touched_words;
+
+    static uint64_t hash(int64_t color){
+        uint64_t h = color;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    void grow_table(){
+        std::vector<int64_t> old_used = used_slots; // Allocates only while the table is still growing
+        std::vector<Entry> old_entries;
+        for(int64_t slot : old_used) old_entries.push_back(table[slot]);
+        table.assign(table.size() * 2, {-1, 0});
+        used_slots.clear();
+        for(const Entry& E : old_entries) add_to_table(E.color, E.count);
+    }
+
+    void add_to_table(int64_t color, uint32_t value){
+        int64_t mask = table.size() - 1;
+        int64_t slot = hash(color) & mask;
+        while(table[slot].color != -1 && table[slot].color != color) slot = (slot + 1) & mask;
+        if(table[slot].color == -1){
+            table[slot].color = color;
+            table[slot].count = 0;
+            used_slots.push_back(slot);
+        }
+        table[slot].count += value;
+    }
+
+    // Makes the dense array cover at least the colors 0, 1, ..., n - 1. Grows at least by doubling
+    // so that a sequence of larger and larger colors takes amortized constant time.
+    void reserve_dense(int64_t n){
+        if(n <= (int64_t)counts.size()) return;
+        int64_t max_words = (n_colors + 63) / 64;
+        int64_t n_words = std::max((n + 63) / 64, std::min(max_words, 2 * (int64_t)word_is_touched.size()));
+        counts.resize(n_words * 64); // The new counters are zeroes
+        word_is_touched.resize(n_words);
+    }
+
+    void add_to_dense(int64_t color, uint32_t value){
+        if(color >= (int64_t)counts.size()) reserve_dense(color + 1);
+        if(counts[color] == 0) nonzero_colors.push_back(color);
+        counts[color] += value;
+    }
+
+    void switch_to_dense(){
+        dense = true;
+        for(int64_t slot : used_slots){
+            add_to_dense(table[slot].color, table[slot].count);
+            table[slot].color = -1;
+        }
+        used_slots.clear();
+    }
+
+    void touch_words(int64_t n_bits){
+        for(int64_t w = 0; w < (n_bits + 63) / 64; w++){
+            if(!word_is_touched[w]){
+                word_is_touched[w] = 1;
+                touched_words.push_back(w);
+            }
+        }
+    }
+
+public:
+
+    // Colors are 0, 1, ..., n_colors - 1
+    Color_Counters(int64_t n_colors) : n_colors(n_colors){
+        dense_switch_size = std::max((int64_t)64, n_colors / 32);
+        table.assign(16, {-1, 0});
+    }
+
+    void add(int64_t color, uint32_t value){
+        if(dense){
+            add_to_dense(color, value);
+            return;
+        }
+        if(2 * (used_slots.size() + 1) > table.size()){
+            if((int64_t)used_slots.size() + 1 > dense_switch_size){
+                switch_to_dense();
+                add_to_dense(color, value);
+                return;
+            }
+            grow_table();
+        }
+        add_to_table(color, value);
+    }
+
+    // Adds value to the counts of the colors in the union of two bitmaps. See color_counting::add_bitmap_union.
+    void add_bitmap_union(const Bit_Vector_Span& A, int64_t A_start, int64_t A_bits,
+                          const Bit_Vector_Span* B, int64_t B_start, int64_t B_bits, uint32_t value){
+        if(!dense) switch_to_dense();
+        int64_t n_bits = std::max(A_bits, B == nullptr ? 0 : B_bits);
+        reserve_dense((n_bits + 63) / 64 * 64);
+        touch_words(n_bits);
+        color_counting::add_bitmap_union(A, A_start, A_bits, B, B_start, B_bits, value, counts.data());
+    }
+
+    // Calls f(color, count) for every color with a non-zero count, in no particular order
+    template<typename callback_t>
+    void for_each_nonzero(const callback_t& f) const{
+        if(!dense){
+            for(int64_t slot : used_slots) f(table[slot].color, (int64_t)table[slot].count);
+            return;
+        }
+        for(int64_t color : nonzero_colors){
+            if(!word_is_touched[color / 64]) f(color, (int64_t)counts[color]); // Otherwise done with the word below
+        }
+        for(int64_t w : touched_words){
+            for(int64_t color = 64*w; color < 64*w + 64; color++){
+                if(counts[color] != 0) f(color, (int64_t)counts[color]);
+            }
+        }
+    }
+
+    // Sets all counts to zero and goes back to the hash table
+    void clear(){
+        if(dense){
+            for(int64_t color : nonzero_colors) counts[color] = 0;
+            for(int64_t w : touched_words){
+                std::fill(counts.begin() + 64*w, counts.begin() + 64*w + 64, 0);
+                word_is_touched[w] = 0;
+            }
+            nonzero_colors.clear();
+            touched_words.clear();
+            dense = false;
+        } else{
+            for(int64_t slot : used_slots) table[slot].color = -1;
+            used_slots.clear();
+        }
+    }
+
+    bool is_dense() const{
+        return dense;
+    }
+
+    // Bytes of memory held by the counters
+    int64_t bytes_allocated() const{
+        return table.capacity() * sizeof(Entry) + used_slots.capacity() * sizeof(int64_t)
+             + counts.capacity() * sizeof(uint32_t) + nonzero_colors.capacity() * sizeof(int64_t)
+             + word_is_touched.capacity() + touched_words.capacity() * sizeof(int64_t);
+    }
+
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+// A bounded cache of decoded color sets for one pseudoalignment worker. The key is a pair of color set
+// ids (fw_id, rc_id) and the value is the sorted union of the two color sets. A single color set is
+// cached with rc_id = -1. When the cache is full, entries are evicted with the CLOCK algorithm. The
+// byte budget covers the cached colors and the bookkeeping of the entries. Not thread-safe.
+class Color_Set_Cache{
+
+    struct Entry{
+        int64_t fw_id;
+        int64_t rc_id;
+        std::vector<int64_t> colors;
+        bool referenced = false; // CLOCK reference bit
+        bool in_use = false;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<int64_t> free_entries; // Indices of unused entries in `entries`
+
+    // Hash table with linear probing from keys to indices in `entries`. -1 means an empty slot.
+    // The size is a power of two and the load factor is at most 1/2.
+    std::vector<int64_t> table;
+    int64_t n_in_table = 0;
+
+    int64_t clock_hand = 0;
+    int64_t bytes_used = 0;
+    int64_t max_bytes;
+
+    int64_t home_slot(int64_t fw_id, int64_t rc_id) const{
+        uint64_t h = (uint64_t)fw_id * 0x9E3779B97F4A7C15ULL ^ (uint64_t)(rc_id + 1) * 0xC2B2AE3D27D4EB4FULL;
+        h ^= h >> 29;
+        return h & (table.size() - 1);
+    }
+
+    // Bytes charged for an entry with the given number of colors. Includes two table slots per entry.
+    static int64_t entry_bytes(int64_t n_colors){
+        return sizeof(Entry) + 2 * sizeof(int64_t) + n_colors * sizeof(int64_t);
+    }
+
+    void insert_to_table(int64_t entry_idx){
+        int64_t slot = home_slot(entries[entry_idx].fw_id, entries[entry_idx].rc_id);
+        while(table[slot] != -1) slot = (slot + 1) & (table.size() - 1);
+        table[slot] = entry_idx;
+        n_in_table++;
+    }
+
+    // Deletion with backward shifting, so that no tombstones are needed
+    void remove_from_table(int64_t entry_idx){
+        int64_t mask = table.size() - 1;
+        int64_t i = home_slot(entries[entry_idx].fw_id, entries[entry_idx].rc_id);
+        while(table[i] != entry_idx) i = (i + 1) & mask;
+        table[i] = -1;
+        n_in_table--;
+
+        int64_t j = i;
+        while(true){
+            j = (j + 1) & mask;
+            if(table[j] == -1) break;
+            int64_t home = home_slot(entries[table[j]].fw_id, entries[table[j]].rc_id);
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if(!stays){
+                table[i] = table[j];
+                table[j] = -1;
+                i = j;
+            }
+        }
+    }
+
+    void grow_table(){
+        table.assign(table.size() * 2, -1);
+        n_in_table = 0;
+        for(int64_t i = 0; i < (int64_t)entries.size(); i++)
+            if(entries[i].in_use) insert_to_table(i);
+    }
+
+    void evict_one(){
+        while(true){
+            if(clock_hand >= (int64_t)entries.size()) clock_hand = 0;
+            Entry& e = entries[clock_hand];
+            if(e.in_use){
+                if(e.referenced) e.referenced = false; // Second chance
+                else{
+                    remove_from_table(clock_hand);
+                    bytes_used -= entry_bytes(e.colors.size());
+                    std::vector<int64_t>().swap(e.colors); // Release the memory
+                    e.in_use = false;
+                    free_entries.push_back(clock_hand);
+                    n_evictions++;
+                    clock_hand++;
+                    return;
+                }
+            }
+            clock_hand++;
+        }
+    }
+
+public:
+
+    int64_t n_hits = 0;
+    int64_t n_misses = 0;
+    int64_t n_evictions = 0;
+
+    Color_Set_Cache(int64_t max_bytes) : max_bytes(max_bytes){
+        table.resize(1024, -1);
+    }
+
+    // Returns a pointer to the cached colors, or nullptr if the key is not in the cache. The pointer
+    // is valid until the next call to put.
+    const std::vector<int64_t>* get(int64_t fw_id, int64_t rc_id){
+        int64_t slot = home_slot(fw_id, rc_id);
+        while(table[slot] != -1){
+            Entry& e = entries[table[slot]];
+            if(e.fw_id == fw_id && e.rc_id == rc_id){
+                e.referenced = true;
+                n_hits++;
+                return &e.colors;
+            }
+            slot = (slot + 1) & (table.size() - 1);
+        }
+        n_misses++;
+        return nullptr;
+    }
+
+    // Stores a copy of the colors. The key must not be in the cache already. Color sets that
+    // would take more than the whole budget are not stored.
+    void put(int64_t fw_id, int64_t rc_id, const std::vector<int64_t>& colors){
+        int64_t bytes = entry_bytes(colors.size());
+        if(bytes > max_bytes) return;
+        while(bytes_used + bytes > max_bytes) evict_one();
+
+        int64_t idx;
+        if(free_entries.empty()){
+            idx = entries.size();
+            entries.emplace_back();
+        } else{
+            idx = free_entries.back();
+            free_entries.pop_back();
+        }
+
+        Entry& e = entries[idx];
+        e.fw_id = fw_id;
+        e.rc_id = rc_id;
+        e.colors.assign(colors.begin(), colors.end());
+        e.referenced = true;
+        e.in_use = true;
+        bytes_used += bytes;
+
+        if((n_in_table + 1) * 2 > (int64_t)table.size()) grow_table();
+        insert_to_table(idx);
+    }
+
+    int64_t size_in_bytes() const{
+        return bytes_used;
+    }
+
+    int64_t number_of_entries() const{
+        return n_in_table;
+    }
+
+};
+
+// Statistics summed over the caches of all workers
+struct Color_Set_Cache_Counters{
+    std::atomic<int64_t> hits = 0;
+    std::atomic<int64_t> misses = 0;
+    std::atomic<int64_t> evictions = 0;
+
+    void add(const Color_Set_Cache& cache){
+        hits += cache.n_hits;
+        misses += cache.n_misses;
+        evictions += cache.n_evictions;
+    }
+
+    double hit_rate() const{
+        int64_t lookups = hits + misses;
+        return lookups == 0 ? 0 : (double)hits / lookups;
+    }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+// Finds reads that are identical to an earlier read in the same work batch, so that a pseudoalignment
+// worker can compute the result once and copy it to the duplicates. A read is one sequence or a pair of
+// mates. If reverse complements are enabled, a read also matches the reverse complement of an earlier
+// read, which has the same pseudoalignment in that mode. For a pair (A, B), the reverse complement is
+// the pair (rc(B), rc(A)). Reverse complement matches are only detected for reads that consist of
+// upper case A, C, G and T, because those are the only characters with a well-defined complement.
+// The table and result storage keep their capacity between batches, so the steady state does not allocate.
+class Read_Deduplicator{
+
+    struct Read{
+        const char* S1;
+        int64_t len1;
+        const char* S2; // nullptr if not a pair
+        int64_t len2;
+        uint64_t hash; // Same for the read and its reverse complement
+
+        bool has_result = false;
+        int64_t hits_start = 0; // In result_hits
+        int64_t n_hits = 0;
+        int64_t n_relevant = 0;
+    };
+
+    bool reverse_complements;
+    std::vector<Read> reads; // Distinct reads of the current batch
+    std::vector<int64_t> table; // Hash table with linear probing: indices to `reads`, or -1 for empty
+    std::vector<int64_t> result_hits; // Concatenated hits of the reads that have a result
+
+    static char complement(char c){
+        switch(c){
+            case 'A': return 'T';
+            case 'C': return 'G';
+            case 'G': return 'C';
+            case 'T': return 'A';
+            default: return 0; // Never equal to a character of a read
+        }
+    }
+
+    static uint64_t mix(uint64_t h){
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // FNV-1a hashes of S and of its reverse complement, computed in one pass
+    static void hash_both_strands(const char* S, int64_t len, uint64_t& fw_hash, uint64_t& rc_hash){
+        fw_hash = 0xcbf29ce484222325ULL;
+        rc_hash = 0xcbf29ce484222325ULL;
+        for(int64_t i = 0; i < len; i++){
+            fw_hash = (fw_hash ^ (uint8_t)S[i]) * 0x100000001b3ULL;
+            rc_hash = (rc_hash ^ (uint8_t)complement(S[len-1-i])) * 0x100000001b3ULL;
+        }
+    }
+
+    static bool equal(const char* A, int64_t A_len, const char* B, int64_t B_len){
+        return A_len == B_len && memcmp(A, B, A_len) == 0;
+    }
+
+    // Whether A is the reverse complement of B
+    static bool equal_to_rc(const char* A, int64_t A_len, const char* B, int64_t B_len){
+        if(A_len != B_len) return false;
+        for(int64_t i = 0; i < A_len; i++)
+            if(A[i] != complement(B[A_len-1-i])) return false;
+        return true;
+    }
+
+    bool same_read(const Read& R, const char* S1, int64_t len1, const char* S2, int64_t len2) const{
+        if((R.S2 == nullptr) != (S2 == nullptr)) return false;
+        if(S2 == nullptr){
+            return equal(R.S1, R.len1, S1, len1) || (reverse_complements && equal_to_rc(R.S1, R.len1, S1, len1));
+        } else{
+            if(equal(R.S1, R.len1, S1, len1) && equal(R.S2, R.len2, S2, len2)) return true;
+            return reverse_complements && equal_to_rc(R.S1, R.len1, S2, len2) && equal_to_rc(R.S2, R.len2, S1, len1);
+        }
+    }
+
+public:
+
+    int64_t n_duplicates = 0; // Total over all batches
+
+    Read_Deduplicator(bool reverse_complements) : reverse_complements(reverse_complements) {}
+
+    // Must be called at the start of every batch. Forgets the previous batch.
+    void start_batch(int64_t n_reads_in_batch){
+        reads.clear();
+        result_hits.clear();
+        int64_t table_size = 16;
+        while(table_size < 2 * n_reads_in_batch) table_size *= 2;
+        table.assign(table_size, -1);
+    }
+
+    // If the read is identical to an earlier read of the batch, returns the index of the earlier read.
+    // Otherwise adds the read to the batch and returns -1. The index of the added read is then
+    // number_of_distinct_reads() - 1. The sequences must stay in memory until the end of the batch.
+    // For a single read, give S2 = nullptr.
+    int64_t find_or_insert(const char* S1, int64_t len1, const char* S2, int64_t len2){
+        uint64_t fw1, rc1, fw2 = 0, rc2 = 0;
+        hash_both_strands(S1, len1, fw1, rc1);
+        if(S2 != nullptr) hash_both_strands(S2, len2, fw2, rc2);
+
+        // The reverse complement of (S1, S2) is (rc(S2), rc(S1)). The hash is the smaller
+        // one of the two orientations so that both get the same hash.
+        uint64_t fw_hash = mix(fw1 ^ mix(fw2 + 1));
+        uint64_t rc_hash = mix(rc2 ^ mix(rc1 + 1));
+        if(S2 == nullptr) rc_hash = mix(rc1 ^ mix(1)); // Same formula with an empty second piece
+        uint64_t hash = reverse_complements ? std::min(fw_hash, rc_hash) : fw_hash;
+
+        int64_t mask = table.size() - 1;
+        int64_t slot = hash & mask;
+        while(table[slot] != -1){
+            const Read& R = reads[table[slot]];
+            if(R.hash == hash && same_read(R, S1, len1, S2, len2)){
+                n_duplicates++;
+                return table[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        table[slot] = reads.size();
+        Read R;
+        R.S1 = S1; R.len1 = len1; R.S2 = S2; R.len2 = len2; R.hash = hash;
+        reads.push_back(R);
+        return -1;
+    }
+
+    int64_t number_of_distinct_reads() const{
+        return reads.size();
+    }
+
+    // Stores the result of the distinct read with the given index
+    void set_result(int64_t read_idx, const std::vector<int64_t>& hits, int64_t n_relevant){
+        Read& R = reads[read_idx];
+        R.has_result = true;
+        R.hits_start = result_hits.size();
+        R.n_hits = hits.size();
+        R.n_relevant = n_relevant;
+        result_hits.insert(result_hits.end(), hits.begin(), hits.end());
+    }
+
+    // Copies the result of the distinct read with the given index into hits and n_relevant.
+    // Returns false if the read has no result (it was not reported).
+    bool get_result(int64_t read_idx, std::vector<int64_t>& hits, int64_t& n_relevant) const{
+        const Read& R = reads[read_idx];
+        if(!R.has_result) return false;
+        hits.assign(result_hits.begin() + R.hits_start, result_hits.begin() + R.hits_start + R.n_hits);
+        n_relevant = R.n_relevant;
+        return true;
+    }
+
+};
@@ -6,6 +6,10 @@
 #include <cmath>
 #include <optional>
 #include <numeric>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <exception>
 
 using namespace std;
 
@@ -19,14 +23,20 @@ class ThreadPoolParallelBoundedQueue
 
  public:
  
-  ThreadPoolParallelBoundedQueue(int64_t max_load) : current_load(0), max_load(max_load)  {
+  // If push_wait_ns or pop_wait_ns is given, the time that push or pop calls spend blocked is added there in nanoseconds
+  ThreadPoolParallelBoundedQueue(int64_t max_load, std::atomic<int64_t>* push_wait_ns = nullptr, std::atomic<int64_t>* pop_wait_ns = nullptr)
+    : current_load(0), max_load(max_load), push_wait_ns(push_wait_ns), pop_wait_ns(pop_wait_ns) {
       assert(max_load > 0);
   }
 
   T pop(){
     std::unique_lock<std::mutex> lock(queueLock);
-    while(queue.empty()) // Check the condition
-        queueEmptyCV.wait(lock);
+    if(queue.empty()){
+        auto t0 = std::chrono::steady_clock::now();
+        while(queue.empty()) // Check the condition
+            queueEmptyCV.wait(lock);
+        add_wait_time(pop_wait_ns, t0);
+    }
 
     // Critical section below
     pair<T,int64_t> item = std::move(queue.front()); queue.pop();
@@ -37,8 +47,12 @@ class ThreadPoolParallelBoundedQueue
  
   void push(T item, int64_t load){
     std::unique_lock<std::mutex> lock(queueLock);
-    while(current_load > max_load) // Check the condition
-        queueFullCV.wait(lock);
+    if(current_load > max_load){
+        auto t0 = std::chrono::steady_clock::now();
+        while(current_load > max_load) // Check the condition
+            queueFullCV.wait(lock);
+        add_wait_time(push_wait_ns, t0);
+    }
     
     // Critical section below
     queue.push(move(make_pair(move(item),load)));
@@ -55,6 +69,29 @@ class ThreadPoolParallelBoundedQueue
   int64_t current_load;
   const int64_t max_load;
 
+  std::atomic<int64_t>* push_wait_ns;
+  std::atomic<int64_t>* pop_wait_ns;
+
+  static void add_wait_time(std::atomic<int64_t>* counter, std::chrono::steady_clock::time_point start){
+    if(counter != nullptr) *counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+};
+
+// Limits how many workers of a ThreadPool process work items at the same time. The limit may change
+// while the pool is running, for example when several pools share the CPUs of a server.
+class Work_Gate{
+
+    public:
+
+    // Blocks until the calling worker may take a work item
+    virtual void enter() = 0;
+
+    // Called when the worker is done with the work item
+    virtual void leave() = 0;
+
+    virtual ~Work_Gate() = default;
+
 };
 
 // Worker threads should inherit from this class.
@@ -82,12 +119,27 @@ class BaseWorkerThread{
     virtual void critical_section() = 0;
 
     
-    void run(ThreadPoolParallelBoundedQueue<std::optional<work_item_t>>& Q){
-        while(std::optional<work_item_t> item = move(Q.pop())){
-            // Process the work item
-            process_work_item(std::move(*item));
-            std::lock_guard<std::mutex> lock(*critical_section_mutex);
-            critical_section();
+    // If gate is given, the worker holds a place from the gate from before it takes a work item until
+    // it has finished it. The place is taken before the item so that every taken item is processed
+    // without waiting, as the items of an ordered output may be waiting for each other.
+    void run(ThreadPoolParallelBoundedQueue<std::optional<work_item_t>>& Q, Work_Gate* gate = nullptr){
+        while(true){
+            if(gate) gate->enter();
+            std::optional<work_item_t> item;
+            try{
+                item = move(Q.pop());
+                if(item){
+                    // Process the work item
+                    process_work_item(std::move(*item));
+                    std::lock_guard<std::mutex> lock(*critical_section_mutex);
+                    critical_section();
+                }
+            } catch(...){
+                if(gate) gate->leave();
+                throw;
+            }
+            if(gate) gate->leave();
+            if(!item) break;
         }
     }
 
@@ -102,14 +154,32 @@ class ThreadPool{
     ThreadPoolParallelBoundedQueue<std::optional<work_item_t>> work_queue;
     std::mutex critical_section_mutex;
 
+    std::mutex error_mutex;
+    std::exception_ptr worker_error; // The first exception thrown by a worker
+
     public:
 
-    ThreadPool(vector<worker_t*>& workers, int64_t max_work_queue_load) : work_queue(max_work_queue_load){
-        for(worker_t* worker : workers){
+    // If push_wait_ns or pop_wait_ns is given, the time spent blocked on the work queue is added there in nanoseconds.
+    // If on_thread_start is given, the thread of the i-th worker calls on_thread_start(i) before taking work,
+    // for example to pin itself to a CPU. If gate is given, it limits how many of the workers run at the same time.
+    ThreadPool(vector<worker_t*>& workers, int64_t max_work_queue_load, std::atomic<int64_t>* push_wait_ns = nullptr, std::atomic<int64_t>* pop_wait_ns = nullptr, std::function<void(int64_t)> on_thread_start = nullptr, Work_Gate* gate = nullptr)
+        : work_queue(max_work_queue_load, push_wait_ns, pop_wait_ns){
+        for(int64_t i = 0; i < (int64_t)workers.size(); i++){
+            worker_t* worker = workers[i];
             worker->set_critical_section_mutex(&critical_section_mutex);
             threads.push_back(
-                std::thread([worker, this]{
-                    worker->run(this->work_queue);
+                std::thread([worker, i, on_thread_start, gate, this]{
+                    if(on_thread_start) on_thread_start(i);
+                    try{
+                        worker->run(this->work_queue, gate);
+                    } catch(...){
+                        {
+                            std::lock_guard<std::mutex> lock(error_mutex);
+                            if(!worker_error) worker_error = std::current_exception();
+                        }
+                        // Keep taking the remaining work items so that the threads adding work do not get stuck
+                        while(this->work_queue.pop()){}
+                    }
                 })
             );
         }
@@ -127,4 +197,9 @@ class ThreadPool{
         for(auto& t : threads) t.join();
     }
 
+    // Throws the first exception thrown by a worker on the calling thread, if any. Call after join_threads.
+    void rethrow_worker_error(){
+        if(worker_error) std::rethrow_exception(worker_error);
+    }
+
 };
\ No newline at end of file
@@ -3,11 +3,23 @@
 #include <vector>
 #include <memory>
 #include <array>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <fstream>
+#include <zlib.h>
 
 #include "globals.hh"
 #include "SeqIO/SeqIO.hh"
 #include "old_buffered_streams.hh"
 #include "sbwt/EM_sort/ParallelBoundedQueue.hh"
+#include "Batch_Pool.hh"
 
 using namespace std;
 using namespace sbwt;
@@ -21,53 +33,281 @@ virtual void write(const char* data, int64_t data_length) = 0;
 virtual void flush() = 0;
 virtual ~ParallelBaseWriter(){}
 
-};
+// Writes everything written so far and finishes the output. Nothing may be written after this. Unlike the
+// destructor, throws if writing the output failed.
+virtual void close(){
+    flush();
+}
 
-class ParallelOutputWriter : public ParallelBaseWriter{
-    public:
+// Writes the output for the input sequences first_seq_id, ..., first_seq_id + n_seqs - 1. Writers that
+// do not keep the output in order just write the data right away.
+virtual void write_batch(int64_t first_seq_id, int64_t n_seqs, const char* data, int64_t data_length){
+    write(data, data_length);
+}
 
-    string outfile;
-    old_themisto_code::Buffered_ofstream outstream;
-    std::mutex mutex;
+// Turns the data into the bytes that write_prepared appends to the output. Called without holding any
+// lock of the writer, so that writers can do expensive encoding like compression on the calling threads.
+virtual vector<char> prepare(const char* data, int64_t data_length){
+    return vector<char>(data, data + data_length);
+}
 
-    ParallelOutputWriter(string outfile) : outfile(outfile){
-        outstream.open(outfile);
+// Appends bytes returned by prepare to the output
+virtual void write_prepared(vector<char>&& block){
+    write(block.data(), block.size());
+}
+
+// From now on, adds the time that write calls spend waiting for the lock of the writer to the counter, in nanoseconds
+virtual void count_lock_wait_time(std::atomic<int64_t>* counter){
+    lock_wait_ns = counter;
+}
+
+protected:
+
+std::atomic<int64_t>* lock_wait_ns = nullptr;
+
+// Locks the mutex. If it is taken and lock wait time is counted, counts the time spent waiting for it.
+std::unique_lock<std::mutex> lock_counting_wait(std::mutex& mutex){
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if(!lock.owns_lock()){
+        auto t0 = std::chrono::steady_clock::now();
+        lock.lock();
+        add_lock_wait_time(t0);
     }
+    return lock;
+}
+
+void add_lock_wait_time(std::chrono::steady_clock::time_point start){
+    if(lock_wait_ns != nullptr) *lock_wait_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+};
 
+// Wraps another writer and writes the batches given to write_batch in the order of their sequence ids,
+// starting from sequence id 0. The batches must cover consecutive ranges of sequence ids without gaps.
+// Batches that arrive early are kept in memory until the batches before them have been written. If the
+// early batches would take more than max_pending_bytes bytes, the thread writing an early batch waits
+// until its batch is next in line or there is space. The thread with the next batch never waits, so if
+// the batches are processed roughly in order, this can not deadlock.
+// Plain write calls bypass the ordering and go directly to the wrapped writer (for headers and such).
+// The batches are prepared by the wrapped writer on the calling threads before they are ordered.
+class ParallelReorderingWriter : public ParallelBaseWriter{
+
+    unique_ptr<ParallelBaseWriter> inner;
+    std::mutex mutex;
+    std::condition_variable next_batch_written_cv;
 
-    ParallelOutputWriter(ostream &ostream) : outstream(ostream) {}
+    map<int64_t, pair<int64_t, vector<char>>> pending_batches; // first seq id -> (number of seqs, prepared data)
+    int64_t pending_bytes = 0;
+    int64_t max_pending_bytes;
+    int64_t next_seq_id = 0; // First sequence id of the next batch to write
 
+    public:
+
+    ParallelReorderingWriter(unique_ptr<ParallelBaseWriter> inner, int64_t max_pending_bytes) : inner(std::move(inner)), max_pending_bytes(max_pending_bytes) {}
 
     virtual void write(const string& data){
         write(data.data(), data.size());
     }
 
     virtual void write(const char* data, int64_t data_length){
-        std::lock_guard<std::mutex> lg(mutex);
-        outstream.write(data, data_length);        
+        inner->write(data, data_length);
+    }
+
+    virtual void write_batch(int64_t first_seq_id, int64_t n_seqs, const char* data, int64_t data_length){
+        vector<char> block = data_length > 0 ? inner->prepare(data, data_length) : vector<char>();
+        int64_t block_bytes = block.size();
+
+        std::unique_lock<std::mutex> lock = lock_counting_wait(mutex);
+        if(first_seq_id != next_seq_id && pending_bytes + block_bytes > max_pending_bytes){
+            auto t0 = std::chrono::steady_clock::now();
+            while(first_seq_id != next_seq_id && pending_bytes + block_bytes > max_pending_bytes)
+                next_batch_written_cv.wait(lock);
+            add_lock_wait_time(t0);
+        }
+
+        if(first_seq_id != next_seq_id){
+            // Keep the batch until it is its turn
+            pending_batches[first_seq_id] = {n_seqs, std::move(block)};
+            pending_bytes += block_bytes;
+            return;
+        }
+
+        if(block_bytes > 0) inner->write_prepared(std::move(block));
+        next_seq_id += n_seqs;
+
+        // Write the pending batches that are now next in line
+        while(!pending_batches.empty() && pending_batches.begin()->first == next_seq_id){
+            auto& [batch_n_seqs, batch_block] = pending_batches.begin()->second;
+            pending_bytes -= batch_block.size();
+            next_seq_id += batch_n_seqs;
+            if(batch_block.size() > 0) inner->write_prepared(std::move(batch_block));
+            pending_batches.erase(pending_batches.begin());
+        }
+
+        next_batch_written_cv.notify_all();
     }
 
     virtual void flush(){
-        outstream.flush();
+        inner->flush();
     }
-    
+
+    virtual void close(){
+        inner->close();
+    }
+
+    virtual void count_lock_wait_time(std::atomic<int64_t>* counter){
+        lock_wait_ns = counter;
+        inner->count_lock_wait_time(counter);
+    }
+
 };
 
-// TODO: is not buffered
-class ParallelGzipWriter : public  ParallelBaseWriter{
+// Discards everything
+class ParallelNullWriter : public ParallelBaseWriter{
     public:
 
-    string outfile;
-    unique_ptr<seq_io::zstr::ostream> gzip_outstream;
+    virtual void write(const string& data){}
+    virtual void write(const char* data, int64_t data_length){}
+    virtual void flush(){}
+
+};
+
+// Writes the output on a dedicated writer thread. The threads calling write prepare their blocks in
+// parallel: with gzip, each write is compressed into an independent gzip member on the calling thread,
+// so the threads do not take turns on one deflate stream. Concatenated gzip members are a valid gzip
+// file, and Parallel_Gzip_ifstream decompresses them in parallel. The lock is held only to queue a
+// finished block, and the writer thread just appends the blocks to the file. A thread waits if the
+// blocks waiting for the writer thread take more than max_queued_bytes. To keep the output in the order
+// of the input, wrap this in a ParallelReorderingWriter: the blocks are then compressed before they are
+// ordered.
+// If writing to the stream fails, the rest of the output is discarded, and the error is thrown from the
+// next flush or close on the calling thread.
+class ParallelBlockWriter : public ParallelBaseWriter{
+
+    std::ofstream file;
+    std::ostream* os; // Either file or a stream given by the caller
+    string output_name; // For error messages
+    bool gzipped;
+    int64_t max_queued_bytes;
+
     std::mutex mutex;
+    std::condition_variable block_queued_cv; // The writer thread waits on this
+    std::condition_variable space_cv; // Threads waiting for space or for a flush wait on this
+    std::deque<vector<char>> ready_blocks; // Blocks to write, in this order
+    int64_t ready_bytes = 0; // Includes the block being written
+    bool any_blocks = false;
+    bool stopping = false;
+    bool finished = false;
+    std::exception_ptr error; // Set if writing failed
+
+    Batch_Pool<vector<char>> buffers; // Buffers of written blocks for reuse
+    std::thread writer_thread;
+
+    // One deflate state per thread, reused for every block
+    struct Deflater{
+        z_stream zs;
+        Deflater(){
+            zs.zalloc = Z_NULL; zs.zfree = Z_NULL; zs.opaque = Z_NULL;
+            if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) // + 16 for a gzip header
+                throw std::runtime_error("Error initializing zlib");
+        }
+        ~Deflater(){ deflateEnd(&zs); }
+    };
+
+    // The bytes to append to the file for the data
+    vector<char> encode(const char* data, int64_t data_length){
+        vector<char> block = buffers.get();
+        if(!gzipped){
+            block.assign(data, data + data_length);
+            return block;
+        }
+        static thread_local Deflater D;
+        deflateReset(&D.zs);
+        block.resize(deflateBound(&D.zs, data_length) + 64); // Room for the gzip header and trailer
+        D.zs.next_in = (Bytef*)data;
+        D.zs.avail_in = data_length;
+        D.zs.next_out = (Bytef*)block.data();
+        D.zs.avail_out = block.size();
+        if(deflate(&D.zs, Z_FINISH) != Z_STREAM_END) throw std::runtime_error("Error compressing output");
+        block.resize(D.zs.total_out);
+        return block;
+    }
+
+    // Caller must hold the lock
+    void queue_block(vector<char>&& block){
+        ready_bytes += block.size();
+        ready_blocks.push_back(std::move(block));
+        any_blocks = true;
+        block_queued_cv.notify_one();
+    }
+
+    // Caller must hold the lock
+    void wait_for_space(std::unique_lock<std::mutex>& lock){
+        if(ready_bytes > 0 && ready_bytes > max_queued_bytes){
+            auto t0 = std::chrono::steady_clock::now();
+            space_cv.wait(lock, [&](){ return ready_bytes == 0 || ready_bytes <= max_queued_bytes; });
+            add_lock_wait_time(t0);
+        }
+    }
+
+    void writer_loop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true){
+            block_queued_cv.wait(lock, [&](){ return !ready_blocks.empty() || stopping; });
+            if(ready_blocks.empty()) return; // Stopping and everything is written
+            vector<char> block = std::move(ready_blocks.front());
+            ready_blocks.pop_front();
+            bool failed_before = error != nullptr;
+            lock.unlock();
+
+            bool failed = false;
+            if(!failed_before){ // After a failure the blocks are just dropped so that the writing threads do not get stuck
+                os->write(block.data(), block.size());
+                failed = os->fail();
+            }
+            int64_t n_bytes = block.size();
+            buffers.give_back(std::move(block));
+
+            lock.lock();
+            if(failed) set_error();
+            ready_bytes -= n_bytes;
+            space_cv.notify_all();
+        }
+    }
+
+    // Caller must hold the lock
+    void set_error(){
+        if(error == nullptr) error = std::make_exception_ptr(std::runtime_error("Error writing " + output_name));
+    }
+
+    // Stops the writer thread after everything has been written and flushes the stream
+    void finish(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if(finished) return;
+            finished = true;
+            if(gzipped && !any_blocks) queue_block(encode(nullptr, 0)); // An empty gzip file still needs one member
+            stopping = true;
+        }
+        block_queued_cv.notify_one();
+        writer_thread.join();
+        os->flush();
+        if(file.is_open()) file.close();
+        std::lock_guard<std::mutex> lock(mutex);
+        if(os->fail()) set_error();
+    }
 
-    ParallelGzipWriter(string outfile) : outfile(outfile){
+    public:
+
+    ParallelBlockWriter(const string& outfile, bool gzipped, int64_t max_queued_bytes) : output_name(outfile), gzipped(gzipped), max_queued_bytes(max_queued_bytes){
         check_writable(outfile);
-	gzip_outstream = unique_ptr<seq_io::zstr::ostream>(reinterpret_cast<seq_io::zstr::ostream*>(new seq_io::zstr::ofstream(outfile)));
+        file.open(outfile, ios::binary);
+        os = &file;
+        writer_thread = std::thread(&ParallelBlockWriter::writer_loop, this);
     }
 
-    ParallelGzipWriter(ostream &ostream) {
-	gzip_outstream = unique_ptr<seq_io::zstr::ostream>(new seq_io::zstr::ostream(ostream.rdbuf()));
+    ParallelBlockWriter(ostream& ostream, bool gzipped, int64_t max_queued_bytes) : os(&ostream), output_name("the output"), gzipped(gzipped), max_queued_bytes(max_queued_bytes){
+        writer_thread = std::thread(&ParallelBlockWriter::writer_loop, this);
     }
 
     virtual void write(const string& data){
@@ -75,16 +315,40 @@ class ParallelGzipWriter : public  ParallelBaseWriter{
     }
 
     virtual void write(const char* data, int64_t data_length){
-        std::lock_guard<std::mutex> lg(mutex);
-        gzip_outstream.get()->write(data, data_length);
+        if(data_length == 0) return;
+        write_prepared(encode(data, data_length));
     }
 
+    virtual vector<char> prepare(const char* data, int64_t data_length){
+        return encode(data, data_length);
+    }
+
+    virtual void write_prepared(vector<char>&& block){
+        if(block.size() == 0) return;
+        std::unique_lock<std::mutex> lock = lock_counting_wait(mutex);
+        wait_for_space(lock);
+        queue_block(std::move(block));
+    }
+
+    // Waits until everything queued so far is written, and flushes the stream
     virtual void flush(){
-        gzip_outstream->flush();
+        std::unique_lock<std::mutex> lock(mutex);
+        space_cv.wait(lock, [&](){ return ready_bytes == 0; });
+        if(error == nullptr){
+            os->flush();
+            if(os->fail()) set_error();
+        }
+        if(error != nullptr) std::rethrow_exception(error);
     }
 
-    virtual ~ParallelGzipWriter(){
-        gzip_outstream.reset();
+    virtual void close(){
+        finish();
+        std::lock_guard<std::mutex> lock(mutex);
+        if(error != nullptr) std::rethrow_exception(error);
+    }
+
+    virtual ~ParallelBlockWriter(){
+        finish();
     }
 };
 
@@ -124,6 +388,14 @@ struct ReadBatch{
                sizeof(uint64_t) * readStarts.size() + 
                sizeof(uint8_t) * 8 * metadata.size();
     }
+
+    // Empties the batch but keeps the capacity of the buffers. Called by Batch_Pool.
+    void clear(){
+        firstReadID = 0;
+        data.clear();
+        readStarts.clear();
+        metadata.clear();
+    }
 };
 
 class ReadBatchIterator{
@@ -169,23 +441,25 @@ class Metadata_Stream{
 };
 
 
-void dispatcher_consumer(ParallelBoundedQueue<ReadBatch*>& Q, DispatcherConsumerCallback* cb, int64_t thread_id);
+// Gives the buffers of the processed batches back to the pool
+void dispatcher_consumer(ParallelBoundedQueue<ReadBatch*>& Q, DispatcherConsumerCallback* cb, int64_t thread_id, Batch_Pool<ReadBatch>* pool);
 
 // Will run characters through fix_char, which at the moment of writing this comment
 // upper-cases the character and further the result is not A, C, G or T, changes it to A.
+// The batches are filled with buffers from the pool.
 template<typename sequence_reader_t>
-void dispatcher_producer(ParallelBoundedQueue<ReadBatch*>& Q, sequence_reader_t& sr, Metadata_Stream* metadata_stream, int64_t batch_size){
+void dispatcher_producer(ParallelBoundedQueue<ReadBatch*>& Q, sequence_reader_t& sr, Metadata_Stream* metadata_stream, int64_t batch_size, Batch_Pool<ReadBatch>* pool){
     // Push work in batches of approximately buffer_size base pairs
 
     int64_t read_id = 0;
-    ReadBatch* batch = new ReadBatch(); // Deleted by consumer
+    ReadBatch* batch = new ReadBatch(pool->get()); // Deleted by consumer
     std::array<uint8_t, 8> dummy_metadata;
 
     auto push_batch = [&](){
         batch->readStarts.push_back(batch->data.size()); // Append the end sentinel
         batch->metadata.push_back(dummy_metadata); // Append the end sentinel
         Q.push(batch, batch->byte_size());
-        batch = new ReadBatch(); // Clear
+        batch = new ReadBatch(pool->get()); // Clear
     };
 
     while(true){
@@ -201,7 +475,7 @@ void dispatcher_producer(ParallelBoundedQueue<ReadBatch*>& Q, sequence_reader_t&
             if(batch->data.size() == 0) batch->firstReadID = read_id;
             batch->readStarts.push_back(batch->data.size());
             batch->metadata.push_back(metadata_stream->next());
-            for(int64_t i = 0; i < len; i++) batch->data.push_back(sr.read_buf[i]);
+            batch->data.insert(batch->data.end(), sr.read_buf, sr.read_buf + len);
             if(batch->data.size() >= batch_size) push_batch();
             read_id++;
         }
@@ -216,14 +490,15 @@ template<typename sequence_reader_t>
 void run_dispatcher(vector<DispatcherConsumerCallback*>& callbacks, sequence_reader_t& sr, Metadata_Stream* metadata_stream, int64_t buffer_size){
     vector<std::thread> threads;
     ParallelBoundedQueue<ReadBatch*> Q(buffer_size);
+    Batch_Pool<ReadBatch> pool; // Buffers go from the producer to the consumers and back
 
     // Create consumers
     for(int64_t i = 0; i < callbacks.size(); i++){
-        threads.push_back(std::thread(dispatcher_consumer,std::ref(Q),callbacks[i], i));
+        threads.push_back(std::thread(dispatcher_consumer,std::ref(Q),callbacks[i], i, &pool));
     }
 
     // Create producer
-    threads.push_back(std::thread(dispatcher_producer<sequence_reader_t>,std::ref(Q),std::ref(sr),metadata_stream,buffer_size));
+    threads.push_back(std::thread(dispatcher_producer<sequence_reader_t>,std::ref(Q),std::ref(sr),metadata_stream,buffer_size,&pool));
 
     for(std::thread& t : threads) t.join();
 
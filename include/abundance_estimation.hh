@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/*
+
+Abundance estimation from pseudoalignments (--abundance-out)
+
+Every read with at least one hit falls into the equivalence class of its hit set. The reads of a
+class could have come from any of the colors of the class. The expectation-maximization algorithm
+finds the number of reads per color that best explains the class counts: in every round, the reads
+of each class are divided between the colors of the class in proportion to the current estimates,
+and the new estimate of a color is the sum of its shares. The result does not depend on the order
+of the reads, so the classes can be counted in parallel by the workers and merged at the end.
+
+Reads without hits are counted as unassigned and do not take part in the estimation.
+
+*/
+
+namespace abundance{
+
+struct Equivalence_Class{
+    std::vector<int64_t> colors; // Sorted
+    int64_t count;
+};
+
+// Counts the reads of each distinct hit set for one pseudoalignment worker. Not thread-safe.
+class Equivalence_Class_Counter{
+
+public:
+
+    struct Hash{
+        uint64_t operator()(const std::vector<int64_t>& colors) const{
+            uint64_t h = 0xcbf29ce484222325ULL ^ colors.size();
+            for(int64_t x : colors){
+                h ^= (uint64_t)x + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+            }
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            return h;
+        }
+    };
+
+    struct Value{
+        int64_t count;
+        uint64_t hash; // Stored so that merging does not need to hash the classes again
+    };
+
+    std::unordered_map<std::vector<int64_t>, Value, Hash> classes;
+    int64_t n_unassigned = 0;
+
+    // The hits must be sorted. Does not allocate if the hit set has been seen before.
+    void add(const std::vector<int64_t>& sorted_hits){
+        if(sorted_hits.empty()){
+            n_unassigned++;
+            return;
+        }
+        auto it = classes.find(sorted_hits);
+        if(it != classes.end()) it->second.count++;
+        else classes.emplace(sorted_hits, Value{1, Hash()(sorted_hits)});
+    }
+
+};
+
+// Sums up the counts of the same classes of different workers. The classes are split into n_threads
+// partitions by hash, and each thread merges one partition without any locking. The order of the
+// returned classes is arbitrary.
+std::vector<Equivalence_Class> merge_equivalence_classes(const std::vector<Equivalence_Class_Counter>& counters, int64_t n_threads);
+
+// Returns the estimated number of reads of each color 0, 1, ..., n_colors - 1. Stops when the estimates
+// change by less than tolerance times the number of reads in total in one round, or after
+// max_iterations rounds. Every round is split between n_threads threads.
+std::vector<double> estimate_abundances(const std::vector<Equivalence_Class>& classes, int64_t n_colors, int64_t n_threads, int64_t max_iterations = 10000, double tolerance = 1e-8);
+
+// Writes a tab-separated table with a header line and one line per color: the color id,
+// the estimated number of reads and the fraction of all assigned reads.
+void write_abundances(const std::vector<double>& abundances, const std::string& filename);
+
+} // namespace abundance
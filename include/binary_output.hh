@@ -0,0 +1,143 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include "SeqIO/SeqIO.hh"
+
+/*
+
+Binary pseudoalignment output format (--binary-output)
+
+The file starts with a 16-byte header:
+    - 4 bytes: the magic string "TMPA"
+    - 4 bytes: format version as a little-endian uint32 (currently 1)
+    - 8 bytes: flags as a little-endian uint64. Bit 0 is set if the records include
+      the number of k-mers of the query that had at least one color (--report-relevant-kmer-count).
+
+After the header come blocks. Each block has a 16-byte header followed by a payload:
+    - 8 bytes: number of bytes in the payload as a little-endian uint64
+    - 8 bytes: number of records in the payload as a little-endian uint64
+
+Every worker thread encodes its results into its own block, so records from different
+threads are never interleaved inside a block, but the blocks can be in any order unless
+the output is sorted with --sort-output-lines, in which case the records of the whole file
+are in order of read id. A record consists of unsigned LEB128 varints:
+    - The read id minus the read id of the previous record in the same block (zero for the
+      first record of a block), zigzag-encoded because the difference can be negative.
+    - The number of hits.
+    - The hits in increasing order. The first hit is stored as is and the rest as the gap
+      to the previous hit minus one.
+    - If bit 0 of the flags is set: the number of k-mers of the query that had at least one color.
+
+If the output is gzipped, the whole file is gzipped.
+
+*/
+
+namespace binary_format{
+
+constexpr char MAGIC[4] = {'T','M','P','A'};
+constexpr uint32_t VERSION = 1;
+constexpr int64_t FILE_HEADER_BYTES = 16;
+constexpr int64_t BLOCK_HEADER_BYTES = 16;
+constexpr int64_t MAX_VARINT_BYTES = 10;
+constexpr int64_t BLOCK_READ_CHUNK_BYTES = 1 << 24; // The reader grows the buffer of a block at most this much at a time
+constexpr uint64_t FLAG_RELEVANT_KMER_COUNTS = 1;
+
+inline uint64_t zigzag_encode(int64_t x){
+    return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t x){
+    return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+// Writes x to dest and returns the number of bytes written (at most MAX_VARINT_BYTES)
+inline int64_t encode_varint(uint64_t x, char* dest){
+    int64_t n = 0;
+    while(x >= 0x80){
+        dest[n++] = (char)((x & 0x7F) | 0x80);
+        x >>= 7;
+    }
+    dest[n++] = (char)x;
+    return n;
+}
+
+// Decodes a varint starting at src and advances src past it. Throws if the varint runs past end.
+inline uint64_t decode_varint(const char*& src, const char* end){
+    uint64_t x = 0;
+    int64_t shift = 0;
+    while(true){
+        if(src == end || shift > 63) throw std::runtime_error("Corrupt binary pseudoalignment output: truncated varint");
+        uint8_t byte = *(src++);
+        x |= (uint64_t)(byte & 0x7F) << shift;
+        if((byte & 0x80) == 0) return x;
+        shift += 7;
+    }
+}
+
+inline void write_uint64_le(uint64_t x, char* dest){
+    for(int64_t i = 0; i < 8; i++) dest[i] = (char)((x >> (8*i)) & 0xFF);
+}
+
+inline uint64_t read_uint64_le(const char* src){
+    uint64_t x = 0;
+    for(int64_t i = 0; i < 8; i++) x |= (uint64_t)(uint8_t)src[i] << (8*i);
+    return x;
+}
+
+// Returns the 16-byte file header
+std::string file_header(bool relevant_kmer_counts);
+
+// Upper bound for the number of bytes of an encoded record with n_hits hits
+inline int64_t max_record_bytes(int64_t n_hits){
+    return (n_hits + 3) * MAX_VARINT_BYTES;
+}
+
+// Encodes a record to dest and returns the number of bytes written. The hits must be sorted
+// and dest must have space for max_record_bytes(n_hits) bytes.
+inline int64_t encode_record(int64_t read_id_delta, const int64_t* hits, int64_t n_hits, bool include_relevant_count, int64_t n_relevant_kmers, char* dest){
+    int64_t n = 0;
+    n += encode_varint(zigzag_encode(read_id_delta), dest + n);
+    n += encode_varint(n_hits, dest + n);
+    for(int64_t i = 0; i < n_hits; i++){
+        uint64_t x = (i == 0) ? hits[0] : hits[i] - hits[i-1] - 1;
+        n += encode_varint(x, dest + n);
+    }
+    if(include_relevant_count) n += encode_varint(n_relevant_kmers, dest + n);
+    return n;
+}
+
+// Reads a binary pseudoalignment output file record by record. Gzipped files are detected automatically.
+class Binary_Pseudoalignment_Reader{
+
+    private:
+
+    std::unique_ptr<seq_io::zstr::ifstream> in;
+    bool relevant_kmer_counts;
+
+    std::vector<char> block; // Payload of the current block
+    const char* block_ptr = nullptr; // Next unread byte in the block
+    const char* block_end = nullptr;
+    int64_t records_left_in_block = 0;
+    int64_t prev_read_id = 0;
+
+    bool read_next_block();
+
+    public:
+
+    Binary_Pseudoalignment_Reader(const std::string& filename);
+
+    // Whether the records include the number of k-mers that had at least one color
+    bool has_relevant_kmer_counts() const {return relevant_kmer_counts;}
+
+    // Reads the next record. Returns false if there are no more records. The hits are
+    // stored into the given vector, which is cleared first. If the file does not have
+    // relevant k-mer counts, n_relevant_kmers is set to -1.
+    bool next(int64_t& read_id, std::vector<int64_t>& hits, int64_t& n_relevant_kmers);
+
+};
+
+} // End namespace binary_format
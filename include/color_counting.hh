@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include "sdsl/bit_vectors.hpp"
+#include "coloring/Mapped_Image.hh"
+
+/*
+
+Counting kernels for the threshold pseudoalignment mode
+
+For every run of k-mers with the same color set, the threshold worker adds the length of the run to
+the counter of every color in the set. When the set is stored as a bitmap, the counters are updated
+one 64-bit word of the bitmap at a time instead of decoding the colors into a vector first. A word
+with only a few bits set is handled by jumping from one set bit to the next, and a denser word by
+adding a masked value to all 64 counters of the word, which the vector instructions do in a few
+steps. The vector kernel is chosen at run time from what the CPU supports, so the same binary runs
+everywhere.
+
+*/
+
+namespace color_counting{
+
+// Words with at most this many bits set are counted bit by bit
+constexpr int64_t SPARSE_WORD_BITS = 8;
+
+// The w-th 64-bit word of the bitmap that starts at bit `start` of `bits` and has n_bits bits.
+// Bits past the end of the bitmap are zero.
+inline uint64_t bitmap_word(const Bit_Vector_Span& bits, int64_t start, int64_t n_bits, int64_t w){
+    int64_t len = std::min((int64_t)64, n_bits - 64*w);
+    if(len <= 0) return 0;
+    return bits.get_int(start + 64*w, len);
+}
+
+// Adds value to counts[i] for every i in [0, 64) such that bit i of word is set. Portable version.
+inline void add_word_scalar(uint64_t word, uint32_t value, uint32_t* counts){
+    for(int64_t i = 0; i < 64; i++)
+        counts[i] += value & -(uint32_t)((word >> i) & 1); // Branchless so that the compiler can vectorize it
+}
+
+// Adds value to counts[c] for every color c in the union of bitmaps A and B, where B may be null.
+// The bitmaps start at bits A_start and B_start of A and B and have A_bits and B_bits bits.
+// counts must have room for max(A_bits, B_bits) rounded up to a multiple of 64.
+void add_bitmap_union(const Bit_Vector_Span& A, int64_t A_start, int64_t A_bits,
+                      const Bit_Vector_Span* B, int64_t B_start, int64_t B_bits,
+                      uint32_t value, uint32_t* counts);
+
+// Name of the vector kernel selected for this CPU: "avx512", "avx2" or "scalar"
+const char* kernel_name();
+
+// Use the portable kernel even if the CPU supports a faster one. For benchmarks and tests.
+void force_scalar_kernel(bool force);
+
+} // namespace color_counting
@@ -4,6 +4,7 @@
 #include "sdsl/bit_vectors.hpp"
 #include "sdsl/int_vector.hpp"
 #include "Color_Set_Interface.hh"
+#include "Mapped_Image.hh"
 #include "SeqIO/SeqIO.hh"
 #include <variant>
 
@@ -12,8 +13,9 @@
 This file defines a hybrid color set that is either a bit map or an integer array.
 
 To avoid copying stuff around in memory, we have a color set view class that stores
-just the pointer to the data. The pointer is stored as a std::variant, which stores 
-either pointer and contains the bit specifying which type of pointer it is (bitmap or array).
+just a span of the data (see Mapped_Image.hh), which may point into a memory-mapped index.
+The span is stored as a std::variant, which stores either span and contains the bit
+specifying which type of span it is (bitmap or array).
 
 But here is the problem. The user might want a mutable color set, for example when doing
 intersections of the sets. The pointer will go into a static concatenation of sets
@@ -39,6 +41,12 @@ is not an option for performance reasons.
 
 using namespace std;
 
+// The view stores spans and the mutable color set stores pointers to sdsl vectors. These give a span for both.
+static inline const Bit_Vector_Span& colorset_bit_span(const Bit_Vector_Span& s){ return s; }
+static inline Bit_Vector_Span colorset_bit_span(const sdsl::bit_vector* v){ return Bit_Vector_Span(*v); }
+static inline const Int_Vector_Span& colorset_int_span(const Int_Vector_Span& s){ return s; }
+static inline Int_Vector_Span colorset_int_span(const sdsl::int_vector<>* v){ return Int_Vector_Span(*v); }
+
 template<typename colorset_t> 
 static inline bool colorset_is_empty(const colorset_t& cs){
     return cs.length == 0;
@@ -53,13 +61,13 @@ static inline bool colorset_is_bitmap(const colorset_t& cs){
 template<typename colorset_t> 
 static inline bool colorset_access_bitmap(const colorset_t& cs, int64_t idx){
     // Using std::holds_alternative by index because it could have a const or a non-const type
-    return (*std::get<0>(cs.data_ptr))[cs.start + idx];
+    return colorset_bit_span(std::get<0>(cs.data_ptr))[cs.start + idx];
 }
 
 template<typename colorset_t> 
 static inline int64_t colorset_access_array(const colorset_t& cs, int64_t idx){
     // Using std::holds_alternative by index because it could have a const or a non-const type
-    return (*std::get<1>(cs.data_ptr))[cs.start + idx];
+    return colorset_int_span(std::get<1>(cs.data_ptr))[cs.start + idx];
 }
 
 template<typename colorset_t> 
@@ -77,7 +85,7 @@ static inline int64_t colorset_size(const colorset_t& cs){
 template<typename colorset_t> 
 static inline int64_t colorset_size_in_bits(const colorset_t& cs){
     if(colorset_is_bitmap(cs)) return cs.length;
-    else return cs.length * std::get<1>(cs.data_ptr)->width();
+    else return cs.length * colorset_int_span(std::get<1>(cs.data_ptr)).width();
     // Using std::holds_alternative by index because it could have a const or a non-const type
 }
 
@@ -118,7 +126,7 @@ static inline bool colorset_contains(const colorset_t& cs, int64_t color){
 // Stores the intersection into buf1 and returns the number of elements in the
 // intersection (does not resize buf1). Buffer elements must be sorted.
 // Assumes all elements in a buffer are distinct
-int64_t intersect_buffers(sdsl::int_vector<>& buf1, int64_t buf1_len, const sdsl::int_vector<>& buf2, int64_t buf2_len);
+int64_t intersect_buffers(sdsl::int_vector<>& buf1, int64_t buf1_len, const Int_Vector_Span& buf2, int64_t buf2_start, int64_t buf2_len);
 
 // Stores the union into result_buf and returns the number of elements in the
 // union (does not resize result_buf). Buffers elements must be sorted.
@@ -128,35 +136,35 @@ int64_t union_buffers(vector<int64_t>& buf1, int64_t buf1_len, vector<int64_t>&
 
 // Stores the result into A and returns the length of the new bit vector. A is not resized
 // but the old elements past the end are left in place to avoid memory reallocations.
-int64_t bitmap_vs_bitmap_intersection(sdsl::bit_vector& A, int64_t A_size, const sdsl::bit_vector& B, int64_t B_start, int64_t B_size);
+int64_t bitmap_vs_bitmap_intersection(sdsl::bit_vector& A, int64_t A_size, const Bit_Vector_Span& B, int64_t B_start, int64_t B_size);
 
 // Stores the result into iv and returns the size of the intersection. iv is not resized
 // but the old elements past the end  are left in place to avoid memory reallocations.
-int64_t array_vs_bitmap_intersection(sdsl::int_vector<>& iv, int64_t iv_size, const sdsl::bit_vector& bv, int64_t bv_start, int64_t bv_size);
+int64_t array_vs_bitmap_intersection(sdsl::int_vector<>& iv, int64_t iv_size, const Bit_Vector_Span& bv, int64_t bv_start, int64_t bv_size);
 
 // Stores the result into bv and returns the length of bv. bv is not resized
 // but the old elements past the end are left in place to avoid memory reallocations.
-int64_t bitmap_vs_array_intersection(sdsl::bit_vector& bv, int64_t bv_size, const sdsl::int_vector<>& iv, int64_t iv_start, int64_t iv_size);
+int64_t bitmap_vs_array_intersection(sdsl::bit_vector& bv, int64_t bv_size, const Int_Vector_Span& iv, int64_t iv_start, int64_t iv_size);
 
 // Stores the result into A and returns the length of the new vector. A is not resized
 // but the old elements past the end are left in place to avoid memory reallocations.
-int64_t array_vs_array_intersection(sdsl::int_vector<>& A, int64_t A_len, const sdsl::int_vector<>& B, int64_t B_start, int64_t B_len);
+int64_t array_vs_array_intersection(sdsl::int_vector<>& A, int64_t A_len, const Int_Vector_Span& B, int64_t B_start, int64_t B_len);
 
 // Stores the result into A and returns the length of the new bit vector. A must have enough
 // space to accommodate the union
-int64_t bitmap_vs_bitmap_union(sdsl::bit_vector& A, int64_t A_size, const sdsl::bit_vector& B, int64_t B_start, int64_t B_size);
+int64_t bitmap_vs_bitmap_union(sdsl::bit_vector& A, int64_t A_size, const Bit_Vector_Span& B, int64_t B_start, int64_t B_size);
 
 // Stores the result into A and returns the length of the new bit vector. A must have enough
 // space to accommodate the union
-int64_t array_vs_bitmap_union(sdsl::int_vector<>& iv, int64_t iv_size, const sdsl::bit_vector& bv, int64_t bv_start, int64_t bv_size);
+int64_t array_vs_bitmap_union(sdsl::int_vector<>& iv, int64_t iv_size, const Bit_Vector_Span& bv, int64_t bv_start, int64_t bv_size);
 
 // Stores the result into A and returns the length of the new bit vector. A must have enough
 // space to accommodate the union
-int64_t bitmap_vs_array_union(sdsl::bit_vector& bv, int64_t bv_size, const sdsl::int_vector<>& iv, int64_t iv_start, int64_t iv_size);
+int64_t bitmap_vs_array_union(sdsl::bit_vector& bv, int64_t bv_size, const Int_Vector_Span& iv, int64_t iv_start, int64_t iv_size);
 
 // Stores the result into A and returns the length of the new bit vector. A must have enough
 // space to accommodate the union
-int64_t array_vs_array_union(sdsl::int_vector<>& A, int64_t A_len, const sdsl::int_vector<>& B, int64_t B_start, int64_t B_len);
+int64_t array_vs_array_union(sdsl::int_vector<>& A, int64_t A_len, const Int_Vector_Span& B, int64_t B_start, int64_t B_len);
 
 class SDSL_Variant_Color_Set;
 
@@ -164,11 +172,11 @@ class SDSL_Variant_Color_Set_View{
 
 public:
 
-    std::variant<const sdsl::bit_vector*, const sdsl::int_vector<>*> data_ptr; // Non-owning pointer to external data
+    std::variant<Bit_Vector_Span, Int_Vector_Span> data_ptr; // Non-owning span of external data
     int64_t start;
     int64_t length; // Number of bits in case of bit vector, number of elements in case of array
 
-    SDSL_Variant_Color_Set_View(std::variant<const sdsl::bit_vector*, const sdsl::int_vector<>*> data_ptr, int64_t start, int64_t length)
+    SDSL_Variant_Color_Set_View(std::variant<Bit_Vector_Span, Int_Vector_Span> data_ptr, int64_t start, int64_t length)
         : data_ptr(data_ptr), start(start), length(length){}
 
     SDSL_Variant_Color_Set_View(const SDSL_Variant_Color_Set& cs); // Defined in the .cpp file because Color_Set is not yet defined at this point of this header
@@ -237,25 +245,24 @@ class SDSL_Variant_Color_Set{
 
     // Construct a copy of a color set from a view
     SDSL_Variant_Color_Set(const SDSL_Variant_Color_Set_View& view) : length(view.length){
-        if(std::holds_alternative<const sdsl::bit_vector*>(view.data_ptr)){
+        if(std::holds_alternative<Bit_Vector_Span>(view.data_ptr)){
             data_ptr = new sdsl::bit_vector(view.length, 0);
 
             // Copy the bits
-            const sdsl::bit_vector* from = std::get<const sdsl::bit_vector*>(view.data_ptr);
+            const Bit_Vector_Span& from = std::get<Bit_Vector_Span>(view.data_ptr);
             sdsl::bit_vector* to = std::get<sdsl::bit_vector*>(data_ptr);
             for(int64_t i = 0; i < view.length; i++){ // TODO: 64 bits at a time
-                (*to)[i] = (*from)[view.start + i];
+                (*to)[i] = from[view.start + i];
             }
         } else{
             // Array
-            int64_t bit_width = std::get<const sdsl::int_vector<>*>(view.data_ptr)->width();
-            data_ptr = new sdsl::int_vector<>(view.length, 0, bit_width);
+            const Int_Vector_Span& from = std::get<Int_Vector_Span>(view.data_ptr);
+            data_ptr = new sdsl::int_vector<>(view.length, 0, from.width());
 
             // Copy the values
-            const sdsl::int_vector<>* from = std::get<const sdsl::int_vector<>*>(view.data_ptr);
             sdsl::int_vector<>* to = std::get<sdsl::int_vector<>*>(data_ptr);
             for(int64_t i = 0; i < view.length; i++){
-                (*to)[i] = (*from)[view.start + i];
+                (*to)[i] = from[view.start + i];
             }
         }
     }
@@ -297,9 +304,9 @@ class SDSL_Variant_Color_Set{
     // Stores the intersection back to to this object
     void intersection(const SDSL_Variant_Color_Set_View& other){
         if(is_bitmap() && other.is_bitmap()){
-            this->length = bitmap_vs_bitmap_intersection(*std::get<sdsl::bit_vector*>(data_ptr), this->length, *std::get<const sdsl::bit_vector*>(other.data_ptr), other.start, other.length);
+            this->length = bitmap_vs_bitmap_intersection(*std::get<sdsl::bit_vector*>(data_ptr), this->length, std::get<Bit_Vector_Span>(other.data_ptr), other.start, other.length);
         } else if(!is_bitmap() && other.is_bitmap()){
-            this->length = array_vs_bitmap_intersection(*std::get<sdsl::int_vector<>*>(data_ptr), this->length, *std::get<const sdsl::bit_vector*>(other.data_ptr), other.start, other.length);
+            this->length = array_vs_bitmap_intersection(*std::get<sdsl::int_vector<>*>(data_ptr), this->length, std::get<Bit_Vector_Span>(other.data_ptr), other.start, other.length);
         } else if(is_bitmap() && !other.is_bitmap()){
             // The result will be sparse, so this will turn our representation into an array
 
@@ -316,7 +323,7 @@ class SDSL_Variant_Color_Set{
             *this = std::move(new_set);
 
         } else{ // Array vs Array
-            this->length = array_vs_array_intersection(*std::get<sdsl::int_vector<>*>(data_ptr), this->length, *std::get<const sdsl::int_vector<>*>(other.data_ptr), other.start, other.length);
+            this->length = array_vs_array_intersection(*std::get<sdsl::int_vector<>*>(data_ptr), this->length, std::get<Int_Vector_Span>(other.data_ptr), other.start, other.length);
         }
     }
 
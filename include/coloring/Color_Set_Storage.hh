@@ -99,6 +99,9 @@ Actually, there are two concatenations: a concatenation of bit maps and a concat
 of integer arrays. A color is stored either as a bit map or an integer array, depending
 which one is smaller.
 
+The concatenations and the pointers are stored in an image (see Mapped_Image.hh), so that
+when the index is loaded from a memory-mapped file, the views point into the mapping.
+
 */
 
 template<>
@@ -106,14 +109,16 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
 
     private:
 
-    sdsl::bit_vector bitmap_concat;
-    sdsl::int_vector<> bitmap_starts; // bitmap_starts[i] = starting position of the i-th bitmap
+    Byte_Region image;
+
+    Bit_Vector_Span bitmap_concat;
+    Int_Vector_Span bitmap_starts; // bitmap_starts[i] = starting position of the i-th bitmap
 
-    sdsl::int_vector<> arrays_concat;
-    sdsl::int_vector<> arrays_starts; // arrays_starts[i] = starting position of the i-th subarray
+    Int_Vector_Span arrays_concat;
+    Int_Vector_Span arrays_starts; // arrays_starts[i] = starting position of the i-th subarray
 
-    sdsl::bit_vector is_bitmap_marks;
-    sdsl::rank_support_v5<> is_bitmap_marks_rs;
+    Bit_Vector_Span is_bitmap_marks;
+    Bit_Vector_Rank is_bitmap_marks_rs;
 
     // Dynamic-length vectors used during construction only
     // TODO: refactor these out of the class to a separate construction class
@@ -143,9 +148,24 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
         return iv;
     }
 
+    static Byte_Region build_image(const sdsl::bit_vector& bitmap_concat, const sdsl::int_vector<>& bitmap_starts,
+                                   const sdsl::int_vector<>& arrays_concat, const sdsl::int_vector<>& arrays_starts,
+                                   const sdsl::bit_vector& is_bitmap_marks){
+        Image_Writer writer;
+        writer.add_bit_vector(bitmap_concat);
+        writer.add_int_vector(bitmap_starts);
+        writer.add_int_vector(arrays_concat);
+        writer.add_int_vector(arrays_starts);
+        writer.add_bit_vector(is_bitmap_marks);
+        Bit_Vector_Rank::build(is_bitmap_marks, writer);
+        return writer.finish();
+    }
+
     public:
 
-    Color_Set_Storage() {}
+    Color_Set_Storage(){
+        load_image(build_image(sdsl::bit_vector(), sdsl::int_vector<>(), sdsl::int_vector<>(), sdsl::int_vector<>(), sdsl::bit_vector()));
+    }
 
     // Build from list of sets directly. Instead of using this constructor, you should probably just
     // call add_set for each set you want to add separately and then call prepare_for_queries when done.
@@ -163,14 +183,14 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
             int64_t start = bitmap_starts[bitmap_idx];
             int64_t end = bitmap_starts[bitmap_idx+1]; // One past the end
 
-            std::variant<const sdsl::bit_vector*, const sdsl::int_vector<>*> data_ptr = &bitmap_concat;
+            std::variant<Bit_Vector_Span, Int_Vector_Span> data_ptr = bitmap_concat;
             return SDSL_Variant_Color_Set::view_t(data_ptr, start, end-start);
         } else{
             int64_t arrays_idx = id - is_bitmap_marks_rs.rank(id); // Rank-0. This many arrays come before this bitmap
             int64_t start = arrays_starts[arrays_idx];
             int64_t end = arrays_starts[arrays_idx+1]; // One past the end
 
-            std::variant<const sdsl::bit_vector*, const sdsl::int_vector<>*> data_ptr = &arrays_concat;
+            std::variant<Bit_Vector_Span, Int_Vector_Span> data_ptr = arrays_concat;
             return SDSL_Variant_Color_Set::view_t(data_ptr, start, end-start);
         }
     }
@@ -221,13 +241,11 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
         temp_bitmap_starts.push_back(temp_bitmap_concat.size());
         temp_arrays_starts.push_back(temp_arrays_concat.size());
 
-        arrays_concat = to_sdsl_int_vector(temp_arrays_concat);
-        bitmap_starts = to_sdsl_int_vector(temp_bitmap_starts);
-        arrays_starts = to_sdsl_int_vector(temp_arrays_starts);
-        bitmap_concat = to_sdsl_bit_vector(temp_bitmap_concat);
-        is_bitmap_marks = to_sdsl_bit_vector(temp_is_bitmap_marks);
-
-        sdsl::util::init_support(is_bitmap_marks_rs, &is_bitmap_marks);
+        load_image(build_image(to_sdsl_bit_vector(temp_bitmap_concat),
+                               to_sdsl_int_vector(temp_bitmap_starts),
+                               to_sdsl_int_vector(temp_arrays_concat),
+                               to_sdsl_int_vector(temp_arrays_starts),
+                               to_sdsl_bit_vector(temp_is_bitmap_marks)));
 
         // Free memory
         temp_arrays_concat.clear(); temp_arrays_concat.shrink_to_fit();    
@@ -237,33 +255,35 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
         temp_bitmap_starts.clear(); temp_bitmap_starts.shrink_to_fit();
     }
 
-    int64_t serialize(ostream& os) const{
-        int64_t bytes_written = 0;
-
-        bytes_written += bitmap_concat.serialize(os);
-        bytes_written += bitmap_starts.serialize(os);
-
-        bytes_written += arrays_concat.serialize(os);
-        bytes_written += arrays_starts.serialize(os);
-
-        bytes_written += is_bitmap_marks.serialize(os);
-        bytes_written += is_bitmap_marks_rs.serialize(os);
-
-        return bytes_written;
+    // The image is serialized by the coloring. Temp structures are not in the image.
+    const Byte_Region& get_image() const{
+        return image;
+    }
 
-        // Do not serialize temp structures
+    // The image may point into a memory-mapped file, which stays mapped as long as the image is in use
+    void load_image(const Byte_Region& new_image){
+        image = new_image;
+        Image_Reader reader(image);
+        bitmap_concat = Bit_Vector_Span::read(reader);
+        bitmap_starts = Int_Vector_Span::read(reader);
+        arrays_concat = Int_Vector_Span::read(reader);
+        arrays_starts = Int_Vector_Span::read(reader);
+        is_bitmap_marks = Bit_Vector_Span::read(reader);
+        is_bitmap_marks_rs = Bit_Vector_Rank::read(reader, is_bitmap_marks);
     }
 
+    // Loads the stream format of color sets of version sdsl-hybrid-v4
     void load(istream& is){
-        bitmap_concat.load(is);
-        bitmap_starts.load(is);
-        arrays_concat.load(is);
-        arrays_starts.load(is);
-        is_bitmap_marks.load(is);
-
-        is_bitmap_marks_rs.load(is, &is_bitmap_marks);
-
-        // Do not load temp structures
+        sdsl::bit_vector bitmap_concat_in, is_bitmap_marks_in;
+        sdsl::int_vector<> bitmap_starts_in, arrays_concat_in, arrays_starts_in;
+        sdsl::rank_support_v5<> is_bitmap_marks_rs_in; // Not needed because the image has its own rank support
+        bitmap_concat_in.load(is);
+        bitmap_starts_in.load(is);
+        arrays_concat_in.load(is);
+        arrays_starts_in.load(is);
+        is_bitmap_marks_in.load(is);
+        is_bitmap_marks_rs_in.load(is, &is_bitmap_marks_in);
+        load_image(build_image(bitmap_concat_in, bitmap_starts_in, arrays_concat_in, arrays_starts_in, is_bitmap_marks_in));
     }
 
     int64_t number_of_sets_stored() const{
@@ -282,14 +302,12 @@ class Color_Set_Storage<SDSL_Variant_Color_Set>{
     map<string, int64_t> space_breakdown() const{
         map<string, int64_t> breakdown;
 
-        seq_io::NullStream ns;
-
-        breakdown["bitmaps-concat"] = bitmap_concat.serialize(ns);
-        breakdown["bitmaps-starts"] = bitmap_starts.serialize(ns);
-        breakdown["arrays-concat"] = arrays_concat.serialize(ns);
-        breakdown["arrays-starts"] = arrays_starts.serialize(ns);
-        breakdown["is-bitmap-marks"] = is_bitmap_marks.serialize(ns);
-        breakdown["is-bitmap-marks-rank-suppport"] = is_bitmap_marks_rs.serialize(ns);
+        breakdown["bitmaps-concat"] = bitmap_concat.size_in_bytes();
+        breakdown["bitmaps-starts"] = bitmap_starts.size_in_bytes();
+        breakdown["arrays-concat"] = arrays_concat.size_in_bytes();
+        breakdown["arrays-starts"] = arrays_starts.size_in_bytes();
+        breakdown["is-bitmap-marks"] = is_bitmap_marks.size_in_bytes();
+        breakdown["is-bitmap-marks-rank-suppport"] = is_bitmap_marks_rs.size_in_bytes();
 
         // In the future maybe the space breakdown struct should support float statistics but for now we just disgustingly print to cout.
         cout << "Fraction of bitmaps in coloring: " << (double) is_bitmap_marks_rs.rank(is_bitmap_marks.size()) / is_bitmap_marks.size() << endl;
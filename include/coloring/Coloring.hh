@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <cstdio>
 
 #include <sdsl/bit_vectors.hpp>
 
@@ -69,22 +70,27 @@ public:
              : sets(sets), node_id_to_color_set_id(node_id_to_color_set_id), index_ptr(&index), largest_color_id(largest_id), total_color_set_length(total_color_set_length){
     }
 
+    // The SDSL coloring is written in the page-aligned format sdsl-hybrid-v5, which can be memory-mapped
+    // (see Mapped_Image.hh). The stream must be at the start of the file for the pages to be aligned.
+    // If the node id -> color set id array is in the interleaved or the Elias-Fano layout, the type id is
+    // sdsl-hybrid-v5-interleaved or sdsl-hybrid-v5-elias-fano and the format is otherwise the same.
     std::size_t serialize(std::ostream& os) const {
         std::size_t bytes_written = 0;
 
-        if(std::is_same<colorset_t, SDSL_Variant_Color_Set>::value){
-            string type_id = "sdsl-hybrid-v4";
+        if constexpr(std::is_same<colorset_t, SDSL_Variant_Color_Set>::value){
+            string type_id = image_type_id(node_id_to_color_set_id.get_layout());
             bytes_written += sbwt::serialize_string(type_id, os);
-        } else if(std::is_same<colorset_t, Roaring_Color_Set>::value){
+            bytes_written += write_page_aligned_image(os, bytes_written, sets.get_image());
+            bytes_written += write_page_aligned_image(os, bytes_written, node_id_to_color_set_id.get_image());
+        } else if constexpr(std::is_same<colorset_t, Roaring_Color_Set>::value){
             string type_id = "roaring-v0";
             bytes_written += sbwt::serialize_string(type_id, os);
+            bytes_written += sets.serialize(os);
+            bytes_written += node_id_to_color_set_id.serialize(os);
         } else{
             throw std::runtime_error("Unsupported color set template");
         }
 
-        bytes_written += sets.serialize(os);
-        bytes_written += node_id_to_color_set_id.serialize(os);
-
         os.write((char*)&largest_color_id, sizeof(largest_color_id));
         bytes_written += sizeof(largest_color_id);
 
@@ -94,19 +100,26 @@ public:
         return bytes_written;
     }
 
+    // Writes to a temporary file that is then renamed to filename, so that overwriting the file that
+    // this coloring is memory-mapped from does not pull the pages from under the mapping.
     int64_t serialize(const string& filename) const{
-        throwing_ofstream out(filename, ios::binary);
-        return serialize(out.stream);
+        string temp_filename = filename + ".tmp";
+        int64_t bytes_written;
+        {
+            throwing_ofstream out(temp_filename, ios::binary);
+            bytes_written = serialize(out.stream);
+        }
+        if(std::rename(temp_filename.c_str(), filename.c_str()) != 0)
+            throw std::runtime_error("Error renaming " + temp_filename + " to " + filename);
+        return bytes_written;
     }
 
 
-    void load(std::ifstream& is, const plain_matrix_sbwt_t& index) {
-        index_ptr = &index;
-
-        string type_id = sbwt::load_string(is);
+    private:
 
-        // Check that the type id is correct for this class
-        if(type_id == "sdsl-hybrid-v4"){
+    // Checks that the type id is correct for this class
+    void check_type_id(const string& type_id) const{
+        if(type_id == "sdsl-hybrid-v4" || is_image_format(type_id)){
             if(!std::is_same<colorset_t, SDSL_Variant_Color_Set>::value){
                 throw WrongTemplateParameterException();
             }
@@ -117,6 +130,57 @@ public:
         } else{
             throw std::runtime_error("Unknown color set type:" + type_id);
         }
+    }
+
+    static string image_type_id(Sparse_Uint_Array_Layout layout){
+        if(layout == Sparse_Uint_Array_Layout::interleaved) return "sdsl-hybrid-v5-interleaved";
+        if(layout == Sparse_Uint_Array_Layout::elias_fano) return "sdsl-hybrid-v5-elias-fano";
+        return "sdsl-hybrid-v5";
+    }
+
+    static bool is_image_format(const string& type_id){
+        for(Sparse_Uint_Array_Layout layout : {Sparse_Uint_Array_Layout::separate, Sparse_Uint_Array_Layout::interleaved, Sparse_Uint_Array_Layout::elias_fano})
+            if(type_id == image_type_id(layout)) return true;
+        return false;
+    }
+
+    // Reads the images of a file in format sdsl-hybrid-v5 starting from the given offset in the file
+    void load_images(const Byte_Region& file, int64_t offset, const string& type_id){
+        if constexpr(std::is_same<colorset_t, SDSL_Variant_Color_Set>::value){
+            Image_Reader reader(file, offset);
+            sets.load_image(read_page_aligned_image(reader));
+            Sparse_Uint_Array_Layout layout = Sparse_Uint_Array_Layout::separate;
+            if(type_id == image_type_id(Sparse_Uint_Array_Layout::interleaved)) layout = Sparse_Uint_Array_Layout::interleaved;
+            if(type_id == image_type_id(Sparse_Uint_Array_Layout::elias_fano)) layout = Sparse_Uint_Array_Layout::elias_fano;
+            node_id_to_color_set_id.load_image(read_page_aligned_image(reader), layout);
+            largest_color_id = reader.read_int();
+            total_color_set_length = reader.read_int();
+        }
+    }
+
+    public:
+
+    // Loads from a stream. A coloring in the page-aligned format is copied to memory. Loading
+    // with a filename maps it instead.
+    void load(std::ifstream& is, const plain_matrix_sbwt_t& index) {
+        index_ptr = &index;
+
+        string type_id = sbwt::load_string(is);
+        check_type_id(type_id);
+
+        if(is_image_format(type_id)){
+            // Read the rest of the stream to a buffer at the same offset as in the file, so that the
+            // positions of the pages are the same as in the file
+            int64_t offset = is.tellg();
+            is.seekg(0, ios::end);
+            int64_t file_size = is.tellg();
+            is.seekg(offset, ios::beg);
+            Image_Words buf((file_size + 7) / 8);
+            is.read((char*)buf.data() + offset, file_size - offset);
+            if(!is) throw std::runtime_error("Error reading the coloring");
+            load_images(Byte_Region::from_buffer(std::move(buf), file_size), offset, type_id);
+            return;
+        }
 
         sets.load(is);
         node_id_to_color_set_id.load(is);
@@ -125,42 +189,126 @@ public:
         is.read((char*)&total_color_set_length, sizeof(total_color_set_length));
     }
 
+    // Memory-maps a coloring in format sdsl-hybrid-v5, so that the index is not copied and
+    // processes that load the same file share it in the page cache. Older formats are read as a stream.
     void load(const std::string& filename, const plain_matrix_sbwt_t& index) {
         throwing_ifstream in(filename, ios::binary);
-        load(in.stream, index);
+        string type_id = sbwt::load_string(in.stream);
+        int64_t offset = in.stream.tellg();
+        if(is_image_format(type_id)){
+            check_type_id(type_id);
+            index_ptr = &index;
+            load_images(Byte_Region::map_file(filename), offset, type_id);
+        } else{
+            in.stream.seekg(0, ios::beg);
+            load(in.stream, index);
+        }
     }
 
-    std::int64_t get_color_set_id(std::int64_t node) const {
+    private:
+
+    // The out-neighbor of a node that is not a core k-mer
+    std::int64_t follow_edge_forward(std::int64_t node) const {
         const auto& C_array = index_ptr->get_C_array();
-        const auto& subset_struct= index_ptr->get_subset_rank_structure();
+        const auto& subset_struct = index_ptr->get_subset_rank_structure();
+
+        // Follow an edge forward. The code below works only if we are at the
+        // start of a suffix group. But this is guaranteed by the core k-mer marking
+        // rules. If a suffix group is wider than 1, then all its elements are marked
+        // as core because:
+        //   - If there is at least one outgoing edge from the group, the nodes are marked
+        //     by core k-mer rule (3) (see core_kmer_marker.hh)
+        //   - If there are no outgoing edges from the group, the nodes are marked by
+        //     core k-mer rule (2) (see core_kmer_marker.hh).
+        if (subset_struct.A_bits[node] == 1) {
+            return C_array[0] + subset_struct.rank(node, 'A');
+        } else if (subset_struct.C_bits[node] == 1) {
+            return C_array[1] + subset_struct.rank(node, 'C');
+        } else if (subset_struct.G_bits[node] == 1) {
+            return C_array[2] + subset_struct.rank(node, 'G');
+        } else if (subset_struct.T_bits[node] == 1) {
+            return C_array[3] + subset_struct.rank(node, 'T');
+        } else {
+            throw std::runtime_error("BUG: dead end in get_color_set_id");
+        }
+    }
+
+    // Starts loading the data that the next step of a color set id lookup at the node needs into the cache
+    void prefetch_lookup_step(std::int64_t node) const {
+        const auto& subset_struct = index_ptr->get_subset_rank_structure();
+        node_id_to_color_set_id.prefetch(node);
+        __builtin_prefetch(subset_struct.A_bits.data() + (node >> 6));
+        __builtin_prefetch(subset_struct.C_bits.data() + (node >> 6));
+        __builtin_prefetch(subset_struct.G_bits.data() + (node >> 6));
+        __builtin_prefetch(subset_struct.T_bits.data() + (node >> 6));
+    }
 
+    public:
+
+    std::int64_t get_color_set_id(std::int64_t node) const {
         while (!is_core_kmer(node)) {
             // While we don't have the color set id stored for the current node...
-
-            // Follow an edge forward. The code below works only if we are at the
-            // start of a suffix group. But this is guaranteed by the core k-mer marking
-            // rules. If a suffix group is wider than 1, then all its elements are marked
-            // as core because:
-            //   - If there is at least one outgoing edge from the group, the nodes are marked
-            //     by core k-mer rule (3) (see core_kmer_marker.hh)
-            //   - If there are no outgoing edges from the group, the nodes are marked by
-            //     core k-mer rule (2) (see core_kmer_marker.hh).
-            if (subset_struct.A_bits[node] == 1) {
-                node = C_array[0] + subset_struct.rank(node, 'A');
-            } else if (subset_struct.C_bits[node] == 1) {
-                node = C_array[1] + subset_struct.rank(node, 'C');
-            } else if (subset_struct.G_bits[node] == 1) {
-                node = C_array[2] + subset_struct.rank(node, 'G');
-            } else if (subset_struct.T_bits[node] == 1) {
-                node = C_array[3] + subset_struct.rank(node, 'T');
-            } else {
-                throw std::runtime_error("BUG: dead end in get_color_set_id");
-            }
+            node = follow_edge_forward(node);
         }
 
         return node_id_to_color_set_id.get(node);
     }
 
+    // The nodes that get_color_set_id(node) walks through before it reaches a node with a pointer, which is
+    // returned. The walk is empty if the node itself has a pointer.
+    std::int64_t get_lookup_walk(std::int64_t node, std::vector<std::int64_t>& walk) const {
+        walk.clear();
+        while (!is_core_kmer(node)) {
+            walk.push_back(node);
+            node = follow_edge_forward(node);
+        }
+        return node;
+    }
+
+    // Same as calling get_color_set_id for each of the n nodes, writing the results to out. Each lookup is
+    // a chain of dependent cache misses, so the lookups are advanced in lockstep, a few at a time, and the
+    // data of the next step of each is prefetched while the others take their step.
+    void get_color_set_ids(const std::int64_t* nodes, std::int64_t n, std::int64_t* out) const {
+        constexpr std::int64_t max_lanes = 16;
+        std::int64_t lane_node[max_lanes]; // The current node of the walk, or the position of the value if found
+        std::int64_t lane_out[max_lanes]; // Index in out
+        bool lane_found[max_lanes];
+        std::int64_t n_lanes = 0;
+        std::int64_t next = 0;
+
+        while(next < n || n_lanes > 0){
+            while(n_lanes < max_lanes && next < n){
+                prefetch_lookup_step(nodes[next]);
+                lane_node[n_lanes] = nodes[next];
+                lane_out[n_lanes] = next;
+                lane_found[n_lanes] = false;
+                n_lanes++; next++;
+            }
+
+            for(std::int64_t l = 0; l < n_lanes; ){
+                if(lane_found[l]){
+                    out[lane_out[l]] = node_id_to_color_set_id.get_value_at(lane_node[l]);
+                    // Move the last lane here. It has not taken its step in this round yet.
+                    n_lanes--;
+                    lane_node[l] = lane_node[n_lanes];
+                    lane_out[l] = lane_out[n_lanes];
+                    lane_found[l] = lane_found[n_lanes];
+                    continue;
+                }
+                std::int64_t v = lane_node[l];
+                if(is_core_kmer(v)){
+                    lane_node[l] = node_id_to_color_set_id.value_position(v);
+                    lane_found[l] = true;
+                    node_id_to_color_set_id.prefetch_value(lane_node[l]);
+                } else{
+                    lane_node[l] = follow_edge_forward(v);
+                    prefetch_lookup_step(lane_node[l]);
+                }
+                l++;
+            }
+        }
+    }
+
     colorset_view_type get_color_set_of_node(std::int64_t node) const {
         std::int64_t color_set_id = get_color_set_id(node);
         return get_color_set_by_color_set_id(color_set_id);
@@ -210,6 +358,50 @@ public:
         return node_id_to_color_set_id;
     }
 
+    // Converts the node id -> color set id array to the given layout. Only the SDSL coloring
+    // stores the interleaved and Elias-Fano layouts on disk.
+    void set_node_id_to_colorset_id_layout(Sparse_Uint_Array_Layout layout){
+        node_id_to_color_set_id = node_id_to_color_set_id.with_layout(layout);
+    }
+
+    // Renumbers the color sets in order of decreasing number of nodes that point to them, ties in the old
+    // order, and stores them in that order. The color sets of most k-mers are then next to each other at
+    // the start of the storage, where they stay in the cache during queries.
+    void order_color_sets_by_frequency(){
+        int64_t n_sets = sets.number_of_sets_stored();
+        vector<int64_t> n_pointers(n_sets, 0);
+        for(int64_t v = 0; v < node_id_to_color_set_id.size(); v++){
+            int64_t id = node_id_to_color_set_id.get(v);
+            if(id != -1) n_pointers[id]++;
+        }
+
+        vector<int64_t> order(n_sets); // New id -> old id
+        for(int64_t i = 0; i < n_sets; i++) order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int64_t a, int64_t b){ return n_pointers[a] > n_pointers[b]; });
+        vector<int64_t> new_id(n_sets);
+        for(int64_t i = 0; i < n_sets; i++) new_id[order[i]] = i;
+
+        colorset_storage_type new_sets;
+        for(int64_t old_id : order) new_sets.add_set(get_color_set_as_vector_by_color_set_id(old_id));
+        new_sets.prepare_for_queries();
+
+        sdsl::bit_vector marks(node_id_to_color_set_id.size(), 0);
+        uint64_t max_value = 0;
+        for(int64_t i = 0; i < n_sets; i++) if(n_pointers[order[i]] > 0) max_value = i;
+        sdsl::int_vector<> values(node_id_to_color_set_id.number_of_values(), 0, std::max((int64_t)std::bit_width(max_value), (int64_t)1));
+        int64_t n_values = 0;
+        for(int64_t v = 0; v < node_id_to_color_set_id.size(); v++){
+            int64_t id = node_id_to_color_set_id.get(v);
+            if(id == -1) continue;
+            marks[v] = 1;
+            values[n_values++] = new_id[id];
+        }
+
+        Sparse_Uint_Array_Layout layout = node_id_to_color_set_id.get_layout();
+        sets = std::move(new_sets);
+        node_id_to_color_set_id = Sparse_Uint_Array(marks, values, max_value).with_layout(layout);
+    }
+
     const std::vector<colorset_view_type> get_all_distinct_color_sets() const{
         return sets.get_all_sets();
     }
@@ -284,6 +476,32 @@ public:
 
     }
 
+    // Adds pointers from the given nodes to their color sets, keeping the layout of the pointer array. This
+    // makes get_color_set_id faster for these nodes and for the nodes whose walks go through them.
+    void add_node_id_to_color_set_id_pointers(std::vector<int64_t> nodes){
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+        vector<pair<int64_t, int64_t>> added; // (node, color set id), sorted by node
+        for(int64_t v : nodes)
+            if(!is_core_kmer(v)) added.push_back({v, get_color_set_id(v)});
+
+        uint64_t max_value = node_id_to_color_set_id.get_max_value();
+        sdsl::bit_vector marks(node_id_to_color_set_id.size(), 0);
+        sdsl::int_vector<> values(node_id_to_color_set_id.number_of_values() + added.size(), 0, std::max((int64_t)std::bit_width(max_value), (int64_t)1));
+        int64_t n_values = 0;
+        int64_t next_added = 0;
+        for(int64_t v = 0; v < node_id_to_color_set_id.size(); v++){
+            int64_t id = node_id_to_color_set_id.get(v);
+            if(id == -1 && next_added < added.size() && added[next_added].first == v) id = added[next_added++].second;
+            if(id == -1) continue;
+            marks[v] = 1;
+            values[n_values++] = id;
+        }
+
+        Sparse_Uint_Array_Layout layout = node_id_to_color_set_id.get_layout();
+        node_id_to_color_set_id = Sparse_Uint_Array(marks, values, max_value).with_layout(layout);
+    }
+
     template<typename T1, typename T2> requires Color_Set_Interface<T1>
     friend class Coloring_Builder;
 
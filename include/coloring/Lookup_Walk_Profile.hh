@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/*
+
+Chooses where to add color set pointers for a given query workload
+
+get_color_set_id walks forward from the node of a k-mer until it reaches a node with a pointer, so a
+lookup takes time in proportion to the distance to the next pointer. A pointer at a node u saves the
+rest of the walk from u for every lookup whose walk goes through u. The profile counts how many times
+each node is looked up in a sample of queries, and then chooses greedily the nodes that save the most
+steps in total. A chosen pointer cuts short the walks through it, which lowers the savings of the nodes
+before it on those walks, so the savings are recomputed lazily: a node is chosen only if its saving
+given the earlier choices is still the largest.
+
+The walks that end at the same pointer form a tree, and a new pointer only changes the savings of the
+nodes in its own tree, so the lookups are grouped by the end of their walk.
+
+*/
+
+template<typename coloring_t>
+class Lookup_Walk_Profile{
+
+    const coloring_t* coloring;
+    std::unordered_map<int64_t, int64_t> lookup_counts; // Node -> number of lookups that start from it
+
+    typedef std::vector<std::pair<int64_t, int64_t>> lookup_list_t; // (node, number of lookups)
+
+    // The number of steps that a pointer at the node saves given the chosen pointers, over the lookups
+    // of the tree of the node
+    int64_t saving(int64_t node, const std::unordered_set<int64_t>& chosen, const lookup_list_t& tree_lookups, std::vector<int64_t>& walk) const{
+        int64_t total = 0;
+        for(auto [start, count] : tree_lookups){
+            coloring->get_lookup_walk(start, walk);
+            int64_t node_pos = -1;
+            int64_t end = walk.size(); // Where the walk ends with the chosen pointers
+            for(int64_t i = 0; i < walk.size(); i++){
+                if(chosen.count(walk[i])){
+                    end = i;
+                    break;
+                }
+                if(walk[i] == node) node_pos = i;
+            }
+            if(node_pos != -1) total += count * (end - node_pos);
+        }
+        return total;
+    }
+
+public:
+
+    Lookup_Walk_Profile(const coloring_t& coloring) : coloring(&coloring) {}
+
+    // Records a lookup of the color set of a node. Nodes of k-mers that are not in the index (-1) are ignored.
+    void add_lookup(int64_t node){
+        if(node >= 0) lookup_counts[node]++;
+    }
+
+    // Records the lookups that pseudoalign does for a query with the given colex ranks of its k-mers,
+    // with -1 for the k-mers that are not found. Like pseudoalign, only the core k-mers and the k-mers
+    // that are not followed by a found k-mer are looked up. The others copy the color set of the next k-mer.
+    void add_query_lookups(const std::vector<int64_t>& colex_ranks){
+        int64_t n = colex_ranks.size();
+        for(int64_t i = 0; i < n; i++){
+            int64_t v = colex_ranks[i];
+            if(v == -1) continue;
+            if(i == n-1 || colex_ranks[i+1] == -1 || coloring->is_core_kmer(v)) add_lookup(v);
+        }
+    }
+
+    // Adds the lookups of another profile of the same coloring
+    void merge(const Lookup_Walk_Profile& other){
+        for(auto [node, count] : other.lookup_counts) lookup_counts[node] += count;
+    }
+
+    int64_t number_of_lookups() const{
+        int64_t total = 0;
+        for(auto [node, count] : lookup_counts) total += count;
+        return total;
+    }
+
+    // The total number of forward steps that the recorded lookups take
+    int64_t number_of_steps() const{
+        int64_t total = 0;
+        std::vector<int64_t> walk;
+        for(auto [node, count] : lookup_counts){
+            coloring->get_lookup_walk(node, walk);
+            total += count * walk.size();
+        }
+        return total;
+    }
+
+    // Chooses at most max_nodes nodes where pointers save the most steps of the recorded lookups. Returns the
+    // nodes and the number of steps that pointers at them save together.
+    std::pair<std::vector<int64_t>, int64_t> choose_nodes(int64_t max_nodes) const{
+        std::unordered_map<int64_t, lookup_list_t> tree_lookups; // End of walk -> lookups
+        std::unordered_map<int64_t, int64_t> tree_of_node; // Node on a walk -> end of the walk
+        std::unordered_map<int64_t, int64_t> initial_savings; // Without any new pointers
+        std::vector<int64_t> walk;
+        for(auto [start, count] : lookup_counts){
+            int64_t end = coloring->get_lookup_walk(start, walk);
+            if(walk.empty()) continue; // Has a pointer already
+            tree_lookups[end].push_back({start, count});
+            for(int64_t i = 0; i < walk.size(); i++){
+                tree_of_node[walk[i]] = end;
+                initial_savings[walk[i]] += count * (walk.size() - i);
+            }
+        }
+
+        // The savings only decrease as pointers are chosen, so the savings in the queue are upper bounds
+        std::priority_queue<std::pair<int64_t, int64_t>> queue; // (saving, node)
+        for(auto [node, s] : initial_savings) queue.push({s, node});
+
+        std::unordered_set<int64_t> chosen;
+        std::vector<int64_t> nodes;
+        int64_t total_saving = 0;
+        while(nodes.size() < max_nodes && !queue.empty()){
+            int64_t node = queue.top().second;
+            queue.pop();
+            int64_t s = saving(node, chosen, tree_lookups[tree_of_node[node]], walk);
+            if(s == 0) continue;
+            if(!queue.empty() && s < queue.top().first){
+                queue.push({s, node}); // Another node may save more now
+                continue;
+            }
+            chosen.insert(node);
+            nodes.push_back(node);
+            total_saving += s;
+        }
+        return {nodes, total_saving};
+    }
+
+};
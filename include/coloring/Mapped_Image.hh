@@ -0,0 +1,482 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+#include "sdsl/bit_vectors.hpp"
+#include "sdsl/int_vector.hpp"
+
+/*
+
+Read-only data structures that can live in a memory-mapped file
+
+The query-time parts of an SDSL coloring (the color set storage and the node id -> color set id array)
+are stored as images: immutable byte buffers with a fixed layout, where the bit vectors and integer
+vectors are plain arrays of 64-bit words. Each array of words starts at a multiple of the page size
+in the image, and the images start at page boundaries of the .tcolors file, so the file can be
+memory-mapped and the structures read straight from the mapping without copying anything. Several
+processes that map the same index share one copy of it in the page cache.
+
+An image is a sequence of 64-bit integers and word blocks. A word block is written as the number of
+words, the number of padding bytes, the padding and the words. The reader just skips the padding, so
+it does not need to know where the image is in the file. The images are in the native byte order,
+like the sdsl vectors of the older formats.
+
+A structure that is built in memory instead of loaded from a file writes its image to a heap buffer
+and reads it from there, so the query code is the same in both cases. The heap buffers are aligned to
+cache lines, so that the word blocks are at the same cache line offsets in memory as in a mapped file.
+The images are shared between copies of the structure.
+
+*/
+
+constexpr int64_t IMAGE_PAGE_BYTES = 4096;
+constexpr int64_t CACHE_LINE_BYTES = 64;
+
+// Allocates cache-line aligned memory
+template<typename T>
+struct Cache_Line_Allocator{
+    typedef T value_type;
+    Cache_Line_Allocator() = default;
+    template<typename U> Cache_Line_Allocator(const Cache_Line_Allocator<U>&) {}
+    T* allocate(std::size_t n){
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(CACHE_LINE_BYTES)));
+    }
+    void deallocate(T* p, std::size_t n){
+        ::operator delete(p, std::align_val_t(CACHE_LINE_BYTES));
+    }
+    template<typename U> bool operator==(const Cache_Line_Allocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const Cache_Line_Allocator<U>&) const { return false; }
+};
+
+typedef std::vector<uint64_t, Cache_Line_Allocator<uint64_t>> Image_Words;
+
+// A read-only byte range that is either a memory-mapped file or a heap buffer. Copies share the bytes,
+// which are released when the last copy is gone.
+class Byte_Region{
+
+    std::shared_ptr<const void> owner;
+    const char* ptr = nullptr;
+    int64_t n_bytes = 0;
+    bool mapped = false;
+
+public:
+
+    Byte_Region(){}
+
+    // Maps the whole file read-only. Throws std::runtime_error if the file can not be mapped.
+    static Byte_Region map_file(const std::string& filename);
+
+    // The first n_bytes bytes of the words
+    static Byte_Region from_buffer(Image_Words&& words, int64_t n_bytes){
+        auto buf = std::make_shared<Image_Words>(std::move(words));
+        Byte_Region R;
+        R.ptr = (const char*)buf->data();
+        R.n_bytes = n_bytes;
+        R.owner = buf;
+        return R;
+    }
+
+    // A region that shares the bytes of this one
+    Byte_Region subregion(int64_t offset, int64_t length) const{
+        if(offset < 0 || length < 0 || offset + length > n_bytes)
+            throw std::runtime_error("Error: subregion out of bounds in a memory-mapped image");
+        Byte_Region R = *this;
+        R.ptr = ptr + offset;
+        R.n_bytes = length;
+        return R;
+    }
+
+    const char* data() const { return ptr; }
+    int64_t size() const { return n_bytes; }
+    bool is_mapped() const { return mapped; }
+
+};
+
+// Appends 64-bit integers and page-aligned word blocks to an image in memory
+class Image_Writer{
+
+    Image_Words words;
+
+public:
+
+    void add_int(int64_t x){
+        words.push_back(x);
+    }
+
+    void add_words(const uint64_t* data, int64_t n_words){
+        add_int(n_words);
+        int64_t start = (int64_t)(words.size() + 1) * 8; // Byte offset after the padding length
+        int64_t padding = (IMAGE_PAGE_BYTES - start % IMAGE_PAGE_BYTES) % IMAGE_PAGE_BYTES;
+        add_int(padding);
+        words.resize(words.size() + padding / 8, 0);
+        words.insert(words.end(), data, data + n_words);
+    }
+
+    void add_bit_vector(const sdsl::bit_vector& v){
+        add_int(v.size());
+        add_words(v.data(), (v.size() + 63) / 64);
+    }
+
+    void add_int_vector(const sdsl::int_vector<>& v){
+        add_int(v.size());
+        add_int(v.width());
+        add_words(v.data(), (v.size() * v.width() + 63) / 64);
+    }
+
+    Byte_Region finish(){
+        int64_t n_bytes = words.size() * 8;
+        return Byte_Region::from_buffer(std::move(words), n_bytes);
+    }
+
+};
+
+// Reads an image written by Image_Writer
+class Image_Reader{
+
+    const Byte_Region& region;
+    int64_t pos = 0;
+
+    void check_available(int64_t n_bytes) const{
+        if(n_bytes < 0 || pos + n_bytes > region.size())
+            throw std::runtime_error("Error: truncated or corrupt memory-mapped image");
+    }
+
+public:
+
+    Image_Reader(const Byte_Region& region, int64_t start = 0) : region(region), pos(start) {}
+
+    int64_t read_int(){
+        check_available(8);
+        int64_t x;
+        std::memcpy(&x, region.data() + pos, 8); // The position may be unaligned at the top level of a file
+        pos += 8;
+        return x;
+    }
+
+    const uint64_t* read_words(int64_t n_words){
+        if(read_int() != n_words) throw std::runtime_error("Error: unexpected word block length in a memory-mapped image");
+        int64_t padding = read_int();
+        check_available(padding);
+        pos += padding;
+        check_available(n_words * 8);
+        const uint64_t* words = (const uint64_t*)(region.data() + pos);
+        pos += n_words * 8;
+        return words;
+    }
+
+    // A region of n_bytes bytes at the current position
+    Byte_Region read_region(int64_t n_bytes){
+        check_available(n_bytes);
+        Byte_Region R = region.subregion(pos, n_bytes);
+        pos += n_bytes;
+        return R;
+    }
+
+    int64_t position() const { return pos; }
+
+};
+
+// Writes an image to a file as a page-aligned block: the length, the padding length, the padding and the
+// image. offset is the position of the stream in the file. Returns the number of bytes written.
+int64_t write_page_aligned_image(std::ostream& os, int64_t offset, const Byte_Region& image);
+
+// Reads a block written by write_page_aligned_image
+Byte_Region read_page_aligned_image(Image_Reader& reader);
+
+// Bits idx..idx+len-1 of an array of words as an integer, in the bit order of sdsl. 1 <= len <= 64.
+inline uint64_t read_bits(const uint64_t* words, int64_t idx, int64_t len){
+    const uint64_t* w = words + (idx >> 6);
+    int64_t offset = idx & 63;
+    uint64_t x = w[0] >> offset;
+    if(offset + len > 64) x |= w[1] << (64 - offset);
+    return len == 64 ? x : x & ((1ULL << len) - 1);
+}
+
+// Position of the n-th one of a word, counting from 1. The word must have at least n ones.
+inline int64_t select_in_word(uint64_t x, int64_t n){
+#ifdef __BMI2__
+    return __builtin_ctzll(_pdep_u64(1ULL << (n - 1), x));
+#else
+    int64_t pos = 0;
+    for(int64_t half : {32, 16, 8}){ // Binary search down to a byte
+        int64_t c = __builtin_popcountll(x & ((1ULL << half) - 1));
+        if(c < n){
+            n -= c;
+            x >>= half;
+            pos += half;
+        }
+    }
+    for(int64_t i = 1; i < n; i++) x &= x - 1;
+    return pos + __builtin_ctzll(x);
+#endif
+}
+
+// Non-owning read-only bit vector with the interface of sdsl::bit_vector that the query code needs
+class Bit_Vector_Span{
+
+    const uint64_t* words = nullptr;
+    int64_t n_bits = 0;
+
+public:
+
+    Bit_Vector_Span(){}
+    Bit_Vector_Span(const uint64_t* words, int64_t n_bits) : words(words), n_bits(n_bits) {}
+    Bit_Vector_Span(const sdsl::bit_vector& v) : words(v.data()), n_bits(v.size()) {}
+
+    static Bit_Vector_Span read(Image_Reader& reader){
+        int64_t n_bits = reader.read_int();
+        return Bit_Vector_Span(reader.read_words((n_bits + 63) / 64), n_bits);
+    }
+
+    bool operator[](int64_t idx) const{
+        return (words[idx >> 6] >> (idx & 63)) & 1;
+    }
+
+    uint64_t get_int(int64_t idx, int64_t len = 64) const{
+        return read_bits(words, idx, len);
+    }
+
+    // Starts loading the word of the bit at idx into the cache
+    void prefetch(int64_t idx) const{
+        __builtin_prefetch(words + (idx >> 6));
+    }
+
+    int64_t size() const { return n_bits; }
+    const uint64_t* data() const { return words; }
+
+    int64_t size_in_bytes() const { return (n_bits + 63) / 64 * 8; }
+
+};
+
+// Non-owning read-only integer vector with the interface of sdsl::int_vector<> that the query code needs
+class Int_Vector_Span{
+
+    const uint64_t* words = nullptr;
+    int64_t n_values = 0;
+    int64_t bit_width = 1;
+
+public:
+
+    Int_Vector_Span(){}
+    Int_Vector_Span(const uint64_t* words, int64_t n_values, int64_t bit_width) : words(words), n_values(n_values), bit_width(bit_width) {}
+    Int_Vector_Span(const sdsl::int_vector<>& v) : words(v.data()), n_values(v.size()), bit_width(v.width()) {}
+
+    static Int_Vector_Span read(Image_Reader& reader){
+        int64_t n_values = reader.read_int();
+        int64_t bit_width = reader.read_int();
+        if(bit_width < 1 || bit_width > 64) throw std::runtime_error("Error: invalid integer width in a memory-mapped image");
+        return Int_Vector_Span(reader.read_words((n_values * bit_width + 63) / 64), n_values, bit_width);
+    }
+
+    uint64_t operator[](int64_t idx) const{
+        return read_bits(words, idx * bit_width, bit_width);
+    }
+
+    // Starts loading the first word of the value at idx into the cache
+    void prefetch(int64_t idx) const{
+        __builtin_prefetch(words + ((idx * bit_width) >> 6));
+    }
+
+    int64_t size() const { return n_values; }
+    int64_t width() const { return bit_width; }
+    const uint64_t* data() const { return words; }
+
+    int64_t size_in_bytes() const { return (n_values * bit_width + 63) / 64 * 8; }
+
+};
+
+// Rank support for a Bit_Vector_Span. Stores the number of ones before every 4096-bit superblock in 64 bits
+// and before every 512-bit block relative to its superblock in 16 bits, so a query reads the two counters
+// and at most 8 words of the bit vector, which are on the same cache line if the words are aligned.
+// This takes 4.7% of the size of the bit vector.
+class Bit_Vector_Rank{
+
+    Bit_Vector_Span bits;
+    const uint64_t* superblocks = nullptr;
+    const uint16_t* blocks = nullptr;
+
+public:
+
+    Bit_Vector_Rank(){}
+
+    // Writes the counters of the bit vector to the image
+    static void build(const sdsl::bit_vector& v, Image_Writer& writer){
+        int64_t n_blocks = v.size() / 512 + 1;
+        std::vector<uint64_t> superblock_counts(v.size() / 4096 + 1);
+        std::vector<uint64_t> block_words((n_blocks + 3) / 4); // Four 16-bit counters per word
+        uint16_t* block_counts = (uint16_t*)block_words.data();
+        const uint64_t* words = v.data();
+        int64_t n_words = (v.size() + 63) / 64;
+        uint64_t count = 0;
+        for(int64_t b = 0; b < n_blocks; b++){
+            if(b % 8 == 0) superblock_counts[b / 8] = count;
+            block_counts[b] = count - superblock_counts[b / 8];
+            for(int64_t w = 8*b; w < std::min(8*b + 8, n_words); w++) count += __builtin_popcountll(words[w]);
+        }
+        writer.add_words(superblock_counts.data(), superblock_counts.size());
+        writer.add_words(block_words.data(), block_words.size());
+    }
+
+    static Bit_Vector_Rank read(Image_Reader& reader, Bit_Vector_Span bits){
+        Bit_Vector_Rank R;
+        R.bits = bits;
+        int64_t n_blocks = bits.size() / 512 + 1;
+        R.superblocks = reader.read_words(bits.size() / 4096 + 1);
+        R.blocks = (const uint16_t*)reader.read_words((n_blocks + 3) / 4);
+        return R;
+    }
+
+    // Number of ones in positions [0, idx). idx may be equal to the size of the bit vector.
+    int64_t rank(int64_t idx) const{
+        int64_t b = idx >> 9;
+        int64_t r = superblocks[idx >> 12] + blocks[b];
+        const uint64_t* w = bits.data() + 8*b;
+        int64_t full_words = (idx >> 6) & 7;
+        for(int64_t i = 0; i < full_words; i++) r += __builtin_popcountll(w[i]);
+        if(idx & 63) r += __builtin_popcountll(w[full_words] & ((1ULL << (idx & 63)) - 1));
+        return r;
+    }
+
+    // Starts loading the counters of rank(idx) into the cache. The bit vector words are not prefetched.
+    void prefetch(int64_t idx) const{
+        __builtin_prefetch(superblocks + (idx >> 12));
+        __builtin_prefetch(blocks + (idx >> 9));
+    }
+
+    int64_t size_in_bytes() const{
+        return size_in_bytes(bits.size());
+    }
+
+    // The size of the rank support of a bit vector of n_bits bits
+    static int64_t size_in_bytes(int64_t n_bits){
+        return (n_bits / 4096 + 1) * 8 + ((n_bits / 512 + 1 + 3) / 4) * 8;
+    }
+
+};
+
+// A sparse bit vector in Elias-Fano coding, for finding the rank of a one. The position of the i-th one is
+// split into its lowest low_width bits, which are stored in an integer vector, and the rest, the bucket,
+// which is stored by setting bit bucket + i of the bit vector high. Every bucket is then a run of ones
+// followed by a zero. With low_width = floor(log2(n_bits / n_ones)), this takes about 2 + low_width bits
+// per one. The number of ones before every 256th bucket is sampled, so a query skips at most 255 zeros
+// from a sample and then compares the low bits of the ones in its bucket, of which there are two on average.
+class Elias_Fano_Marks{
+
+    static constexpr int64_t BUCKETS_PER_SAMPLE = 256;
+
+    int64_t n_bits = 0;
+    int64_t n_ones = 0;
+    int64_t low_width = 0;
+    Int_Vector_Span low; // Empty if low_width is zero
+    Bit_Vector_Span high;
+    const uint64_t* samples = nullptr; // Number of ones before bucket k * BUCKETS_PER_SAMPLE
+
+    static int64_t number_of_buckets(int64_t n_bits, int64_t low_width){
+        return (n_bits >> low_width) + 1;
+    }
+
+public:
+
+    Elias_Fano_Marks(){}
+
+    // Writes the Elias-Fano coding of the bit vector to the image
+    static void build(const Bit_Vector_Span& bits, Image_Writer& writer){
+        int64_t n = bits.size();
+        int64_t n_words = (n + 63) / 64;
+        int64_t m = 0;
+        for(int64_t w = 0; w < n_words; w++) m += __builtin_popcountll(bits.data()[w]);
+
+        int64_t l = 0;
+        while(m > 0 && (m << (l + 1)) <= n) l++;
+        int64_t n_buckets = number_of_buckets(n, l);
+
+        sdsl::int_vector<> low_bits(l == 0 ? 0 : m, 0, std::max(l, (int64_t)1));
+        sdsl::bit_vector high_bits(m + n_buckets, 0);
+        std::vector<uint64_t> sample_counts(n_buckets / BUCKETS_PER_SAMPLE + 1, m);
+        int64_t i = 0;
+        int64_t next_sample = 0;
+        for(int64_t w = 0; w < n_words; w++){
+            for(uint64_t x = bits.data()[w]; x != 0; x &= x - 1){
+                int64_t pos = w * 64 + __builtin_ctzll(x);
+                int64_t bucket = pos >> l;
+                while(next_sample * BUCKETS_PER_SAMPLE <= bucket) sample_counts[next_sample++] = i;
+                high_bits[bucket + i] = 1;
+                if(l > 0) low_bits[i] = pos & ((1ULL << l) - 1);
+                i++;
+            }
+        }
+
+        writer.add_int(n);
+        writer.add_int(m);
+        writer.add_int(l);
+        writer.add_int_vector(low_bits);
+        writer.add_bit_vector(high_bits);
+        writer.add_words(sample_counts.data(), sample_counts.size());
+    }
+
+    static Elias_Fano_Marks read(Image_Reader& reader){
+        Elias_Fano_Marks E;
+        E.n_bits = reader.read_int();
+        E.n_ones = reader.read_int();
+        E.low_width = reader.read_int();
+        if(E.n_bits < 0 || E.n_ones < 0 || E.n_ones > E.n_bits || E.low_width < 0 || E.low_width > 63)
+            throw std::runtime_error("Error: corrupt Elias-Fano bit vector in a memory-mapped image");
+        E.low = Int_Vector_Span::read(reader);
+        E.high = Bit_Vector_Span::read(reader);
+        int64_t n_buckets = number_of_buckets(E.n_bits, E.low_width);
+        if(E.high.size() != E.n_ones + n_buckets)
+            throw std::runtime_error("Error: corrupt Elias-Fano bit vector in a memory-mapped image");
+        E.samples = reader.read_words(n_buckets / BUCKETS_PER_SAMPLE + 1);
+        return E;
+    }
+
+    // The number of ones before idx if bit idx is set, otherwise -1. 0 <= idx < size().
+    int64_t find(int64_t idx) const{
+        int64_t bucket = idx >> low_width;
+        int64_t sample = bucket / BUCKETS_PER_SAMPLE;
+        int64_t pos = sample * BUCKETS_PER_SAMPLE + samples[sample]; // Start of the sampled bucket in high
+        int64_t zeros = bucket - sample * BUCKETS_PER_SAMPLE; // Zeros to skip to get to the start of the bucket
+        if(zeros > 0){
+            const uint64_t* words = high.data();
+            int64_t w = pos >> 6;
+            uint64_t x = ~words[w] & (~0ULL << (pos & 63));
+            int64_t c;
+            while((c = __builtin_popcountll(x)) < zeros){
+                zeros -= c;
+                x = ~words[++w];
+            }
+            pos = w * 64 + select_in_word(x, zeros) + 1;
+        }
+
+        uint64_t target = idx & ((1ULL << low_width) - 1);
+        for(int64_t i = pos - bucket; high[pos]; pos++, i++){
+            uint64_t x = low_width == 0 ? 0 : low[i];
+            if(x == target) return i;
+            if(x > target) return -1; // The low bits are increasing within a bucket
+        }
+        return -1;
+    }
+
+    // Starts loading the sample of find(idx) into the cache
+    void prefetch(int64_t idx) const{
+        __builtin_prefetch(samples + (idx >> low_width) / BUCKETS_PER_SAMPLE);
+    }
+
+    int64_t size() const { return n_bits; }
+    int64_t number_of_ones() const { return n_ones; }
+    int64_t get_low_width() const { return low_width; }
+
+    int64_t size_in_bytes() const{
+        return low.size_in_bytes() + high.size_in_bytes() + (number_of_buckets(n_bits, low_width) / BUCKETS_PER_SAMPLE + 1) * 8;
+    }
+
+};
@@ -86,9 +86,10 @@ public:
     }
 
     void push_colors_to_vector(std::vector<int64_t>& vec) const{
-        // Todo: implement without get_colors_as_vector
-        for(int64_t color : get_colors_as_vector())
-            vec.push_back(color);
+        // Decode directly to the end of vec so that this does not allocate if vec has enough capacity
+        int64_t old_size = vec.size();
+        vec.resize(old_size + roaring.cardinality());
+        roaring.toUint64Array(reinterpret_cast<std::uint64_t*>(vec.data() + old_size));
     }
 
     int64_t size() const {
@@ -6,72 +6,315 @@
 #include "sbwt/EM_sort/EM_sort.hh"
 #include "sbwt/EM_sort/bit_level_stuff.hh"
 #include "sdsl/bit_vectors.hpp"
-
-
-// Should be constructed with Sparse_Uint_Array_Builder
+#include "Mapped_Image.hh"
+#include <bit>
+
+
+// How the marks and values of a Sparse_Uint_Array are laid out in memory:
+// - separate: a bit vector of marks, its rank support and an array of the values, so that a lookup
+//   touches three structures, each usually on a different cache line.
+// - interleaved: the array is cut into blocks of 64, 128 or 256 cells, and each block is one 64-byte
+//   cache line with the marks of its cells and its values packed after them, so a lookup usually
+//   reads one cache line. The values that do not fit in the line go to an overflow array. The block
+//   size is chosen so that the values of an average block fit. Takes 2 to 8 bits per cell regardless of
+//   the number of values, so it is larger than the separate layout when few cells have values.
+// - elias_fano: like separate, but the marks are in Elias-Fano coding (see Elias_Fano_Marks), which takes
+//   about 2 + log2(cells per value) bits per value instead of 1.05 bits per cell. Much smaller than the
+//   separate layout when few cells have values, but a lookup is slower.
+enum class Sparse_Uint_Array_Layout{ separate, interleaved, elias_fano };
+
+// Should be constructed with Sparse_Uint_Array_Builder. The query-time data is an image that is
+// either in memory or in a memory-mapped index file (see Mapped_Image.hh).
 class Sparse_Uint_Array{
     private:
 
-    sdsl::bit_vector marks; // Marks which cells have a value
-    sdsl::rank_support_v5<> marks_rs; // Rank support for marks
-    sdsl::int_vector<> values; // Values at those cells that are marked
-    uint64_t max_value;
-
-    public:
+    Byte_Region image;
+    Sparse_Uint_Array_Layout layout = Sparse_Uint_Array_Layout::separate;
+    int64_t n_cells = 0;
+    int64_t n_values = 0;
+    uint64_t max_value = 0;
+
+    // Separate layout
+    Bit_Vector_Span marks; // Marks which cells have a value
+    Bit_Vector_Rank marks_rank; // Rank support for marks
+    Int_Vector_Span values; // Values at those cells that are marked. Also used by the elias_fano layout.
+
+    // Elias-Fano layout
+    Elias_Fano_Marks compressed_marks;
+
+    // Interleaved layout. A block is 8 words: the index of its first value in the overflow array, the
+    // marks of its cells, and the values packed into the remaining words.
+    static constexpr int64_t BLOCK_WORDS = CACHE_LINE_BYTES / 8;
+    const uint64_t* blocks = nullptr;
+    int64_t log2_block_cells = 6;
+    int64_t block_mark_words = 1;
+    int64_t value_width = 1;
+    int64_t block_capacity = 0; // Number of values that fit in a block
+    Int_Vector_Span overflow_values;
+
+    static Byte_Region build_image(const sdsl::bit_vector& marks, const sdsl::int_vector<>& values, uint64_t max_value){
+        Image_Writer writer;
+        writer.add_bit_vector(marks);
+        Bit_Vector_Rank::build(marks, writer);
+        writer.add_int_vector(values);
+        writer.add_int(max_value);
+        return writer.finish();
+    }
 
-    Sparse_Uint_Array(const Sparse_Uint_Array& other){
-        *this = other;
+    static int64_t interleaved_block_capacity(int64_t log2_block_cells, int64_t value_width){
+        int64_t mark_words = (1LL << log2_block_cells) / 64;
+        return (BLOCK_WORDS - 1 - mark_words) * 64 / value_width;
     }
 
-    Sparse_Uint_Array& operator=(const Sparse_Uint_Array& other){
-        this->marks = other.marks;
-        this->marks_rs = other.marks_rs;
-        this->marks_rs.set_vector(&this->marks);
-        this->values = other.values;
-        this->max_value = other.max_value;
-        return *this;
+    // The same content in the interleaved layout
+    static Byte_Region build_interleaved_image(const Sparse_Uint_Array& A){
+        int64_t width = 1;
+        while(width < 64 && (A.max_value >> width) > 0) width++;
+
+        // The largest block size where the values of an average block fit
+        int64_t log2_cells = 6;
+        for(int64_t l : {8, 7}){
+            if(A.n_values * (1LL << l) <= interleaved_block_capacity(l, width) * max(A.n_cells, (int64_t)1)){
+                log2_cells = l;
+                break;
+            }
+        }
+        int64_t cells = 1LL << log2_cells;
+        int64_t mark_words = cells / 64;
+        int64_t capacity = interleaved_block_capacity(log2_cells, width);
+        int64_t n_blocks = (A.n_cells + cells - 1) / cells;
+
+        vector<uint64_t> block_words(n_blocks * BLOCK_WORDS, 0);
+        vector<uint64_t> overflow;
+        for(int64_t b = 0; b < n_blocks; b++){
+            uint64_t* block = block_words.data() + b * BLOCK_WORDS;
+            block[0] = overflow.size();
+            int64_t n_in_block = 0;
+            for(int64_t i = b * cells; i < min((b+1) * cells, A.n_cells); i++){
+                int64_t x = A.get(i);
+                if(x == -1) continue;
+                int64_t local = i - b * cells;
+                block[1 + local / 64] |= 1ULL << (local % 64);
+                if(n_in_block < capacity){
+                    int64_t bit = (1 + mark_words) * 64 + n_in_block * width;
+                    block[bit / 64] |= (uint64_t)x << (bit % 64);
+                    if(bit % 64 + width > 64) block[bit / 64 + 1] |= (uint64_t)x >> (64 - bit % 64);
+                } else overflow.push_back(x);
+                n_in_block++;
+            }
+        }
+
+        sdsl::int_vector<> overflow_vector(overflow.size(), 0, width);
+        for(int64_t i = 0; i < overflow.size(); i++) overflow_vector[i] = overflow[i];
+
+        Image_Writer writer;
+        writer.add_int(A.n_cells);
+        writer.add_int(A.n_values);
+        writer.add_int(log2_cells);
+        writer.add_int(width);
+        writer.add_words(block_words.data(), block_words.size());
+        writer.add_int_vector(overflow_vector);
+        writer.add_int(A.max_value);
+        return writer.finish();
     }
 
+    // The same content in the Elias-Fano layout. A must be in the separate layout.
+    static Byte_Region build_elias_fano_image(const Sparse_Uint_Array& A){
+        Image_Writer writer;
+        Elias_Fano_Marks::build(A.marks, writer);
+        writer.add_int(A.values.size());
+        writer.add_int(A.values.width());
+        writer.add_words(A.values.data(), A.values.size_in_bytes() / 8);
+        writer.add_int(A.max_value);
+        return writer.finish();
+    }
 
-    Sparse_Uint_Array(){}
+    int64_t interleaved_get(uint64_t idx) const{
+        const uint64_t* block = blocks + (idx >> log2_block_cells) * BLOCK_WORDS;
+        int64_t local = idx & ((1LL << log2_block_cells) - 1);
+        const uint64_t* block_marks = block + 1;
+        int64_t word = local >> 6;
+        if(((block_marks[word] >> (local & 63)) & 1) == 0) return -1; // Not in array
+        int64_t r = 0;
+        for(int64_t w = 0; w < word; w++) r += __builtin_popcountll(block_marks[w]);
+        r += __builtin_popcountll(block_marks[word] & ((1ULL << (local & 63)) - 1));
+        if(r < block_capacity) return read_bits(block + 1 + block_mark_words, r * value_width, value_width);
+        return overflow_values[block[0] + r - block_capacity];
+    }
 
+    public:
 
-    Sparse_Uint_Array(const sdsl::bit_vector& marks, sdsl::int_vector<>& values, uint64_t max_value) : marks(marks), values(values), max_value(max_value){
-        sdsl::util::init_support(marks_rs, &marks);
+    Sparse_Uint_Array(){
+        load_image(build_image(sdsl::bit_vector(), sdsl::int_vector<>(), 0));
     }
 
+    Sparse_Uint_Array(const sdsl::bit_vector& marks, const sdsl::int_vector<>& values, uint64_t max_value){
+        load_image(build_image(marks, values, max_value));
+    }
 
     // Return -1 if not in the array
     int64_t get(uint64_t idx) const{
-        if(idx >= marks.size()) throw std::runtime_error("Access out of bounds at Sparse_Uint_Array");
+        if(idx >= n_cells) throw std::runtime_error("Access out of bounds at Sparse_Uint_Array");
+        if(layout == Sparse_Uint_Array_Layout::interleaved) return interleaved_get(idx);
+        if(layout == Sparse_Uint_Array_Layout::elias_fano){
+            int64_t pos = compressed_marks.find(idx);
+            return pos == -1 ? -1 : values[pos];
+        }
         if(marks[idx] == 0) return -1; // Not in array
-        int64_t pos = marks_rs.rank(idx);
+        int64_t pos = marks_rank.rank(idx);
         return values[pos];
     }
 
     bool has_index(uint64_t idx) const{
+        if(layout == Sparse_Uint_Array_Layout::interleaved){
+            int64_t local = idx & ((1LL << log2_block_cells) - 1);
+            return (blocks[(idx >> log2_block_cells) * BLOCK_WORDS + 1 + (local >> 6)] >> (local & 63)) & 1;
+        }
+        if(layout == Sparse_Uint_Array_Layout::elias_fano) return compressed_marks.find(idx) != -1;
         return marks[idx];
     }
 
+    // For lookups that are split into steps to overlap their cache misses: if has_index(idx), then
+    // get(idx) == get_value_at(value_position(idx)), and the prefetch functions start loading the data
+    // of the next step into the cache. In the interleaved layout, the value is on the same cache line
+    // as the mark, so the position is idx itself.
+    void prefetch(uint64_t idx) const{
+        if(layout == Sparse_Uint_Array_Layout::interleaved){
+            __builtin_prefetch(blocks + (idx >> log2_block_cells) * BLOCK_WORDS);
+            return;
+        }
+        if(layout == Sparse_Uint_Array_Layout::elias_fano){
+            compressed_marks.prefetch(idx);
+            return;
+        }
+        marks.prefetch(idx);
+        marks_rank.prefetch(idx);
+    }
+
+    int64_t value_position(uint64_t idx) const{
+        if(layout == Sparse_Uint_Array_Layout::interleaved) return idx;
+        if(layout == Sparse_Uint_Array_Layout::elias_fano) return compressed_marks.find(idx);
+        return marks_rank.rank(idx);
+    }
+
+    void prefetch_value(int64_t pos) const{
+        if(layout != Sparse_Uint_Array_Layout::interleaved) values.prefetch(pos);
+    }
+
+    int64_t get_value_at(int64_t pos) const{
+        if(layout == Sparse_Uint_Array_Layout::interleaved) return interleaved_get(pos);
+        return values[pos];
+    }
+
     // Length of the array, including non-existent entries
     int64_t size() const{
-        return marks.size();
+        return n_cells;
     }
 
     // Number of values stored in this array
     int64_t number_of_values() const{
-        return values.size();
+        return n_values;
     }
 
     int64_t get_max_value() const{
         return max_value;
     }
 
+    Sparse_Uint_Array_Layout get_layout() const{
+        return layout;
+    }
+
+    // About how many bits one more value would take in the current layout
+    int64_t bits_per_new_value() const{
+        int64_t bits = std::max((int64_t)std::bit_width(max_value), (int64_t)1);
+        if(layout == Sparse_Uint_Array_Layout::elias_fano) bits += 2 + compressed_marks.get_low_width();
+        return bits;
+    }
+
+    // The number of bytes that the marks and their rank support take in the separate layout
+    int64_t plain_marks_size_in_bytes() const{
+        return (n_cells + 63) / 64 * 8 + Bit_Vector_Rank::size_in_bytes(n_cells);
+    }
+
+    // A copy with the same content in the given layout
+    Sparse_Uint_Array with_layout(Sparse_Uint_Array_Layout new_layout) const{
+        if(new_layout == layout) return *this;
+        if(layout != Sparse_Uint_Array_Layout::separate && new_layout != Sparse_Uint_Array_Layout::separate)
+            return with_layout(Sparse_Uint_Array_Layout::separate).with_layout(new_layout);
+
+        Sparse_Uint_Array A;
+        if(new_layout == Sparse_Uint_Array_Layout::interleaved) A.load_image(build_interleaved_image(*this), new_layout);
+        else if(new_layout == Sparse_Uint_Array_Layout::elias_fano) A.load_image(build_elias_fano_image(*this), new_layout);
+        else{
+            sdsl::bit_vector marks_copy(n_cells, 0);
+            sdsl::int_vector<> values_copy(n_values, 0, value_width);
+            int64_t n = 0;
+            for(int64_t i = 0; i < n_cells; i++){
+                int64_t x = get(i);
+                if(x == -1) continue;
+                marks_copy[i] = 1;
+                values_copy[n++] = x;
+            }
+            A.load_image(build_image(marks_copy, values_copy, max_value), new_layout);
+        }
+        return A;
+    }
+
+    const Byte_Region& get_image() const{
+        return image;
+    }
+
+    // The image may point into a memory-mapped file, which stays mapped as long as the image is in use
+    void load_image(const Byte_Region& new_image, Sparse_Uint_Array_Layout image_layout = Sparse_Uint_Array_Layout::separate){
+        image = new_image;
+        layout = image_layout;
+        Image_Reader reader(image);
+        if(layout == Sparse_Uint_Array_Layout::interleaved){
+            n_cells = reader.read_int();
+            n_values = reader.read_int();
+            log2_block_cells = reader.read_int();
+            value_width = reader.read_int();
+            if(log2_block_cells < 6 || log2_block_cells > 8 || value_width < 1 || value_width > 64)
+                throw std::runtime_error("Error: corrupt interleaved Sparse_Uint_Array image");
+            block_mark_words = (1LL << log2_block_cells) / 64;
+            block_capacity = interleaved_block_capacity(log2_block_cells, value_width);
+            int64_t n_blocks = (n_cells + (1LL << log2_block_cells) - 1) >> log2_block_cells;
+            blocks = reader.read_words(n_blocks * BLOCK_WORDS);
+            overflow_values = Int_Vector_Span::read(reader);
+            max_value = reader.read_int();
+        } else if(layout == Sparse_Uint_Array_Layout::elias_fano){
+            compressed_marks = Elias_Fano_Marks::read(reader);
+            values = Int_Vector_Span::read(reader);
+            max_value = reader.read_int();
+            n_cells = compressed_marks.size();
+            n_values = values.size();
+            value_width = values.width();
+            if(n_values != compressed_marks.number_of_ones())
+                throw std::runtime_error("Error: corrupt Elias-Fano Sparse_Uint_Array image");
+        } else{
+            marks = Bit_Vector_Span::read(reader);
+            marks_rank = Bit_Vector_Rank::read(reader, marks);
+            values = Int_Vector_Span::read(reader);
+            max_value = reader.read_int();
+            n_cells = marks.size();
+            n_values = values.size();
+            value_width = values.width();
+        }
+    }
+
+    // Serializes in the stream format of the roaring coloring. The SDSL coloring stores the image instead.
     int64_t serialize(ostream& os) const{
+        if(layout != Sparse_Uint_Array_Layout::separate) return with_layout(Sparse_Uint_Array_Layout::separate).serialize(os);
+        sdsl::bit_vector marks_copy(marks.size());
+        for(int64_t w = 0; w < (marks.size() + 63) / 64; w++) marks_copy.data()[w] = marks.data()[w];
+        sdsl::rank_support_v5<> marks_rs(&marks_copy);
+        sdsl::int_vector<> values_copy(values.size(), 0, values.width());
+        for(int64_t i = 0; i < values.size(); i++) values_copy[i] = values[i];
+
         int64_t n_bytes_written = 0;
-        n_bytes_written += marks.serialize(os);
+        n_bytes_written += marks_copy.serialize(os);
         n_bytes_written += marks_rs.serialize(os);
-        n_bytes_written += values.serialize(os);
+        n_bytes_written += values_copy.serialize(os);
 
         os.write((char*)&max_value, sizeof(max_value));
         n_bytes_written += sizeof(max_value);
@@ -79,20 +322,37 @@ class Sparse_Uint_Array{
         return n_bytes_written;
     }
 
+    // Loads the stream format
     void load(istream& is){
-        marks.load(is);
-        marks_rs.load(is, &marks);
-        values.load(is);
-        is.read((char*)&max_value, sizeof(max_value));
-        
+        sdsl::bit_vector marks_in;
+        sdsl::rank_support_v5<> marks_rs_in; // Not needed because the image has its own rank support
+        sdsl::int_vector<> values_in;
+        uint64_t max_value_in;
+        marks_in.load(is);
+        marks_rs_in.load(is, &marks_in);
+        values_in.load(is);
+        is.read((char*)&max_value_in, sizeof(max_value_in));
+        load_image(build_image(marks_in, values_in, max_value_in));
     }
 
     // Returns map: component -> number of bytes
     map<string, int64_t> space_breakdown() const{
         map<string, int64_t> breakdown;
-        breakdown["marks"] = sdsl::size_in_bytes(marks);
-        breakdown["marks-rank-support"] = sdsl::size_in_bytes(marks_rs);
-        breakdown["values"] = sdsl::size_in_bytes(values);
+        if(layout == Sparse_Uint_Array_Layout::interleaved){
+            breakdown["interleaved-blocks"] = ((n_cells + (1LL << log2_block_cells) - 1) >> log2_block_cells) * CACHE_LINE_BYTES;
+            breakdown["overflow-values"] = overflow_values.size_in_bytes();
+            breakdown["max-value"] = sizeof(max_value);
+            return breakdown;
+        }
+        if(layout == Sparse_Uint_Array_Layout::elias_fano){
+            breakdown["marks-elias-fano"] = compressed_marks.size_in_bytes();
+            breakdown["values"] = values.size_in_bytes();
+            breakdown["max-value"] = sizeof(max_value);
+            return breakdown;
+        }
+        breakdown["marks"] = marks.size_in_bytes();
+        breakdown["marks-rank-support"] = marks_rank.size_in_bytes();
+        breakdown["values"] = values.size_in_bytes();
         breakdown["max-value"] = sizeof(max_value);
         return breakdown;
     }
@@ -5,6 +5,10 @@ int pseudoalign_main(int argc, char** argv);
 int extract_unitigs_main(int argc, char** argv);
 int stats_main(int argc, char** argv);
 int dump_color_matrix_main(int argc, char** argv);
+int decode_output_main(int argc, char** argv);
+int serve_main(int argc, char** argv);
+int client_main(int argc, char** argv);
+int add_hot_pointers_main(int argc, char** argv);
 
 int color_set_diagnostics_main(int argc, char** argv); // Undocumented developer feature
 int make_d_equal_1_main(int argc, char** argv); // Undocumented developer feature
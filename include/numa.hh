@@ -0,0 +1,56 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdint>
+
+/*
+
+NUMA topology and thread pinning for the pseudoalignment workers
+
+On a machine with many sockets, every socket has its own memory (a NUMA node), and reading the memory
+of another node is slower. With --pin-threads, the workers are spread evenly over the nodes and every
+worker stays on one CPU. With --numa-replicate-index, every node also gets its own copy of the index,
+loaded by a thread running on that node so that Linux allocates the memory on the node, and each
+worker queries the copy on its own node.
+
+The topology is read from /sys/devices/system/node, restricted to the CPUs that the process is allowed
+to run on (e.g. with taskset). If the topology is not available, like on macOS, the machine is
+treated as one node, and pinning does nothing.
+
+*/
+
+namespace numa{
+
+// Parses a CPU list like "0-3,8,10-11" from sysfs
+std::vector<int> parse_cpu_list(const std::string& list);
+
+// The CPUs of each NUMA node, leaving out the CPUs that this process may not use and nodes without them
+std::vector<std::vector<int>> node_cpus();
+
+// Restricts the calling thread to the given CPUs. Returns false if it could not be done.
+bool pin_current_thread(const std::vector<int>& cpus);
+
+// Where each worker runs
+struct Worker_Placement{
+    int64_t n_nodes = 1;
+    std::vector<int64_t> worker_node;
+    std::vector<int> worker_cpu;
+};
+
+// Assigns workers to the nodes round-robin, and to the CPUs of each node round-robin, so that the
+// workers are spread evenly and a CPU gets a second worker only when every CPU of its node has one
+Worker_Placement place_workers(const std::vector<std::vector<int>>& nodes, int64_t n_workers);
+
+// Runs f on a new thread restricted to the given CPUs and waits for it to finish
+template<typename function_t>
+void run_on_cpus(const std::vector<int>& cpus, function_t f){
+    std::thread t([&](){
+        pin_current_thread(cpus);
+        f();
+    });
+    t.join();
+}
+
+} // namespace numa
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <fstream>
+#include <cstdint>
+#include "zlib.h"
+
+/*
+
+Decompression of gzipped query files on many threads
+
+A gzip file is a sequence of members, each with its own header and deflate stream. BGZF files (bgzip)
+consist of members of at most 64 KiB, and files written in blocks or concatenated with cat have many
+members too. Members can be inflated independently, so the file is split into chunks of compressed
+bytes and helper threads inflate the members that start in each chunk while the reading thread
+consumes the output of the earlier chunks in order.
+
+The boundaries of the members are not stored in the file, except in the headers of BGZF, so a helper
+starts from the first position in its chunk that looks like a gzip header and inflates whole members
+until it passes the end of its chunk. The position is only a guess: its output is used only if the
+previous chunk really ended at that position, and the checksums of the members must match, so a
+false guess only wastes the work of the helper. Whenever no helper has the next member, the reading
+thread inflates it itself. A file with a single member, like the output of plain gzip, is thus read
+on one thread just as fast as before.
+
+The file is memory-mapped in the parallel mode. With one thread, or if the file can not be mapped,
+the file is read as a stream. Input that is zlib-compressed or not compressed at all is read like
+zstr reads it.
+
+*/
+
+class Parallel_Gzip_streambuf : public std::streambuf{
+
+public:
+
+    static constexpr int64_t default_chunk_bytes = 1 << 20;
+
+    // n_threads is the total number of threads inflating the file, including the reading thread, so
+    // n_threads - 1 helpers are started. 1 means no helpers.
+    Parallel_Gzip_streambuf(const std::string& filename, int64_t n_threads, int64_t chunk_bytes = default_chunk_bytes);
+    ~Parallel_Gzip_streambuf();
+
+    bool is_open() const { return open; }
+
+    // Number of chunks whose output came from the helper threads
+    int64_t n_chunks_from_helpers() const { return chunks_from_helpers; }
+
+protected:
+
+    int_type underflow() override;
+
+private:
+
+    // The members that start in one chunk of the compressed data, inflated by a helper thread
+    struct Chunk_Job{
+        int64_t start; // Offset of the first member. A guess until the previous output ends here.
+        int64_t chunk_end; // Inflate members until one ends at or after this offset
+        int64_t end = -1; // Offset where the last inflated member ended
+        std::vector<char> output;
+        bool done = false;
+        bool ok = false;
+        std::atomic<bool> cancelled = false;
+    };
+
+    bool open = false;
+    int64_t n_threads;
+    int64_t chunk_bytes;
+
+    // Compressed input. Mapped in the parallel mode, a stream otherwise.
+    const unsigned char* data = nullptr;
+    int64_t data_size = 0;
+    std::ifstream stream;
+    std::vector<unsigned char> stream_buf;
+    bool stream_eof = false;
+
+    enum Format{ GZIP, ZLIB, PLAIN };
+    Format format = GZIP;
+
+    // The member that the reading thread is inflating itself
+    z_stream strm;
+    bool strm_initialized = false;
+    bool in_member = false;
+    int64_t offset = 0; // Compressed offset of the next byte for the reading thread in the mapped mode
+    std::vector<char> out_buf;
+    std::shared_ptr<Chunk_Job> current_job; // Holds the output being read, if it came from a helper
+
+    // Helpers
+    std::map<int64_t, std::shared_ptr<Chunk_Job>> jobs; // By chunk index. Null if the chunk has no candidate header.
+    std::deque<std::shared_ptr<Chunk_Job>> job_queue;
+    std::vector<std::thread> helpers;
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::condition_variable job_done;
+    bool stopping = false;
+    int64_t chunks_from_helpers = 0;
+
+    void helper_loop();
+    static void run_job(Chunk_Job& job, const unsigned char* data, int64_t data_size, int64_t max_output);
+    void schedule_jobs();
+    bool take_job_output();
+    int64_t find_candidate_header(int64_t begin, int64_t end) const;
+
+    bool fill_mapped();
+    bool fill_stream();
+    bool refill_stream_input();
+    void start_member(int window_bits);
+
+};
+
+// A std::istream over a gzipped file that is decompressed with Parallel_Gzip_streambuf. Can be used in
+// place of zstr::ifstream, e.g. as seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>. Throws
+// std::runtime_error from read if the data is corrupt.
+class Parallel_Gzip_ifstream : public std::istream{
+
+    std::unique_ptr<Parallel_Gzip_streambuf> buf;
+
+public:
+
+    // Uses the number of threads set with set_n_threads_for_new_streams on this thread
+    Parallel_Gzip_ifstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in);
+
+    Parallel_Gzip_ifstream(const std::string& filename, int64_t n_threads, int64_t chunk_bytes = Parallel_Gzip_streambuf::default_chunk_bytes);
+
+    // Streams constructed from a filename alone on the calling thread will use n_threads threads. The
+    // setting is per thread so that jobs running at the same time can use different values.
+    static void set_n_threads_for_new_streams(int64_t n_threads);
+
+    int64_t n_chunks_from_helpers() const { return buf->n_chunks_from_helpers(); }
+
+};
@@ -1,11 +1,21 @@
 #pragma once
 
 #include <string>
+#include <algorithm>
+#include "globals.hh"
 #include "sbwt/SBWT.hh"
 #include "coloring/Coloring.hh"
 #include "SeqIO/SeqIO.hh"
 #include "ThreadPool.hh"
+#include "Batch_Pool.hh"
 #include "variants.hh"
+#include "binary_output.hh"
+#include "Color_Set_Cache.hh"
+#include "Read_Deduplicator.hh"
+#include "abundance_estimation.hh"
+#include "Color_Counters.hh"
+#include "pseudoalign_metrics.hh"
+#include "numa.hh"
 
 using namespace std;
 using namespace sbwt;
@@ -16,12 +26,228 @@ typedef int64_t color_t;
 vector<vector<int64_t> > parse_pseudoalignment_output_format_from_disk(string filename);
 
 // If outfile is empty, creates a writer to cout
-std::unique_ptr<ParallelBaseWriter> create_writer(const string& outfile, bool gzipped);
+// If ordered is true, the writer puts the batches given to write_batch in order. Threads writing to it wait if
+// more than max_queued_bytes bytes are waiting to be written.
+std::unique_ptr<ParallelBaseWriter> create_writer(const string& outfile, bool gzipped, bool ordered, int64_t max_queued_bytes);
+
+// Copies of the index, one per NUMA node, for --numa-replicate-index. Each copy is loaded by a thread
+// running on its node, so that its memory is on that node. The copy of node 0 also serves as the main
+// index, so the index is not loaded once more outside the replicas.
+struct Index_Replicas{
+    numa::Worker_Placement placement; // Of the workers over the nodes of the replicas
+    vector<unique_ptr<plain_matrix_sbwt_t>> SBWTs; // One per node
+    vector<unique_ptr<std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>>>> colorings; // One per node
+
+    // Loads a copy of the index files on every node
+    Index_Replicas(const string& index_dbg_file, const string& index_color_file, int64_t n_workers);
+
+    template<typename coloring_t>
+    const coloring_t* get_coloring(int64_t node) const{
+        if constexpr(std::is_same_v<coloring_t, Coloring<SDSL_Variant_Color_Set>> || std::is_same_v<coloring_t, Coloring<Roaring_Color_Set>>)
+            return &std::get<coloring_t>(*colorings[node]);
+        else throw std::runtime_error("BUG: no index replicas for this coloring type");
+    }
+};
+
+struct Pseudoalign_Config{
+    vector<string> query_files;
+    vector<string> query_files_2; // Second mates in paired-end mode
+    vector<string> outfiles;
+    string index_dbg_file;
+    string index_color_file;
+    string temp_dir;
+
+    bool gzipped_output = false;
+    bool reverse_complements = false;
+    bool sort_output_lines = false;
+    bool sort_hits = false;
+    bool paired = false;
+    bool binary_output = false;
+    int64_t n_threads = 1;
+    double buffer_size_megas = 8;
+    bool verbose = false;
+    bool silent = false;
+    bool print_progress = true; // Print the throughput to stderr every second. Off for the jobs of a server, which run at the same time.
+    double threshold = -1;
+    bool ignore_unknown = false;
+    bool report_relevant = false;
+    double relevant_kmers_fraction = 0;
+    double color_set_cache_megas = 0; // Total over all threads. Zero disables the cache.
+    bool dedup_reads = false;
+    int64_t kmer_stride = 1;
+    int64_t max_kmers_per_read = 0; // 0 = no limit
+    vector<string> abundance_outfiles; // One per query file, or empty if abundances are not estimated
+    int64_t max_concurrent_files = 1; // Number of query files that are read at the same time
+    int64_t gzip_decompression_threads = 1; // Per gzipped query file. 1 means decompression on the reading thread.
+    string metrics_outfile; // Empty if metrics are not written
+    double metrics_interval_seconds = 10;
+    pseudoalignment::Pseudoalign_Metrics* metrics = nullptr; // Not owned. Set while metrics_outfile is being written.
+    bool pin_threads = false;
+    bool numa_replicate_index = false;
+    const Index_Replicas* index_replicas = nullptr; // Not owned. Set if numa_replicate_index is given and there are many nodes.
+    Work_Gate* work_gate = nullptr; // Not owned. If set, limits how many of the n_threads workers run at the same time.
+
+    void check_valid(){
+        for(string query_file : query_files){
+            if(query_file != ""){
+                check_readable(query_file);
+            }
+        }
 
-void call_sort_parallel_output_file(const string& outfile, bool gzipped);
+        if(paired){
+            check_true(query_files_2.size() == query_files.size(), "Paired-end mode needs a second mate file for each query file");
+            for(string query_file : query_files_2) check_readable(query_file);
+        } else{
+            check_true(query_files_2.size() == 0, "Second mate files given without --paired");
+        }
+
+        check_readable(index_dbg_file);
+        check_readable(index_color_file);
+
+        for(string outfile : outfiles){
+            check_true(outfile != "", "Outfile not set");
+            check_writable(outfile);
+        }
+
+        // With abundance estimation and no outfiles, there is no per-read output to print
+        if (outfiles.size() == 0 && query_files.size() > 1 && abundance_outfiles.size() == 0) {
+            check_true(query_files.size() == 1, "Can't print results when aligning multiple files; supply " + to_string(query_files.size()) + " outfiles with --out-file-list.");
+        }
+        if (outfiles.size() > 0) {
+            check_true(query_files.size() == outfiles.size(), "Number of query files and outfiles do not match");
+        }
+
+        if (abundance_outfiles.size() > 0) {
+            check_true(query_files.size() == abundance_outfiles.size(), "Number of query files and abundance outfiles do not match");
+            for(string outfile : abundance_outfiles) check_writable(outfile);
+        }
+
+        check_true(max_concurrent_files >= 1, "--max-concurrent-files must be at least 1");
+        check_true(gzip_decompression_threads >= 1, "--gzip-decompression-threads must be at least 1");
+        if (max_concurrent_files > 1 && query_files.size() > 1) {
+            check_true(outfiles.size() > 0, "--max-concurrent-files needs output files");
+            check_true(abundance_outfiles.size() == 0, "--abundance-out is not supported with --max-concurrent-files");
+        }
+
+        check_true(color_set_cache_megas >= 0, "Color set cache size can not be negative");
+        check_true(kmer_stride >= 1, "--kmer-stride must be at least 1");
+        check_true(max_kmers_per_read >= 0, "--max-kmers-per-read can not be negative");
+        check_true(metrics_interval_seconds > 0, "--metrics-interval must be positive");
+        if(metrics_outfile != "") check_writable(metrics_outfile);
+
+        check_true(temp_dir != "", "Temp directory not set");
+        check_dir_exists(temp_dir);
+    }
+};
 
 namespace pseudoalignment{ // Helper classes for pseudoalignment.
 
+// The functions below operate on sorted lists of distinct colors stored in std::vectors
+// owned by the workers. They only ever shrink or clear the vectors or push into them, so
+// once the vectors have grown to their working size, no more heap allocations happen.
+
+// Stores the union of the sorted color lists A and B into result.
+inline void union_of_sorted_colors(const vector<int64_t>& A, const vector<int64_t>& B, vector<int64_t>& result){
+    result.clear();
+    int64_t i = 0, j = 0;
+    while(i < (int64_t)A.size() && j < (int64_t)B.size()){
+        if(A[i] < B[j]) result.push_back(A[i++]);
+        else if(A[i] > B[j]) result.push_back(B[j++]);
+        else{
+            result.push_back(A[i]);
+            i++; j++;
+        }
+    }
+    while(i < (int64_t)A.size()) result.push_back(A[i++]);
+    while(j < (int64_t)B.size()) result.push_back(B[j++]);
+}
+
+// Removes from acc all colors that are not in the sorted color list B.
+inline void intersect_sorted_colors(vector<int64_t>& acc, const vector<int64_t>& B){
+    int64_t i = 0, j = 0, n = 0;
+    while(i < (int64_t)acc.size() && j < (int64_t)B.size()){
+        if(acc[i] < B[j]) i++;
+        else if(acc[i] > B[j]) j++;
+        else{
+            acc[n++] = acc[i];
+            i++; j++;
+        }
+    }
+    acc.resize(n); // Never reallocates because n <= acc.size()
+}
+
+// Removes from acc all colors that are not in the color set cs. The generic version
+// decodes the set into the scratch buffer and does a linear merge.
+template<typename colorset_view_t>
+void intersect_sorted_colors_with_view(vector<int64_t>& acc, const colorset_view_t& cs, vector<int64_t>& scratch){
+    scratch.clear();
+    cs.push_colors_to_vector(scratch);
+    intersect_sorted_colors(acc, scratch);
+}
+
+// Bitmaps have constant-time membership queries, so we do not need to decode them.
+inline void intersect_sorted_colors_with_view(vector<int64_t>& acc, const SDSL_Variant_Color_Set_View& cs, vector<int64_t>& scratch){
+    if(cs.is_bitmap()){
+        int64_t n = 0;
+        for(int64_t i = 0; i < (int64_t)acc.size(); i++){
+            if(cs.contains(acc[i])) acc[n++] = acc[i];
+        }
+        acc.resize(n);
+    } else{
+        scratch.clear();
+        cs.push_colors_to_vector(scratch);
+        intersect_sorted_colors(acc, scratch);
+    }
+}
+
+// Roaring bitmaps have fast membership queries, so we do not need to decode them.
+inline void intersect_sorted_colors_with_view(vector<int64_t>& acc, const Roaring_Color_Set_View& cs, vector<int64_t>& scratch){
+    int64_t n = 0;
+    for(int64_t i = 0; i < (int64_t)acc.size(); i++){
+        if(cs.contains(acc[i])) acc[n++] = acc[i];
+    }
+    acc.resize(n);
+}
+
+// Output of one query file when many files are pseudoaligned with the same workers. The writer is
+// created when the file is opened and destroyed as soon as all batches of the file have been processed,
+// so only the files in progress are open. The thread that pushes the batches of the file reports the
+// number of batches when it is done, and the workers report every processed batch.
+class Query_File_Output{
+
+    atomic<int64_t> n_batches_done = 0;
+    atomic<int64_t> n_batches_total = -1; // Not known until all batches have been pushed
+    atomic<bool> closed = false;
+
+    void close(){
+        if(closed.exchange(true)) return; // Both the pusher and a worker may see that the file is done
+        try{
+            writer->close();
+        } catch(...){
+            error = std::current_exception(); // Thrown on the main thread when all files are done
+        }
+        writer.reset();
+    }
+
+public:
+
+    unique_ptr<ParallelBaseWriter> writer;
+    std::exception_ptr error; // Set if writing the output failed
+
+    // Called by a worker after the output of the batch has been written
+    void batch_done(){
+        int64_t done = ++n_batches_done;
+        if(done == n_batches_total) close();
+    }
+
+    // Called by the pusher after the last batch has been pushed
+    void all_batches_pushed(int64_t n_batches){
+        n_batches_total = n_batches;
+        if(n_batches_done == n_batches) close();
+    }
+
+};
+
 template<class coloring_t>
 class Pseudoaligner_Base{
 
@@ -37,31 +263,87 @@ public:
     bool report_relevant;
     double relevant_kmers_fraction;
     bool sort_hits;
+    bool binary_output; // See binary_output.hh for the format
+    bool ordered_output; // If true, the output of each work batch is written as one batch with ParallelBaseWriter::write_batch
+
+    // Per-worker scratch space. Every buffer below is only ever cleared and refilled, which does not
+    // release the capacity of the vector, so after the buffers have grown to fit the longest query
+    // seen so far, processing a query does not allocate any heap memory.
 
     // Buffer for reverse-complementing strings
     vector<char> rc_buffer;
 
     // Buffer for printing. We want to have a local buffer for each thread to avoid having to call the
     // parallel writer so often to avoid locking the writer from other threads.
+    // In binary mode, the buffer holds one block, and the first BLOCK_HEADER_BYTES bytes are reserved for
+    // the block header, which is filled in when the block is flushed.
     vector<char> output_buffer;
     int64_t output_buffer_flush_threshold;
+    int64_t records_in_block = 0; // Binary mode only
+    int64_t prev_read_id_in_block = 0; // Binary mode only
+
+    // If true, the forward and reverse complement k-mers are searched in one interleaved pass.
+    // Benchmarks turn this off to compare against the two-pass lookup.
+    bool fused_rc_lookup = true;
+
+    // Buffers for storing colex ranks of k-mers
+    vector<int64_t> colex_rank_buffer;
+    vector<int64_t> rc_colex_rank_buffer;
 
     // Buffer for storing color set ids
     vector<int64_t> color_set_id_buffer;
     vector<int64_t> rc_color_set_id_buffer;
 
+    // Color set id lookups queued for Coloring::get_color_set_ids, where the results go, and the spans
+    // of the id buffers to fill from the results. See queue_color_set_ids.
+    vector<int64_t> queued_nodes;
+    vector<pair<vector<int64_t>*, int64_t>> queued_targets; // (buffer, index)
+    vector<int64_t> queued_ids;
+    vector<tuple<vector<int64_t>*, int64_t, int64_t>> queued_spans; // (buffer, offset, length)
+
+    // Buffers for decoded color sets and for unions and intersections of them
+    vector<int64_t> color_buffer;
+    vector<int64_t> rc_color_buffer;
+    vector<int64_t> union_buffer;
+    vector<int64_t> intersection_buffer;
+
+    // Pseudoalignment hits to report
+    vector<int64_t> hits;
+
+    // Optional cache of decoded color sets and unions of fw and rc color sets. Null if disabled.
+    unique_ptr<Color_Set_Cache> color_set_cache;
+    Color_Set_Cache_Counters* color_set_cache_counters; // Shared by all workers. The counts are added in the destructor.
+
+    // Optional deduplication of identical reads within a work batch. Null if disabled.
+    unique_ptr<Read_Deduplicator> deduplicator;
+    int64_t current_distinct_read = -1; // Index in the deduplicator of the read whose result is reported next, or -1
+
+    // Optional counts of the distinct hit sets for abundance estimation. Not owned. Null if disabled.
+    abundance::Equivalence_Class_Counter* equivalence_classes;
+    bool read_output; // If false, the results are only counted into equivalence_classes and nothing is written
+
+    // If not null, every work batch comes from one of these files and the output goes to the writer of that file
+    vector<unique_ptr<Query_File_Output>>* file_outputs;
+    int64_t current_file_idx = 0;
+
     // Statistics to print. These will be read by a printer thread while
     // they are modified, so they need to be atomic.
     atomic<int64_t>* total_length_of_sequence_processed;
     atomic<int64_t>* total_bytes_written;
 
+    // Optional runtime metrics. Not owned. Null if disabled. The counts of this worker are kept in
+    // worker_metrics and added to the shared metrics at the end of every work batch.
+    Pseudoalign_Metrics* metrics;
+    Worker_Metrics worker_metrics;
+    metrics_time_t batch_start_time;
+
     // For output writing
     char int_to_string_buffer[32]; // Enough space for a 64-bit integer in ascii
     char newline = '\n';
     char space = ' ';
     char semicolon = ';';
 
-    Pseudoaligner_Base(const plain_matrix_sbwt_t* SBWT, const coloring_t* coloring, ParallelBaseWriter* out, bool reverse_complements, int64_t output_buffer_capacity, atomic<int64_t>* total_length_of_sequence_processed, atomic<int64_t>* total_bytes_written, bool report_relevant, double relevant_kmers_fraction, bool sort_hits){
+    Pseudoaligner_Base(const plain_matrix_sbwt_t* SBWT, const coloring_t* coloring, ParallelBaseWriter* out, bool reverse_complements, int64_t output_buffer_capacity, atomic<int64_t>* total_length_of_sequence_processed, atomic<int64_t>* total_bytes_written, bool report_relevant, double relevant_kmers_fraction, bool sort_hits, bool binary_output, bool ordered_output, int64_t color_set_cache_bytes, Color_Set_Cache_Counters* color_set_cache_counters, bool dedup_reads, abundance::Equivalence_Class_Counter* equivalence_classes, bool read_output, vector<unique_ptr<Query_File_Output>>* file_outputs, Pseudoalign_Metrics* metrics){
         this->SBWT = SBWT;
         this->coloring = coloring;
         this->out = out;
@@ -73,108 +355,478 @@ public:
         this->report_relevant = report_relevant;
         this->relevant_kmers_fraction = relevant_kmers_fraction;
         this->sort_hits = sort_hits;
+        this->binary_output = binary_output;
+        this->ordered_output = ordered_output;
+        this->color_set_cache_counters = color_set_cache_counters;
+        this->equivalence_classes = equivalence_classes;
+        this->read_output = read_output;
+        this->file_outputs = file_outputs;
+        this->metrics = metrics;
+        if(color_set_cache_bytes > 0) color_set_cache = make_unique<Color_Set_Cache>(color_set_cache_bytes);
+        if(dedup_reads) deduplicator = make_unique<Read_Deduplicator>(reverse_complements);
         rc_buffer.resize(1 << 10); // 1 kb. Will be resized if needed
         output_buffer.reserve(output_buffer_capacity);
+        if(binary_output) output_buffer.resize(binary_format::BLOCK_HEADER_BYTES); // Space for the block header
     }
 
-    // Flushes at the next newline when output_buffer_flush_threshold is exceeded
-    void add_to_output(char* data, int64_t data_length){
-        for(int64_t i = 0; i < data_length; i++){
-            output_buffer.push_back(data[i]);
-            if(output_buffer.size() > output_buffer_flush_threshold && data[i] == '\n'){
-                out->write(output_buffer.data(), output_buffer.size());
-                *total_bytes_written += output_buffer.size();
-                output_buffer.clear(); // Let's hope this keeps the reserved capacity of the vector intact
-            }
+    void add_to_output(const char* data, int64_t data_length){
+        output_buffer.insert(output_buffer.end(), data, data + data_length);
+    }
+
+    // Fills in the block header in binary mode and returns the number of bytes to write from the output buffer
+    int64_t finish_output_buffer(){
+        if(binary_output){
+            if(records_in_block == 0) return 0; // No empty blocks
+            binary_format::write_uint64_le(output_buffer.size() - binary_format::BLOCK_HEADER_BYTES, output_buffer.data());
+            binary_format::write_uint64_le(records_in_block, output_buffer.data() + 8);
+        }
+        return output_buffer.size();
+    }
+
+    void clear_output_buffer(){
+        // Resizing keeps the capacity
+        if(binary_output){
+            output_buffer.resize(binary_format::BLOCK_HEADER_BYTES);
+            records_in_block = 0;
+            prev_read_id_in_block = 0;
+        } else output_buffer.clear();
+    }
+
+    // Writes the output buffer to the output writer
+    void flush_output_buffer(){
+        int64_t n_bytes = finish_output_buffer();
+        if(n_bytes == 0) return; // The writer may already be closed in multi-file mode
+        metrics_time_t t0 = metrics_start_time();
+        out->write(output_buffer.data(), n_bytes);
+        if(metrics) worker_metrics.writer_ns += nanoseconds_since(t0);
+        *total_bytes_written += n_bytes;
+        worker_metrics.bytes_written += n_bytes;
+        clear_output_buffer();
+    }
+
+    // Must be called at the start of each work batch. In multi-file mode, switches to the writer of the file of the batch.
+    void start_batch(int64_t n_reads, int64_t file_idx){
+        batch_start_time = metrics_start_time();
+        worker_metrics.reads += n_reads;
+        if(deduplicator) deduplicator->start_batch(n_reads);
+        current_distinct_read = -1;
+        if(file_outputs){
+            current_file_idx = file_idx;
+            out = (*file_outputs)[file_idx]->writer.get();
         }
     }
 
-    // If n_kmers_found_in_index is given, then also reports that
+    // In dedup mode, if the read (or pair if S2 is not null) is identical to an earlier read of the batch,
+    // reports the result of the earlier read for seq_id and returns true. Otherwise returns false, and the
+    // next reported result is saved for the later duplicates of this read.
+    bool report_if_duplicate(const char* S1, int64_t S1_size, const char* S2, int64_t S2_size, int64_t seq_id){
+        if(!deduplicator) return false;
+        int64_t earlier = deduplicator->find_or_insert(S1, S1_size, S2, S2_size);
+        if(earlier == -1){
+            current_distinct_read = deduplicator->number_of_distinct_reads() - 1;
+            return false;
+        }
+        current_distinct_read = -1; // The previous distinct read may have been left unreported
+        int64_t n_relevant;
+        if(deduplicator->get_result(earlier, hits, n_relevant)) report_results_for_seq(seq_id, hits, n_relevant);
+        return true;
+    }
+
+    // Must be called after each work batch. In ordered mode, writes the output of the batch in one piece
+    // tagged with the sequence ids of the batch so that the writer can put the batches in order.
+    // In multi-file mode, the output is always written at the end of the batch because the file may be closed after it.
+    void end_of_batch(int64_t first_seq_id, int64_t n_seqs){
+        if(ordered_output){
+            int64_t n_bytes = finish_output_buffer();
+            metrics_time_t t0 = metrics_start_time();
+            out->write_batch(first_seq_id, n_seqs, output_buffer.data(), n_bytes); // Even if empty, to let the next batch through
+            if(metrics) worker_metrics.writer_ns += nanoseconds_since(t0);
+            *total_bytes_written += n_bytes;
+            worker_metrics.bytes_written += n_bytes;
+            clear_output_buffer();
+        } else if(file_outputs) flush_output_buffer(); // Otherwise flushing is driven by the buffer size
+
+        if(metrics){
+            worker_metrics.processing_ns += nanoseconds_since(batch_start_time);
+            worker_metrics.move_to(*metrics);
+        }
+
+        if(file_outputs) (*file_outputs)[current_file_idx]->batch_done();
+    }
+
+    // The current time if metrics are collected. Otherwise does not read the clock.
+    metrics_time_t metrics_start_time() const{
+        return metrics ? std::chrono::steady_clock::now() : metrics_time_t();
+    }
+
+    // Counts a processed read of the given length, or a read pair of the given total length
+    void count_processed_bases(int64_t n_bases){
+        *total_length_of_sequence_processed += n_bases;
+        worker_metrics.bases += n_bases;
+    }
+
+    // Counts the k-mers in the color set id buffers and the time since the lookup started
+    void count_lookup(metrics_time_t start){
+        if(!metrics) return;
+        worker_metrics.lookup_ns += nanoseconds_since(start);
+        int64_t n_kmers = color_set_id_buffer.size();
+        int64_t n_found = 0;
+        for(int64_t i = 0; i < n_kmers; i++){
+            bool found = color_set_id_buffer[i] != -1 || (reverse_complements && rc_color_set_id_buffer[n_kmers-1-i] != -1);
+            n_found += found;
+        }
+        worker_metrics.kmers += n_kmers;
+        worker_metrics.kmers_found += n_found;
+    }
+
+    // If n_kmers_found_in_index is given, then also reports that. The output buffer is flushed
+    // only between records, so records are never split between two writes. In ordered mode,
+    // the buffer is flushed only at the end of the batch.
     void report_results_for_seq(int64_t seq_id, vector<int64_t>& hits, int64_t n_kmers_found_in_index){
-        if(sort_hits) std::sort(hits.begin(), hits.end());
-        int64_t len = fast_int_to_string(seq_id, int_to_string_buffer);
-        add_to_output(int_to_string_buffer, len);
-        for(color_t x : hits){
-            len = fast_int_to_string(x, int_to_string_buffer);
-            add_to_output(&space, 1);
-            add_to_output(int_to_string_buffer, len);
+        if(binary_output || equivalence_classes){
+            // Hits are always sorted in binary mode because they are delta-coded, and
+            // equivalence classes need one representation of each hit set
+            if(!std::is_sorted(hits.begin(), hits.end())) std::sort(hits.begin(), hits.end());
+        } else if(sort_hits) std::sort(hits.begin(), hits.end());
+
+        if(current_distinct_read != -1){
+            // Save the result for the duplicates of this read
+            deduplicator->set_result(current_distinct_read, hits, n_kmers_found_in_index);
+            current_distinct_read = -1;
         }
-        if(report_relevant){
-            len = fast_int_to_string(n_kmers_found_in_index, int_to_string_buffer);
-            add_to_output(&semicolon, 1);
-            add_to_output(&space, 1);
+
+        if(equivalence_classes) equivalence_classes->add(hits);
+        if(!read_output) return;
+
+        if(binary_output){
+            int64_t old_size = output_buffer.size();
+            output_buffer.resize(old_size + binary_format::max_record_bytes(hits.size()));
+            int64_t record_size = binary_format::encode_record(seq_id - prev_read_id_in_block, hits.data(), hits.size(), report_relevant, n_kmers_found_in_index, output_buffer.data() + old_size);
+            output_buffer.resize(old_size + record_size);
+            prev_read_id_in_block = seq_id;
+            records_in_block++;
+        } else{
+            int64_t len = fast_int_to_string(seq_id, int_to_string_buffer);
             add_to_output(int_to_string_buffer, len);
+            for(color_t x : hits){
+                int_to_string_buffer[0] = space;
+                len = fast_int_to_string(x, int_to_string_buffer + 1);
+                add_to_output(int_to_string_buffer, len + 1);
+            }
+            if(report_relevant){
+                len = fast_int_to_string(n_kmers_found_in_index, int_to_string_buffer);
+                add_to_output(&semicolon, 1);
+                add_to_output(&space, 1);
+                add_to_output(int_to_string_buffer, len);
+            }
+            add_to_output(&newline, 1);
         }
-        add_to_output(&newline, 1);
+
+        if(!ordered_output && output_buffer.size() > output_buffer_flush_threshold) flush_output_buffer();
     }
 
-    // -1 if node is not found at all.
-    void push_color_set_ids_to_buffer(const vector<int64_t>& colex_ranks, vector<int64_t>& buffer){
+    // The color set ids of the nodes are looked up in batches with Coloring::get_color_set_ids so that
+    // the cache misses of the lookups overlap. The queue functions append placeholders to the id buffers,
+    // and resolve_queued_color_set_ids fills them in. The buffers must not be reordered in between.
 
-        // First pass: get all k-mer kmers and the last k-mer
-        for(int64_t v : colex_ranks){
+    // Appends the color set id of the node to the buffer, or -1 if the node is -1 (k-mer not found)
+    void queue_color_set_id(int64_t node, vector<int64_t>& buffer){
+        if(node != -1){
+            queued_nodes.push_back(node);
+            queued_targets.push_back({&buffer, (int64_t)buffer.size()});
+        }
+        buffer.push_back(-1);
+    }
+
+    // Appends the color set ids of the colex ranks to the buffer, with -1 for the nodes that are not
+    // found. Only the core k-mers and the k-mers that are not followed by a found k-mer are looked up.
+    // The others have the same color set as the next k-mer, so they are copied from it in the end.
+    void queue_color_set_ids(const vector<int64_t>& colex_ranks, vector<int64_t>& buffer){
+        int64_t offset = buffer.size();
+        int64_t n = colex_ranks.size();
+        for(int64_t i = 0; i < n; i++){
+            int64_t v = colex_ranks[i];
             if(v == -1) buffer.push_back(-1); // k-mer not found
-            else{
-                if(coloring->is_core_kmer(v) || v == colex_ranks.back()){
-                    int64_t id = coloring->get_color_set_id(v);
-                    buffer.push_back(id);
-                } else{
-                    buffer.push_back(-2); // To be filled in the second pass
-                }
-            }
+            else if(i == n-1 || colex_ranks[i+1] == -1 || coloring->is_core_kmer(v)) queue_color_set_id(v, buffer);
+            else buffer.push_back(-2); // Copied from the next k-mer
         }
+        queued_spans.push_back({&buffer, offset, n});
+    }
 
-        // Second pass: fill in the rest
-        for(int64_t i = (int64_t)colex_ranks.size()-2; i >= 0; i--){ // -2: skip the last one
-            if(buffer[i] == -2){
-                if(buffer[i+1] == -1){
-                    // Can't copy from the next k-mer because it's not found
-                    buffer[i] = coloring->get_color_set_id(colex_ranks[i]);
-                }
-                else {
-                    // Can copy from the next k-mer
-                    buffer[i] = buffer[i+1];
-                }
+    void resolve_queued_color_set_ids(){
+        queued_ids.resize(queued_nodes.size());
+        coloring->get_color_set_ids(queued_nodes.data(), queued_nodes.size(), queued_ids.data());
+        for(int64_t i = 0; i < queued_ids.size(); i++)
+            (*queued_targets[i].first)[queued_targets[i].second] = queued_ids[i];
+
+        for(auto [buffer, offset, length] : queued_spans){
+            for(int64_t i = offset + length - 2; i >= offset; i--) // -2: the last one is never copied
+                if((*buffer)[i] == -2) (*buffer)[i] = (*buffer)[i+1];
+        }
+
+        queued_nodes.clear();
+        queued_targets.clear();
+        queued_spans.clear();
+    }
+
+    // Returns the colex rank of the k-mer starting at S, or -1 if not found. Same as SBWT::search
+    // but without constructing a std::string.
+    int64_t search_kmer(const char* S) const{
+        const vector<int64_t>& C = SBWT->get_C_array();
+        const auto& subset_rank = SBWT->get_subset_rank_structure();
+        int64_t left = 0;
+        int64_t right = SBWT->number_of_subsets() - 1;
+        for(int64_t i = 0; i < k; i++){
+            char c = toupper(S[i]);
+            int64_t char_idx;
+            switch(c){
+                case 'A': char_idx = 0; break;
+                case 'C': char_idx = 1; break;
+                case 'G': char_idx = 2; break;
+                case 'T': char_idx = 3; break;
+                default: return -1;
             }
+            left = C[char_idx] + subset_rank.rank(left, c);
+            right = C[char_idx] + subset_rank.rank(right+1, c) - 1;
+            if(left > right) return -1;
         }
+        return left;
     }
 
-    vector<int64_t> get_rc_colex_ranks(const char* S, int64_t S_size){
+    // One step of the streaming search: returns the colex rank of the k-mer starting at S[i] given the
+    // colex rank prev of the k-mer starting at S[i-1], or -1 if not found.
+    int64_t streaming_search_step(const char* S, int64_t i, int64_t prev) const{
+        if(prev == -1) return search_kmer(S + i); // Need to search from scratch
+
+        const vector<int64_t>& C = SBWT->get_C_array();
+        const auto& subset_rank = SBWT->get_subset_rank_structure();
+        const sdsl::bit_vector& suffix_group_starts = SBWT->get_streaming_support();
+
+        // Go to the start of the suffix group and do one search iteration
+        int64_t column = prev;
+        while(suffix_group_starts[column] == 0) column--; // Can not go negative because the first column is always marked
+        char c = toupper(S[i+k-1]);
+        int64_t char_idx = -1;
+        switch(c){
+            case 'A': char_idx = 0; break;
+            case 'C': char_idx = 1; break;
+            case 'G': char_idx = 2; break;
+            case 'T': char_idx = 3; break;
+        }
+        if(char_idx == -1) return -1; // Not found
+        int64_t node_left = C[char_idx] + subset_rank.rank(column, c);
+        int64_t node_right = C[char_idx] + subset_rank.rank(column+1, c) - 1;
+        return node_left == node_right ? node_left : -1;
+    }
+
+    // Same as SBWT::streaming_search but writes the colex ranks into the given buffer so that
+    // we do not need to allocate a new vector for every query. The buffer is overwritten.
+    void streaming_search_to_buffer(const char* S, int64_t S_size, vector<int64_t>& buffer) const{
+        buffer.clear();
+        if(S_size < k) return;
+
+        buffer.push_back(search_kmer(S));
+        for(int64_t i = 1; i < S_size - k + 1; i++)
+            buffer.push_back(streaming_search_step(S, i, buffer.back()));
+    }
+
+    // Streaming search of S into fw_buffer and of the reverse complement of S into rc_buffer in one pass.
+    // The two searches are independent chains of rank queries, so advancing both in the same loop
+    // iteration lets the cache misses of one strand overlap with those of the other. Both buffers
+    // are overwritten and end up the same as with two calls to streaming_search_to_buffer.
+    void streaming_search_both_strands_to_buffers(const char* S, int64_t S_size, vector<int64_t>& fw_buffer, vector<int64_t>& rc_buffer_out){
+        fw_buffer.clear();
+        rc_buffer_out.clear();
+        if(S_size < k) return;
+
+        reverse_complement_to_rc_buffer(S, S_size);
+        const char* R = rc_buffer.data();
+
+        int64_t fw = search_kmer(S);
+        int64_t rc = search_kmer(R);
+        fw_buffer.push_back(fw);
+        rc_buffer_out.push_back(rc);
+        for(int64_t i = 1; i < S_size - k + 1; i++){
+            fw = streaming_search_step(S, i, fw);
+            rc = streaming_search_step(R, i, rc);
+            fw_buffer.push_back(fw);
+            rc_buffer_out.push_back(rc);
+        }
+    }
+
+    // Writes the reverse complement of S to the start of rc_buffer
+    void reverse_complement_to_rc_buffer(const char* S, int64_t S_size){
         while(S_size > rc_buffer.size()){
             rc_buffer.resize(rc_buffer.size()*2);
         }
         memcpy(rc_buffer.data(), S, S_size);
         reverse_complement_c_string(rc_buffer.data(), S_size); // There is no null at the end but that is ok
-        return SBWT->streaming_search(rc_buffer.data(), S_size);
     }
 
-    ~Pseudoaligner_Base(){
-        // Flush remaining output
-        out->write(output_buffer.data(), output_buffer.size());
-        *total_bytes_written += output_buffer.size();
+    // Stores the colex ranks of the reverse complement of S into the given buffer
+    void push_rc_colex_ranks_to_buffer(const char* S, int64_t S_size, vector<int64_t>& buffer){
+        reverse_complement_to_rc_buffer(S, S_size);
+        streaming_search_to_buffer(rc_buffer.data(), S_size, buffer);
     }
 
-};
+    // Queues the color set ids of the k-mers at positions 0, stride, 2*stride, ... of S to the buffer.
+    // With a long stride, searching each sampled k-mer separately is cheaper than streaming through S.
+    void push_sampled_color_set_ids(const char* S, int64_t S_size, int64_t stride, vector<int64_t>& buffer){
+        if(S_size < k) return;
+        int64_t n_kmers = S_size - k + 1;
+        if(stride < k){
+            streaming_search_to_buffer(S, S_size, colex_rank_buffer);
+            for(int64_t i = 0; i < n_kmers; i += stride) queue_color_set_id(colex_rank_buffer[i], buffer);
+        } else{
+            for(int64_t i = 0; i < n_kmers; i += stride) queue_color_set_id(search_kmer(S + i), buffer);
+        }
+    }
+
+    // Queues the color set ids of the reverse complements of the same k-mers as push_sampled_color_set_ids,
+    // in reverse order. That is the order in which they appear in the reverse complement of S, which is
+    // the order that the rest of the code expects for the reverse complement ids.
+    void push_sampled_rc_color_set_ids(const char* S, int64_t S_size, int64_t stride, vector<int64_t>& buffer){
+        if(S_size < k) return;
+        int64_t n_kmers = S_size - k + 1;
+        int64_t last_sample = ((n_kmers - 1) / stride) * stride;
+        reverse_complement_to_rc_buffer(S, S_size);
+        // The reverse complement of the k-mer at position i in S is at position n_kmers - 1 - i in rc(S)
+        if(stride < k){
+            streaming_search_to_buffer(rc_buffer.data(), S_size, rc_colex_rank_buffer);
+            for(int64_t i = last_sample; i >= 0; i -= stride) queue_color_set_id(rc_colex_rank_buffer[n_kmers - 1 - i], buffer);
+        } else{
+            for(int64_t i = last_sample; i >= 0; i -= stride) queue_color_set_id(search_kmer(rc_buffer.data() + n_kmers - 1 - i), buffer);
+        }
+    }
 
-template<typename instream_t, typename outstream_t>
-void sort_parallel_output_file(instream_t& instream, outstream_t& outstream){
-    set<pair<int64_t, string> > Q; // Priority queue with pairs (priority, content)
-    string line;
-    vector<string> tokens;
-    int64_t current_query_id = 0;
+    // Like lookup_color_set_ids but only for every stride-th k-mer
+    void lookup_sampled_color_set_ids(const char* S, int64_t S_size, int64_t stride){
+        metrics_time_t t0 = metrics_start_time();
+        color_set_id_buffer.clear();
+        rc_color_set_id_buffer.clear();
+        push_sampled_color_set_ids(S, S_size, stride, color_set_id_buffer);
+        if(reverse_complements) push_sampled_rc_color_set_ids(S, S_size, stride, rc_color_set_id_buffer);
+        resolve_queued_color_set_ids();
+        count_lookup(t0);
+    }
 
-    while(getline(instream,line)){
-        stringstream ss(line);
-        int64_t priority; ss >> priority;
-        Q.insert({priority, line + "\n"});
-        while(Q.begin()->first == current_query_id){
-            outstream << Q.begin()->second;
-            Q.erase(Q.begin());
-            current_query_id++;
+    // Like lookup_color_set_ids_of_pair but only for every stride-th k-mer of each mate
+    void lookup_sampled_color_set_ids_of_pair(const char* S1, int64_t S1_size, const char* S2, int64_t S2_size, int64_t stride){
+        metrics_time_t t0 = metrics_start_time();
+        color_set_id_buffer.clear();
+        rc_color_set_id_buffer.clear();
+        push_sampled_color_set_ids(S1, S1_size, stride, color_set_id_buffer);
+        push_sampled_color_set_ids(S2, S2_size, stride, color_set_id_buffer);
+        if(reverse_complements){
+            push_sampled_rc_color_set_ids(S2, S2_size, stride, rc_color_set_id_buffer);
+            push_sampled_rc_color_set_ids(S1, S1_size, stride, rc_color_set_id_buffer);
+        }
+        resolve_queued_color_set_ids();
+        count_lookup(t0);
+    }
+
+    // Looks up the color set ids of all k-mers of S (and its reverse complement if enabled) into
+    // color_set_id_buffer and rc_color_set_id_buffer.
+    void lookup_color_set_ids(const char* S, int64_t S_size){
+        metrics_time_t t0 = metrics_start_time();
+        color_set_id_buffer.clear();
+        rc_color_set_id_buffer.clear();
+        push_color_set_ids_of_sequence(S, S_size);
+        resolve_queued_color_set_ids();
+        count_lookup(t0);
+    }
+
+    // Queues the color set ids of the k-mers of S to color_set_id_buffer, and if reverse complements
+    // are enabled, the ids of the k-mers of the reverse complement of S to rc_color_set_id_buffer.
+    void push_color_set_ids_of_sequence(const char* S, int64_t S_size){
+        if(reverse_complements && fused_rc_lookup){
+            streaming_search_both_strands_to_buffers(S, S_size, colex_rank_buffer, rc_colex_rank_buffer);
+            queue_color_set_ids(colex_rank_buffer, color_set_id_buffer);
+            queue_color_set_ids(rc_colex_rank_buffer, rc_color_set_id_buffer);
+        } else{
+            streaming_search_to_buffer(S, S_size, colex_rank_buffer);
+            queue_color_set_ids(colex_rank_buffer, color_set_id_buffer);
+            if(reverse_complements){
+                push_rc_colex_ranks_to_buffer(S, S_size, rc_colex_rank_buffer);
+                queue_color_set_ids(rc_colex_rank_buffer, rc_color_set_id_buffer);
+            }
         }
     }
-    assert(Q.empty());
-}
+
+    // Same as lookup_color_set_ids, but for a read pair. The forward buffer gets the k-mers of
+    // the first mate followed by the k-mers of the second mate, and the reverse complement buffer
+    // gets the reverse complement of the second mate followed by the reverse complement of the
+    // first mate. This way the reverse complement of the i-th k-mer in the forward buffer is
+    // still at index n_kmers-1-i in the reverse complement buffer, like for a single read.
+    void lookup_color_set_ids_of_pair(const char* S1, int64_t S1_size, const char* S2, int64_t S2_size){
+        metrics_time_t t0 = metrics_start_time();
+        color_set_id_buffer.clear();
+        rc_color_set_id_buffer.clear();
+        if(reverse_complements && fused_rc_lookup){
+            // The rc buffer must get rc(S2) before rc(S1), so fill it for S2 first and move it to the end
+            push_color_set_ids_of_sequence(S1, S1_size);
+            int64_t n_rc_S1 = rc_color_set_id_buffer.size();
+            push_color_set_ids_of_sequence(S2, S2_size);
+            resolve_queued_color_set_ids(); // Before moving the placeholders
+            std::rotate(rc_color_set_id_buffer.begin(), rc_color_set_id_buffer.begin() + n_rc_S1, rc_color_set_id_buffer.end());
+        } else{
+            streaming_search_to_buffer(S1, S1_size, colex_rank_buffer);
+            queue_color_set_ids(colex_rank_buffer, color_set_id_buffer);
+            streaming_search_to_buffer(S2, S2_size, colex_rank_buffer);
+            queue_color_set_ids(colex_rank_buffer, color_set_id_buffer);
+            if(reverse_complements){
+                push_rc_colex_ranks_to_buffer(S2, S2_size, rc_colex_rank_buffer);
+                queue_color_set_ids(rc_colex_rank_buffer, rc_color_set_id_buffer);
+                push_rc_colex_ranks_to_buffer(S1, S1_size, rc_colex_rank_buffer);
+                queue_color_set_ids(rc_colex_rank_buffer, rc_color_set_id_buffer);
+            }
+            resolve_queued_color_set_ids();
+        }
+        count_lookup(t0);
+    }
+
+    // Decodes the union of the color sets with the given ids into color_buffer. Id -1 means no color set.
+    void decode_color_set_union(int64_t fw_id, int64_t rc_id){
+        worker_metrics.color_sets_decoded += (fw_id != -1) + (rc_id != -1);
+        color_buffer.clear();
+        if(fw_id != -1) coloring->get_color_set_by_color_set_id(fw_id).push_colors_to_vector(color_buffer);
+        if(rc_id != -1){
+            if(color_buffer.empty()){
+                coloring->get_color_set_by_color_set_id(rc_id).push_colors_to_vector(color_buffer);
+            } else{
+                rc_color_buffer.clear();
+                coloring->get_color_set_by_color_set_id(rc_id).push_colors_to_vector(rc_color_buffer);
+                union_of_sorted_colors(color_buffer, rc_color_buffer, union_buffer);
+                std::swap(color_buffer, union_buffer); // Swapping vectors does not allocate
+            }
+        }
+    }
+
+    // Returns the union of the color sets with the given ids, where id -1 means no color set. Goes through
+    // the color set cache if it is enabled. The returned vector is valid until the next call.
+    const vector<int64_t>& get_color_set_union(int64_t fw_id, int64_t rc_id){
+        if(fw_id == -1) std::swap(fw_id, rc_id); // The union is symmetric, so use one key for both orders
+        if(fw_id == -1 || !color_set_cache){
+            decode_color_set_union(fw_id, rc_id);
+            return color_buffer;
+        }
+
+        const vector<int64_t>* cached = color_set_cache->get(fw_id, rc_id);
+        if(cached != nullptr) return *cached;
+
+        decode_color_set_union(fw_id, rc_id);
+        color_set_cache->put(fw_id, rc_id, color_buffer);
+        return color_buffer;
+    }
+
+    ~Pseudoaligner_Base(){
+        // Flush remaining output
+        flush_output_buffer();
+        if(metrics) worker_metrics.move_to(*metrics);
+        if(color_set_cache && color_set_cache_counters) color_set_cache_counters->add(*color_set_cache);
+    }
+
+};
 
 class WorkBatch{
     public:
@@ -182,6 +834,16 @@ class WorkBatch{
         unique_ptr<vector<int64_t>> starts; // Has an end sentinel one past the last one
         unique_ptr<vector<int64_t>> seq_ids;
 
+        // If true, the batch contains read pairs. Then starts has two entries per pair (the
+        // starts of the two mates) and seq_ids has one entry per pair.
+        bool paired = false;
+
+        int64_t file_idx = 0; // Index of the query file in multi-file mode
+
+        // If set, the buffers go back to this pool when the batch is destroyed, so that the
+        // reading thread can fill them again without allocating
+        shared_ptr<Batch_Pool<WorkBatch>> pool;
+
     // Default constructor
     WorkBatch(){
         seqs_concat = make_unique<vector<char>>();
@@ -189,21 +851,36 @@ class WorkBatch{
         seq_ids = make_unique<vector<int64_t>>();
     }
 
-    // Move constructor
-    WorkBatch(WorkBatch&& other){
+    // The moved-from batch has no buffers. It can only be assigned to or destroyed.
+    WorkBatch(WorkBatch&& other) = default;
+    WorkBatch& operator=(WorkBatch&& other) = default;
 
-        // Move the stuff in
-        this->seqs_concat = move(other.seqs_concat);
-        this->starts = move(other.starts);
-        this->seq_ids = move(other.seq_ids);
+    ~WorkBatch(){
+        if(pool && seqs_concat){
+            shared_ptr<Batch_Pool<WorkBatch>> p = std::move(pool); // The pooled batch does not point to the pool
+            p->give_back(std::move(*this));
+        }
+    }
 
-        // Clear the other
-        other.seqs_concat = make_unique<vector<char>>();
-        other.starts = make_unique<vector<int64_t>>();
-        other.seq_ids = make_unique<vector<int64_t>>();
+    // Empties the batch but keeps the capacity of the buffers. Called by the pool.
+    void clear(){
+        seqs_concat->clear();
+        starts->clear();
+        seq_ids->clear();
+        paired = false;
+        file_idx = 0;
     }
 };
 
+// An empty batch from the pool that goes back to the pool when destroyed
+inline WorkBatch get_pooled_work_batch(const shared_ptr<Batch_Pool<WorkBatch>>& pool, int64_t file_idx, bool paired){
+    WorkBatch wb = pool->get();
+    wb.file_idx = file_idx;
+    wb.paired = paired;
+    wb.pool = pool;
+    return wb;
+}
+
 
 // Context for the worker threads
 template<typename coloring_t>
@@ -226,6 +903,17 @@ struct WorkerContext{
     // Don't move these fields up because we're using the struct initializer list syntax which depends on the order
     bool report_relevant; 
     double relevant_kmers_fraction;
+    bool binary_output;
+    bool ordered_output;
+    int64_t color_set_cache_bytes; // Per worker. Zero disables the cache.
+    Color_Set_Cache_Counters* color_set_cache_counters;
+    bool dedup_reads;
+    int64_t kmer_stride;
+    int64_t max_kmers_per_read;
+    abundance::Equivalence_Class_Counter* equivalence_classes; // Different for each worker
+    bool read_output;
+    vector<unique_ptr<Query_File_Output>>* file_outputs; // Null unless many files are pseudoaligned at once
+    Pseudoalign_Metrics* metrics; // Null if metrics are not collected
 
 };
 
@@ -240,105 +928,187 @@ class ThresholdWorker : public BaseWorkerThread<WorkBatch>, Pseudoaligner_Base<c
     double count_threshold; // Fraction of k-mers that need to be found to report pseudoalignment to a color
     bool ignore_unknown_kmers = false; // Ignore k-mers that do not exist in the de Bruijn graph or have no colors
 
+    // Approximate mode: only every kmer_stride-th k-mer is looked up, and the stride is made longer
+    // if needed so that at most max_kmers_per_read k-mers are looked up (0 = no limit). The threshold
+    // is applied to the fraction of the sampled k-mers.
+    int64_t kmer_stride = 1;
+    int64_t max_kmers_per_read = 0;
+    int64_t n_kmers_in_query = 0; // Before sampling
 
     // State used during callback
-    vector<int64_t> counts; // counts[i] = number of occurrences of color i
-    vector<int64_t> nonzero_count_indices; // Indices in this->counts that have a non-zero value
-    vector<int64_t> color_buffer; // Reused buffer for storing colors
-    vector<int64_t> hits; // Pseudoalignment hits to report
+    Color_Counters counters; // Number of occurrences of each color in the current query
+
+    // Bitmap color sets are counted word-at-a-time with Color_Counters::add_bitmap_union
+    bool bitmap_counting = true; // Turned off only in benchmarks and tests
 
     ThresholdWorker(WorkerContext<coloring_t> context) :
-        Pseudoaligner_Base<coloring_t>(context.SBWT, context.coloring, context.writer, context.reverse_complements, context.output_buffer_size, context.total_length_of_sequence_processed, context.total_bytes_written, context.report_relevant, context.relevant_kmers_fraction, context.sort_hits), count_threshold(context.threshold), ignore_unknown_kmers(context.ignore_unknown){
-        counts.resize(context.coloring->largest_color() + 1); // Initializes counts to zeroes
+        Pseudoaligner_Base<coloring_t>(context.SBWT, context.coloring, context.writer, context.reverse_complements, context.output_buffer_size, context.total_length_of_sequence_processed, context.total_bytes_written, context.report_relevant, context.relevant_kmers_fraction, context.sort_hits, context.binary_output, context.ordered_output, context.color_set_cache_bytes, context.color_set_cache_counters, context.dedup_reads, context.equivalence_classes, context.read_output, context.file_outputs, context.metrics), count_threshold(context.threshold), ignore_unknown_kmers(context.ignore_unknown), counters(context.coloring->largest_color() + 1){
+        kmer_stride = context.kmer_stride;
+        max_kmers_per_read = context.max_kmers_per_read;
+
+        // The sampled k-mers of the reverse complement of a read are not the reverse complements of the
+        // sampled k-mers of the read, so with sampling a result is reused only for exact copies of a read.
+        // The same goes for unsorted hits: they are in the order in which the colors were first seen,
+        // and the reverse complement sees them in a different order.
+        if(this->deduplicator && (sampling_enabled() || !this->sort_hits)) this->deduplicator = make_unique<Read_Deduplicator>(false);
     }
 
+    bool sampling_enabled() const{
+        return kmer_stride > 1 || max_kmers_per_read > 0;
+    }
 
-    void process_sequence(const char* S, int64_t S_size, int64_t string_id){
-
-        Base::color_set_id_buffer.resize(0);
-        Base::rc_color_set_id_buffer.resize(0);
+    // The stride to use for a query with n_kmers k-mers
+    int64_t stride_for(int64_t n_kmers) const{
+        int64_t stride = kmer_stride;
+        if(max_kmers_per_read > 0) stride = max(stride, (n_kmers + max_kmers_per_read - 1) / max_kmers_per_read);
+        return stride;
+    }
 
+    void process_sequence(const char* S, int64_t S_size, int64_t string_id){
         if(S_size < Base::k){
             write_log("Warning: query is shorter than k", LogLevel::MINOR);
-            hits.clear();
-            Base::report_results_for_seq(string_id, hits, 0);
+            Base::hits.clear();
+            Base::report_results_for_seq(string_id, Base::hits, 0);
         } else{
-            vector<int64_t> colex_ranks = Base::SBWT->streaming_search(S, S_size); // TODO: version that pushes to existing buffer?
-            Base::push_color_set_ids_to_buffer(colex_ranks, Base::color_set_id_buffer);
-            if(Base::reverse_complements){
-                Base::push_color_set_ids_to_buffer(Base::get_rc_colex_ranks(S, S_size), Base::rc_color_set_id_buffer);
-            }
+            n_kmers_in_query = S_size - Base::k + 1;
+            if(sampling_enabled()) Base::lookup_sampled_color_set_ids(S, S_size, stride_for(n_kmers_in_query));
+            else Base::lookup_color_set_ids(S, S_size);
+            process_color_set_id_buffers(string_id);
+        }
+    }
 
-            typename coloring_t::colorset_type fw_set;
-            int64_t n_kmers = S_size - Base::k  + 1;
-            int64_t n_kmers_with_at_least_1_color = 0;
-            int64_t run_length = 0; // Number of consecutive identical color sets 
-            for(int64_t kmer_idx = 0; kmer_idx < n_kmers; kmer_idx++){
-                run_length++;
-
-                bool last = (kmer_idx == n_kmers - 1);
-                bool fw_different = !last && Base::color_set_id_buffer[kmer_idx] != Base::color_set_id_buffer[kmer_idx+1];
-                bool rc_different = !last && Base::reverse_complements && Base::rc_color_set_id_buffer[n_kmers-1-kmer_idx] != Base::rc_color_set_id_buffer[n_kmers-1-kmer_idx-1];
-                bool end_of_run = (last || fw_different || rc_different);
-
-                if(end_of_run){
-
-                    // Retrieve forward color set
-                    if(Base::color_set_id_buffer[kmer_idx] == -1) fw_set = (typename coloring_t::colorset_type){}; // Empty
-                    else fw_set = Base::coloring->get_color_set_by_color_set_id(Base::color_set_id_buffer[kmer_idx]);
-                    
-                    // Retrieve reverse complement color set
-                    if(Base::reverse_complements && Base::rc_color_set_id_buffer[n_kmers - 1  - kmer_idx] != -1){
-                        typename coloring_t::colorset_type::view_t rc_set_view = Base::coloring->get_color_set_by_color_set_id(Base::rc_color_set_id_buffer[n_kmers - 1 - kmer_idx]);
-                        fw_set.do_union(rc_set_view);
-                    }
+    // The k-mers of both mates are counted together and one result is reported for the pair
+    void process_read_pair(const char* S1, int64_t S1_size, const char* S2, int64_t S2_size, int64_t string_id){
+        if(S1_size < Base::k && S2_size < Base::k){
+            write_log("Warning: both mates of a read pair are shorter than k", LogLevel::MINOR);
+            Base::hits.clear();
+            Base::report_results_for_seq(string_id, Base::hits, 0);
+        } else{
+            n_kmers_in_query = max((int64_t)0, S1_size - Base::k + 1) + max((int64_t)0, S2_size - Base::k + 1);
+            if(sampling_enabled()) Base::lookup_sampled_color_set_ids_of_pair(S1, S1_size, S2, S2_size, stride_for(n_kmers_in_query));
+            else Base::lookup_color_set_ids_of_pair(S1, S1_size, S2, S2_size);
+            process_color_set_id_buffers(string_id);
+        }
+    }
 
-                    bool has_at_least_one_color =false;
+    // Counts the colors of the k-mers in the color set id buffers and reports the colors above the threshold
+    void process_color_set_id_buffers(int64_t string_id){
 
-                    // Add the run length to the counts
-                    color_buffer.clear();
-                    fw_set.push_colors_to_vector(color_buffer);
-                    for(int64_t color : color_buffer){
-                        has_at_least_one_color = true;
-                        if(counts[color] == 0) nonzero_count_indices.push_back(color);
-                        counts[color] += run_length;
-                    }
+        vector<int64_t>& hits = Base::hits;
 
-                    n_kmers_with_at_least_1_color += has_at_least_one_color * run_length;
+        int64_t n_kmers = Base::color_set_id_buffer.size();
+        int64_t n_kmers_with_at_least_1_color = 0;
+        int64_t run_length = 0; // Number of consecutive identical color sets 
+        for(int64_t kmer_idx = 0; kmer_idx < n_kmers; kmer_idx++){
+            run_length++;
 
-                    run_length = 0; // Reset the run
-                }
+            bool last = (kmer_idx == n_kmers - 1);
+            bool fw_different = !last && Base::color_set_id_buffer[kmer_idx] != Base::color_set_id_buffer[kmer_idx+1];
+            bool rc_different = !last && Base::reverse_complements && Base::rc_color_set_id_buffer[n_kmers-1-kmer_idx] != Base::rc_color_set_id_buffer[n_kmers-1-kmer_idx-1];
+            bool end_of_run = (last || fw_different || rc_different);
+
+            if(end_of_run){
+
+                // Add the run length to the counts of the union of the forward and reverse complement color sets
+                int64_t fw_id = Base::color_set_id_buffer[kmer_idx];
+                int64_t rc_id = Base::reverse_complements ? Base::rc_color_set_id_buffer[n_kmers - 1  - kmer_idx] : -1;
+                bool has_at_least_one_color = add_to_counts(fw_id, rc_id, run_length);
+
+                n_kmers_with_at_least_1_color += has_at_least_one_color * run_length;
+
+                run_length = 0; // Reset the run
             }
+        }
 
-            // Print the colors of all counters that are above threshold and the relevant k-mers fraction
-            hits.clear();
-            for(int64_t color : nonzero_count_indices){
-                int64_t count = counts[color];
-                int64_t effective_kmers = ignore_unknown_kmers ? n_kmers_with_at_least_1_color : n_kmers;
-                if(count >= effective_kmers * count_threshold && (double)effective_kmers / n_kmers >= Base::relevant_kmers_fraction){
+        // Print the colors of all counters that are above threshold and the relevant k-mers fraction
+        hits.clear();
+        int64_t effective_kmers = ignore_unknown_kmers ? n_kmers_with_at_least_1_color : n_kmers;
+        if((double)effective_kmers / n_kmers >= Base::relevant_kmers_fraction){
+            counters.for_each_nonzero([&](int64_t color, int64_t count){
+                if(count >= effective_kmers * count_threshold){
                     // Add to list of reported colors
                     hits.push_back(color);
                 }
-            }
-            Base::report_results_for_seq(string_id, hits, n_kmers_with_at_least_1_color);
+            });
+        }
+        counters.clear();
+
+        int64_t relevant_kmers_to_report = n_kmers_with_at_least_1_color;
+        if(sampling_enabled() && n_kmers > 0){
+            // Estimate for the whole query
+            relevant_kmers_to_report = llround((double)n_kmers_with_at_least_1_color * n_kmers_in_query / n_kmers);
+        }
+        Base::report_results_for_seq(string_id, hits, relevant_kmers_to_report);
+    }
 
-            // Reset counts
-            for(int64_t idx : nonzero_count_indices){
-                counts[idx] = 0;
+    // Adds value to the counts of the colors in the union of the color sets with the given ids
+    // (-1 = no color set). Returns whether the union is non-empty.
+    bool add_to_counts(int64_t fw_id, int64_t rc_id, int64_t value){
+        if constexpr(std::is_same_v<typename coloring_t::colorset_view_type, SDSL_Variant_Color_Set_View>){
+            if(bitmap_counting){
+                if(fw_id == -1) std::swap(fw_id, rc_id);
+                if(fw_id == -1) return false; // Both are -1
+                if(rc_id == fw_id) rc_id = -1; // Same set
+                auto fw = Base::coloring->get_color_set_by_color_set_id(fw_id);
+                if(rc_id == -1){
+                    if(fw.is_bitmap()){
+                        counters.add_bitmap_union(std::get<0>(fw.data_ptr), fw.start, fw.length, nullptr, 0, 0, value);
+                        Base::worker_metrics.color_sets_decoded++;
+                        return !fw.empty();
+                    }
+                } else{
+                    auto rc = Base::coloring->get_color_set_by_color_set_id(rc_id);
+                    if(fw.is_bitmap() && rc.is_bitmap()){
+                        counters.add_bitmap_union(std::get<0>(fw.data_ptr), fw.start, fw.length, &std::get<0>(rc.data_ptr), rc.start, rc.length, value);
+                        Base::worker_metrics.color_sets_decoded += 2;
+                        return !fw.empty() || !rc.empty();
+                    }
+                    if(fw.is_bitmap() || rc.is_bitmap()){
+                        // Count the bitmap word-at-a-time and the colors of the array that are not in the bitmap one by one
+                        const auto& bitmap = fw.is_bitmap() ? fw : rc;
+                        const auto& array = fw.is_bitmap() ? rc : fw;
+                        counters.add_bitmap_union(std::get<0>(bitmap.data_ptr), bitmap.start, bitmap.length, nullptr, 0, 0, value);
+                        for(int64_t i = 0; i < array.length; i++){
+                            int64_t color = colorset_access_array(array, i);
+                            if(!bitmap.contains(color)) counters.add(color, value);
+                        }
+                        Base::worker_metrics.color_sets_decoded += 2;
+                        return !bitmap.empty() || !array.empty();
+                    }
+                }
             }
-            nonzero_count_indices.clear();
         }
+
+        const vector<int64_t>& colors = Base::get_color_set_union(fw_id, rc_id);
+        for(int64_t color : colors) counters.add(color, value);
+        return !colors.empty();
     }
 
     // This function should only use local variables and protected shared variables
     virtual void process_work_item(WorkBatch item){
-        for(int64_t i = 0; i < (int64_t)item.starts->size() - 1; i++){
-            int64_t start = (*item.starts)[i];
-            int64_t end = (*item.starts)[i+1];
-            int64_t seq_id = (*item.seq_ids)[i];
-            process_sequence(item.seqs_concat->data() + start, end-start, seq_id);
-            *Base::total_length_of_sequence_processed += end - start;
+        Base::start_batch(item.seq_ids->size(), item.file_idx);
+        if(item.paired){
+            for(int64_t i = 0; i < (int64_t)item.seq_ids->size(); i++){
+                const char* S1 = item.seqs_concat->data() + (*item.starts)[2*i];
+                const char* S2 = item.seqs_concat->data() + (*item.starts)[2*i+1];
+                int64_t S1_size = (*item.starts)[2*i+1] - (*item.starts)[2*i];
+                int64_t S2_size = (*item.starts)[2*i+2] - (*item.starts)[2*i+1];
+                int64_t seq_id = (*item.seq_ids)[i];
+                if(!Base::report_if_duplicate(S1, S1_size, S2, S2_size, seq_id))
+                    process_read_pair(S1, S1_size, S2, S2_size, seq_id);
+                Base::count_processed_bases(S1_size + S2_size);
+            }
+        } else{
+            for(int64_t i = 0; i < (int64_t)item.starts->size() - 1; i++){
+                int64_t start = (*item.starts)[i];
+                int64_t end = (*item.starts)[i+1];
+                int64_t seq_id = (*item.seq_ids)[i];
+                if(!Base::report_if_duplicate(item.seqs_concat->data() + start, end - start, nullptr, 0, seq_id))
+                    process_sequence(item.seqs_concat->data() + start, end-start, seq_id);
+                Base::count_processed_bases(end - start);
+            }
         }
+        Base::end_of_batch(item.seq_ids->front(), item.seq_ids->size());
     }
 
     // This function is called after every work item. It is called so
@@ -356,55 +1126,101 @@ class IntersectionWorker : public BaseWorkerThread<WorkBatch>, Pseudoaligner_Bas
     typedef WorkerContext<coloring_t> Context;
     typedef Pseudoaligner_Base<coloring_t> Base;
 
+    // Whether the exact number of k-mers with at least one color is needed. If not, the intersection
+    // stops as soon as it becomes empty.
+    bool need_nonempty_count;
+
+    bool early_exit = true; // Stop intersecting when the intersection becomes empty. Turned off only in benchmarks.
+
     IntersectionWorker(WorkerContext<coloring_t> context) :
-        Pseudoaligner_Base<coloring_t>(context.SBWT, context.coloring, context.writer, context.reverse_complements, context.output_buffer_size, context.total_length_of_sequence_processed, context.total_bytes_written, context.report_relevant, context.relevant_kmers_fraction, context.sort_hits){}
+        Pseudoaligner_Base<coloring_t>(context.SBWT, context.coloring, context.writer, context.reverse_complements, context.output_buffer_size, context.total_length_of_sequence_processed, context.total_bytes_written, context.report_relevant, context.relevant_kmers_fraction, context.sort_hits, context.binary_output, context.ordered_output, context.color_set_cache_bytes, context.color_set_cache_counters, context.dedup_reads, context.equivalence_classes, context.read_output, context.file_outputs, context.metrics){
+        need_nonempty_count = context.report_relevant || context.relevant_kmers_fraction > 0;
+    }
 
     void process_sequence(const char* S, int64_t S_size, int64_t string_id){
 
-        Base::color_set_id_buffer.resize(0);
-        Base::rc_color_set_id_buffer.resize(0);
-        // Clearing the buffers like this might look bad for performance at first glance because
-        // we will then need to allocate new space for new elements that will be pushed to the buffers.
-        // But in fact it's ok because resize is not supposed to affect the internal capacity of the vector.
-        // cppreference.com says:
-        //     "Vector capacity is never reduced when resizing to smaller size because that would
-        //      invalidate all iterators, rather than only the ones that would be invalidated by the
-        //      equivalent sequence of pop_back() calls."
-
         if(S_size < Base::k){
             write_log("Warning: query is shorter than k", LogLevel::MINOR);
-            vector<color_t> empty;
-            Base::report_results_for_seq(string_id, empty, 0);
+            Base::hits.clear();
+            Base::report_results_for_seq(string_id, Base::hits, 0);
         }
         else{
-            vector<int64_t> colex_ranks = Base::SBWT->streaming_search(S, S_size); // TODO: version that pushes to existing buffer?
-            Base::push_color_set_ids_to_buffer(colex_ranks, Base::color_set_id_buffer);
-            if(Base::reverse_complements){
-                Base::push_color_set_ids_to_buffer(Base::get_rc_colex_ranks(S, S_size), Base::rc_color_set_id_buffer);
-            }
+            Base::lookup_color_set_ids(S, S_size);
+            process_color_set_id_buffers(string_id);
+        }
+    }
+
+    // The k-mers of both mates are intersected together and one result is reported for the pair
+    void process_read_pair(const char* S1, int64_t S1_size, const char* S2, int64_t S2_size, int64_t string_id){
+        if(S1_size < Base::k && S2_size < Base::k){
+            write_log("Warning: both mates of a read pair are shorter than k", LogLevel::MINOR);
+            Base::hits.clear();
+            Base::report_results_for_seq(string_id, Base::hits, 0);
+        } else{
+            Base::lookup_color_set_ids_of_pair(S1, S1_size, S2, S2_size);
+            process_color_set_id_buffers(string_id);
+        }
+    }
+
+    // Intersects the color sets in the color set id buffers and reports the result
+    void process_color_set_id_buffers(int64_t string_id){
+        int64_t n_kmers = Base::color_set_id_buffer.size();
+
+        int64_t n_nonempty;
+        if(Base::reverse_complements) n_nonempty = do_intersections_on_color_id_buffers_with_reverse_complements();
+        else n_nonempty = do_intersections_on_color_id_buffers_without_reverse_complements();
+
+        if((double)n_nonempty / n_kmers >= Base::relevant_kmers_fraction)
+            Base::report_results_for_seq(string_id, Base::intersection_buffer, n_nonempty);
+    }
+
+    // Intersects the color set with the given id into Base::intersection_buffer. Returns whether the set was non-empty.
+    bool intersect_with_color_set_id(int64_t color_set_id, bool first){
+        typename coloring_t::colorset_view_type cs = Base::coloring->get_color_set_by_color_set_id(color_set_id);
+        if(cs.empty()) return false;
+        Base::worker_metrics.color_sets_decoded++;
+        if(first) cs.push_colors_to_vector(Base::intersection_buffer);
+        else intersect_sorted_colors_with_view(Base::intersection_buffer, cs, Base::color_buffer);
+        return true;
+    }
 
-            vector<int64_t> intersection; int64_t n_nonempty;
-            if(Base::reverse_complements) tie(intersection, n_nonempty) = do_intersections_on_color_id_buffers_with_reverse_complements();
-            else tie(intersection, n_nonempty) = do_intersections_on_color_id_buffers_without_reverse_complements();
+    // Whether the color set with the given id has at least one color. Id -1 means that the k-mer was not
+    // found. This does not decode the color set.
+    bool has_colors(int64_t color_set_id) const{
+        return color_set_id >= 0 && !Base::coloring->get_color_set_by_color_set_id(color_set_id).empty();
+    }
 
-            if((double)n_nonempty / (S_size - Base::k + 1) >= Base::relevant_kmers_fraction)
-                Base::report_results_for_seq(string_id, intersection, n_nonempty);
+    // Returns the number of k-mers starting from index `start` that have at least one color (in either
+    // orientation if reverse complements are enabled). Used after the intersection has become empty,
+    // so that the rest of the color sets do not need to be intersected.
+    int64_t count_kmers_with_colors(int64_t start) const{
+        int64_t n_kmers = Base::color_set_id_buffer.size();
+        const vector<int64_t>& fw_ids = Base::color_set_id_buffer;
+        const vector<int64_t>& rc_ids = Base::rc_color_set_id_buffer;
+        int64_t count = 0;
+        bool prev_has_colors = false;
+        for(int64_t i = start; i < n_kmers; i++){
+            bool same_as_prev = i > start && fw_ids[i] == fw_ids[i-1] && (!Base::reverse_complements || rc_ids[n_kmers-1-i] == rc_ids[n_kmers-i]);
+            if(!same_as_prev) prev_has_colors = has_colors(fw_ids[i]) || (Base::reverse_complements && has_colors(rc_ids[n_kmers-1-i]));
+            count += prev_has_colors;
         }
+        return count;
     }
 
-    // Returns the color set and the number of non-empty colorsets in the query
-    pair<vector<int64_t>, int64_t> do_intersections_on_color_id_buffers_with_reverse_complements(){
+    // Stores the intersection into Base::intersection_buffer and returns the number of non-empty colorsets in the query
+    int64_t do_intersections_on_color_id_buffers_with_reverse_complements(){
         int64_t n_kmers = Base::color_set_id_buffer.size();
 
-        int64_t prev_colorset_size = 0;
+        bool prev_nonempty = false;
         int64_t n_nonempty = 0;
-        
-        typename coloring_t::colorset_type result;
+
+        vector<int64_t>& result = Base::intersection_buffer;
+        result.clear();
         for(int64_t i = 0; i < n_kmers; i++){
             if(i > 0
             && (Base::color_set_id_buffer[i] == Base::color_set_id_buffer[i-1])
             && (Base::rc_color_set_id_buffer[n_kmers-1-i] == Base::rc_color_set_id_buffer[n_kmers-1-i+1])){
-                if(prev_colorset_size > 0) n_nonempty++;
+                if(prev_nonempty) n_nonempty++;
                 continue; // This pair of color set ids was already intersected in the previous iteration
             }
 
@@ -412,67 +1228,88 @@ class IntersectionWorker : public BaseWorkerThread<WorkBatch>, Pseudoaligner_Bas
             int64_t rc_id = Base::rc_color_set_id_buffer[n_kmers-1-i];
 
             // Figure out the color set
-            typename coloring_t::colorset_type cs; // For union. TODO: Reuse a union buffer
+            bool nonempty = false;
             if(fw_id == -1 && rc_id == -1){
-                prev_colorset_size = 0;
-                continue; // Neither direction is found
+                nonempty = false; // Neither direction is found
             }
-            else if(fw_id == -1 && rc_id >= 0) cs = Base::coloring->get_color_set_by_color_set_id(rc_id);
-            else if(fw_id >= 0 && rc_id == -1) cs = Base::coloring->get_color_set_by_color_set_id(fw_id);
+            else if(fw_id == -1 && rc_id >= 0) nonempty = intersect_with_color_set_id(rc_id, n_nonempty == 0);
+            else if(fw_id >= 0 && rc_id == -1) nonempty = intersect_with_color_set_id(fw_id, n_nonempty == 0);
             else if(fw_id >= 0 && rc_id >= 0){
                 // Take union of forward and reverse complement
-                cs = Base::coloring->get_color_set_by_color_set_id(fw_id);
-                cs.do_union(Base::coloring->get_color_set_by_color_set_id(rc_id));
+                const vector<int64_t>& colors = Base::get_color_set_union(fw_id, rc_id);
+                nonempty = !colors.empty();
+                if(nonempty){
+                    if(n_nonempty == 0) result.assign(colors.begin(), colors.end()); // First nonempty color set
+                    else intersect_sorted_colors(result, colors);
+                }
             }
 
-            if(cs.size() > 0){
-                if(n_nonempty == 0) result = cs; // This is the first nonempty color set
-                else result.intersection(cs); // Intersection
-                n_nonempty++;
+            if(nonempty) n_nonempty++;
+            prev_nonempty = nonempty;
+
+            if(early_exit && nonempty && result.empty()){
+                // The intersection is empty and stays empty
+                return need_nonempty_count ? n_nonempty + count_kmers_with_colors(i+1) : n_nonempty;
             }
-            prev_colorset_size = cs.size();
         }
-        return {result.get_colors_as_vector(), n_nonempty};
+        return n_nonempty;
     }
 
-    // Returns the color set and the number of non-empty colorsets in the query
-    pair<vector<int64_t>, int64_t> do_intersections_on_color_id_buffers_without_reverse_complements(){
+    // Stores the intersection into Base::intersection_buffer and returns the number of non-empty colorsets in the query
+    int64_t do_intersections_on_color_id_buffers_without_reverse_complements(){
         int64_t n_kmers = Base::color_set_id_buffer.size();
 
-        int64_t prev_colorset_size = 0;
+        bool prev_nonempty = false;
         int64_t n_nonempty = 0;
-        typename coloring_t::colorset_type result;
+
+        Base::intersection_buffer.clear();
         for(int64_t i = 0; i < n_kmers; i++){
             if(i > 0  && (Base::color_set_id_buffer[i] == Base::color_set_id_buffer[i-1])){
                 // This color set was already intersected in the previous iteration
-                if(prev_colorset_size > 0) n_nonempty++;
-                // prev_colorset_size unchanged
+                if(prev_nonempty) n_nonempty++;
+                // prev_nonempty unchanged
             } else if(Base::color_set_id_buffer[i] == -1){
                 // k-mer not found
-                prev_colorset_size = 0;
+                prev_nonempty = false;
             } else{
                 // k-mer is found and it has a different color set from the previous one
-                const typename coloring_t::colorset_type::view_t cs = Base::coloring->get_color_set_by_color_set_id(Base::color_set_id_buffer[i]);
-                if(cs.size() > 0){
-                    if(n_nonempty == 0) result = cs; // This is the first nonempty color set
-                    else result.intersection(cs); // Intersection
-                    n_nonempty++;
+                prev_nonempty = intersect_with_color_set_id(Base::color_set_id_buffer[i], n_nonempty == 0);
+                if(prev_nonempty) n_nonempty++;
+
+                if(early_exit && prev_nonempty && Base::intersection_buffer.empty()){
+                    // The intersection is empty and stays empty
+                    return need_nonempty_count ? n_nonempty + count_kmers_with_colors(i+1) : n_nonempty;
                 }
-                prev_colorset_size = cs.size();
             }
         }
-        return {result.get_colors_as_vector(), n_nonempty};
+        return n_nonempty;
     }
 
     // This function should only use local variables and protected shared variables
     virtual void process_work_item(WorkBatch item){
-        for(int64_t i = 0; i < (int64_t)item.starts->size() - 1; i++){
-            int64_t start = (*item.starts)[i];
-            int64_t end = (*item.starts)[i+1];
-            int64_t seq_id = (*item.seq_ids)[i];
-            process_sequence(item.seqs_concat->data() + start, end-start, seq_id);
-            *Base::total_length_of_sequence_processed += end - start;
+        Base::start_batch(item.seq_ids->size(), item.file_idx);
+        if(item.paired){
+            for(int64_t i = 0; i < (int64_t)item.seq_ids->size(); i++){
+                const char* S1 = item.seqs_concat->data() + (*item.starts)[2*i];
+                const char* S2 = item.seqs_concat->data() + (*item.starts)[2*i+1];
+                int64_t S1_size = (*item.starts)[2*i+1] - (*item.starts)[2*i];
+                int64_t S2_size = (*item.starts)[2*i+2] - (*item.starts)[2*i+1];
+                int64_t seq_id = (*item.seq_ids)[i];
+                if(!Base::report_if_duplicate(S1, S1_size, S2, S2_size, seq_id))
+                    process_read_pair(S1, S1_size, S2, S2_size, seq_id);
+                Base::count_processed_bases(S1_size + S2_size);
+            }
+        } else{
+            for(int64_t i = 0; i < (int64_t)item.starts->size() - 1; i++){
+                int64_t start = (*item.starts)[i];
+                int64_t end = (*item.starts)[i+1];
+                int64_t seq_id = (*item.seq_ids)[i];
+                if(!Base::report_if_duplicate(item.seqs_concat->data() + start, end - start, nullptr, 0, seq_id))
+                    process_sequence(item.seqs_concat->data() + start, end-start, seq_id);
+                Base::count_processed_bases(end - start);
+            }
         }
+        Base::end_of_batch(item.seq_ids->front(), item.seq_ids->size());
     }
 
     // This function is called after every work item. It is called so
@@ -488,10 +1325,13 @@ class Worker : public BaseWorkerThread<WorkBatch>{
     public:
 
         unique_ptr<BaseWorkerThread<WorkBatch>> inner_worker;
+        atomic<int64_t>* node_bases = nullptr; // Bases processed on the NUMA node of this worker. Null if not counted.
 
         Worker(WorkerContext<coloring_t> context){
             // Initialize the correct inner worker
-            if(context.threshold == 1)
+            // The threshold worker also handles threshold 1 in approximate mode, where not all k-mers are looked up
+            bool sampling = context.kmer_stride > 1 || context.max_kmers_per_read > 0;
+            if(context.threshold == 1 && !sampling)
                 inner_worker = make_unique<IntersectionWorker<coloring_t>>(context);
             else
                 inner_worker = make_unique<ThresholdWorker<coloring_t>>(context);
@@ -499,6 +1339,7 @@ class Worker : public BaseWorkerThread<WorkBatch>{
 
         // This function should only use local variables and protected shared variables
         virtual void process_work_item(WorkBatch item){
+            if(node_bases) *node_bases += item.seqs_concat->size();
             inner_worker->process_work_item(move(item));
         }
 
@@ -513,11 +1354,50 @@ class Worker : public BaseWorkerThread<WorkBatch>{
 
 void print_thread(atomic<int64_t>* total_length_of_sequence_processed, atomic<int64_t>* total_bytes_written, atomic<bool>* stop_printing);
 
+// The NUMA nodes of the workers with --pin-threads or --numa-replicate-index, and the number of bases
+// processed on each node
+struct Worker_Nodes{
+    bool enabled = false;
+    numa::Worker_Placement placement;
+    vector<atomic<int64_t>> bases; // Per node
+    std::chrono::steady_clock::time_point start_time;
+
+    Worker_Nodes(const Pseudoalign_Config& C);
+
+    // For the ThreadPool: pins the i-th worker to its CPU
+    std::function<void(int64_t)> thread_start_function() const;
+
+    // Logs the throughput of each node since construction
+    void log_throughput() const;
+};
+
+// Creates the workers. With --numa-replicate-index, every worker uses the copy of the index on its node.
+template<typename coloring_t>
+void create_workers(WorkerContext<coloring_t> context, const Pseudoalign_Config& C, Worker_Nodes& nodes, vector<abundance::Equivalence_Class_Counter>* equivalence_classes, vector<unique_ptr<Worker<coloring_t>>>& workers, vector<Worker<coloring_t>*>& worker_ptrs){
+    for(int64_t i = 0; i < C.n_threads; i++){
+        WorkerContext<coloring_t> worker_context = context;
+        if(equivalence_classes) worker_context.equivalence_classes = &(*equivalence_classes)[i];
+        if(C.index_replicas){
+            int64_t node = nodes.placement.worker_node[i];
+            worker_context.SBWT = C.index_replicas->SBWTs[node].get();
+            worker_context.coloring = C.index_replicas->template get_coloring<coloring_t>(node);
+        }
+        workers.push_back(make_unique<Worker<coloring_t>>(worker_context));
+        if(nodes.enabled) workers.back()->node_bases = &nodes.bases[nodes.placement.worker_node[i]];
+        worker_ptrs.push_back(workers.back().get());
+    }
+}
+
+// Returns the number of batches pushed. The batches are tagged with file_idx. If metrics is given,
+// the time spent reading the input, but not waiting for space in the work queue, is added to it.
 template<typename sequence_reader_t, typename coloring_t>
-void push_work_batches(int64_t buffer_size, sequence_reader_t& reader, ThreadPool<Worker<coloring_t>, pseudoalignment::WorkBatch>& TP){
+int64_t push_work_batches(int64_t buffer_size, sequence_reader_t& reader, ThreadPool<Worker<coloring_t>, pseudoalignment::WorkBatch>& TP, int64_t file_idx = 0, Pseudoalign_Metrics* metrics = nullptr){
     // Start creating work batches
     int64_t batch_push_threshold = buffer_size; // A batch is pushed to the thread pool when it reaches this size
-    WorkBatch wb;
+    auto pool = make_shared<Batch_Pool<WorkBatch>>(); // The workers give the batches back here
+    WorkBatch wb = get_pooled_work_batch(pool, file_idx, false);
+    int64_t n_batches = 0;
+    metrics_time_t input_start = metrics ? std::chrono::steady_clock::now() : metrics_time_t();
 
     int64_t seq_id = 0;
     while(true){
@@ -527,15 +1407,17 @@ void push_work_batches(int64_t buffer_size, sequence_reader_t& reader, ThreadPoo
         // Add the read to the batch
         wb.starts->push_back(wb.seqs_concat->size());
         wb.seq_ids->push_back(seq_id);
-        for(int64_t i = 0 ; i < len; i++){
-            wb.seqs_concat->push_back(reader.read_buf[i]);
-        }
+        wb.seqs_concat->insert(wb.seqs_concat->end(), reader.read_buf, reader.read_buf + len);
 
         if(wb.seqs_concat->size() >= batch_push_threshold){
             // Push the batch
             wb.starts->push_back(wb.seqs_concat->size()); // End sentinel
-            TP.add_work(std::move(wb), wb.seqs_concat->size());
-            // Moving the batch also clears it
+            int64_t load = wb.seqs_concat->size();
+            if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+            TP.add_work(std::move(wb), load);
+            if(metrics) input_start = std::chrono::steady_clock::now();
+            n_batches++;
+            wb = get_pooled_work_batch(pool, file_idx, false);
         }
 
         seq_id++;
@@ -544,58 +1426,243 @@ void push_work_batches(int64_t buffer_size, sequence_reader_t& reader, ThreadPoo
     // Push the last batch
     if(wb.seqs_concat->size() > 0){
         wb.starts->push_back(wb.seqs_concat->size()); // End sentinel
-        TP.add_work(std::move(wb), wb.seqs_concat->size());
+        int64_t load = wb.seqs_concat->size();
+        if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+        TP.add_work(std::move(wb), load);
+        n_batches++;
+    } else if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+
+    return n_batches;
+}
+
+// Reads the two mate files in lockstep and puts both mates of each pair into the same batch.
+// The pairs are numbered from zero in the order they appear in the files. Returns the number of batches pushed.
+// Metrics are counted like in push_work_batches.
+template<typename sequence_reader1_t, typename sequence_reader2_t, typename coloring_t>
+int64_t push_paired_work_batches(int64_t buffer_size, sequence_reader1_t& reader1, sequence_reader2_t& reader2, ThreadPool<Worker<coloring_t>, pseudoalignment::WorkBatch>& TP, int64_t file_idx = 0, Pseudoalign_Metrics* metrics = nullptr){
+    int64_t batch_push_threshold = buffer_size; // A batch is pushed to the thread pool when it reaches this size
+    auto pool = make_shared<Batch_Pool<WorkBatch>>(); // The workers give the batches back here
+    WorkBatch wb = get_pooled_work_batch(pool, file_idx, true);
+    int64_t n_batches = 0;
+    metrics_time_t input_start = metrics ? std::chrono::steady_clock::now() : metrics_time_t();
+
+    int64_t pair_id = 0;
+    while(true){
+        int64_t len1 = reader1.get_next_read_to_buffer();
+        int64_t len2 = reader2.get_next_read_to_buffer();
+        if(len1 == 0 && len2 == 0) break;
+        if(len1 == 0 || len2 == 0)
+            throw std::runtime_error("The paired-end query files have different numbers of reads (the shorter one ends after " + to_string(pair_id) + " reads)");
+
+        // Add the pair to the batch
+        wb.starts->push_back(wb.seqs_concat->size());
+        wb.seqs_concat->insert(wb.seqs_concat->end(), reader1.read_buf, reader1.read_buf + len1);
+        wb.starts->push_back(wb.seqs_concat->size());
+        wb.seqs_concat->insert(wb.seqs_concat->end(), reader2.read_buf, reader2.read_buf + len2);
+        wb.seq_ids->push_back(pair_id);
+
+        if(wb.seqs_concat->size() >= batch_push_threshold){
+            // Push the batch
+            wb.starts->push_back(wb.seqs_concat->size()); // End sentinel
+            int64_t load = wb.seqs_concat->size();
+            if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+            TP.add_work(std::move(wb), load);
+            if(metrics) input_start = std::chrono::steady_clock::now();
+            n_batches++;
+            wb = get_pooled_work_batch(pool, file_idx, true);
+        }
+
+        pair_id++;
     }
 
+    // Push the last batch
+    if(wb.seqs_concat->size() > 0){
+        wb.starts->push_back(wb.seqs_concat->size()); // End sentinel
+        int64_t load = wb.seqs_concat->size();
+        if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+        TP.add_work(std::move(wb), load);
+        n_batches++;
+    } else if(metrics) metrics->input_ns += nanoseconds_since(input_start);
+
+    return n_batches;
 }
 
-} // End namespace pseudoalignment
+// Runs the EM algorithm on the merged equivalence classes of the workers and writes the abundances
+void estimate_and_write_abundances(const vector<abundance::Equivalence_Class_Counter>& counters, int64_t n_colors, int64_t n_threads, const std::string& abundance_outfile);
 
-template<typename coloring_t, typename sequence_reader_t>
-void pseudoalign(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, int64_t n_threads, sequence_reader_t& reader, std::string outfile, bool reverse_complements, int64_t buffer_size, bool gzipped, bool sorted_output, double threshold, bool ignore_unknown, bool report_relevant, double relevant_kmers_fraction, bool sort_hits){
+// Sets up the workers and the thread pool and calls push_batches(TP) to feed in the work. If
+// abundance_outfile is given, also estimates abundances. Then, if outfile is empty, the per-read
+// results are not written at all.
+template<typename coloring_t, typename batch_pusher_t>
+void run_pseudoalignment_workers(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, const std::string& outfile, const std::string& abundance_outfile, batch_pusher_t push_batches){
 
-    using namespace pseudoalignment;
+    int64_t buffer_size = C.buffer_size_megas * (1 << 20);
 
-    // Artificial scope to free the output writer before sorting output. This is needed because
-    // zstr is stupid and the flush function does not actually flush. It's only flushes when the
-    // object is freed.
+    // Artificial scope to free the output writer before returning. The writer thread of the output
+    // writer finishes writing only when the writer is freed.
     {
         // Set up context (= commmon variables for all workers).
-        std::unique_ptr<ParallelBaseWriter> out = create_writer(outfile, gzipped);
+        bool estimate_abundances = abundance_outfile != "";
+        bool read_output = !(estimate_abundances && outfile == "");
+        std::unique_ptr<ParallelBaseWriter> out;
+        // With sorted output, the writer puts the batches in order as they are written. Batches are handed to the
+        // workers in order, so the number of batches waiting for earlier ones stays small. The window is generous.
+        if(read_output) out = create_writer(outfile, C.gzipped_output, C.sort_output_lines, C.n_threads * buffer_size);
+        else out = make_unique<ParallelNullWriter>();
+        if(C.binary_output) out->write(binary_format::file_header(C.report_relevant));
+        if(C.metrics) out->count_lock_wait_time(&C.metrics->writer_lock_wait_ns);
         atomic<int64_t> total_length_of_sequence_processed = 0; // For printing progress
         atomic<int64_t> total_bytes_written = 0; // For printing progress
-        WorkerContext<coloring_t> context = {&SBWT, &coloring, reverse_complements, threshold, ignore_unknown, sort_hits, buffer_size, &total_length_of_sequence_processed, &total_bytes_written, out.get(), report_relevant, relevant_kmers_fraction};
+        Color_Set_Cache_Counters cache_counters;
+        int64_t cache_bytes_per_worker = C.color_set_cache_megas * (1 << 20) / C.n_threads;
+        WorkerContext<coloring_t> context = {&SBWT, &coloring, C.reverse_complements, C.threshold, C.ignore_unknown, C.sort_hits, buffer_size, &total_length_of_sequence_processed, &total_bytes_written, out.get(), C.report_relevant, C.relevant_kmers_fraction, C.binary_output, C.sort_output_lines, cache_bytes_per_worker, &cache_counters, C.dedup_reads, C.kmer_stride, C.max_kmers_per_read, nullptr, read_output, nullptr, C.metrics};
+
+        // Every worker counts equivalence classes into its own counter. They are merged at the end.
+        vector<abundance::Equivalence_Class_Counter> equivalence_classes(estimate_abundances ? C.n_threads : 0);
 
         // Create workers
+        Worker_Nodes nodes(C);
         vector<unique_ptr<Worker<coloring_t>>> workers;
         vector<Worker<coloring_t>*> worker_ptrs;
-        for(int64_t i = 0; i < n_threads; i++){
-            workers.push_back(make_unique<Worker<coloring_t>>(context));
-            worker_ptrs.push_back(workers.back().get());
-        }
+        create_workers(context, C, nodes, estimate_abundances ? &equivalence_classes : nullptr, workers, worker_ptrs);
 
         // Launch a thread that prints progress every second until done
         atomic<bool> stop_printing = false; // The thread will stop when this is set to true
-        std::thread print_thread(pseudoalignment::print_thread, &total_length_of_sequence_processed, &total_bytes_written, &stop_printing);
+        std::thread print_thread;
+        if(C.print_progress) print_thread = std::thread(pseudoalignment::print_thread, &total_length_of_sequence_processed, &total_bytes_written, &stop_printing);
 
         // Create a worker thread pool
-        ThreadPool<Worker<coloring_t>, WorkBatch> TP(worker_ptrs, buffer_size);
-
-        try{ // For some reason exceptions are not propagates up to main from here, so we catch them and terminate the program here
-            push_work_batches(buffer_size, reader, TP);
-        } catch (const std::runtime_error &e){
-            std::cerr << "Runtime error: " << e.what() << '\n';
-            std::terminate();
+        ThreadPool<Worker<coloring_t>, WorkBatch> TP(worker_ptrs, buffer_size, C.metrics ? &C.metrics->queue_push_wait_ns : nullptr, C.metrics ? &C.metrics->queue_pop_wait_ns : nullptr, nodes.thread_start_function(), C.work_gate);
+
+        // An error in reading the input is thrown only after the threads have been stopped, so that it reaches
+        // the caller. The server keeps running after a job fails.
+        std::exception_ptr push_error;
+        try{
+            push_batches(TP);
+        } catch(...){
+            push_error = std::current_exception();
         }
 
         TP.join_threads();
         workers.clear(); // This will delete the workers, which will flush their internal buffers to the common output buffer
+        nodes.log_throughput();
 
         // Terminate the print thread
         stop_printing = true;
-        print_thread.join();
+        if(print_thread.joinable()) print_thread.join();
+
+        if(push_error) std::rethrow_exception(push_error);
+        TP.rethrow_worker_error();
+        out->close(); // Throws if writing the output failed
+
+        if(cache_bytes_per_worker > 0){
+            write_log("Color set cache hit rate: " + to_string(cache_counters.hit_rate()) + " (" + to_string(cache_counters.hits) + " hits, " + to_string(cache_counters.misses) + " misses, " + to_string(cache_counters.evictions) + " evictions)", LogLevel::MAJOR);
+        }
+
+        if(estimate_abundances){
+            estimate_and_write_abundances(equivalence_classes, coloring.largest_color() + 1, C.n_threads, abundance_outfile);
+        }
     } // Flushes output
+}
 
-    if (sorted_output) call_sort_parallel_output_file(outfile, gzipped);
-    
-}
\ No newline at end of file
+// Pseudoaligns all the query files of C with one set of workers. Up to C.max_concurrent_files files are
+// read at the same time, each by its own thread, which calls push_file(file_idx, TP) to push the batches
+// of the file tagged with file_idx. The function must return the number of batches pushed. The output of
+// each file goes to its own writer, which is closed as soon as the file is done.
+template<typename coloring_t, typename file_pusher_t>
+void pseudoalign_files_concurrently(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, file_pusher_t push_file){
+
+    int64_t buffer_size = C.buffer_size_megas * (1 << 20);
+    int64_t n_files = C.query_files.size();
+
+    vector<unique_ptr<Query_File_Output>> file_outputs;
+    for(int64_t i = 0; i < n_files; i++) file_outputs.push_back(make_unique<Query_File_Output>());
+
+    atomic<int64_t> total_length_of_sequence_processed = 0; // For printing progress
+    atomic<int64_t> total_bytes_written = 0; // For printing progress
+    Color_Set_Cache_Counters cache_counters;
+    int64_t cache_bytes_per_worker = C.color_set_cache_megas * (1 << 20) / C.n_threads;
+    WorkerContext<coloring_t> context = {&SBWT, &coloring, C.reverse_complements, C.threshold, C.ignore_unknown, C.sort_hits, buffer_size, &total_length_of_sequence_processed, &total_bytes_written, nullptr, C.report_relevant, C.relevant_kmers_fraction, C.binary_output, C.sort_output_lines, cache_bytes_per_worker, &cache_counters, C.dedup_reads, C.kmer_stride, C.max_kmers_per_read, nullptr, true, &file_outputs, C.metrics};
+
+    // Create workers
+    Worker_Nodes nodes(C);
+    vector<unique_ptr<Worker<coloring_t>>> workers;
+    vector<Worker<coloring_t>*> worker_ptrs;
+    create_workers(context, C, nodes, nullptr, workers, worker_ptrs);
+
+    // Launch a thread that prints progress every second until done
+    atomic<bool> stop_printing = false; // The thread will stop when this is set to true
+    std::thread print_thread;
+    if(C.print_progress) print_thread = std::thread(pseudoalignment::print_thread, &total_length_of_sequence_processed, &total_bytes_written, &stop_printing);
+
+    // Create a worker thread pool
+    ThreadPool<Worker<coloring_t>, WorkBatch> TP(worker_ptrs, buffer_size, C.metrics ? &C.metrics->queue_push_wait_ns : nullptr, C.metrics ? &C.metrics->queue_pop_wait_ns : nullptr, nodes.thread_start_function(), C.work_gate);
+
+    // Each pusher thread takes the next unopened file until all files have been taken. If a pusher fails,
+    // no more files are opened, and the error is thrown on this thread after the other threads are done.
+    atomic<int64_t> next_file = 0;
+    std::mutex push_error_mutex;
+    std::exception_ptr push_error;
+    auto pusher = [&](){
+        try{
+            while(true){
+                int64_t i = next_file++;
+                if(i >= n_files) break;
+                string query_name = C.paired ? (C.query_files[i] + " and " + C.query_files_2[i]) : C.query_files[i];
+                write_log("Aligning " + query_name + " (writing output to " + C.outfiles[i] + ")", LogLevel::MAJOR);
+
+                Query_File_Output& F = *file_outputs[i];
+                F.writer = create_writer(C.outfiles[i], C.gzipped_output, C.sort_output_lines, C.n_threads * buffer_size);
+                if(C.binary_output) F.writer->write(binary_format::file_header(C.report_relevant));
+                if(C.metrics) F.writer->count_lock_wait_time(&C.metrics->writer_lock_wait_ns);
+                F.all_batches_pushed(push_file(i, TP));
+            }
+        } catch(...){
+            next_file = n_files;
+            std::lock_guard<std::mutex> lock(push_error_mutex);
+            if(!push_error) push_error = std::current_exception();
+        }
+    };
+
+    vector<std::thread> pusher_threads;
+    for(int64_t t = 0; t < min(C.max_concurrent_files, n_files); t++) pusher_threads.push_back(std::thread(pusher));
+    for(std::thread& t : pusher_threads) t.join();
+
+    TP.join_threads(); // All files are closed after this
+    workers.clear();
+    nodes.log_throughput();
+
+    // Terminate the print thread
+    stop_printing = true;
+    if(print_thread.joinable()) print_thread.join();
+
+    if(push_error) std::rethrow_exception(push_error);
+    TP.rethrow_worker_error();
+    for(const unique_ptr<Query_File_Output>& F : file_outputs)
+        if(F->error) std::rethrow_exception(F->error);
+
+    if(cache_bytes_per_worker > 0){
+        write_log("Color set cache hit rate: " + to_string(cache_counters.hit_rate()) + " (" + to_string(cache_counters.hits) + " hits, " + to_string(cache_counters.misses) + " misses, " + to_string(cache_counters.evictions) + " evictions)", LogLevel::MAJOR);
+    }
+}
+
+} // End namespace pseudoalignment
+
+// If outfile is empty, prints to stdout, unless abundance_outfile is given, in which case only the abundances are written
+template<typename coloring_t, typename sequence_reader_t>
+void pseudoalign(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, sequence_reader_t& reader, const std::string& outfile, const std::string& abundance_outfile = ""){
+    using namespace pseudoalignment;
+    run_pseudoalignment_workers(SBWT, coloring, C, outfile, abundance_outfile, [&](ThreadPool<Worker<coloring_t>, WorkBatch>& TP){
+        push_work_batches(C.buffer_size_megas * (1 << 20), reader, TP, 0, C.metrics);
+    });
+}
+
+// Pseudoaligns read pairs, one from each reader. Outputs one line per pair. If outfile is empty, prints to stdout,
+// unless abundance_outfile is given, in which case only the abundances are written.
+template<typename coloring_t, typename sequence_reader1_t, typename sequence_reader2_t>
+void pseudoalign_paired(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, sequence_reader1_t& reader1, sequence_reader2_t& reader2, const std::string& outfile, const std::string& abundance_outfile = ""){
+    using namespace pseudoalignment;
+    run_pseudoalignment_workers(SBWT, coloring, C, outfile, abundance_outfile, [&](ThreadPool<Worker<coloring_t>, WorkBatch>& TP){
+        push_paired_work_batches(C.buffer_size_megas * (1 << 20), reader1, reader2, TP, 0, C.metrics);
+    });
+}
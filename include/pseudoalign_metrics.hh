@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+/*
+
+Runtime metrics of the pseudoalign command (--metrics-out)
+
+The metrics are written as JSON lines: one line with "type": "progress" every --metrics-interval seconds
+and one line with "type": "summary" at the end of the command. All numbers are totals since the start
+of the command. The times are summed over all threads, so with n threads a stage can take up to n
+seconds per second of wall-clock time. The stages are:
+
+    input_seconds              Reading, decompressing and parsing the query files into work batches
+    queue_push_wait_seconds    Readers blocked because the work queue was full (the workers are the bottleneck)
+    queue_pop_wait_seconds     Workers blocked because the work queue was empty (the input is the bottleneck)
+    lookup_seconds             Searching k-mers in the SBWT and looking up their color set ids
+    coloring_seconds           Everything else the workers do: decoding, intersecting and counting color sets, formatting output
+    writer_seconds             Handing output to the writer, including the wait for the writer lock
+    writer_lock_wait_seconds   Waiting for the writer lock or for an earlier batch in --sort-output-lines mode
+
+The workers keep their counts in private variables and add them to the shared totals once per work batch,
+and nothing is timed when metrics are off.
+
+*/
+
+namespace pseudoalignment{
+
+typedef std::chrono::steady_clock::time_point metrics_time_t;
+
+inline int64_t nanoseconds_since(metrics_time_t start){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Totals shared by all threads
+struct Pseudoalign_Metrics{
+    std::atomic<int64_t> reads = 0; // Read pairs count as one
+    std::atomic<int64_t> bases = 0;
+    std::atomic<int64_t> kmers = 0; // Looked up k-mers
+    std::atomic<int64_t> kmers_found = 0; // Looked up k-mers found in the index (in either orientation with --rc)
+    std::atomic<int64_t> color_sets_decoded = 0;
+    std::atomic<int64_t> bytes_written = 0;
+
+    // Nanoseconds, summed over threads
+    std::atomic<int64_t> input_ns = 0;
+    std::atomic<int64_t> queue_push_wait_ns = 0;
+    std::atomic<int64_t> queue_pop_wait_ns = 0;
+    std::atomic<int64_t> lookup_ns = 0;
+    std::atomic<int64_t> processing_ns = 0; // Time workers spend on work batches. Includes lookup and writer time.
+    std::atomic<int64_t> writer_ns = 0;
+    std::atomic<int64_t> writer_lock_wait_ns = 0;
+
+    // One JSON object without a newline
+    std::string to_json(const std::string& type, double elapsed_seconds) const;
+};
+
+// The counts of one worker since it last added them to the shared totals
+struct Worker_Metrics{
+    int64_t reads = 0;
+    int64_t bases = 0;
+    int64_t kmers = 0;
+    int64_t kmers_found = 0;
+    int64_t color_sets_decoded = 0;
+    int64_t bytes_written = 0;
+    int64_t lookup_ns = 0;
+    int64_t processing_ns = 0;
+    int64_t writer_ns = 0;
+
+    // Adds the counts to M and sets them to zero
+    void move_to(Pseudoalign_Metrics& M){
+        M.reads += reads;
+        M.bases += bases;
+        M.kmers += kmers;
+        M.kmers_found += kmers_found;
+        M.color_sets_decoded += color_sets_decoded;
+        M.bytes_written += bytes_written;
+        M.lookup_ns += lookup_ns;
+        M.processing_ns += processing_ns;
+        M.writer_ns += writer_ns;
+        *this = Worker_Metrics();
+    }
+};
+
+// Writes the metrics to a file as JSON lines from a background thread: a progress line every
+// interval_seconds, and a summary line when stopped. Throws if the file can not be opened.
+class Metrics_Reporter{
+
+    const Pseudoalign_Metrics* metrics;
+    std::string outfile;
+    double interval_seconds;
+    metrics_time_t start_time;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stop_cv;
+    bool stop_requested = false;
+
+    void run();
+
+    public:
+
+    Metrics_Reporter(const Pseudoalign_Metrics* metrics, const std::string& outfile, double interval_seconds);
+
+    // Writes the summary line and stops the thread
+    void stop();
+
+    ~Metrics_Reporter(); // Calls stop if not already stopped
+
+};
+
+} // namespace pseudoalignment
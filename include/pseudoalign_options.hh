@@ -0,0 +1,13 @@
+#pragma once
+
+#include <variant>
+#include "pseudoalign.hh"
+#include "sbwt/cxxopts.hpp"
+
+// Command line handling of the pseudoalign command, shared with the serve command. Defined in pseudoalign_main.cpp.
+
+void add_pseudoalign_options(cxxopts::Options& options);
+
+Pseudoalign_Config pseudoalign_config_from_options(cxxopts::ParseResult& opts);
+
+void pseudoalign_query_files(const plain_matrix_sbwt_t& SBWT, const std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>>& coloring, const Pseudoalign_Config& C);
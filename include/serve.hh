@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+/*
+
+Protocol between `themisto serve` and `themisto client`
+
+The server listens on a Unix domain socket and handles one job per connection. All messages are
+framed as an 8-byte little-endian length followed by that many bytes.
+
+The client sends two messages:
+    1. The arguments of the job separated by null characters. They are the options of the pseudoalign
+       command, except that the index is the one loaded by the server. The single argument
+       "--shutdown" asks the server to stop after the running jobs.
+    2. Inline query sequences in FASTA or FASTQ format, or an empty message if the query files are
+       given in the arguments.
+
+The server replies with two messages:
+    1. "OK", or "ERROR: " followed by the error message.
+    2. The pseudoalignment output if the job did not give output files, otherwise empty.
+
+*/
+
+namespace serve{
+
+// Sends a pseudoalignment job to a running server. If inline_sequences is not empty, it is the query.
+// If the job gives no output file, the output is written to out. Throws std::runtime_error if the job fails.
+void run_client_job(const std::string& socket_path, const std::vector<std::string>& args, const std::string& inline_sequences, std::ostream& out);
+
+// Asks the server to stop accepting jobs and exit after the running jobs are done
+void send_shutdown_request(const std::string& socket_path);
+
+// Makes the file paths in the arguments of a job absolute, because the server may have a different
+// working directory. Handles both "--out-file out.txt" and "--out-file=out.txt". Returns true if the
+// arguments give a query file.
+bool make_paths_absolute(std::vector<std::string>& args);
+
+} // namespace serve
@@ -66,6 +66,12 @@ vector<string> split_seqs_to_separate_files(string infile);
 
 void write_lines(const vector<string>& lines, const string& filename);
 
+// One gzip member that decompresses to data. If bgzf is true, the header has the BGZF block size field.
+string gzip_member(const string& data, bool bgzf);
+
+// The data compressed as gzip members of member_size uncompressed bytes each
+string gzip_members(const string& data, int64_t member_size, bool bgzf);
+
 template<typename T>
 T to_disk_and_back(T& c){
     string f = sbwt::get_temp_file_manager().create_filename();
@@ -75,4 +75,32 @@ void transform_existing_index(const string& from_index_dbg, const string& from_i
 
     return;
 
-}
\ No newline at end of file
+}
+
+// Rewrites the node id -> color set id array of an SDSL coloring in the given layout (see Sparse_Uint_Array.hh)
+void convert_color_set_pointer_layout(const string& index_dbg_file, const string& index_color_file, Sparse_Uint_Array_Layout layout){
+    string layout_name = "separate";
+    if(layout == Sparse_Uint_Array_Layout::interleaved) layout_name = "interleaved";
+    if(layout == Sparse_Uint_Array_Layout::elias_fano) layout_name = "Elias-Fano";
+    write_log("Converting the color set pointers to the " + layout_name + " layout", LogLevel::MAJOR);
+    plain_matrix_sbwt_t dbg;
+    dbg.load(index_dbg_file);
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    coloring.load(index_color_file, dbg);
+    coloring.set_node_id_to_colorset_id_layout(layout);
+    coloring.serialize(index_color_file); // Writes to a temporary file first, so this does not disturb the mapping
+}
+
+// Renumbers the color sets of a coloring of either type by the number of nodes that point to them (see
+// Coloring::order_color_sets_by_frequency)
+void order_color_sets_by_frequency(const string& index_dbg_file, const string& index_color_file){
+    write_log("Ordering the color sets by frequency", LogLevel::MAJOR);
+    plain_matrix_sbwt_t dbg;
+    dbg.load(index_dbg_file);
+    std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>> coloring;
+    load_coloring(index_color_file, dbg, coloring);
+    std::visit([&](auto& C){
+        C.order_color_sets_by_frequency();
+        C.serialize(index_color_file); // Writes to a temporary file first, so this does not disturb the mapping
+    }, coloring);
+}
@@ -0,0 +1,76 @@
+# Estimates the error of the approximate pseudoalignment mode (--kmer-stride, --max-kmers-per-read)
+# relative to the exact mode on the same generated queries and index as run.py. Run from this directory
+# after building Themisto.
+
+import subprocess
+import sys
+
+if sys.version_info < (3, 0):
+    sys.stdout.write("Error: Python3 required\n")
+    sys.exit(1)
+
+def run(command):
+    sys.stderr.write(command + "\n")
+    return subprocess.run(command, shell=True).returncode
+
+def read_hits(filename):
+    hits = dict()
+    for line in open(filename).read().splitlines():
+        tokens = line.split()
+        hits[int(tokens[0])] = set(map(int, tokens[1:]))
+    return hits
+
+def compare(exact, approx):
+    # Returns (fraction of reads with identical hits, mean Jaccard, precision, recall)
+    n_identical = 0
+    jaccard_sum = 0
+    n_true_positives = 0
+    n_approx_hits = 0
+    n_exact_hits = 0
+    for read_id in exact:
+        E = exact[read_id]
+        A = approx[read_id]
+        if E == A: n_identical += 1
+        union = len(E | A)
+        jaccard_sum += 1 if union == 0 else len(E & A) / union
+        n_true_positives += len(E & A)
+        n_approx_hits += len(A)
+        n_exact_hits += len(E)
+    n = len(exact)
+    precision = 1 if n_approx_hits == 0 else n_true_positives / n_approx_hits
+    recall = 1 if n_exact_hits == 0 else n_true_positives / n_exact_hits
+    return n_identical / n, jaccard_sum / n, precision, recall
+
+themisto_binary = "../../build/bin/themisto"
+k = 9
+temp_dir = "./temp"
+index_prefix = temp_dir + "/index"
+query_file = "generated_queries.fasta.gz"
+out_dir = "./out"
+
+run("mkdir -p {}".format(out_dir))
+run("mkdir -p {}".format(temp_dir))
+
+assert(run("python3 gen_queries.py " + query_file) == 0)
+assert(run("echo -n > file_list.txt") == 0) # Clear file
+assert(run("find ../ref_sequences -type f | grep fasta.gz >> file_list.txt") == 0)
+
+assert(run("{} build -k {} -i {} -o {} --temp-dir {} --sequence-colors -d 5 --forward-strand-only".format(
+    themisto_binary, k, "file_list.txt", index_prefix, temp_dir))
+== 0)
+
+def pseudoalign(outfile, threshold, options):
+    assert(run("{} pseudoalign -q {} -i {} -o {} --temp-dir {} --threshold {} --rc --sort-hits --sort-output-lines -t 4 {}".format(
+        themisto_binary, query_file, index_prefix, outfile, temp_dir, threshold, options))
+    == 0)
+
+print("threshold\tsampling\tidentical_reads\tmean_jaccard\tprecision\trecall")
+for threshold in ["1", "0.7"]:
+    exact_outfile = out_dir + "/exact-" + threshold + ".txt"
+    pseudoalign(exact_outfile, threshold, "")
+    exact = read_hits(exact_outfile)
+    for sampling in ["--kmer-stride 2", "--kmer-stride 4", "--kmer-stride 8", "--max-kmers-per-read 10", "--max-kmers-per-read 3"]:
+        approx_outfile = out_dir + "/approx-" + threshold + "-" + sampling.replace(" ", "") + ".txt"
+        pseudoalign(approx_outfile, threshold, sampling)
+        identical, jaccard, precision, recall = compare(exact, read_hits(approx_outfile))
+        print("{}\t{}\t{:.4f}\t{:.4f}\t{:.4f}\t{:.4f}".format(threshold, sampling, identical, jaccard, precision, recall))
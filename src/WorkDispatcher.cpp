@@ -9,7 +9,7 @@
 using namespace std;
 using namespace sbwt;
 
-void dispatcher_consumer(ParallelBoundedQueue<ReadBatch*>& Q, DispatcherConsumerCallback* cb, int64_t thread_id){
+void dispatcher_consumer(ParallelBoundedQueue<ReadBatch*>& Q, DispatcherConsumerCallback* cb, int64_t thread_id, Batch_Pool<ReadBatch>* pool){
     write_log("Starting thread " + to_string(thread_id), LogLevel::MINOR);
     while(true){
         ReadBatch* batch  = Q.pop();
@@ -28,6 +28,7 @@ void dispatcher_consumer(ParallelBoundedQueue<ReadBatch*>& Q, DispatcherConsumer
             cb->callback(read, read_len, read_id, metadata);
             read_id++;
         }
+        pool->give_back(std::move(*batch)); // Keep the buffers for the producer
         delete batch; // Allocated by producer
     }
     write_log("Thread " + to_string(thread_id) + " done", LogLevel::MINOR);
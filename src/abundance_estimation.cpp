@@ -0,0 +1,128 @@
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include "abundance_estimation.hh"
+#include "sbwt/globals.hh"
+#include "sbwt/throwing_streams.hh"
+
+using namespace std;
+using namespace sbwt;
+
+namespace abundance{
+
+vector<Equivalence_Class> merge_equivalence_classes(const vector<Equivalence_Class_Counter>& counters, int64_t n_threads){
+    typedef pair<const vector<int64_t>, Equivalence_Class_Counter::Value> Entry;
+
+    // Split the classes of each counter into the partitions once, so that the thread of a partition
+    // only visits its own classes
+    vector<vector<vector<const Entry*>>> buckets(counters.size(), vector<vector<const Entry*>>(n_threads));
+    #pragma omp parallel for num_threads (n_threads)
+    for(int64_t i = 0; i < (int64_t)counters.size(); i++){
+        for(const Entry& entry : counters[i].classes)
+            buckets[i][entry.second.hash % n_threads].push_back(&entry);
+    }
+
+    vector<vector<Equivalence_Class>> partitions(n_threads);
+
+    #pragma omp parallel for num_threads (n_threads)
+    for(int64_t p = 0; p < n_threads; p++){
+        unordered_map<vector<int64_t>, int64_t, Equivalence_Class_Counter::Hash> merged;
+        for(int64_t i = 0; i < (int64_t)counters.size(); i++){
+            for(const Entry* entry : buckets[i][p]) merged[entry->first] += entry->second.count;
+        }
+        for(auto& [colors, count] : merged) partitions[p].push_back({colors, count});
+    }
+
+    vector<Equivalence_Class> classes;
+    for(vector<Equivalence_Class>& partition : partitions)
+        for(Equivalence_Class& ec : partition) classes.push_back(std::move(ec));
+    return classes;
+}
+
+vector<double> estimate_abundances(const vector<Equivalence_Class>& classes, int64_t n_colors, int64_t n_threads, int64_t max_iterations, double tolerance){
+    int64_t total_reads = 0;
+    for(const Equivalence_Class& ec : classes) total_reads += ec.count;
+    if(total_reads == 0 || n_colors == 0) return vector<double>(n_colors, 0);
+
+    // The classes containing each color, in compressed sparse row form: the classes of color c are
+    // class_ids[color_starts[c]..color_starts[c+1]). Summing the shares of a color from this list
+    // lets every thread own a range of colors, so no per-thread sums over all colors are needed.
+    vector<int64_t> color_starts(n_colors + 1, 0);
+    for(const Equivalence_Class& ec : classes)
+        for(int64_t c : ec.colors) color_starts[c+1]++;
+    for(int64_t c = 0; c < n_colors; c++) color_starts[c+1] += color_starts[c];
+    vector<int64_t> class_ids(color_starts[n_colors]);
+    {
+        vector<int64_t> fill_pos(color_starts.begin(), color_starts.end() - 1);
+        for(int64_t i = 0; i < (int64_t)classes.size(); i++)
+            for(int64_t c : classes[i].colors) class_ids[fill_pos[c]++] = i;
+    }
+
+    // Start from the uniform distribution over the colors
+    vector<double> alpha(n_colors, (double)total_reads / n_colors);
+    vector<double> new_alpha(n_colors);
+
+    // The share of color c of class i is alpha[c] * scale[i] + flat[i]
+    vector<double> scale(classes.size());
+    vector<double> flat(classes.size());
+
+    for(int64_t iteration = 0; iteration < max_iterations; iteration++){
+        double change = 0;
+
+        #pragma omp parallel num_threads (n_threads) reduction(+:change)
+        {
+            // Divide the reads of each class in proportion to the current estimates
+            #pragma omp for schedule(dynamic, 1024)
+            for(int64_t i = 0; i < (int64_t)classes.size(); i++){
+                const Equivalence_Class& ec = classes[i];
+                double denominator = 0;
+                for(int64_t c : ec.colors) denominator += alpha[c];
+                if(denominator > 0){
+                    scale[i] = ec.count / denominator;
+                    flat[i] = 0;
+                } else{
+                    // All the colors of the class have gone to zero. Divide evenly.
+                    scale[i] = 0;
+                    flat[i] = (double)ec.count / ec.colors.size();
+                }
+            } // Implicit barrier
+
+            #pragma omp for schedule(dynamic, 1024)
+            for(int64_t c = 0; c < n_colors; c++){
+                double scale_sum = 0, flat_sum = 0;
+                for(int64_t j = color_starts[c]; j < color_starts[c+1]; j++){
+                    scale_sum += scale[class_ids[j]];
+                    flat_sum += flat[class_ids[j]];
+                }
+                double sum = alpha[c] * scale_sum + flat_sum;
+                new_alpha[c] = sum;
+                change += std::abs(sum - alpha[c]);
+            }
+        }
+
+        alpha.swap(new_alpha);
+        if(change < tolerance * total_reads){
+            write_log("EM converged after " + to_string(iteration + 1) + " iterations", LogLevel::MINOR);
+            return alpha;
+        }
+    }
+
+    write_log("EM did not converge in " + to_string(max_iterations) + " iterations", LogLevel::MAJOR);
+    return alpha;
+}
+
+void write_abundances(const vector<double>& abundances, const string& filename){
+    double total = 0;
+    for(double x : abundances) total += x;
+
+    throwing_ofstream out(filename);
+    out << "color\treads\trelative_abundance\n";
+    for(int64_t c = 0; c < (int64_t)abundances.size(); c++){
+        char line[128];
+        snprintf(line, sizeof(line), "%lld\t%.3f\t%.10g\n", (long long)c, abundances[c], total > 0 ? abundances[c] / total : 0.0);
+        out << line;
+    }
+}
+
+} // namespace abundance
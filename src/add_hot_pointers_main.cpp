@@ -0,0 +1,128 @@
+#include "sbwt/SBWT.hh"
+#include "sbwt/globals.hh"
+#include "globals.hh"
+#include "coloring/Coloring.hh"
+#include "coloring/Lookup_Walk_Profile.hh"
+#include "parallel_gzip.hh"
+#include <string>
+#include <variant>
+#include "version.h"
+#include "cxxopts.hpp"
+
+using namespace sbwt;
+using namespace std;
+
+// Records the color set lookups that pseudoalign does for the reads, like pseudoalign with --rc if
+// reverse_complements is true. Pseudoalign looks up only some of the k-mers of a read, see
+// Lookup_Walk_Profile::add_query_lookups.
+template<typename coloring_t, typename reader_t>
+void profile_lookups(const plain_matrix_sbwt_t& SBWT, reader_t& reader, bool reverse_complements, int64_t max_reads, Lookup_Walk_Profile<coloring_t>& profile){
+    int64_t n_reads = 0;
+    while(max_reads == 0 || n_reads < max_reads){
+        int64_t len = reader.get_next_read_to_buffer();
+        if(len == 0) break;
+        profile.add_query_lookups(SBWT.streaming_search(reader.read_buf, len));
+        if(reverse_complements){
+            reverse_complement_c_string(reader.read_buf, len);
+            profile.add_query_lookups(SBWT.streaming_search(reader.read_buf, len));
+        }
+        n_reads++;
+    }
+    write_log("Profiled " + to_string(n_reads) + " reads", LogLevel::MAJOR);
+}
+
+template<typename coloring_t>
+void add_hot_pointers(const plain_matrix_sbwt_t& SBWT, coloring_t& coloring, const string& query_file, bool reverse_complements, int64_t max_reads, int64_t budget_bytes){
+    Lookup_Walk_Profile<coloring_t> profile(coloring);
+    if(seq_io::figure_out_file_format(query_file).gzipped){
+        seq_io::Reader<seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>> reader(query_file);
+        profile_lookups(SBWT, reader, reverse_complements, max_reads, profile);
+    } else{
+        seq_io::Reader<seq_io::Buffered_ifstream<std::ifstream>> reader(query_file);
+        profile_lookups(SBWT, reader, reverse_complements, max_reads, profile);
+    }
+
+    int64_t n_lookups = profile.number_of_lookups();
+    int64_t n_steps = profile.number_of_steps();
+    write_log(to_string(n_lookups) + " color set lookups take " + to_string(n_steps) + " forward steps in total", LogLevel::MAJOR);
+
+    int64_t bits_per_pointer = coloring.get_node_id_to_colorset_id_structure().bits_per_new_value();
+    int64_t max_pointers = budget_bytes * 8 / bits_per_pointer;
+    write_log("Choosing at most " + to_string(max_pointers) + " nodes for new pointers", LogLevel::MAJOR);
+    auto [nodes, saved_steps] = profile.choose_nodes(max_pointers);
+
+    auto pointer_bytes = [&](){
+        int64_t total = 0;
+        for(auto [component, bytes] : coloring.get_node_id_to_colorset_id_structure().space_breakdown()) total += bytes;
+        return total;
+    };
+    int64_t bytes_before = pointer_bytes();
+    coloring.add_node_id_to_color_set_id_pointers(nodes);
+    int64_t bytes_after = pointer_bytes();
+
+    write_log("Added " + to_string(nodes.size()) + " pointers, which take " + to_string(bytes_after - bytes_before) + " bytes", LogLevel::MAJOR);
+    if(n_lookups > 0){
+        write_log("Forward steps per lookup in the profile: " + to_string((double)n_steps / n_lookups) + " before, "
+                  + to_string((double)(n_steps - saved_steps) / n_lookups) + " after", LogLevel::MAJOR);
+    }
+}
+
+int add_hot_pointers_main(int argc, char** argv){
+
+    cxxopts::Options options(argv[0], "Adds color set pointers to the nodes where a sample of query reads spends the most time looking for one.");
+
+    options.add_options()
+        ("i,index-prefix", "The index prefix that was given to the build command.", cxxopts::value<string>())
+        ("o,out-index-prefix", "The index prefix for the output index.", cxxopts::value<string>())
+        ("q,query-file", "A sample of query reads in FASTA or FASTQ format, possibly gzipped.", cxxopts::value<string>())
+        ("budget-megas", "The new pointers may take at most this many megabytes.", cxxopts::value<double>())
+        ("max-reads", "Use at most this many reads from the start of the query file. 0 means no limit.", cxxopts::value<int64_t>()->default_value("0"))
+        ("rc", "Also profile the reverse complements of the reads, like pseudoalign --rc.", cxxopts::value<bool>()->default_value("false"))
+        ("h,help", "Print usage")
+    ;
+
+    int64_t old_argc = argc; // Must store this because the parser modifies it
+    auto opts = options.parse(argc, argv);
+
+    if (old_argc == 1 || opts.count("help")){
+        std::cerr << options.help() << std::endl;
+        return 1;
+    }
+
+    for(string required : {"index-prefix", "out-index-prefix", "query-file", "budget-megas"})
+        if(!opts.count(required)) throw std::runtime_error("Option --" + required + " is required");
+
+    string input_dbg_file = opts["index-prefix"].as<string>() + ".tdbg";
+    string input_color_file = opts["index-prefix"].as<string>() + ".tcolors";
+    string output_dbg_file = opts["out-index-prefix"].as<string>() + ".tdbg";
+    string output_color_file = opts["out-index-prefix"].as<string>() + ".tcolors";
+    string query_file = opts["query-file"].as<string>();
+    double budget_megas = opts["budget-megas"].as<double>();
+    int64_t max_reads = opts["max-reads"].as<int64_t>();
+    bool reverse_complements = opts["rc"].as<bool>();
+
+    check_true(budget_megas >= 0, "The budget must be non-negative");
+    check_true(max_reads >= 0, "--max-reads must be non-negative");
+    check_readable(input_dbg_file);
+    check_readable(input_color_file);
+    check_readable(query_file);
+    check_writable(output_dbg_file);
+    check_writable(output_color_file);
+
+    write_log("Loading the index", LogLevel::MAJOR);
+    plain_matrix_sbwt_t SBWT;
+    SBWT.load(input_dbg_file);
+    std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>> coloring;
+    load_coloring(input_color_file, SBWT, coloring);
+
+    std::visit([&](auto& C){
+        add_hot_pointers(SBWT, C, query_file, reverse_complements, max_reads, budget_megas * (1 << 20));
+    }, coloring);
+
+    write_log("Saving the updated index", LogLevel::MAJOR);
+    SBWT.serialize(output_dbg_file);
+    std::visit([&](auto& C){ C.serialize(output_color_file); }, coloring);
+
+    write_log("Done", LogLevel::MAJOR);
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include <string>
+#include <vector>
+#include "binary_output.hh"
+#include "sbwt/globals.hh"
+
+using namespace std;
+using namespace sbwt;
+
+namespace binary_format{
+
+string file_header(bool relevant_kmer_counts){
+    string header(FILE_HEADER_BYTES, '\0');
+    memcpy(header.data(), MAGIC, 4);
+    for(int64_t i = 0; i < 4; i++) header[4+i] = (char)((VERSION >> (8*i)) & 0xFF);
+    write_uint64_le(relevant_kmer_counts ? FLAG_RELEVANT_KMER_COUNTS : 0, header.data() + 8);
+    return header;
+}
+
+Binary_Pseudoalignment_Reader::Binary_Pseudoalignment_Reader(const string& filename){
+    check_readable(filename);
+    in = make_unique<seq_io::zstr::ifstream>(filename, ios::binary);
+
+    char header[FILE_HEADER_BYTES];
+    in->read(header, FILE_HEADER_BYTES);
+    if(in->gcount() != FILE_HEADER_BYTES || memcmp(header, MAGIC, 4) != 0)
+        throw std::runtime_error("File " + filename + " is not a binary pseudoalignment output file");
+
+    uint32_t version = 0;
+    for(int64_t i = 0; i < 4; i++) version |= (uint32_t)(uint8_t)header[4+i] << (8*i);
+    if(version != VERSION)
+        throw std::runtime_error("Unsupported binary pseudoalignment output version " + to_string(version) + " in " + filename);
+
+    uint64_t flags = read_uint64_le(header + 8);
+    relevant_kmer_counts = flags & FLAG_RELEVANT_KMER_COUNTS;
+}
+
+bool Binary_Pseudoalignment_Reader::read_next_block(){
+    char header[BLOCK_HEADER_BYTES];
+    in->read(header, BLOCK_HEADER_BYTES);
+    if(in->gcount() == 0) return false; // End of file
+    if(in->gcount() != BLOCK_HEADER_BYTES) throw std::runtime_error("Corrupt binary pseudoalignment output: truncated block header");
+
+    uint64_t n_bytes = read_uint64_le(header);
+    uint64_t n_records = read_uint64_le(header + 8);
+    if(n_records > n_bytes / 2) // Every record takes at least two bytes: the read id and the number of hits
+        throw std::runtime_error("Corrupt binary pseudoalignment output: too many records for the block size");
+    records_left_in_block = n_records;
+
+    // The block size comes from the file, so the block is read in chunks. A corrupt size then fails
+    // as a truncated block after reading the rest of the file instead of allocating the size up front.
+    block.clear();
+    while(block.size() < n_bytes){
+        uint64_t start = block.size();
+        uint64_t chunk = min(n_bytes - start, (uint64_t)BLOCK_READ_CHUNK_BYTES);
+        block.resize(start + chunk);
+        in->read(block.data() + start, chunk);
+        if((uint64_t)in->gcount() != chunk) throw std::runtime_error("Corrupt binary pseudoalignment output: truncated block");
+    }
+
+    block_ptr = block.data();
+    block_end = block.data() + block.size();
+    prev_read_id = 0;
+    return true;
+}
+
+bool Binary_Pseudoalignment_Reader::next(int64_t& read_id, vector<int64_t>& hits, int64_t& n_relevant_kmers){
+    while(records_left_in_block == 0){
+        if(!read_next_block()) return false;
+    }
+
+    read_id = prev_read_id + zigzag_decode(decode_varint(block_ptr, block_end));
+    prev_read_id = read_id;
+
+    int64_t n_hits = decode_varint(block_ptr, block_end);
+    hits.clear();
+    for(int64_t i = 0; i < n_hits; i++){
+        int64_t x = decode_varint(block_ptr, block_end);
+        if(i == 0) hits.push_back(x);
+        else hits.push_back(hits.back() + x + 1);
+    }
+
+    n_relevant_kmers = relevant_kmer_counts ? (int64_t)decode_varint(block_ptr, block_end) : -1;
+
+    records_left_in_block--;
+    return true;
+}
+
+} // End namespace binary_format
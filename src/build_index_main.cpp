@@ -147,6 +147,9 @@ struct Build_Config{
     bool verbose = false;
     bool silent = false;
     bool reverse_complements = false;
+    bool interleaved_pointers = false;
+    bool compressed_pointers = false;
+    bool order_color_sets_by_frequency = false;
 
     bool manual_colors = false;
     bool file_colors = false;
@@ -190,6 +193,21 @@ struct Build_Config{
             throw std::runtime_error("Unknown coloring structure type: " + coloring_structure_type);
         }
 
+        if(interleaved_pointers){
+            sbwt::check_true(coloring_structure_type == "sdsl-hybrid", "--interleaved-pointers needs coloring structure type sdsl-hybrid");
+            sbwt::check_true(!no_colors, "Must not give both --no-colors and --interleaved-pointers");
+        }
+
+        if(compressed_pointers){
+            sbwt::check_true(coloring_structure_type == "sdsl-hybrid", "--compressed-pointers needs coloring structure type sdsl-hybrid");
+            sbwt::check_true(!no_colors, "Must not give both --no-colors and --compressed-pointers");
+            sbwt::check_true(!interleaved_pointers, "Must not give both --interleaved-pointers and --compressed-pointers");
+        }
+
+        if(order_color_sets_by_frequency){
+            sbwt::check_true(!no_colors, "Must not give both --no-colors and --order-color-sets-by-frequency");
+        }
+
         sbwt::check_true(temp_dir != "", "Temp directory not set");
         check_dir_exists(temp_dir);
 
@@ -220,6 +238,9 @@ struct Build_Config{
         ss << "Load DBG = " << (load_dbg ? "true" : "false") << "\n";
         ss << "Handling of non-ACGT characters = " << (del_non_ACGT ? "delete" : "randomize") << "\n";
         ss << "Coloring structure type: " << coloring_structure_type << "\n"; 
+        ss << "Interleaved color set pointers = " << (interleaved_pointers ? "true" : "false") << "\n";
+        ss << "Compressed color set pointers = " << (compressed_pointers ? "true" : "false") << "\n";
+        ss << "Order color sets by frequency = " << (order_color_sets_by_frequency ? "true" : "false") << "\n";
 
         string verbose_level = "normal";
         if(verbose) verbose_level = "verbose";
@@ -345,6 +366,9 @@ Build_Config parse_build_options(int argc_given, char** argv_given){
         ("randomize-non-ACGT", "Replace non-ACGT letters with random nucleotides. If this option is not given, k-mers containing a non-ACGT character are deleted instead.", cxxopts::value<bool>()->default_value("false"))
         ("d,colorset-pointer-tradeoff", "This option controls a time-space tradeoff for storing and querying color sets. If given a value d, we store color set pointers only for every d nodes on every unitig. The higher the value of d, the smaller then index, but the slower the queries. The savings might be significant if the number of distinct color sets is small and the graph is large and has long unitigs.", cxxopts::value<int64_t>()->default_value("20"))
         ("s,coloring-structure-type", "Type of coloring structure to build (\"sdsl-hybrid\", \"roaring\").", cxxopts::value<string>()->default_value("sdsl-hybrid"))
+        ("interleaved-pointers", "Store the color set pointers of the k-mers so that each pointer lookup usually reads only one cache line. Faster queries, but takes 2-8 bits per k-mer, which is more than the default layout when the pointers are sparse (see --colorset-pointer-tradeoff). Only for sdsl-hybrid. An existing index can be converted with --from-index.", cxxopts::value<bool>()->default_value("false"))
+        ("compressed-pointers", "Store the marks of which k-mers have a color set pointer in Elias-Fano coding instead of a plain bit vector. Much smaller when the pointers are sparse (large --colorset-pointer-tradeoff), but pointer lookups are slower. Only for sdsl-hybrid. An existing index can be converted with --from-index.", cxxopts::value<bool>()->default_value("false"))
+        ("order-color-sets-by-frequency", "Number and store the distinct color sets in order of decreasing number of k-mers that point to them, so that the color sets of most k-mers are next to each other in memory and stay in the cache during queries. An existing index can be converted with --from-index.", cxxopts::value<bool>()->default_value("false"))
         ("from-index", "Take as input a pre-built Themisto index. Builds a new index in the format specified by --coloring-structure-type. This is currently implemented by decompressing the distinct color sets in memory before re-encoding them, so this might take a lot of RAM.",  cxxopts::value<string>())
         ("silent", "Print as little as possible to stderr (only errors).", cxxopts::value<bool>()->default_value("false"))
     ;
@@ -377,6 +401,9 @@ Build_Config parse_build_options(int argc_given, char** argv_given){
     C.silent = opts["silent"].as<bool>();
     C.coloring_structure_type = opts["coloring-structure-type"].as<string>();
     C.reverse_complements = !opts["forward-strand-only"].as<bool>();
+    C.interleaved_pointers = opts["interleaved-pointers"].as<bool>();
+    C.compressed_pointers = opts["compressed-pointers"].as<bool>();
+    C.order_color_sets_by_frequency = opts["order-color-sets-by-frequency"].as<bool>();
     C.file_colors = opts["file-colors"].as<bool>();
     C.sequence_colors = opts["sequence-colors"].as<bool>();
 
@@ -446,6 +473,9 @@ int build_index_main(int argc, char** argv){
 
     if(C.from_index != ""){
         transform_existing_index(C.from_index + ".tdbg", C.from_index + ".tcolors", C.index_dbg_file, C.index_color_file, C.coloring_structure_type);
+        if(C.order_color_sets_by_frequency) order_color_sets_by_frequency(C.index_dbg_file, C.index_color_file);
+        if(C.interleaved_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::interleaved);
+        if(C.compressed_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::elias_fano);
         return 0;
     }
 
@@ -465,6 +495,9 @@ int build_index_main(int argc, char** argv){
         } else if(C.coloring_structure_type == "roaring"){
             build_index_with_ggcat<Roaring_Color_Set>(C.k, C.n_threads, C.index_dbg_file, C.index_color_file, C.temp_dir, C.memory_megas, C.colorset_sampling_distance, C.seqfiles, C.load_dbg); 
         }
+        if(C.order_color_sets_by_frequency) order_color_sets_by_frequency(C.index_dbg_file, C.index_color_file);
+        if(C.interleaved_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::interleaved);
+        if(C.compressed_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::elias_fano);
         return 0;
     }
 
@@ -544,6 +577,9 @@ int build_index_main(int argc, char** argv){
         } else if(C.coloring_structure_type == "roaring"){
             build_coloring<Roaring_Color_Set>(*dbg_ptr, color_stream.get(), C);
         }
+        if(C.order_color_sets_by_frequency) order_color_sets_by_frequency(C.index_dbg_file, C.index_color_file);
+        if(C.interleaved_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::interleaved);
+        if(C.compressed_pointers) convert_color_set_pointer_layout(C.index_dbg_file, C.index_color_file, Sparse_Uint_Array_Layout::elias_fano);
     } else{
         std::filesystem::remove(C.index_color_file); // There is an empty file so let's remove it
     }
@@ -0,0 +1,90 @@
+#include "color_counting.hh"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define THEMISTO_X86_COUNTING_KERNELS
+#endif
+
+namespace color_counting{
+
+#ifdef THEMISTO_X86_COUNTING_KERNELS
+
+__attribute__((target("avx2")))
+static void add_word_avx2(uint64_t word, uint32_t value, uint32_t* counts){
+    const __m256i values = _mm256_set1_epi32(value);
+    const __m256i bit_selectors = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+    for(int64_t i = 0; i < 64; i += 8){
+        // Expand eight bits of the word into eight all-ones or all-zeros lanes
+        __m256i byte = _mm256_set1_epi32((word >> i) & 0xFF);
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(byte, bit_selectors), bit_selectors);
+        __m256i c = _mm256_loadu_si256((const __m256i*)(counts + i));
+        c = _mm256_add_epi32(c, _mm256_and_si256(mask, values));
+        _mm256_storeu_si256((__m256i*)(counts + i), c);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void add_word_avx512(uint64_t word, uint32_t value, uint32_t* counts){
+    const __m512i values = _mm512_set1_epi32(value);
+    for(int64_t i = 0; i < 64; i += 16){
+        __mmask16 mask = (word >> i) & 0xFFFF;
+        __m512i c = _mm512_loadu_si512((const void*)(counts + i));
+        c = _mm512_mask_add_epi32(c, mask, c, values);
+        _mm512_storeu_si512((void*)(counts + i), c);
+    }
+}
+
+#endif
+
+typedef void (*add_word_t)(uint64_t, uint32_t, uint32_t*);
+
+static add_word_t select_kernel(const char** name){
+    #ifdef THEMISTO_X86_COUNTING_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        *name = "avx512";
+        return add_word_avx512;
+    }
+    if(__builtin_cpu_supports("avx2")){
+        *name = "avx2";
+        return add_word_avx2;
+    }
+    #endif
+    *name = "scalar";
+    return add_word_scalar;
+}
+
+static const char* best_kernel_name = nullptr;
+static const add_word_t best_kernel = select_kernel(&best_kernel_name);
+static bool scalar_forced = false;
+
+const char* kernel_name(){
+    return scalar_forced ? "scalar" : best_kernel_name;
+}
+
+void force_scalar_kernel(bool force){
+    scalar_forced = force;
+}
+
+void add_bitmap_union(const Bit_Vector_Span& A, int64_t A_start, int64_t A_bits,
+                      const Bit_Vector_Span* B, int64_t B_start, int64_t B_bits,
+                      uint32_t value, uint32_t* counts){
+    add_word_t add_dense_word = scalar_forced ? add_word_scalar : best_kernel;
+    if(B == nullptr) B_bits = 0;
+    int64_t n_words = (std::max(A_bits, B_bits) + 63) / 64;
+    for(int64_t w = 0; w < n_words; w++){
+        uint64_t word = bitmap_word(A, A_start, A_bits, w);
+        if(B != nullptr) word |= bitmap_word(*B, B_start, B_bits, w);
+        if(word == 0) continue;
+
+        uint32_t* word_counts = counts + 64*w;
+        if(__builtin_popcountll(word) <= SPARSE_WORD_BITS){
+            while(word != 0){
+                word_counts[__builtin_ctzll(word)] += value;
+                word &= word - 1; // Clear the lowest set bit
+            }
+        } else add_dense_word(word, value, word_counts);
+    }
+}
+
+} // namespace color_counting
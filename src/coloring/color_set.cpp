@@ -1,7 +1,7 @@
 #include "coloring/Color_Set.hh"
 
 // See header for description
-int64_t intersect_buffers(sdsl::int_vector<>& buf1, int64_t buf1_len, const sdsl::int_vector<>& buf2, int64_t buf2_start, int64_t buf2_len){
+int64_t intersect_buffers(sdsl::int_vector<>& buf1, int64_t buf1_len, const Int_Vector_Span& buf2, int64_t buf2_start, int64_t buf2_len){
 
     int64_t i = 0, j = 0, k = 0;
     while(i < buf1_len && j < buf2_len){
@@ -27,7 +27,7 @@ int64_t union_buffers(vector<int64_t>& buf1, int64_t buf1_len, vector<int64_t>&
 }
 
 // See header for description
-int64_t bitmap_vs_bitmap_intersection(sdsl::bit_vector& A, int64_t A_size, const sdsl::bit_vector& B, int64_t B_start, int64_t B_size){
+int64_t bitmap_vs_bitmap_intersection(sdsl::bit_vector& A, int64_t A_size, const Bit_Vector_Span& B, int64_t B_start, int64_t B_size){
     int64_t n = min(A_size, B_size);
     int64_t words = n / 64;
 
@@ -48,7 +48,7 @@ int64_t bitmap_vs_bitmap_intersection(sdsl::bit_vector& A, int64_t A_size, const
 }
 
 // See header for description
-int64_t array_vs_bitmap_intersection(sdsl::int_vector<>& iv, int64_t iv_size, const sdsl::bit_vector& bv, int64_t bv_start, int64_t bv_size){
+int64_t array_vs_bitmap_intersection(sdsl::int_vector<>& iv, int64_t iv_size, const Bit_Vector_Span& bv, int64_t bv_start, int64_t bv_size){
     int64_t j = 0;
     for(int64_t i = 0; i < iv_size; i++){
         if(iv[i] >= bv_size) break;
@@ -58,7 +58,7 @@ int64_t array_vs_bitmap_intersection(sdsl::int_vector<>& iv, int64_t iv_size, co
 }
 
 // See header for description
-int64_t bitmap_vs_array_intersection(sdsl::bit_vector& bv, int64_t bv_size, const sdsl::int_vector<>& iv, int64_t iv_start, int64_t iv_size){
+int64_t bitmap_vs_array_intersection(sdsl::bit_vector& bv, int64_t bv_size, const Int_Vector_Span& iv, int64_t iv_start, int64_t iv_size){
     int64_t iv_idx = 0;
     for(int64_t bv_idx = 0; bv_idx < bv_size; bv_idx++){
         int64_t iv_value = iv_idx < iv_size ? iv[iv_start + iv_idx] : -1;
@@ -73,32 +73,35 @@ int64_t bitmap_vs_array_intersection(sdsl::bit_vector& bv, int64_t bv_size, cons
 }
 
 // See header for description
-int64_t array_vs_array_intersection(sdsl::int_vector<>& A, int64_t A_len, const sdsl::int_vector<>& B, int64_t B_start, int64_t B_len){
+int64_t array_vs_array_intersection(sdsl::int_vector<>& A, int64_t A_len, const Int_Vector_Span& B, int64_t B_start, int64_t B_len){
     return intersect_buffers(A, A_len, B, B_start, B_len);
 }
 
 // See header for description
-int64_t bitmap_vs_bitmap_union(sdsl::bit_vector& A, int64_t A_size, const sdsl::bit_vector& B, int64_t B_start, int64_t B_size){
+int64_t bitmap_vs_bitmap_union(sdsl::bit_vector& A, int64_t A_size, const Bit_Vector_Span& B, int64_t B_start, int64_t B_size){
     return 0; // TODO
 }
 
 // See header for description
-int64_t array_vs_bitmap_union(sdsl::int_vector<>& iv, int64_t iv_size, const sdsl::bit_vector& bv, int64_t bv_start, int64_t bv_size){
+int64_t array_vs_bitmap_union(sdsl::int_vector<>& iv, int64_t iv_size, const Bit_Vector_Span& bv, int64_t bv_start, int64_t bv_size){
     return 0; // TODO
 }
 
 // See header for description
-int64_t bitmap_vs_array_union(sdsl::bit_vector& bv, int64_t bv_size, const sdsl::int_vector<>& iv, int64_t iv_start, int64_t iv_size){
+int64_t bitmap_vs_array_union(sdsl::bit_vector& bv, int64_t bv_size, const Int_Vector_Span& iv, int64_t iv_start, int64_t iv_size){
     return 0; // TODO
 }
 
 // See header for description
-int64_t array_vs_array_union(sdsl::int_vector<>& A, int64_t A_len, const sdsl::int_vector<>& B, int64_t B_start, int64_t B_len){
+int64_t array_vs_array_union(sdsl::int_vector<>& A, int64_t A_len, const Int_Vector_Span& B, int64_t B_start, int64_t B_len){
     return 0; // TODO
 }
 
 SDSL_Variant_Color_Set_View::SDSL_Variant_Color_Set_View(const SDSL_Variant_Color_Set& cs) : start(cs.start), length(cs.length) {
-    auto set_data_ptr = [&](auto& ptr){this->data_ptr = ptr;};
+    auto set_data_ptr = [&](auto ptr){
+        if constexpr(std::is_same_v<decltype(ptr), sdsl::bit_vector*>) this->data_ptr = colorset_bit_span(ptr);
+        else this->data_ptr = colorset_int_span(ptr);
+    };
     std::visit(set_data_ptr, cs.data_ptr);
 }
 
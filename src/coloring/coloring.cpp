@@ -9,18 +9,16 @@ Coloring<Roaring_Color_Set>>& coloring){
     Coloring<Roaring_Color_Set> coloring2;
 
     try{
-        throwing_ifstream colors_in(filename, ios::binary);
         coloring = coloring1;
-        std::get<Coloring<SDSL_Variant_Color_Set>>(coloring).load(colors_in.stream, SBWT);
+        std::get<Coloring<SDSL_Variant_Color_Set>>(coloring).load(filename, SBWT); // Memory-maps the file if possible
         return; // No exception thrown
     } catch(Coloring<SDSL_Variant_Color_Set>::WrongTemplateParameterException& e){
         // Was not this one
     }
 
     try{
-        throwing_ifstream colors_in(filename, ios::binary);
         coloring = coloring2;
-        std::get<Coloring<Roaring_Color_Set>>(coloring).load(colors_in.stream, SBWT);
+        std::get<Coloring<Roaring_Color_Set>>(coloring).load(filename, SBWT); // Memory-maps the file if possible
         return; // No exception thrown
     } catch(Coloring<Roaring_Color_Set>::WrongTemplateParameterException& e){
         // Was not this one
@@ -0,0 +1,66 @@
+#include "coloring/Mapped_Image.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Unmaps the file when the last Byte_Region that refers to it is destroyed
+struct File_Mapping{
+    void* ptr;
+    int64_t n_bytes;
+    ~File_Mapping(){
+        if(n_bytes > 0) munmap(ptr, n_bytes);
+    }
+};
+
+Byte_Region Byte_Region::map_file(const std::string& filename){
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if(fd < 0) throw std::runtime_error("Error opening file " + filename);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0){
+        ::close(fd);
+        throw std::runtime_error("Error reading the size of file " + filename);
+    }
+
+    auto mapping = std::make_shared<File_Mapping>();
+    mapping->ptr = nullptr;
+    mapping->n_bytes = st.st_size;
+    if(st.st_size > 0){
+        // MAP_SHARED so that all processes that map the index use the same pages of the page cache
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(p == MAP_FAILED){
+            ::close(fd);
+            throw std::runtime_error("Error memory-mapping file " + filename);
+        }
+        mapping->ptr = p;
+    }
+    ::close(fd); // The mapping stays valid
+
+    Byte_Region R;
+    R.ptr = (const char*)mapping->ptr;
+    R.n_bytes = st.st_size;
+    R.owner = mapping;
+    R.mapped = true;
+    return R;
+}
+
+int64_t write_page_aligned_image(std::ostream& os, int64_t offset, const Byte_Region& image){
+    int64_t header[2];
+    header[0] = image.size();
+    int64_t start = offset + sizeof(header); // Offset of the padding
+    header[1] = (IMAGE_PAGE_BYTES - start % IMAGE_PAGE_BYTES) % IMAGE_PAGE_BYTES;
+    os.write((const char*)header, sizeof(header));
+
+    std::vector<char> padding(header[1], 0);
+    os.write(padding.data(), padding.size());
+    os.write(image.data(), image.size());
+    return sizeof(header) + header[1] + image.size();
+}
+
+Byte_Region read_page_aligned_image(Image_Reader& reader){
+    int64_t n_bytes = reader.read_int();
+    int64_t padding = reader.read_int();
+    reader.read_region(padding); // Skip
+    return reader.read_region(n_bytes);
+}
@@ -0,0 +1,67 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include "sbwt/globals.hh"
+#include "sbwt/throwing_streams.hh"
+#include "sbwt/cxxopts.hpp"
+#include "globals.hh"
+#include "binary_output.hh"
+
+using namespace std;
+using namespace sbwt;
+
+// Converts a file written with pseudoalign --binary-output to the text format of pseudoalign
+int decode_output_main(int argc, char** argv){
+
+    cxxopts::Options options(argv[0], "Convert the output of `pseudoalign --binary-output` into the text output format of pseudoalign. Gzipped input is detected automatically.");
+
+    options.add_options()
+        ("i,in-file", "Binary pseudoalignment output file.", cxxopts::value<string>())
+        ("o,out-file", "Output filename. Print results if no output filename is given.", cxxopts::value<string>()->default_value(""))
+        ("h,help", "Print usage")
+    ;
+
+    int64_t old_argc = argc; // Must store this because the parser modifies it
+    auto opts = options.parse(argc, argv);
+
+    if (old_argc == 1 || opts.count("help")){
+        std::cerr << options.help() << std::endl;
+        cerr << "Usage example:" << endl;
+        cerr << argv[0] << " decode-output --in-file out.bin --out-file out.txt" << endl;
+        return 1;
+    }
+
+    string infile = opts["in-file"].as<string>();
+    string outfile = opts["out-file"].as<string>();
+
+    binary_format::Binary_Pseudoalignment_Reader reader(infile);
+
+    throwing_ofstream out_ofstream;
+    ostream* out = &cout;
+    if(outfile != ""){
+        out_ofstream.open(outfile);
+        out = &(out_ofstream.stream);
+    }
+
+    int64_t read_id, n_relevant_kmers;
+    vector<int64_t> hits;
+    string line;
+    char int_to_string_buffer[32];
+    while(reader.next(read_id, hits, n_relevant_kmers)){
+        line.clear();
+        line.append(int_to_string_buffer, fast_int_to_string(read_id, int_to_string_buffer));
+        for(int64_t x : hits){
+            line += ' ';
+            line.append(int_to_string_buffer, fast_int_to_string(x, int_to_string_buffer));
+        }
+        if(reader.has_relevant_kmer_counts()){
+            line += "; ";
+            line.append(int_to_string_buffer, fast_int_to_string(n_relevant_kmers, int_to_string_buffer));
+        }
+        line += '\n';
+        out->write(line.data(), line.size());
+    }
+    out->flush();
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "numa.hh"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+namespace numa{
+
+vector<int> parse_cpu_list(const string& list){
+    vector<int> cpus;
+    stringstream ss(list);
+    string range;
+    while(getline(ss, range, ',')){
+        range.erase(remove_if(range.begin(), range.end(), ::isspace), range.end());
+        if(range.empty()) continue;
+        size_t dash = range.find('-');
+        int first = stoi(range.substr(0, dash));
+        int last = dash == string::npos ? first : stoi(range.substr(dash + 1));
+        for(int c = first; c <= last; c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// CPUs that this process may run on
+static vector<int> allowed_cpus(){
+    vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0){
+        for(int c = 0; c < CPU_SETSIZE; c++) if(CPU_ISSET(c, &set)) cpus.push_back(c);
+    }
+#endif
+    if(cpus.empty()){
+        for(int c = 0; c < (int)max(1u, std::thread::hardware_concurrency()); c++) cpus.push_back(c);
+    }
+    return cpus;
+}
+
+vector<vector<int>> node_cpus(){
+    vector<int> allowed = allowed_cpus();
+
+    // Node directories are named node0, node1, ... but the numbers may have gaps
+    vector<int> node_ids;
+    error_code ec;
+    for(const auto& entry : filesystem::directory_iterator("/sys/devices/system/node", ec)){
+        string name = entry.path().filename().string();
+        if(name.size() > 4 && name.substr(0, 4) == "node" && all_of(name.begin() + 4, name.end(), ::isdigit))
+            node_ids.push_back(stoi(name.substr(4)));
+    }
+    sort(node_ids.begin(), node_ids.end());
+
+    vector<vector<int>> nodes;
+    for(int node : node_ids){
+        ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        string list;
+        getline(in, list);
+        vector<int> cpus;
+        for(int c : parse_cpu_list(list))
+            if(binary_search(allowed.begin(), allowed.end(), c)) cpus.push_back(c);
+        if(!cpus.empty()) nodes.push_back(cpus);
+    }
+    if(nodes.empty()) nodes.push_back(allowed); // Topology not available
+    return nodes;
+}
+
+bool pin_current_thread(const vector<int>& cpus){
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int c : cpus) if(c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+Worker_Placement place_workers(const vector<vector<int>>& nodes, int64_t n_workers){
+    Worker_Placement P;
+    P.n_nodes = nodes.size();
+    for(int64_t i = 0; i < n_workers; i++){
+        int64_t node = i % P.n_nodes;
+        int64_t rank_in_node = i / P.n_nodes;
+        P.worker_node.push_back(node);
+        P.worker_cpu.push_back(nodes[node][rank_in_node % nodes[node].size()]);
+    }
+    return P;
+}
+
+} // namespace numa
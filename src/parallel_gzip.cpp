@@ -0,0 +1,337 @@
+#include "parallel_gzip.hh"
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// zlib takes buffer lengths as 32-bit integers
+static constexpr int64_t max_zlib_bytes = 1 << 30;
+
+// Output buffer of the reading thread
+static constexpr int64_t out_buf_bytes = 1 << 20;
+
+// A helper gives up on a chunk if its output grows beyond this many times the chunk size. Then the
+// member is too large to buffer, and the reading thread inflates it as a stream.
+static constexpr int64_t max_chunk_expansion = 32;
+
+static thread_local int64_t n_threads_for_new_streams = 1;
+
+Parallel_Gzip_streambuf::Parallel_Gzip_streambuf(const string& filename, int64_t n_threads, int64_t chunk_bytes)
+    : n_threads(max((int64_t)1, n_threads)), chunk_bytes(max((int64_t)1 << 16, chunk_bytes)){
+
+    memset(&strm, 0, sizeof(strm));
+    out_buf.resize(out_buf_bytes);
+
+    if(this->n_threads > 1){
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd >= 0){
+            struct stat st;
+            if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= 2){
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(p != MAP_FAILED){
+                    data = (const unsigned char*)p;
+                    data_size = st.st_size;
+                    madvise(p, data_size, MADV_SEQUENTIAL);
+                }
+            }
+            ::close(fd);
+        }
+        if(data != nullptr && !(data[0] == 0x1f && data[1] == 0x8b)){
+            // Not gzip, so there are no members to split on
+            munmap((void*)data, data_size);
+            data = nullptr;
+            data_size = 0;
+        }
+    }
+
+    if(data != nullptr){
+        format = GZIP;
+        for(int64_t i = 0; i + 1 < this->n_threads; i++) // The reading thread is one of the n_threads
+            helpers.emplace_back([this](){ helper_loop(); });
+    } else{
+        stream.open(filename, ios::binary);
+        if(!stream.good()) return;
+        stream_buf.resize(out_buf_bytes);
+        refill_stream_input();
+        const unsigned char* b = strm.next_in;
+        if(strm.avail_in >= 2 && b[0] == 0x1f && b[1] == 0x8b) format = GZIP;
+        else if(strm.avail_in >= 2 && b[0] == 0x78 && (b[1] == 0x01 || b[1] == 0x5e || b[1] == 0x9c || b[1] == 0xda)) format = ZLIB;
+        else format = PLAIN; // Like zstr, pass through input that is not compressed
+    }
+
+    open = true;
+}
+
+Parallel_Gzip_streambuf::~Parallel_Gzip_streambuf(){
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for(auto& [c, job] : jobs) if(job) job->cancelled = true;
+    }
+    job_available.notify_all();
+    for(std::thread& t : helpers) t.join();
+    if(strm_initialized) inflateEnd(&strm);
+    if(data != nullptr) munmap((void*)data, data_size);
+}
+
+Parallel_Gzip_streambuf::int_type Parallel_Gzip_streambuf::underflow(){
+    while(gptr() == egptr()){
+        bool more = data != nullptr ? fill_mapped() : fill_stream();
+        if(!more) return traits_type::eof();
+    }
+    return traits_type::to_int_type(*gptr());
+}
+
+void Parallel_Gzip_streambuf::start_member(int window_bits){
+    if(!strm_initialized){
+        if(inflateInit2(&strm, window_bits) != Z_OK) throw runtime_error("Could not initialize zlib");
+        strm_initialized = true;
+    } else if(inflateReset2(&strm, window_bits) != Z_OK) throw runtime_error("Could not reset zlib");
+    in_member = true;
+}
+
+// Mapped mode: the output of the helpers if they have the member at offset, otherwise inflate here
+bool Parallel_Gzip_streambuf::fill_mapped(){
+    current_job.reset();
+    while(true){
+        if(!in_member){
+            if(offset >= data_size) return false;
+            if(take_job_output()) return true;
+            strm.next_in = (unsigned char*)data + offset;
+            strm.avail_in = min(data_size - offset, max_zlib_bytes);
+            start_member(16 + MAX_WBITS);
+        }
+
+        if(strm.avail_in == 0){
+            int64_t remaining = data_size - (strm.next_in - data);
+            if(remaining == 0) throw runtime_error("Unexpected end of gzip data");
+            strm.avail_in = min(remaining, max_zlib_bytes);
+        }
+        strm.next_out = (unsigned char*)out_buf.data();
+        strm.avail_out = out_buf.size();
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END){
+            in_member = false;
+            offset = strm.next_in - data;
+        } else if(ret != Z_OK && ret != Z_BUF_ERROR) throw runtime_error("Corrupt gzip data: " + string(strm.msg ? strm.msg : "zlib error " + to_string(ret)));
+
+        int64_t produced = out_buf.size() - strm.avail_out;
+        if(produced > 0){
+            setg(out_buf.data(), out_buf.data(), out_buf.data() + produced);
+            return true;
+        }
+    }
+}
+
+// Stream mode: inflate everything on this thread, like zstr
+bool Parallel_Gzip_streambuf::fill_stream(){
+    if(format == PLAIN){
+        if(!refill_stream_input()) return false;
+        char* b = (char*)strm.next_in;
+        setg(b, b, b + strm.avail_in);
+        strm.avail_in = 0;
+        return true;
+    }
+
+    while(true){
+        if(!in_member){
+            if(!refill_stream_input()) return false; // No more members
+            start_member(format == GZIP ? 16 + MAX_WBITS : MAX_WBITS);
+        }
+        if(!refill_stream_input()) throw runtime_error("Unexpected end of compressed data");
+
+        strm.next_out = (unsigned char*)out_buf.data();
+        strm.avail_out = out_buf.size();
+        int ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END) in_member = false;
+        else if(ret != Z_OK && ret != Z_BUF_ERROR) throw runtime_error("Corrupt compressed data: " + string(strm.msg ? strm.msg : "zlib error " + to_string(ret)));
+
+        int64_t produced = out_buf.size() - strm.avail_out;
+        if(produced > 0){
+            setg(out_buf.data(), out_buf.data(), out_buf.data() + produced);
+            return true;
+        }
+    }
+}
+
+// Returns true if there is unread input in the stream buffer after the call
+bool Parallel_Gzip_streambuf::refill_stream_input(){
+    if(strm.avail_in > 0) return true;
+    if(stream_eof) return false;
+    stream.read((char*)stream_buf.data(), stream_buf.size());
+    int64_t n = stream.gcount();
+    if(n == 0){
+        stream_eof = true;
+        return false;
+    }
+    strm.next_in = stream_buf.data();
+    strm.avail_in = n;
+    return true;
+}
+
+// The first offset in [begin, end) where a gzip member header could start, or -1 if none
+int64_t Parallel_Gzip_streambuf::find_candidate_header(int64_t begin, int64_t end) const{
+    int64_t p = begin;
+    while(p < end){
+        const void* found = memchr(data + p, 0x1f, end - p);
+        if(found == nullptr) return -1;
+        p = (const unsigned char*)found - data;
+        if(p + 10 <= data_size){
+            const unsigned char* h = data + p;
+            bool plausible = h[1] == 0x8b && h[2] == 8 // Magic and deflate
+                && (h[3] & 0xE0) == 0 // Reserved flags
+                && (h[8] == 0 || h[8] == 2 || h[8] == 4) // Extra flags
+                && (h[9] <= 13 || h[9] == 255); // Operating system
+            if(plausible) return p;
+        }
+        p++;
+    }
+    return -1;
+}
+
+// Creates the jobs of the chunks after the one containing offset, up to a few per helper ahead. The
+// members in the chunk of offset are inflated by the reading thread, unless an earlier job already has them.
+void Parallel_Gzip_streambuf::schedule_jobs(){
+    int64_t first = offset / chunk_bytes;
+    int64_t n_chunks = (data_size + chunk_bytes - 1) / chunk_bytes;
+    int64_t last = min(n_chunks, first + 1 + 3 * (n_threads - 1));
+
+    // Drop the jobs that start before offset. Their output is never used.
+    while(!jobs.empty() && (jobs.begin()->first < first || (jobs.begin()->second && jobs.begin()->second->start < offset))){
+        if(jobs.begin()->second) jobs.begin()->second->cancelled = true;
+        jobs.erase(jobs.begin());
+    }
+
+    vector<shared_ptr<Chunk_Job>> new_jobs;
+    for(int64_t c = first + 1; c < last; c++){
+        if(jobs.count(c)) continue;
+        int64_t chunk_end = min((c+1) * chunk_bytes, data_size);
+        int64_t start = find_candidate_header(c * chunk_bytes, chunk_end);
+        if(start == -1){
+            jobs[c] = nullptr;
+            continue;
+        }
+        auto job = make_shared<Chunk_Job>();
+        job->start = start;
+        job->chunk_end = chunk_end;
+        jobs[c] = job;
+        new_jobs.push_back(job);
+    }
+
+    if(new_jobs.size() > 0){
+        lock_guard<std::mutex> lock(mutex);
+        for(auto& job : new_jobs) job_queue.push_back(job);
+    }
+    for(size_t i = 0; i < new_jobs.size(); i++) job_available.notify_one();
+}
+
+// If a helper inflated the members starting at offset, puts its output in the get area and returns true
+bool Parallel_Gzip_streambuf::take_job_output(){
+    schedule_jobs();
+    auto it = jobs.find(offset / chunk_bytes);
+    if(it == jobs.end() || !it->second || it->second->start != offset) return false;
+
+    shared_ptr<Chunk_Job> job = it->second;
+    {
+        unique_lock<std::mutex> lock(mutex);
+        job_done.wait(lock, [&](){ return job->done; });
+    }
+    if(!job->ok){
+        it->second = nullptr; // Inflate the member on this thread instead
+        return false;
+    }
+
+    jobs.erase(it);
+    current_job = job;
+    offset = job->end;
+    chunks_from_helpers++;
+    setg(job->output.data(), job->output.data(), job->output.data() + job->output.size());
+    return true;
+}
+
+void Parallel_Gzip_streambuf::helper_loop(){
+    while(true){
+        shared_ptr<Chunk_Job> job;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            job_available.wait(lock, [&](){ return stopping || !job_queue.empty(); });
+            if(stopping) return;
+            job = job_queue.front();
+            job_queue.pop_front();
+        }
+        if(!job->cancelled) run_job(*job, data, data_size, max_chunk_expansion * chunk_bytes);
+        {
+            lock_guard<std::mutex> lock(mutex);
+            job->done = true;
+        }
+        job_done.notify_all();
+    }
+}
+
+// Inflates whole members from job.start until a member ends at or after job.chunk_end. Sets job.ok
+// to false if the start was not a member, the data is corrupt or the output exceeds max_output.
+void Parallel_Gzip_streambuf::run_job(Chunk_Job& job, const unsigned char* data, int64_t data_size, int64_t max_output){
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    if(inflateInit2(&s, 16 + MAX_WBITS) != Z_OK) return;
+
+    int64_t used = 0;
+    job.output.resize(min(max_output, 4 * (job.chunk_end - job.start) + (1 << 16)));
+    s.next_in = (unsigned char*)data + job.start;
+    s.avail_in = 0;
+
+    bool ok = true;
+    while(ok){
+        // Inflate one member
+        while(true){
+            if(s.avail_in == 0){
+                int64_t remaining = data_size - (s.next_in - data);
+                if(remaining == 0){ ok = false; break; } // Truncated
+                s.avail_in = min(remaining, max_zlib_bytes);
+            }
+            if(used == (int64_t)job.output.size()){
+                if(used >= max_output){ ok = false; break; }
+                job.output.resize(min(max_output, 2 * used));
+            }
+            s.next_out = (unsigned char*)job.output.data() + used;
+            s.avail_out = min((int64_t)job.output.size() - used, max_zlib_bytes);
+            int ret = inflate(&s, Z_NO_FLUSH);
+            used = (char*)s.next_out - job.output.data();
+            if(ret == Z_STREAM_END) break;
+            if((ret != Z_OK && ret != Z_BUF_ERROR) || job.cancelled){ ok = false; break; }
+        }
+        if(!ok) break;
+
+        int64_t pos = s.next_in - data;
+        if(pos >= job.chunk_end || pos == data_size){
+            job.end = pos;
+            break;
+        }
+        inflateReset(&s);
+    }
+    inflateEnd(&s);
+
+    job.ok = ok;
+    if(ok) job.output.resize(used);
+    else vector<char>().swap(job.output);
+}
+
+Parallel_Gzip_ifstream::Parallel_Gzip_ifstream(const string& filename, std::ios_base::openmode mode)
+    : Parallel_Gzip_ifstream(filename, n_threads_for_new_streams){}
+
+Parallel_Gzip_ifstream::Parallel_Gzip_ifstream(const string& filename, int64_t n_threads, int64_t chunk_bytes)
+    : std::istream(nullptr), buf(make_unique<Parallel_Gzip_streambuf>(filename, n_threads, chunk_bytes)){
+    init(buf.get());
+    exceptions(std::ios_base::badbit); // Rethrow errors of the stream buffer from read instead of ending the input early
+    if(!buf->is_open()) setstate(std::ios_base::failbit);
+}
+
+void Parallel_Gzip_ifstream::set_n_threads_for_new_streams(int64_t n_threads){
+    n_threads_for_new_streams = n_threads;
+}
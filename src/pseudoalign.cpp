@@ -1,5 +1,7 @@
 #include <string>
 #include <sstream>
+#include <thread>
+#include <exception>
 #include "pseudoalign.hh"
 #include "WorkDispatcher.hh"
 
@@ -33,38 +35,14 @@ vector<vector<int64_t> > parse_pseudoalignment_output_format_from_disk(string fi
 }
 
 
-// If outfile is empty, creates a writer to cout
-std::unique_ptr<ParallelBaseWriter> create_writer(const string& outfile, bool gzipped){
-    std::unique_ptr<ParallelBaseWriter> out = nullptr;
-    if (!outfile.empty()) {
-        if (gzipped)
-            out = std::make_unique<ParallelGzipWriter>(outfile);
-        else
-            out = std::make_unique<ParallelOutputWriter>(outfile);
-    } else {
-        if (gzipped)
-            out = std::make_unique<ParallelGzipWriter>(cout);
-        else
-            out = std::make_unique<ParallelOutputWriter>(cout);
-    }
-    return out;
-}
-
-void call_sort_parallel_output_file(const string& outfile, bool gzipped){
-    if(outfile == "") throw std::runtime_error("Can't sort stdout output");
-
-    write_log("Sorting output file", LogLevel::MAJOR);
-    string tempfile = get_temp_file_manager().create_filename("results_temp");
-    if (gzipped) {
-        seq_io::zstr::ifstream instream(outfile);
-        seq_io::zstr::ofstream outstream(tempfile);
-        sort_parallel_output_file(instream, outstream);
-    } else {
-        throwing_ifstream instream(outfile);
-        throwing_ofstream outstream(tempfile);
-        sort_parallel_output_file(instream.stream, outstream.stream);
-    }
-    std::filesystem::rename(tempfile, outfile);
+// If outfile is empty, creates a writer to cout. If ordered is true, the batches are written in the
+// order of their sequence ids.
+std::unique_ptr<ParallelBaseWriter> create_writer(const string& outfile, bool gzipped, bool ordered, int64_t max_queued_bytes){
+    std::unique_ptr<ParallelBaseWriter> writer;
+    if(!outfile.empty()) writer = std::make_unique<ParallelBlockWriter>(outfile, gzipped, max_queued_bytes);
+    else writer = std::make_unique<ParallelBlockWriter>(cout, gzipped, max_queued_bytes);
+    if(ordered) writer = std::make_unique<ParallelReorderingWriter>(std::move(writer), max_queued_bytes);
+    return writer;
 }
 
 void pseudoalignment::print_thread(atomic<int64_t>* total_length_of_sequence_processed, atomic<int64_t>* total_bytes_written, atomic<bool>* stop_printing){
@@ -87,3 +65,83 @@ void pseudoalignment::print_thread(atomic<int64_t>* total_length_of_sequence_pro
     }
     cerr << endl;
 }
+
+void pseudoalignment::estimate_and_write_abundances(const vector<abundance::Equivalence_Class_Counter>& counters, int64_t n_colors, int64_t n_threads, const string& abundance_outfile){
+    int64_t n_unassigned = 0;
+    for(const abundance::Equivalence_Class_Counter& counter : counters) n_unassigned += counter.n_unassigned;
+
+    write_log("Merging equivalence classes", LogLevel::MAJOR);
+    vector<abundance::Equivalence_Class> classes = abundance::merge_equivalence_classes(counters, n_threads);
+    int64_t n_assigned = 0;
+    for(const abundance::Equivalence_Class& ec : classes) n_assigned += ec.count;
+    write_log(to_string(classes.size()) + " equivalence classes, " + to_string(n_assigned) + " reads with hits, " + to_string(n_unassigned) + " reads without hits", LogLevel::MAJOR);
+
+    write_log("Estimating abundances", LogLevel::MAJOR);
+    vector<double> abundances = abundance::estimate_abundances(classes, n_colors, n_threads);
+    abundance::write_abundances(abundances, abundance_outfile);
+}
+
+Index_Replicas::Index_Replicas(const string& index_dbg_file, const string& index_color_file, int64_t n_workers){
+    vector<vector<int>> nodes = numa::node_cpus();
+    placement = numa::place_workers(nodes, n_workers);
+    SBWTs.resize(nodes.size());
+    colorings.resize(nodes.size());
+
+    // Each copy is loaded by a thread running on its node, so that the memory is allocated on that node.
+    // The coloring is read as a stream instead of memory-mapping it, because a mapped file would share
+    // the same pages of the page cache on all nodes.
+    vector<std::thread> threads;
+    vector<std::exception_ptr> errors(nodes.size());
+    for(int64_t node = 0; node < (int64_t)nodes.size(); node++){
+        threads.emplace_back([&, node](){
+            try{
+                numa::pin_current_thread(nodes[node]);
+                SBWTs[node] = make_unique<plain_matrix_sbwt_t>();
+                SBWTs[node]->load(index_dbg_file);
+                colorings[node] = make_unique<std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>>>();
+                try{
+                    // Like load_coloring, try the types one by one
+                    Coloring<SDSL_Variant_Color_Set>& copy = colorings[node]->emplace<Coloring<SDSL_Variant_Color_Set>>();
+                    throwing_ifstream in(index_color_file, ios::binary);
+                    copy.load(in.stream, *SBWTs[node]);
+                } catch(Coloring<SDSL_Variant_Color_Set>::WrongTemplateParameterException& e){
+                    Coloring<Roaring_Color_Set>& copy = colorings[node]->emplace<Coloring<Roaring_Color_Set>>();
+                    throwing_ifstream in(index_color_file, ios::binary);
+                    copy.load(in.stream, *SBWTs[node]);
+                }
+            } catch(...){
+                errors[node] = std::current_exception();
+            }
+        });
+    }
+    for(std::thread& t : threads) t.join();
+    for(std::exception_ptr& e : errors) if(e) std::rethrow_exception(e);
+}
+
+pseudoalignment::Worker_Nodes::Worker_Nodes(const Pseudoalign_Config& C) : start_time(std::chrono::steady_clock::now()){
+    if(C.index_replicas){
+        enabled = true;
+        placement = C.index_replicas->placement;
+    } else if(C.pin_threads){
+        enabled = true;
+        placement = numa::place_workers(numa::node_cpus(), C.n_threads);
+    }
+    bases = vector<atomic<int64_t>>(placement.n_nodes);
+}
+
+std::function<void(int64_t)> pseudoalignment::Worker_Nodes::thread_start_function() const{
+    if(!enabled) return nullptr;
+    return [this](int64_t worker_idx){
+        if(!numa::pin_current_thread({placement.worker_cpu[worker_idx]}))
+            write_log("Could not pin worker " + to_string(worker_idx) + " to CPU " + to_string(placement.worker_cpu[worker_idx]), LogLevel::MINOR);
+    };
+}
+
+void pseudoalignment::Worker_Nodes::log_throughput() const{
+    if(!enabled) return;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    for(int64_t node = 0; node < placement.n_nodes; node++){
+        int64_t n_workers = std::count(placement.worker_node.begin(), placement.worker_node.end(), node);
+        write_log("NUMA node " + to_string(node) + ": " + to_string(n_workers) + " workers, " + to_string(bases[node] / 1e6) + " Mbases, " + to_string(bases[node] / 1e6 / max(seconds, 1e-9)) + " Mbases/s", LogLevel::MAJOR);
+    }
+}
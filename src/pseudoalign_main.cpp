@@ -5,6 +5,8 @@
 #include "coloring/Coloring.hh"
 #include "globals.hh"
 #include "pseudoalign.hh"
+#include "pseudoalign_options.hh"
+#include "parallel_gzip.hh"
 #include "sbwt/globals.hh"
 #include "sbwt/throwing_streams.hh"
 #include "sbwt/variants.hh"
@@ -14,57 +16,6 @@
 using namespace std;
 using namespace sbwt;
 
-struct Pseudoalign_Config{
-    vector<string> query_files;
-    vector<string> outfiles;
-    string index_dbg_file;
-    string index_color_file;
-    string temp_dir;
-
-    bool gzipped_output = false;
-    bool reverse_complements = false;
-    bool sort_output_lines = false;
-    bool sort_hits = false;
-    int64_t n_threads = 1;
-    double buffer_size_megas = 8;
-    bool verbose = false;
-    bool silent = false;
-    double threshold = -1;
-    bool ignore_unknown = false;
-    bool report_relevant = false;
-    double relevant_kmers_fraction = 0;
-
-    void check_valid(){
-        for(string query_file : query_files){
-            if(query_file != ""){
-                check_readable(query_file);
-            }
-        }
-
-        check_readable(index_dbg_file);
-        check_readable(index_color_file);
-
-        for(string outfile : outfiles){
-            check_true(outfile != "", "Outfile not set");
-            check_writable(outfile);
-        }
-
-    if (outfiles.size() == 0 && query_files.size() > 1) {
-        check_true(query_files.size() == 1, "Can't print results when aligning multiple files; supply " + to_string(query_files.size()) + " outfiles with --out-file-list.");
-    }
-    if (outfiles.size() > 0) {
-        check_true(query_files.size() == outfiles.size(), "Number of query files and outfiles do not match");
-    }
-
-    if (sort_output_lines) {
-        check_true(outfiles.size() > 0, "Can't sort output when printing results");
-    }
-
-    check_true(temp_dir != "", "Temp directory not set");
-        check_dir_exists(temp_dir);
-    }
-};
-
 vector<string> read_lines(string filename){
     check_readable(filename);
     vector<string> lines;
@@ -78,47 +29,91 @@ vector<string> read_lines(string filename){
 
 // If outputfile is an empty string, prints to stdout
 template<typename coloring_t> 
-void call_pseudoalign(plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, Pseudoalign_Config& C, string inputfile, string outputfile){
+void call_pseudoalign(plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, string inputfile, string outputfile, string abundance_outfile){
+    Parallel_Gzip_ifstream::set_n_threads_for_new_streams(C.gzip_decompression_threads);
     if(seq_io::figure_out_file_format(inputfile).gzipped){
-        seq_io::Reader<seq_io::Buffered_ifstream<seq_io::zstr::ifstream>> reader(inputfile);
-        pseudoalign(SBWT, coloring, C.n_threads, reader, outputfile, C.reverse_complements, C.buffer_size_megas * (1 << 20), C.gzipped_output, C.sort_output_lines, C.threshold, C.ignore_unknown, C.report_relevant, C.relevant_kmers_fraction, C.sort_hits); // Buffer size 8 MB
+        seq_io::Reader<seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>> reader(inputfile);
+        pseudoalign(SBWT, coloring, C, reader, outputfile, abundance_outfile);
     } else{
         seq_io::Reader<seq_io::Buffered_ifstream<std::ifstream>> reader(inputfile);
-        pseudoalign(SBWT, coloring, C.n_threads, reader, outputfile, C.reverse_complements, C.buffer_size_megas * (1 << 20), C.gzipped_output, C.sort_output_lines, C.threshold, C.ignore_unknown, C.report_relevant, C.relevant_kmers_fraction, C.sort_hits); // Buffer size 8 MB
+        pseudoalign(SBWT, coloring, C, reader, outputfile, abundance_outfile);
     }
 }
 
-int pseudoalign_main(int argc_given, char** argv_given){
+// Opens the second mate file and pseudoaligns the pairs. If outputfile is an empty string, prints to stdout
+template<typename coloring_t, typename sequence_reader1_t> 
+void call_pseudoalign_paired_with_first_reader(plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, sequence_reader1_t& reader1, string inputfile2, string outputfile, string abundance_outfile){
+    if(seq_io::figure_out_file_format(inputfile2).gzipped){
+        seq_io::Reader<seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>> reader2(inputfile2);
+        pseudoalign_paired(SBWT, coloring, C, reader1, reader2, outputfile, abundance_outfile);
+    } else{
+        seq_io::Reader<seq_io::Buffered_ifstream<std::ifstream>> reader2(inputfile2);
+        pseudoalign_paired(SBWT, coloring, C, reader1, reader2, outputfile, abundance_outfile);
+    }
+}
 
-    // Legacy support: transform old options
-    char** argv = (char**)malloc(sizeof(char*) * argc_given); // Freed and the and of the function
-    argv[0] = argv_given[0];
-    int64_t argc = 1;
-    char legacy_support_fix[] = "--out-file";
-    char legacy_support_fix2[] = "--sort-output-lines"; // --sort-output is now this
-    for(int64_t i = 1; i < argc_given; i++){
-        if(string(argv_given[i]) == "--outfile") argv[argc++] = legacy_support_fix;
-        else if(string(argv_given[i]) == "--sort-output"){
-            cerr << "Note: --sort-output is now called " + string(legacy_support_fix2) << ", but the old option name still works." <<  endl;
-            argv[argc++] = legacy_support_fix2;
-        }
-        else if(string(argv_given[i]) == "--ignore-unknown-kmers"){
-            // This is now the default. Remove (ignore) the flag.
-        } else argv[argc++] = argv_given[i];
+// If outputfile is an empty string, prints to stdout
+template<typename coloring_t> 
+void call_pseudoalign_paired(plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, const Pseudoalign_Config& C, string inputfile1, string inputfile2, string outputfile, string abundance_outfile){
+    Parallel_Gzip_ifstream::set_n_threads_for_new_streams(C.gzip_decompression_threads);
+    if(seq_io::figure_out_file_format(inputfile1).gzipped){
+        seq_io::Reader<seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>> reader1(inputfile1);
+        call_pseudoalign_paired_with_first_reader(SBWT, coloring, C, reader1, inputfile2, outputfile, abundance_outfile);
+    } else{
+        seq_io::Reader<seq_io::Buffered_ifstream<std::ifstream>> reader1(inputfile1);
+        call_pseudoalign_paired_with_first_reader(SBWT, coloring, C, reader1, inputfile2, outputfile, abundance_outfile);
+    }
+}
+
+// Opens the sequence file with a reader of the right type and returns f(reader)
+template<typename function_t>
+int64_t with_sequence_reader(const string& filename, function_t f){
+    if(seq_io::figure_out_file_format(filename).gzipped){
+        seq_io::Reader<seq_io::Buffered_ifstream<Parallel_Gzip_ifstream>> reader(filename);
+        return f(reader);
+    } else{
+        seq_io::Reader<seq_io::Buffered_ifstream<std::ifstream>> reader(filename);
+        return f(reader);
     }
+}
 
-    cxxopts::Options options(argv[0], "This program aligns query sequences against an index that has been built previously. The output is one line per input read. Each line consists of a space-separated list of integers. The first integer specifies the rank of the read in the input file, and the rest of the integers are the identifiers of the colors of the sequences that the read pseudoaligns with. If the program is ran with more than one thread, the output lines are not necessarily in the same order as the reads in the input file. This can be fixed with the option --sort-output, but this will slow down the program.\n\n The query can be given as one file, or as a file with a list of files. In the former case, we must specify one output file with the options --out-file, and in the latter case, we must give a file that lists one output filename per line using the option --out-file-list.\n\nThe query file(s) should be in fasta of fastq format. The format is inferred from the file extension. Recognized file extensions for fasta are: .fasta, .fna, .ffn, .faa and .frn . Recognized extensions for fastq are: .fastq and .fq. Gzipped sequence files with the extension .gz are also supported.");
+// Pushes the work batches of query file i (or the pair of mate files i in paired-end mode) to the
+// thread pool. Returns the number of batches pushed.
+template<typename thread_pool_t>
+int64_t push_query_file(const Pseudoalign_Config& C, int64_t i, thread_pool_t& TP){
+    int64_t buffer_size = C.buffer_size_megas * (1 << 20);
+    Parallel_Gzip_ifstream::set_n_threads_for_new_streams(C.gzip_decompression_threads);
+    if(C.paired){
+        return with_sequence_reader(C.query_files[i], [&](auto& reader1){
+            return with_sequence_reader(C.query_files_2[i], [&](auto& reader2){
+                return pseudoalignment::push_paired_work_batches(buffer_size, reader1, reader2, TP, i, C.metrics);
+            });
+        });
+    } else{
+        return with_sequence_reader(C.query_files[i], [&](auto& reader){
+            return pseudoalignment::push_work_batches(buffer_size, reader, TP, i, C.metrics);
+        });
+    }
+}
 
+// Declares the options of the pseudoalign command. The serve command uses the same options for its jobs.
+void add_pseudoalign_options(cxxopts::Options& options){
     options.add_options("Basic")
         ("q, query-file", "Input file of the query sequences", cxxopts::value<string>()->default_value(""))
         ("query-file-list", "A list of query filenames, one line per filename", cxxopts::value<string>()->default_value(""))
+        ("paired", "Paired-end mode. The first mates are given with --query-file or --query-file-list and the second mates with --query-file-2 or --query-file-list-2. The k-mers of both mates are pseudoaligned together and one output line is printed per read pair.", cxxopts::value<bool>()->default_value("false"))
+        ("query-file-2", "Input file of the second mates in paired-end mode.", cxxopts::value<string>()->default_value(""))
+        ("query-file-list-2", "A list of input filenames of the second mates in paired-end mode, one line per filename, in the same order as in --query-file-list.", cxxopts::value<string>()->default_value(""))
         ("o,out-file", "Output filename. Print results if no output filename is given.", cxxopts::value<string>()->default_value(""))
         ("out-file-list", "A file containing a list of output filenames, one per line.", cxxopts::value<string>()->default_value(""))
         ("i,index-prefix", "The index prefix that was given to the build command.", cxxopts::value<string>())
         ("temp-dir", "Directory for temporary files.", cxxopts::value<string>())
         ("gzip-output", "Compress the output files with gzip.", cxxopts::value<bool>()->default_value("false"))
-        ("sort-output-lines", "Sort the lines in the output files by sequence rank in the input files. To sort the color ids *within* the lines, use --sort-hits.", cxxopts::value<bool>()->default_value("false"))
+        ("sort-output-lines", "Sort the lines in the output by sequence rank in the input files. This also works when printing the results. To sort the color ids *within* the lines, use --sort-hits.", cxxopts::value<bool>()->default_value("false"))
         ("sort-hits", "Sort the color ids within each line of the output.", cxxopts::value<bool>()->default_value("false"))
+        ("binary-output", "Write the output in a compact binary format instead of text. The hits are always sorted in this format. The output can be converted to text with `themisto decode-output`.", cxxopts::value<bool>()->default_value("false"))
+        ("abundance-out", "Estimate the relative abundances of the colors from the pseudoalignments with the EM algorithm and write them to this file as a tab-separated table. If no --out-file is given, the per-read results are not written at all.", cxxopts::value<string>()->default_value(""))
+        ("abundance-out-list", "A file containing a list of abundance output filenames, one per query file.", cxxopts::value<string>()->default_value(""))
         ("v,verbose", "More verbose progress reporting into stderr.", cxxopts::value<bool>()->default_value("false"))
     ;
 
@@ -127,10 +122,16 @@ int pseudoalign_main(int argc_given, char** argv_given){
         ("include-unknown-kmers", "Include all k-mers in the pseudoalignment, even those which do not occur in the index.", cxxopts::value<bool>()->default_value("false"))
         ("report-relevant-kmer-count", "Appends to each output line a semicolon followed by a space and then the number of k-mers of the query that had at least 1 color.", cxxopts::value<bool>()->default_value("false"))
         ("relevant-kmers-fraction", "Accept a pseudoalignment only if at least this fraction of k-mers of the read had at least 1 color.", cxxopts::value<double>()->default_value("0.0"))
+        ("kmer-stride", "Approximate mode: look up only every s-th k-mer of each read and apply the threshold to the fraction of the looked-up k-mers. The relevant k-mer count is then an estimate for the whole read. Faster but approximate, see integration_tests/queries/kmer_stride_error.py for an error estimate.", cxxopts::value<int64_t>()->default_value("1"))
+        ("max-kmers-per-read", "Approximate mode: look up at most this many evenly spaced k-mers per read (per pair in paired-end mode). Can be combined with --kmer-stride. 0 means no limit.", cxxopts::value<int64_t>()->default_value("0"))
     ;
 
     options.add_options("Computational resources")
         ("t, n-threads", "Number of parallel execution threads. Default: 1", cxxopts::value<int64_t>()->default_value("1"))
+        ("max-concurrent-files", "When there are many query files, read up to this many files at the same time and pseudoalign all of them with the same threads. This keeps the threads busy when the files are small. Needs --out-file-list.", cxxopts::value<int64_t>()->default_value("1"))
+        ("gzip-decompression-threads", "Number of threads that decompress each gzipped query file, including the thread reading the file. Values above 1 start that many minus one helper threads in addition to --n-threads. Helps when reading the input is the bottleneck and the files consist of many gzip members, like the files written by bgzip. A file compressed with plain gzip has only one member and is always decompressed on one thread.", cxxopts::value<int64_t>()->default_value("1"))
+        ("pin-threads", "Spread the threads evenly over the NUMA nodes of the machine and keep each thread on one CPU. The throughput of each node is printed at the end. Linux only.", cxxopts::value<bool>()->default_value("false"))
+        ("numa-replicate-index", "Load a copy of the index into the memory of each NUMA node, and have each thread query the copy on its own node. Uses one index worth of memory per node. Implies --pin-threads. Does nothing on a machine with one node.", cxxopts::value<bool>()->default_value("false"))
     ;
 
     options.add_options("Help")
@@ -140,47 +141,151 @@ int pseudoalign_main(int argc_given, char** argv_given){
 
     options.add_options("Advanced")
         ("rc", "Include reverse complement matches in the pseudoalignment. This option only makes sense if the index was built with --forward-strand-only. Otherwise this option has no effect except to slow down the query.", cxxopts::value<bool>()->default_value("false"))
+        ("dedup-reads", "Compute the pseudoalignment of identical reads in the same input buffer only once. With --rc, a read also matches the reverse complement of another read, unless --kmer-stride or --max-kmers-per-read is given or the threshold mode is used without --sort-hits. The output is the same as without this option. Useful for amplicon data with many duplicate reads.", cxxopts::value<bool>()->default_value("false"))
+        ("color-set-cache-megas", "Total size in megabytes of the caches of decoded color sets, shared evenly between the threads. Helps when the same color sets are seen over and over again, for example with many k-mers that are shared by all references. The hit rate is reported at the end. 0 disables the cache.", cxxopts::value<double>()->default_value("0"))
         ("buffer-size-megas", "Size of the input buffer in megabytes in each thread. If this is larger than the number of nucleotides in the input divided by the number of threads, then some threads will be idle. So if your input files are really small and you have a lot of threads, consider using a small buffer.", cxxopts::value<double>()->default_value("8.0"))
         ("silent", "Print as little as possible to stderr (only errors).", cxxopts::value<bool>()->default_value("false"))
+        ("metrics-out", "Write runtime metrics to this file as JSON lines: counts of reads, k-mers and color sets, and the time spent reading input, waiting on the work queue, looking up k-mers, processing color sets and writing output. A progress line is written every --metrics-interval seconds and a summary line at the end.", cxxopts::value<string>()->default_value(""))
+        ("metrics-interval", "Seconds between the progress lines of --metrics-out.", cxxopts::value<double>()->default_value("10"))
     ;
+}
 
-    int64_t old_argc = argc; // Must store this because the parser modifies it
-    auto opts = options.parse(argc, argv);
-
-    if (old_argc == 1 || opts.count("help") || opts.count("help-advanced")){
-        if(old_argc == 1 || opts.count("help"))
-            std::cerr << options.help({"Basic","Algorithm","Computational resources","Help"}) << std::endl;
-        if(opts.count("help-advanced"))
-            std::cerr << options.help({"Basic","Algorithm","Computational resources","Advanced","Help"}) << std::endl;
-        cerr << "Usage example:" << endl;
-        cerr << argv[0] << " pseudoalign --query-file example_input/queries.fna --index-prefix my_index --temp-dir temp --out-file out.txt --n-threads 4 --threshold 0.7" << endl;
-        exit(1);
-    }    
-
+// Fills a config from parsed pseudoalign options. The index files and the temp dir are set only if given.
+Pseudoalign_Config pseudoalign_config_from_options(cxxopts::ParseResult& opts){
     Pseudoalign_Config C;
     if(opts.count("query-file") && opts["query-file"].as<string>() != "") C.query_files.push_back(opts["query-file"].as<string>());
     if(opts.count("query-file-list") && opts["query-file-list"].as<string>() != "")
         for(string line : read_lines(opts["query-file-list"].as<string>()))
             C.query_files.push_back(line);
+    if(opts.count("query-file-2") && opts["query-file-2"].as<string>() != "") C.query_files_2.push_back(opts["query-file-2"].as<string>());
+    if(opts.count("query-file-list-2") && opts["query-file-list-2"].as<string>() != "")
+        for(string line : read_lines(opts["query-file-list-2"].as<string>()))
+            C.query_files_2.push_back(line);
     if(opts.count("out-file") && opts["out-file"].as<string>() != "") C.outfiles.push_back(opts["out-file"].as<string>());
     if(opts.count("out-file-list") && opts["out-file-list"].as<string>() != "")
         for(string line : read_lines(opts["out-file-list"].as<string>()))
             C.outfiles.push_back(line);
-    C.index_dbg_file = opts["index-prefix"].as<string>() + ".tdbg";
-    C.index_color_file = opts["index-prefix"].as<string>() + ".tcolors";
-    C.temp_dir = opts["temp-dir"].as<string>();
+    if(opts.count("abundance-out") && opts["abundance-out"].as<string>() != "") C.abundance_outfiles.push_back(opts["abundance-out"].as<string>());
+    if(opts.count("abundance-out-list") && opts["abundance-out-list"].as<string>() != "")
+        for(string line : read_lines(opts["abundance-out-list"].as<string>()))
+            C.abundance_outfiles.push_back(line);
+    if(opts.count("index-prefix")){
+        C.index_dbg_file = opts["index-prefix"].as<string>() + ".tdbg";
+        C.index_color_file = opts["index-prefix"].as<string>() + ".tcolors";
+    }
+    if(opts.count("temp-dir")) C.temp_dir = opts["temp-dir"].as<string>();
     C.reverse_complements = opts["rc"].as<bool>();
     C.n_threads = opts["n-threads"].as<int64_t>();
+    C.max_concurrent_files = opts["max-concurrent-files"].as<int64_t>();
+    C.gzip_decompression_threads = opts["gzip-decompression-threads"].as<int64_t>();
+    C.numa_replicate_index = opts["numa-replicate-index"].as<bool>();
+    C.pin_threads = opts["pin-threads"].as<bool>() || C.numa_replicate_index;
     C.gzipped_output = opts["gzip-output"].as<bool>();
     C.sort_output_lines = opts["sort-output-lines"].as<bool>();
     C.sort_hits = opts["sort-hits"].as<bool>();
+    C.binary_output = opts["binary-output"].as<bool>();
+    C.paired = opts["paired"].as<bool>();
     C.verbose = opts["verbose"].as<bool>();
     C.silent = opts["silent"].as<bool>();
     C.buffer_size_megas = opts["buffer-size-megas"].as<double>();
+    C.color_set_cache_megas = opts["color-set-cache-megas"].as<double>();
+    C.dedup_reads = opts["dedup-reads"].as<bool>();
+    C.kmer_stride = opts["kmer-stride"].as<int64_t>();
+    C.max_kmers_per_read = opts["max-kmers-per-read"].as<int64_t>();
     C.threshold = opts["threshold"].as<double>();
     C.ignore_unknown = !opts["include-unknown-kmers"].as<bool>();
     C.report_relevant = opts["report-relevant-kmer-count"].as<bool>();
     C.relevant_kmers_fraction = opts["relevant-kmers-fraction"].as<double>();
+    C.metrics_outfile = opts["metrics-out"].as<string>();
+    C.metrics_interval_seconds = opts["metrics-interval"].as<double>();
+
+    if(C.gzipped_output){
+        for(string& filename : C.outfiles) filename += ".gz";
+    }
+
+    return C;
+}
+
+// Pseudoaligns the query files of the config one by one, or many at a time with --max-concurrent-files
+void pseudoalign_query_files(const plain_matrix_sbwt_t& SBWT, const std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>>& coloring, const Pseudoalign_Config& C_given){
+    Pseudoalign_Config C = C_given;
+
+    // The metrics cover all the query files. The summary is written when the reporter goes out of scope.
+    pseudoalignment::Pseudoalign_Metrics metrics;
+    unique_ptr<pseudoalignment::Metrics_Reporter> metrics_reporter;
+    if(C.metrics_outfile != ""){
+        C.metrics = &metrics;
+        metrics_reporter = make_unique<pseudoalignment::Metrics_Reporter>(&metrics, C.metrics_outfile, C.metrics_interval_seconds);
+    }
+
+    if(C.max_concurrent_files > 1 && C.query_files.size() > 1){
+        std::visit([&](auto& coloring){
+            pseudoalignment::pseudoalign_files_concurrently(SBWT, coloring, C, [&](int64_t file_idx, auto& TP){
+                return push_query_file(C, file_idx, TP);
+            });
+        }, coloring);
+        return;
+    }
+
+    for(int64_t i = 0; i < C.query_files.size(); i++){
+        string query_name = C.paired ? (C.query_files[i] + " and " + C.query_files_2[i]) : C.query_files[i];
+        if (C.outfiles.size() > 0) {
+            write_log("Aligning " + query_name + " (writing output to " + C.outfiles[i] + ")", LogLevel::MAJOR);
+        } else if (C.abundance_outfiles.size() > 0) {
+            write_log("Aligning " + query_name + " (writing abundances to " + C.abundance_outfiles[i] + ")", LogLevel::MAJOR);
+        } else {
+            write_log("Aligning " + query_name + " (printing output)", LogLevel::MAJOR);
+        }
+
+        string outfile = (C.outfiles.size() > 0 ? C.outfiles[i] : "");
+        string abundance_outfile = (C.abundance_outfiles.size() > 0 ? C.abundance_outfiles[i] : "");
+        std::visit([&](auto& coloring){
+            if(C.paired) call_pseudoalign_paired(SBWT, coloring, C, C.query_files[i], C.query_files_2[i], outfile, abundance_outfile);
+            else call_pseudoalign(SBWT, coloring, C, C.query_files[i], outfile, abundance_outfile);
+        }, coloring);
+    }
+
+}
+
+int pseudoalign_main(int argc_given, char** argv_given){
+
+    // Legacy support: transform old options
+    char** argv = (char**)malloc(sizeof(char*) * argc_given); // Freed and the and of the function
+    argv[0] = argv_given[0];
+    int64_t argc = 1;
+    char legacy_support_fix[] = "--out-file";
+    char legacy_support_fix2[] = "--sort-output-lines"; // --sort-output is now this
+    for(int64_t i = 1; i < argc_given; i++){
+        if(string(argv_given[i]) == "--outfile") argv[argc++] = legacy_support_fix;
+        else if(string(argv_given[i]) == "--sort-output"){
+            cerr << "Note: --sort-output is now called " + string(legacy_support_fix2) << ", but the old option name still works." <<  endl;
+            argv[argc++] = legacy_support_fix2;
+        }
+        else if(string(argv_given[i]) == "--ignore-unknown-kmers"){
+            // This is now the default. Remove (ignore) the flag.
+        } else argv[argc++] = argv_given[i];
+    }
+
+    cxxopts::Options options(argv[0], "This program aligns query sequences against an index that has been built previously. The output is one line per input read. Each line consists of a space-separated list of integers. The first integer specifies the rank of the read in the input file, and the rest of the integers are the identifiers of the colors of the sequences that the read pseudoaligns with. If the program is ran with more than one thread, the output lines are not necessarily in the same order as the reads in the input file. This can be fixed with the option --sort-output, which puts the output in order as it is written.\n\n The query can be given as one file, or as a file with a list of files. In the former case, we must specify one output file with the options --out-file, and in the latter case, we must give a file that lists one output filename per line using the option --out-file-list.\n\nThe query file(s) should be in fasta of fastq format. The format is inferred from the file extension. Recognized file extensions for fasta are: .fasta, .fna, .ffn, .faa and .frn . Recognized extensions for fastq are: .fastq and .fq. Gzipped sequence files with the extension .gz are also supported.");
+
+    add_pseudoalign_options(options);
+
+    int64_t old_argc = argc; // Must store this because the parser modifies it
+    auto opts = options.parse(argc, argv);
+
+    if (old_argc == 1 || opts.count("help") || opts.count("help-advanced")){
+        if(old_argc == 1 || opts.count("help"))
+            std::cerr << options.help({"Basic","Algorithm","Computational resources","Help"}) << std::endl;
+        if(opts.count("help-advanced"))
+            std::cerr << options.help({"Basic","Algorithm","Computational resources","Advanced","Help"}) << std::endl;
+        cerr << "Usage example:" << endl;
+        cerr << argv[0] << " pseudoalign --query-file example_input/queries.fna --index-prefix my_index --temp-dir temp --out-file out.txt --n-threads 4 --threshold 0.7" << endl;
+        exit(1);
+    }    
+
+    check_true(opts.count("index-prefix"), "Index prefix not given");
+    check_true(opts.count("temp-dir"), "Temp directory not given");
+    Pseudoalign_Config C = pseudoalign_config_from_options(opts);
 
     if(C.verbose && C.silent) throw runtime_error("Can not give both --verbose and --silent");
     if(C.verbose) set_log_level(LogLevel::MINOR);
@@ -188,42 +293,41 @@ int pseudoalign_main(int argc_given, char** argv_given){
 
     create_directory_if_does_not_exist(C.temp_dir);
 
-    if(C.gzipped_output){
-        for(string& filename : C.outfiles) filename += ".gz";
-    }
-
     C.check_valid();
 
     write_log("Starting", LogLevel::MAJOR);
 
     get_temp_file_manager().set_dir(C.temp_dir);
 
-    write_log("Loading the index", LogLevel::MAJOR);
-    plain_matrix_sbwt_t SBWT;
-    SBWT.load(C.index_dbg_file);
+    unique_ptr<Index_Replicas> replicas;
+    if(C.numa_replicate_index){
+        int64_t n_nodes = numa::node_cpus().size();
+        if(n_nodes > 1){
+            write_log("Loading a copy of the index on each of " + to_string(n_nodes) + " NUMA nodes", LogLevel::MAJOR);
+            replicas = make_unique<Index_Replicas>(C.index_dbg_file, C.index_color_file, C.n_threads);
+            C.index_replicas = replicas.get();
+        } else write_log("Only one NUMA node available: not replicating the index", LogLevel::MAJOR);
+    }
 
-    // Load whichever coloring data structure type is stored on disk
+    plain_matrix_sbwt_t SBWT;
     std::variant<Coloring<SDSL_Variant_Color_Set>,
                  Coloring<Roaring_Color_Set>> coloring;
-    load_coloring(C.index_color_file, SBWT, coloring);
+    if(!replicas){
+        write_log("Loading the index", LogLevel::MAJOR);
+        SBWT.load(C.index_dbg_file);
 
-    if(std::holds_alternative<Coloring<SDSL_Variant_Color_Set>>(coloring))
+        // Load whichever coloring data structure type is stored on disk
+        load_coloring(C.index_color_file, SBWT, coloring);
+    }
+
+    // With replicas, the copy on node 0 is the main index
+    const std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>>& main_coloring = replicas ? *replicas->colorings[0] : coloring;
+    if(std::holds_alternative<Coloring<SDSL_Variant_Color_Set>>(main_coloring))
         write_log("sdsl coloring structure loaded", LogLevel::MAJOR);
-    if(std::holds_alternative<Coloring<Roaring_Color_Set>>(coloring))
+    if(std::holds_alternative<Coloring<Roaring_Color_Set>>(main_coloring))
         write_log("roaring coloring structure loaded", LogLevel::MAJOR);
 
-    for(int64_t i = 0; i < C.query_files.size(); i++){
-        if (C.outfiles.size() > 0) {
-            write_log("Aligning " + C.query_files[i] + " (writing output to " + C.outfiles[i] + ")", LogLevel::MAJOR);
-        } else {
-            write_log("Aligning " + C.query_files[i] + " (printing output)", LogLevel::MAJOR);
-        }
-
-        if(std::holds_alternative<Coloring<SDSL_Variant_Color_Set>>(coloring))
-            call_pseudoalign(SBWT, get<Coloring<SDSL_Variant_Color_Set>>(coloring), C, C.query_files[i], (C.outfiles.size() > 0 ? C.outfiles[i] : ""));
-        if(std::holds_alternative<Coloring<Roaring_Color_Set>>(coloring))
-            call_pseudoalign(SBWT, get<Coloring<Roaring_Color_Set>>(coloring), C, C.query_files[i], (C.outfiles.size() > 0 ? C.outfiles[i] : ""));
-    }
+    pseudoalign_query_files(replicas ? *replicas->SBWTs[0] : SBWT, main_coloring, C);
 
     write_log("Finished", LogLevel::MAJOR);
 
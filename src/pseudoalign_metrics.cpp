@@ -0,0 +1,67 @@
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+#include "pseudoalign_metrics.hh"
+
+using namespace std;
+
+namespace pseudoalignment{
+
+string Pseudoalign_Metrics::to_json(const string& type, double elapsed_seconds) const{
+    auto seconds = [](int64_t ns){ return ns / 1e9; };
+    double processing = seconds(processing_ns);
+    double lookup = seconds(lookup_ns);
+    double writer = seconds(writer_ns);
+    double coloring = max(0.0, processing - lookup - writer);
+    int64_t n_reads = reads;
+
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+        "{\"type\": \"%s\", \"elapsed_seconds\": %.3f, "
+        "\"reads\": %lld, \"bases\": %lld, \"kmers\": %lld, \"kmers_found\": %lld, \"color_sets_decoded\": %lld, \"bytes_written\": %lld, "
+        "\"reads_per_second\": %.1f, "
+        "\"input_seconds\": %.3f, \"queue_push_wait_seconds\": %.3f, \"queue_pop_wait_seconds\": %.3f, "
+        "\"lookup_seconds\": %.3f, \"coloring_seconds\": %.3f, \"writer_seconds\": %.3f, \"writer_lock_wait_seconds\": %.3f}",
+        type.c_str(), elapsed_seconds,
+        (long long)n_reads, (long long)bases.load(), (long long)kmers.load(), (long long)kmers_found.load(), (long long)color_sets_decoded.load(), (long long)bytes_written.load(),
+        elapsed_seconds > 0 ? n_reads / elapsed_seconds : 0.0,
+        seconds(input_ns), seconds(queue_push_wait_ns), seconds(queue_pop_wait_ns),
+        lookup, coloring, writer, seconds(writer_lock_wait_ns));
+    return buf;
+}
+
+Metrics_Reporter::Metrics_Reporter(const Pseudoalign_Metrics* metrics, const string& outfile, double interval_seconds)
+    : metrics(metrics), outfile(outfile), interval_seconds(interval_seconds){
+    if(interval_seconds <= 0) throw std::runtime_error("Metrics interval must be positive");
+    ofstream out(outfile); // Truncate
+    if(!out.good()) throw std::runtime_error("Could not open metrics file " + outfile);
+    start_time = std::chrono::steady_clock::now();
+    thread = std::thread([this](){ run(); });
+}
+
+void Metrics_Reporter::run(){
+    ofstream out(outfile, ios::app);
+    auto elapsed = [this](){ return nanoseconds_since(start_time) / 1e9; };
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true){
+        auto interval = std::chrono::duration<double>(interval_seconds);
+        if(stop_cv.wait_for(lock, interval, [this](){ return stop_requested; })) break;
+        out << metrics->to_json("progress", elapsed()) << "\n" << flush;
+    }
+    out << metrics->to_json("summary", elapsed()) << "\n" << flush;
+}
+
+void Metrics_Reporter::stop(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop_requested = true;
+    }
+    stop_cv.notify_all();
+    if(thread.joinable()) thread.join();
+}
+
+Metrics_Reporter::~Metrics_Reporter(){
+    stop();
+}
+
+} // namespace pseudoalignment
@@ -0,0 +1,498 @@
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "sbwt/globals.hh"
+#include "sbwt/throwing_streams.hh"
+#include "sbwt/cxxopts.hpp"
+#include "globals.hh"
+#include "pseudoalign.hh"
+#include "pseudoalign_options.hh"
+#include "serve.hh"
+
+using namespace std;
+using namespace sbwt;
+
+namespace serve{
+
+// Socket helpers. Messages are an 8-byte little-endian length followed by the bytes.
+
+static void write_all(int fd, const char* data, int64_t length){
+    while(length > 0){
+        ssize_t n = ::write(fd, data, length);
+        if(n <= 0) throw std::runtime_error("Error writing to socket");
+        data += n;
+        length -= n;
+    }
+}
+
+static void read_all(int fd, char* data, int64_t length){
+    while(length > 0){
+        ssize_t n = ::read(fd, data, length);
+        if(n <= 0) throw std::runtime_error("Connection closed unexpectedly");
+        data += n;
+        length -= n;
+    }
+}
+
+static void write_length(int fd, int64_t length){
+    char buf[8];
+    for(int64_t i = 0; i < 8; i++) buf[i] = (char)(((uint64_t)length >> (8*i)) & 0xFF);
+    write_all(fd, buf, 8);
+}
+
+static int64_t read_length(int fd){
+    char buf[8];
+    read_all(fd, buf, 8);
+    uint64_t length = 0;
+    for(int64_t i = 0; i < 8; i++) length |= (uint64_t)(uint8_t)buf[i] << (8*i);
+    return length;
+}
+
+static void write_message(int fd, const string& message){
+    write_length(fd, message.size());
+    write_all(fd, message.data(), message.size());
+}
+
+static string read_message(int fd){
+    string message(read_length(fd), '\0');
+    read_all(fd, message.data(), message.size());
+    return message;
+}
+
+// Sends the contents of a file as one message without loading the whole file into memory
+static void write_file_as_message(int fd, const string& filename){
+    write_length(fd, std::filesystem::file_size(filename));
+    throwing_ifstream in(filename, ios::binary);
+    vector<char> buf(1 << 20);
+    while(true){
+        in.stream.read(buf.data(), buf.size());
+        int64_t n = in.stream.gcount();
+        if(n == 0) break;
+        write_all(fd, buf.data(), n);
+    }
+}
+
+static sockaddr_un make_address(const string& socket_path){
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if(socket_path.size() >= sizeof(address.sun_path))
+        throw std::runtime_error("Socket path too long: " + socket_path);
+    strcpy(address.sun_path, socket_path.c_str());
+    return address;
+}
+
+static int connect_to_server(const string& socket_path){
+    sockaddr_un address = make_address(socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) throw std::runtime_error("Could not create a socket");
+    if(connect(fd, (sockaddr*)&address, sizeof(address)) != 0){
+        close(fd);
+        throw std::runtime_error("Could not connect to server at " + socket_path);
+    }
+    return fd;
+}
+
+static string join_args(const vector<string>& args){
+    string joined;
+    for(int64_t i = 0; i < args.size(); i++){
+        if(i > 0) joined += '\0';
+        joined += args[i];
+    }
+    return joined;
+}
+
+void run_client_job(const string& socket_path, const vector<string>& args, const string& inline_sequences, ostream& out){
+    int fd = connect_to_server(socket_path);
+    string status;
+    try{
+        write_message(fd, join_args(args));
+        write_message(fd, inline_sequences);
+        status = read_message(fd);
+
+        // Stream the output through a buffer
+        int64_t length = read_length(fd);
+        vector<char> buf(1 << 20);
+        while(length > 0){
+            int64_t n = min(length, (int64_t)buf.size());
+            read_all(fd, buf.data(), n);
+            out.write(buf.data(), n);
+            length -= n;
+        }
+    } catch(...){
+        close(fd);
+        throw;
+    }
+    close(fd);
+    if(status != "OK") throw std::runtime_error(status);
+}
+
+void send_shutdown_request(const string& socket_path){
+    std::stringstream ignored;
+    run_client_job(socket_path, {"--shutdown"}, "", ignored);
+}
+
+bool make_paths_absolute(vector<string>& args){
+    static const vector<string> path_options = {"-q", "--query-file", "--query-file-list", "--query-file-2", "--query-file-list-2", "-o", "--out-file", "--out-file-list", "--abundance-out", "--abundance-out-list"};
+    bool has_query = false;
+    for(int64_t i = 0; i < args.size(); i++){
+        // The path is the next argument, or in the same argument as in --out-file=out.txt or -oout.txt
+        string option = args[i];
+        string path;
+        bool attached = false;
+        if(args[i].rfind("--", 0) == 0 && args[i].find('=') != string::npos){
+            option = args[i].substr(0, args[i].find('='));
+            path = args[i].substr(option.size() + 1);
+            attached = true;
+        } else if(args[i].size() > 2 && args[i][0] == '-' && args[i][1] != '-'){
+            option = args[i].substr(0, 2);
+            path = args[i].substr(2);
+            attached = true;
+        }
+        if(std::find(path_options.begin(), path_options.end(), option) == path_options.end()) continue;
+        if(option == "-q" || option.rfind("--query-file", 0) == 0) has_query = true;
+
+        if(attached) args[i] = option + (option.size() == 2 ? "" : "=") + std::filesystem::absolute(path).string();
+        else if(i + 1 < args.size()){
+            args[i+1] = std::filesystem::absolute(args[i+1]).string();
+            i++;
+        }
+    }
+    return has_query;
+}
+
+// Divides the threads of the server between the running jobs. Every job starts right away with a pool
+// of worker threads, and the scheduler limits how many of them may run at the same time. The limits
+// are an equal share of the threads, capped by the number of threads the job asked for, and they are
+// recomputed whenever a job starts or finishes. A worker over the limit of its job finishes its
+// current work batch and waits, so a lone job uses all threads and gives them up when others arrive.
+class Thread_Scheduler{
+
+public:
+
+    class Job : public Work_Gate{
+
+        Thread_Scheduler* scheduler;
+        int64_t max_threads;
+        int64_t share = 0; // Number of workers that may run at the same time
+        int64_t running = 0;
+
+        friend class Thread_Scheduler;
+
+    public:
+
+        Job(Thread_Scheduler* scheduler, int64_t max_threads) : scheduler(scheduler), max_threads(max_threads) {}
+
+        virtual void enter(){
+            std::unique_lock<std::mutex> lock(scheduler->mutex);
+            scheduler->cv.wait(lock, [&]{ return running < share; });
+            running++;
+        }
+
+        virtual void leave(){
+            std::lock_guard<std::mutex> lock(scheduler->mutex);
+            running--;
+            scheduler->cv.notify_all();
+        }
+
+        virtual ~Job(){
+            std::lock_guard<std::mutex> lock(scheduler->mutex);
+            scheduler->jobs.erase(std::find(scheduler->jobs.begin(), scheduler->jobs.end(), this));
+            scheduler->rebalance();
+        }
+
+    };
+
+private:
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    int64_t total_threads;
+    vector<Job*> jobs;
+
+    // Gives every job an equal share of the threads, but at most the number it asked for and at least
+    // one. Threads that a small job does not use are divided between the others. Call with the mutex held.
+    void rebalance(){
+        vector<Job*> by_max = jobs;
+        std::sort(by_max.begin(), by_max.end(), [](const Job* A, const Job* B){ return A->max_threads < B->max_threads; });
+        int64_t threads_left = total_threads;
+        for(int64_t i = 0; i < (int64_t)by_max.size(); i++){
+            int64_t jobs_left = by_max.size() - i;
+            by_max[i]->share = max((int64_t)1, min(by_max[i]->max_threads, threads_left / jobs_left));
+            threads_left = max((int64_t)0, threads_left - by_max[i]->share);
+        }
+        cv.notify_all();
+    }
+
+public:
+
+    Thread_Scheduler(int64_t total_threads) : total_threads(total_threads) {}
+
+    // Registers a job that runs at most max_threads workers at the same time. The job is removed
+    // from the scheduler when the returned object is destroyed.
+    unique_ptr<Job> start_job(int64_t max_threads){
+        unique_ptr<Job> job = make_unique<Job>(this, max_threads);
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job.get());
+        rebalance();
+        return job;
+    }
+
+};
+
+struct Server{
+    plain_matrix_sbwt_t SBWT;
+    std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>> coloring;
+    string index_dbg_file;
+    string index_color_file;
+    string temp_dir;
+    unique_ptr<Thread_Scheduler> scheduler;
+    int64_t max_threads;
+
+    std::mutex temp_file_mutex; // The temp file manager is not thread-safe
+    int listen_fd = -1;
+    std::atomic<bool> stopping = false;
+
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cv;
+    int64_t running_jobs = 0;
+
+    string create_temp_filename(const string& prefix, const string& suffix){
+        std::lock_guard<std::mutex> lock(temp_file_mutex);
+        return get_temp_file_manager().create_filename(prefix, suffix);
+    }
+
+    // Runs one job. Returns the name of the file with the output to send back, or an empty string.
+    string run_job(const vector<string>& args, const string& inline_sequences, vector<string>& temp_files){
+        vector<string> argv_strings = {"pseudoalign"};
+        argv_strings.insert(argv_strings.end(), args.begin(), args.end());
+        Argv argv(argv_strings);
+
+        cxxopts::Options options("pseudoalign", "");
+        add_pseudoalign_options(options);
+        int argc = argv.size;
+        auto opts = options.parse(argc, argv.array);
+
+        // These options act on the whole process, so the jobs can not give them
+        for(string process_option : {"pin-threads", "numa-replicate-index", "metrics-out", "metrics-interval", "verbose", "silent"})
+            if(opts.count(process_option)) throw std::runtime_error("Option --" + process_option + " can not be given to a job of a server");
+
+        Pseudoalign_Config C = pseudoalign_config_from_options(opts);
+
+        // The index, the temp dir and the logging are the server's. The progress lines of jobs running
+        // at the same time would be mixed up on stderr, so they are not printed.
+        C.index_dbg_file = index_dbg_file;
+        C.index_color_file = index_color_file;
+        C.temp_dir = temp_dir;
+        C.print_progress = false;
+
+        if(inline_sequences.size() > 0){
+            check_true(C.query_files.size() == 0, "Both inline sequences and query files given");
+            string query_file = create_temp_filename("inline-", inline_sequences[0] == '@' ? ".fastq" : ".fna");
+            temp_files.push_back(query_file);
+            throwing_ofstream query_out(query_file);
+            query_out.write(inline_sequences.data(), inline_sequences.size());
+            query_out.close();
+            C.query_files.push_back(query_file);
+        }
+
+        // Without output files, the output is collected into a temporary file and sent back
+        string output_to_send = "";
+        if(C.outfiles.size() == 0 && C.abundance_outfiles.size() == 0){
+            output_to_send = create_temp_filename("out-", C.gzipped_output ? ".gz" : "");
+            temp_files.push_back(output_to_send);
+            C.outfiles.push_back(output_to_send);
+        }
+
+        C.check_valid();
+
+        C.n_threads = opts.count("n-threads") ? min(C.n_threads, max_threads) : max_threads;
+        unique_ptr<Thread_Scheduler::Job> job = scheduler->start_job(C.n_threads);
+        C.work_gate = job.get();
+        write_log("Running a job with up to " + to_string(C.n_threads) + " threads", LogLevel::MAJOR);
+        pseudoalign_query_files(SBWT, coloring, C);
+        return output_to_send;
+    }
+
+    void handle_connection(int fd){
+        vector<string> temp_files;
+        try{
+            string joined_args = read_message(fd);
+            string inline_sequences = read_message(fd);
+            vector<string> args;
+            if(joined_args.size() > 0) args = split(joined_args, '\0');
+
+            if(args.size() == 1 && args[0] == "--shutdown"){
+                write_log("Shutdown requested", LogLevel::MAJOR);
+                stopping = true;
+                ::shutdown(listen_fd, SHUT_RDWR); // Wakes up accept
+                write_message(fd, "OK");
+                write_message(fd, "");
+            } else{
+                string output_file;
+                try{
+                    output_file = run_job(args, inline_sequences, temp_files);
+                } catch(const std::exception& e){
+                    write_log(string("Job failed: ") + e.what(), LogLevel::MAJOR);
+                    write_message(fd, string("ERROR: ") + e.what());
+                    write_message(fd, "");
+                    output_file = "-"; // Reply sent
+                }
+                if(output_file != "-"){
+                    write_message(fd, "OK");
+                    if(output_file == "") write_message(fd, "");
+                    else write_file_as_message(fd, output_file);
+                }
+            }
+        } catch(const std::exception& e){
+            write_log(string("Lost connection to client: ") + e.what(), LogLevel::MAJOR);
+        }
+        for(const string& filename : temp_files) std::filesystem::remove(filename);
+        close(fd);
+    }
+
+    void serve(const string& socket_path){
+        sockaddr_un address = make_address(socket_path);
+        std::filesystem::remove(socket_path); // Left over from an earlier server
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(listen_fd < 0) throw std::runtime_error("Could not create a socket");
+        if(::bind(listen_fd, (sockaddr*)&address, sizeof(address)) != 0)
+            throw std::runtime_error("Could not bind to socket " + socket_path);
+        if(listen(listen_fd, 64) != 0)
+            throw std::runtime_error("Could not listen on socket " + socket_path);
+
+        write_log("Listening on " + socket_path, LogLevel::MAJOR);
+        while(!stopping){
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if(fd < 0){
+                if(stopping) break;
+                continue; // Interrupted or a transient error
+            }
+            {
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                running_jobs++;
+            }
+            std::thread([this, fd](){
+                handle_connection(fd);
+                std::lock_guard<std::mutex> lock(jobs_mutex);
+                running_jobs--;
+                jobs_cv.notify_all();
+            }).detach();
+        }
+
+        // Wait for the running jobs
+        std::unique_lock<std::mutex> lock(jobs_mutex);
+        jobs_cv.wait(lock, [&]{ return running_jobs == 0; });
+        close(listen_fd);
+        std::filesystem::remove(socket_path);
+    }
+};
+
+} // namespace serve
+
+int serve_main(int argc, char** argv){
+
+    cxxopts::Options options(argv[0], "Load the index once and pseudoalign jobs sent with `themisto client` over a Unix domain socket. The jobs run at the same time, and the threads are divided evenly between the running jobs whenever a job starts or finishes. The jobs take the same options as the pseudoalign command, except for the index and the options that act on the whole process: --pin-threads, --numa-replicate-index, --metrics-out, --metrics-interval, --verbose and --silent. File paths in the jobs are relative to the working directory of the client, but the paths inside list files must be absolute.");
+
+    options.add_options()
+        ("i,index-prefix", "The index prefix that was given to the build command.", cxxopts::value<string>())
+        ("socket", "Path of the Unix domain socket to listen on.", cxxopts::value<string>())
+        ("temp-dir", "Directory for temporary files.", cxxopts::value<string>())
+        ("t,n-threads", "Number of threads shared by all jobs.", cxxopts::value<int64_t>()->default_value("1"))
+        ("v,verbose", "More verbose progress reporting into stderr.", cxxopts::value<bool>()->default_value("false"))
+        ("silent", "Print as little as possible to stderr (only errors).", cxxopts::value<bool>()->default_value("false"))
+        ("h,help", "Print usage")
+    ;
+
+    int64_t old_argc = argc; // Must store this because the parser modifies it
+    auto opts = options.parse(argc, argv);
+
+    if (old_argc == 1 || opts.count("help")){
+        std::cerr << options.help() << std::endl;
+        cerr << "Usage example:" << endl;
+        cerr << argv[0] << " serve --index-prefix my_index --socket /tmp/themisto.sock --temp-dir temp --n-threads 16" << endl;
+        return 1;
+    }
+
+    if(opts["verbose"].as<bool>() && opts["silent"].as<bool>()) throw runtime_error("Can not give both --verbose and --silent");
+    if(opts["verbose"].as<bool>()) set_log_level(LogLevel::MINOR);
+    if(opts["silent"].as<bool>()) set_log_level(LogLevel::OFF);
+
+    serve::Server server;
+    server.index_dbg_file = opts["index-prefix"].as<string>() + ".tdbg";
+    server.index_color_file = opts["index-prefix"].as<string>() + ".tcolors";
+    server.temp_dir = opts["temp-dir"].as<string>();
+    server.max_threads = opts["n-threads"].as<int64_t>();
+    check_true(server.max_threads >= 1, "Number of threads must be at least 1");
+    server.scheduler = make_unique<serve::Thread_Scheduler>(server.max_threads);
+
+    check_readable(server.index_dbg_file);
+    check_readable(server.index_color_file);
+    create_directory_if_does_not_exist(server.temp_dir);
+    get_temp_file_manager().set_dir(server.temp_dir);
+
+    write_log("Loading the index", LogLevel::MAJOR);
+    server.SBWT.load(server.index_dbg_file);
+    load_coloring(server.index_color_file, server.SBWT, server.coloring);
+
+    server.serve(opts["socket"].as<string>());
+
+    write_log("Finished", LogLevel::MAJOR);
+    return 0;
+}
+
+int client_main(int argc, char** argv){
+
+    // The arguments other than --socket are passed on to the server as they are, so they are not parsed with cxxopts
+    string socket_path;
+    bool shutdown = false;
+    vector<string> args;
+    for(int64_t i = 1; i < argc; i++){
+        string arg = argv[i];
+        if(arg == "--socket" && i + 1 < argc) socket_path = argv[++i];
+        else if(arg == "--shutdown") shutdown = true;
+        else args.push_back(arg);
+    }
+
+    if(argc == 1 || socket_path == "" || (args.size() > 0 && (args[0] == "-h" || args[0] == "--help"))){
+        cerr << "Send a pseudoalignment job to a server started with `themisto serve`." << endl << endl;
+        cerr << "Usage: " << argv[0] << " client --socket <path> [pseudoalign options]" << endl << endl;
+        cerr << "The options are the same as for the pseudoalign command, without --index-prefix and the options that" << endl;
+        cerr << "act on the whole server process (see `themisto serve --help`). If no query file is" << endl;
+        cerr << "given, the query sequences are read from stdin. If no output file is given, the output is printed." << endl;
+        cerr << "With --shutdown, the server stops after the running jobs." << endl << endl;
+        cerr << "Usage example:" << endl;
+        cerr << argv[0] << " client --socket /tmp/themisto.sock --query-file queries.fna --out-file out.txt --threshold 0.7" << endl;
+        return 1;
+    }
+
+    if(shutdown){
+        serve::send_shutdown_request(socket_path);
+        return 0;
+    }
+
+    // The server may have a different working directory
+    bool has_query = serve::make_paths_absolute(args);
+
+    string inline_sequences;
+    if(!has_query){
+        std::stringstream ss;
+        ss << cin.rdbuf();
+        inline_sequences = ss.str();
+        check_true(inline_sequences.size() > 0, "No query file given and nothing in stdin");
+    }
+
+    serve::run_client_job(socket_path, args, inline_sequences, cout);
+    cout.flush();
+    return 0;
+}
@@ -106,6 +106,15 @@ int stats_main(int argc, char** argv){
         for(auto [component, space] : std::visit(call_space_breakdown, coloring)){
             cout << component << ": " << human_readable_bytes(space) << endl;
         }
+        auto call_pointer_array = [](auto& obj) -> const Sparse_Uint_Array& { return obj.get_node_id_to_colorset_id_structure(); };
+        const Sparse_Uint_Array& pointers = std::visit(call_pointer_array, coloring);
+        if(pointers.get_layout() == Sparse_Uint_Array_Layout::elias_fano){
+            int64_t compressed = pointers.space_breakdown()["marks-elias-fano"];
+            int64_t plain = pointers.plain_marks_size_in_bytes();
+            cout << "Elias-Fano marks of the node id -> color set id array take " << human_readable_bytes(compressed)
+                 << " instead of " << human_readable_bytes(plain) << " as a plain bit vector with rank support (saves "
+                 << (plain >= compressed ? human_readable_bytes(plain - compressed) : "-" + human_readable_bytes(compressed - plain)) << ")" << endl;
+        }
         cout << "== Space taken for the de Bruijn graph ==" << endl;
         seq_io::NullStream ns;
         int64_t bytes = SBWT.serialize(ns);
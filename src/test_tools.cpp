@@ -11,6 +11,8 @@
 #include "stdlib_printing.hh"
 #include "throwing_streams.hh"
 #include "test_tools.hh"
+#include <cstring>
+#include "zlib.h"
 #include <cassert>
 
 using namespace std;
@@ -180,4 +182,38 @@ vector<string> split_seqs_to_separate_files(string infile){
 void write_lines(const vector<string>& lines, const string& filename){
     sbwt::throwing_ofstream out(filename);
     for(const string& line : lines) out.stream << line << "\n";
-}
\ No newline at end of file
+}
+
+string gzip_member(const string& data, bool bgzf){
+    z_stream s;
+    memset(&s, 0, sizeof(s));
+    deflateInit2(&s, 6, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY); // Raw deflate
+    string deflated(deflateBound(&s, data.size()), '\0');
+    s.next_in = (unsigned char*)data.data();
+    s.avail_in = data.size();
+    s.next_out = (unsigned char*)deflated.data();
+    s.avail_out = deflated.size();
+    deflate(&s, Z_FINISH);
+    deflated.resize(s.total_out);
+    deflateEnd(&s);
+
+    auto little_endian = [](uint64_t x, int64_t n_bytes){
+        string bytes;
+        for(int64_t i = 0; i < n_bytes; i++) bytes.push_back((char)((x >> (8*i)) & 0xFF));
+        return bytes;
+    };
+
+    string member = bgzf ? string("\x1f\x8b\x08\x04\x00\x00\x00\x00\x00\xff", 10) : string("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    if(bgzf) member += little_endian(6, 2) + "BC" + little_endian(2, 2) + little_endian(deflated.size() + 25, 2);
+    member += deflated;
+    member += little_endian(crc32(0, (const unsigned char*)data.data(), data.size()), 4);
+    member += little_endian(data.size(), 4);
+    return member;
+}
+
+string gzip_members(const string& data, int64_t member_size, bool bgzf){
+    string gz;
+    for(int64_t i = 0; i < (int64_t)data.size(); i += member_size)
+        gz += gzip_member(data.substr(i, member_size), bgzf);
+    return gz;
+}
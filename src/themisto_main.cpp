@@ -8,7 +8,7 @@
 
 using namespace std;
 
-static vector<string> commands = {"build", "pseudoalign", "extract-unitigs", "dump-color-matrix", "stats"};
+static vector<string> commands = {"build", "pseudoalign", "extract-unitigs", "dump-color-matrix", "stats", "decode-output", "serve", "client", "add-hot-pointers"};
 
 void print_help(int argc, char** argv){
     (void) argc; // Unused parameter
@@ -49,6 +49,10 @@ int main(int argc, char** argv){
         else if(command == "pseudoalign") return pseudoalign_main(argc, argv);
         else if(command == "extract-unitigs") return extract_unitigs_main(argc, argv);
         else if(command == "stats") return stats_main(argc, argv);
+        else if(command == "decode-output") return decode_output_main(argc, argv);
+        else if(command == "serve") return serve_main(argc, argv);
+        else if(command == "client") return client_main(argc, argv);
+        else if(command == "add-hot-pointers") return add_hot_pointers_main(argc, argv);
         else if(command == "dump-color-matrix") return dump_color_matrix_main(argc, argv); // Undocumented developer feature
         else if(command == "color-set-diagnostics") return color_set_diagnostics_main(argc, argv); // Undocumented developer feature
         else if(command == "make-d-equal-1") return make_d_equal_1_main(argc, argv); // Undocumented developer feature
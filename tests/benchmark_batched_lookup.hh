@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "sbwt/SBWT.hh"
+#include "coloring/Coloring.hh"
+#include "benchmark_intersection.hh"
+
+// Compares looking up the color set ids of random k-mers one at a time against Coloring::get_color_set_ids
+// in batches of different sizes. The index is large enough not to fit in the cache.
+void benchmark_batched_color_set_id_lookup(){
+    srand(2121);
+    int64_t k = 31;
+    int64_t n_refs = 200;
+    int64_t n_lookups = 2000000;
+
+    vector<string> refs;
+    for(int64_t i = 0; i < n_refs; i++) refs.push_back(get_random_dna_string(100000, 4));
+
+    plain_matrix_sbwt_t SBWT;
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    build_benchmark_index(refs, k, SBWT, coloring);
+
+    vector<int64_t> nodes;
+    while(nodes.size() < n_lookups){
+        const string& ref = refs[rand() % n_refs];
+        int64_t node = SBWT.search(ref.substr(rand() % (ref.size() - k), k));
+        if(node != -1) nodes.push_back(node);
+    }
+
+    vector<int64_t> ids(n_lookups);
+    double one_by_one = time_seconds([&](){
+        for(int64_t i = 0; i < n_lookups; i++) ids[i] = coloring.get_color_set_id(nodes[i]);
+    });
+    cout << "One at a time: " << n_lookups / one_by_one / 1e6 << " M lookups/s" << endl;
+
+    vector<int64_t> batched_ids(n_lookups);
+    for(int64_t batch_size : {4, 16, 64, 1024}){
+        double batched = time_seconds([&](){
+            for(int64_t i = 0; i < n_lookups; i += batch_size)
+                coloring.get_color_set_ids(nodes.data() + i, min(batch_size, n_lookups - i), batched_ids.data() + i);
+        });
+        if(batched_ids != ids) cerr << "Error: batched lookup gave different ids" << endl;
+        cout << "Batches of " << batch_size << ": " << n_lookups / batched / 1e6 << " M lookups/s, speedup " << one_by_one / batched << "x" << endl;
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+#include "coloring/Sparse_Uint_Array.hh"
+
+// Compares the lookup latency and the size of the marks of the separate and the Elias-Fano layout of a
+// Sparse_Uint_Array that is much larger than the cache, for densities like those given by different
+// values of --colorset-pointer-tradeoff.
+void benchmark_elias_fano_sparse_array(){
+    srand(2323);
+    int64_t length = 1LL << 30;
+    int64_t n_lookups = 10000000;
+    int64_t max_value = 1LL << 20;
+
+    vector<int64_t> queries(n_lookups);
+    for(int64_t& q : queries) q = ((uint64_t)rand() * rand()) % length;
+
+    for(int64_t density : {5, 20, 100}){
+        sdsl::bit_vector marks(length, 0);
+        int64_t n_values = 0;
+        for(int64_t i = 0; i < length; i++){
+            marks[i] = rand() % density == 0;
+            n_values += marks[i];
+        }
+        sdsl::int_vector<> values(n_values, 0, 21);
+        for(int64_t i = 0; i < n_values; i++) values[i] = rand() % max_value;
+
+        Sparse_Uint_Array separate(marks, values, max_value);
+        Sparse_Uint_Array compressed = separate.with_layout(Sparse_Uint_Array_Layout::elias_fano);
+
+        int64_t checksum_separate = 0, checksum_compressed = 0;
+        double separate_time = time_seconds([&](){
+            for(int64_t q : queries) checksum_separate += separate.get(q);
+        });
+        double compressed_time = time_seconds([&](){
+            for(int64_t q : queries) checksum_compressed += compressed.get(q);
+        });
+        if(checksum_separate != checksum_compressed) cerr << "Error: the layouts gave different values" << endl;
+
+        cout << "One value per " << density << " cells:" << endl;
+        cout << "  separate:    " << separate_time / n_lookups * 1e9 << " ns/lookup, marks " << separate.plain_marks_size_in_bytes() / 1e6 << " MB" << endl;
+        cout << "  Elias-Fano:  " << compressed_time / n_lookups * 1e9 << " ns/lookup, marks " << compressed.space_breakdown()["marks-elias-fano"] / 1e6 << " MB" << endl;
+    }
+}
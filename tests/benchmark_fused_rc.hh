@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "sbwt/SBWT.hh"
+#include "pseudoalign.hh"
+#include "coloring/Coloring.hh"
+#include "benchmark_intersection.hh"
+
+// Reads per second through the color set id lookup of both strands
+template<typename colorset_t>
+double rc_lookup_reads_per_second(const plain_matrix_sbwt_t& SBWT, const Coloring<colorset_t>& coloring, const vector<string>& reads, bool fused){
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+    pseudoalignment::WorkerContext<Coloring<colorset_t>> context = {&SBWT, &coloring, true, 1, true, false, 1 << 16, &total_length, &total_bytes, &writer, false, 0, false, false, 0, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+    pseudoalignment::IntersectionWorker<Coloring<colorset_t>> worker(context);
+    worker.fused_rc_lookup = fused;
+
+    double seconds = time_seconds([&](){
+        for(const string& read : reads)
+            worker.lookup_color_set_ids(read.c_str(), read.size());
+    });
+    return reads.size() / seconds;
+}
+
+// Compares the one-pass lookup of the forward and reverse complement k-mers against searching the
+// two strands one after the other. The index is large enough not to fit in the cache.
+void benchmark_fused_rc_lookup(){
+    srand(9001);
+    int64_t k = 31;
+    int64_t n_refs = 200;
+    int64_t read_length = 150;
+    int64_t n_reads = 200000;
+
+    vector<string> refs;
+    for(int64_t i = 0; i < n_refs; i++) refs.push_back(get_random_dna_string(100000, 4));
+
+    vector<string> reads;
+    for(int64_t i = 0; i < n_reads; i++){
+        const string& ref = refs[rand() % n_refs];
+        string read = ref.substr(rand() % (ref.size() - read_length), read_length);
+        if(i % 2 == 1) read = sbwt::get_rc(read);
+        reads.push_back(read);
+    }
+
+    plain_matrix_sbwt_t SBWT;
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    build_benchmark_index(refs, k, SBWT, coloring);
+
+    double two_pass = rc_lookup_reads_per_second(SBWT, coloring, reads, false);
+    double fused = rc_lookup_reads_per_second(SBWT, coloring, reads, true);
+    cout << two_pass << " reads/s with two passes, " << fused << " reads/s with one fused pass, speedup " << fused / two_pass << "x" << endl;
+}
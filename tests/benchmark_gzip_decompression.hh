@@ -0,0 +1,57 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include "parallel_gzip.hh"
+#include "SeqIO/SeqIO.hh"
+#include "test_tools.hh"
+
+// Megabytes of decompressed output per second when reading the whole stream in buffer-sized pieces
+template<typename stream_t>
+double decompressed_megabytes_per_second(stream_t& in){
+    vector<char> buf(1 << 20);
+    int64_t total = 0;
+    double seconds = time_seconds([&](){
+        while(true){
+            in.read(buf.data(), buf.size());
+            if(in.gcount() == 0) break;
+            total += in.gcount();
+        }
+    });
+    return total / 1e6 / seconds;
+}
+
+// Reading a gzipped FASTQ file with zstr and with Parallel_Gzip_ifstream on 1 to 8 threads, for a file with a
+// single gzip member, a file of 1 MB members and a BGZF file. Only the files with many members can be
+// decompressed in parallel.
+void benchmark_gzip_decompression(){
+    srand(5511);
+    string fastq;
+    for(int64_t i = 0; fastq.size() < 200 * (1 << 20); i++)
+        fastq += "@read" + to_string(i) + "\n" + get_random_dna_string(150, 4) + "\n+\n" + string(150, 'F') + "\n";
+
+    vector<pair<string, string>> files = {
+        {"single member", gzip_member(fastq, false)},
+        {"1 MB members", gzip_members(fastq, 1 << 20, false)},
+        {"bgzf", gzip_members(fastq, 65280, true) + gzip_member("", true)},
+    };
+
+    cout << "Hardware threads: " << std::thread::hardware_concurrency() << endl;
+    for(auto& [name, gz] : files){
+        string filename = get_temp_file_manager().create_filename("", ".fq.gz");
+        {
+            ofstream out(filename, ios::binary);
+            out.write(gz.data(), gz.size());
+        }
+
+        seq_io::zstr::ifstream zstr_in(filename, ios::binary);
+        cout << name << ": zstr " << decompressed_megabytes_per_second(zstr_in) << " MB/s";
+        for(int64_t n_threads : {1, 2, 4, 8}){
+            Parallel_Gzip_ifstream in(filename, n_threads);
+            cout << ", " << n_threads << " threads " << decompressed_megabytes_per_second(in) << " MB/s";
+        }
+        cout << endl;
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include "coloring/Sparse_Uint_Array.hh"
+
+// Compares random get(...) on the separate and the interleaved layout of a Sparse_Uint_Array that is much
+// larger than the cache, for densities that give each block size of the interleaved layout.
+void benchmark_interleaved_sparse_array(){
+    srand(2222);
+    int64_t length = 1LL << 28;
+    int64_t n_lookups = 10000000;
+    int64_t max_value = 1LL << 20;
+
+    vector<int64_t> queries(n_lookups);
+    for(int64_t& q : queries) q = ((uint64_t)rand() * rand()) % length;
+
+    for(int64_t density : {1, 4, 20}){
+        sdsl::bit_vector marks(length, 0);
+        int64_t n_values = 0;
+        for(int64_t i = 0; i < length; i++){
+            marks[i] = rand() % density == 0;
+            n_values += marks[i];
+        }
+        sdsl::int_vector<> values(n_values, 0, 21);
+        for(int64_t i = 0; i < n_values; i++) values[i] = rand() % max_value;
+
+        Sparse_Uint_Array separate(marks, values, max_value);
+        Sparse_Uint_Array interleaved = separate.with_layout(Sparse_Uint_Array_Layout::interleaved);
+
+        int64_t checksum_separate = 0, checksum_interleaved = 0;
+        double separate_time = time_seconds([&](){
+            for(int64_t q : queries) checksum_separate += separate.get(q);
+        });
+        double interleaved_time = time_seconds([&](){
+            for(int64_t q : queries) checksum_interleaved += interleaved.get(q);
+        });
+        if(checksum_separate != checksum_interleaved) cerr << "Error: the layouts gave different values" << endl;
+
+        auto bytes = [](const Sparse_Uint_Array& A){
+            int64_t total = 0;
+            for(auto [component, n_bytes] : A.space_breakdown()) total += n_bytes;
+            return total;
+        };
+        cout << "One value per " << density << " cells:" << endl;
+        cout << "  separate:    " << n_lookups / separate_time / 1e6 << " M lookups/s, " << bytes(separate) / 1e6 << " MB" << endl;
+        cout << "  interleaved: " << n_lookups / interleaved_time / 1e6 << " M lookups/s, " << bytes(interleaved) / 1e6 << " MB, speedup " << separate_time / interleaved_time << "x" << endl;
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "sbwt/SBWT.hh"
+#include "pseudoalign.hh"
+#include "coloring/Coloring.hh"
+#include "coloring/Coloring_Builder.hh"
+
+// Discards everything written to it
+// Builds an index of random references with one color per reference
+template<typename colorset_t>
+void build_benchmark_index(const vector<string>& refs, int64_t k, plain_matrix_sbwt_t& SBWT, Coloring<colorset_t>& coloring){
+    vector<int64_t> colors;
+    for(int64_t i = 0; i < refs.size(); i++) colors.push_back(i);
+
+    string fastafile = get_temp_file_manager().create_filename("refs-",".fna");
+    write_as_fasta(refs, fastafile);
+    build_nodeboss_in_memory<plain_matrix_sbwt_t>(refs, SBWT, k, true);
+
+    Coloring_Builder<colorset_t> cb;
+    seq_io::Reader<> reader(fastafile);
+    cb.build_coloring(coloring, SBWT, reader, colors, 1 << 30, 4, 3);
+}
+
+// Reads per second through the intersection worker
+template<typename colorset_t>
+double intersection_reads_per_second(const plain_matrix_sbwt_t& SBWT, const Coloring<colorset_t>& coloring, const vector<string>& reads, bool early_exit, bool report_relevant){
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+    pseudoalignment::WorkerContext<Coloring<colorset_t>> context = {&SBWT, &coloring, true, 1, true, false, 1 << 16, &total_length, &total_bytes, &writer, report_relevant, 0, false, false, 0, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+    pseudoalignment::IntersectionWorker<Coloring<colorset_t>> worker(context);
+    worker.early_exit = early_exit;
+
+    double seconds = time_seconds([&](){
+        for(int64_t i = 0; i < reads.size(); i++)
+            worker.process_sequence(reads[i].c_str(), reads[i].size(), i);
+    });
+    return reads.size() / seconds;
+}
+
+// Off-target reads are mosaics of segments of different references, so most of their k-mers are found
+// in the index but the intersection of their color sets becomes empty early in the read.
+void benchmark_intersection_early_exit(){
+    srand(5412);
+    int64_t k = 31;
+    int64_t n_refs = 500;
+    int64_t read_length = 150;
+    int64_t n_reads = 200000;
+
+    // References share a common core so that color sets are large
+    string core = get_random_dna_string(5000, 4);
+    vector<string> refs;
+    for(int64_t i = 0; i < n_refs; i++)
+        refs.push_back(get_random_dna_string(3000, 4) + core + get_random_dna_string(3000, 4));
+
+    vector<string> on_target, off_target;
+    for(int64_t i = 0; i < n_reads; i++){
+        const string& ref = refs[rand() % n_refs];
+        on_target.push_back(ref.substr(rand() % (ref.size() - read_length), read_length));
+
+        string mosaic;
+        while(mosaic.size() < read_length){
+            const string& segment_ref = refs[rand() % n_refs];
+            mosaic += segment_ref.substr(rand() % (segment_ref.size() - 50), 50);
+        }
+        off_target.push_back(mosaic.substr(0, read_length));
+    }
+
+    plain_matrix_sbwt_t SBWT;
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    build_benchmark_index(refs, k, SBWT, coloring);
+
+    for(bool report_relevant : {false, true}){
+        for(auto [name, reads] : vector<pair<string, vector<string>*>>{{"on-target", &on_target}, {"off-target", &off_target}}){
+            double without = intersection_reads_per_second(SBWT, coloring, *reads, false, report_relevant);
+            double with = intersection_reads_per_second(SBWT, coloring, *reads, true, report_relevant);
+            cout << name << (report_relevant ? " (with relevant k-mer counts)" : "") << ": "
+                 << without << " reads/s without early exit, "
+                 << with << " reads/s with early exit, speedup " << with / without << "x" << endl;
+        }
+    }
+}
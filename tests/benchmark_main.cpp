@@ -0,0 +1,61 @@
+// Microbenchmarks. Build with -DBUILD_THEMISTO_BENCHMARKS=1 and run bin/themisto_benchmarks.
+// Give benchmark names as arguments to run only those benchmarks.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <functional>
+#include "globals.hh"
+#include "test_tools.hh"
+#include "sbwt/globals.hh"
+
+using namespace std;
+using namespace sbwt;
+
+// Seconds taken by f()
+double time_seconds(const std::function<void()>& f){
+    auto t0 = std::chrono::high_resolution_clock::now();
+    f();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(t1 - t0).count();
+}
+
+#include "benchmark_intersection.hh"
+#include "benchmark_fused_rc.hh"
+#include "benchmark_threshold_counting.hh"
+#include "benchmark_gzip_decompression.hh"
+#include "benchmark_output_writer.hh"
+#include "benchmark_batched_lookup.hh"
+#include "benchmark_interleaved_sparse_array.hh"
+#include "benchmark_elias_fano_sparse_array.hh"
+
+int main(int argc, char** argv){
+    map<string, std::function<void()>> benchmarks = {
+        {"intersection_early_exit", benchmark_intersection_early_exit},
+        {"fused_rc_lookup", benchmark_fused_rc_lookup},
+        {"threshold_counting", benchmark_threshold_counting},
+        {"gzip_decompression", benchmark_gzip_decompression},
+        {"output_writer", benchmark_output_writer},
+        {"batched_color_set_id_lookup", benchmark_batched_color_set_id_lookup},
+        {"interleaved_sparse_array", benchmark_interleaved_sparse_array},
+        {"elias_fano_sparse_array", benchmark_elias_fano_sparse_array},
+    };
+
+    create_directory_if_does_not_exist("temp");
+    get_temp_file_manager().set_dir("temp");
+
+    vector<string> to_run;
+    for(int64_t i = 1; i < argc; i++) to_run.push_back(argv[i]);
+    if(to_run.empty()) for(auto& [name, f] : benchmarks) to_run.push_back(name);
+
+    for(const string& name : to_run){
+        if(benchmarks.count(name) == 0){
+            cerr << "Unknown benchmark: " << name << endl;
+            return 1;
+        }
+        cout << "== " << name << " ==" << endl;
+        benchmarks[name]();
+    }
+}
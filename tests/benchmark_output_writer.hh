@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include "WorkDispatcher.hh"
+#include "test_tools.hh"
+
+// Megabytes of uncompressed output per second when n_threads threads write the chunks through the writer
+double written_megabytes_per_second(ParallelBaseWriter& writer, const vector<string>& chunks, int64_t n_threads){
+    std::atomic<int64_t> next_chunk = 0;
+    int64_t total = 0;
+    for(const string& chunk : chunks) total += chunk.size();
+    double seconds = time_seconds([&](){
+        vector<std::thread> threads;
+        for(int64_t t = 0; t < n_threads; t++){
+            threads.push_back(std::thread([&](){
+                while(true){
+                    int64_t i = next_chunk++;
+                    if(i >= chunks.size()) break;
+                    writer.write(chunks[i].data(), chunks[i].size());
+                }
+            }));
+        }
+        for(std::thread& t : threads) t.join();
+        writer.flush();
+    });
+    return total / 1e6 / seconds;
+}
+
+// Writing gzipped pseudoalignment output in 1 MB chunks from 1 to 8 threads with ParallelBlockWriter, which
+// compresses on the writing threads. The speedup is relative to one thread, which is the speed of a
+// writer that compresses under its lock.
+void benchmark_output_writer(){
+    srand(2020);
+    vector<string> chunks;
+    int64_t read_id = 0;
+    for(int64_t c = 0; c < 200; c++){
+        string chunk;
+        while(chunk.size() < (1 << 20)){
+            chunk += to_string(read_id++);
+            for(int64_t j = rand() % 4; j > 0; j--) chunk += " " + to_string(rand() % 1000);
+            chunk += "\n";
+        }
+        chunks.push_back(chunk);
+    }
+
+    cout << "Hardware threads: " << std::thread::hardware_concurrency() << endl;
+    double one_thread_speed = 0;
+    for(int64_t n_threads : {1, 2, 4, 8}){
+        string filename = get_temp_file_manager().create_filename("", ".txt.gz");
+        ParallelBlockWriter writer(filename, true, n_threads << 20);
+        double speed = written_megabytes_per_second(writer, chunks, n_threads);
+        if(n_threads == 1) one_thread_speed = speed;
+        cout << n_threads << " threads: ParallelBlockWriter " << speed << " MB/s, speedup " << speed / one_thread_speed << endl;
+    }
+}
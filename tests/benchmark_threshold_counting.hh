@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include "sbwt/SBWT.hh"
+#include "pseudoalign.hh"
+#include "color_counting.hh"
+#include "coloring/Coloring.hh"
+#include "benchmark_intersection.hh"
+
+// Reads per second through the threshold worker
+template<typename colorset_t>
+double threshold_reads_per_second(const plain_matrix_sbwt_t& SBWT, const Coloring<colorset_t>& coloring, const vector<string>& reads, bool bitmap_counting){
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+    pseudoalignment::WorkerContext<Coloring<colorset_t>> context = {&SBWT, &coloring, true, 0.7, true, false, 1 << 16, &total_length, &total_bytes, &writer, false, 0, false, false, 0, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+    pseudoalignment::ThresholdWorker<Coloring<colorset_t>> worker(context);
+    worker.bitmap_counting = bitmap_counting;
+
+    double seconds = time_seconds([&](){
+        for(int64_t i = 0; i < reads.size(); i++)
+            worker.process_sequence(reads[i].c_str(), reads[i].size(), i);
+    });
+    return reads.size() / seconds;
+}
+
+// Threshold mode with many colors. Reads from the segment shared by all references hit dense
+// bitmap color sets, and reads from the private parts hit small arrays.
+void benchmark_threshold_counting(){
+    srand(3307);
+    int64_t k = 31;
+    int64_t n_refs = 20000;
+    int64_t read_length = 150;
+    int64_t n_reads = 20000;
+
+    string core = get_random_dna_string(2000, 4);
+    vector<string> refs;
+    for(int64_t i = 0; i < n_refs; i++)
+        refs.push_back(get_random_dna_string(200, 4) + core + get_random_dna_string(200, 4));
+
+    vector<string> dense_reads, sparse_reads;
+    for(int64_t i = 0; i < n_reads; i++){
+        dense_reads.push_back(core.substr(rand() % (core.size() - read_length), read_length));
+        const string& ref = refs[rand() % n_refs];
+        sparse_reads.push_back(ref.substr(0, read_length));
+    }
+
+    plain_matrix_sbwt_t SBWT;
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    build_benchmark_index(refs, k, SBWT, coloring);
+
+    cout << "Vector kernel: " << color_counting::kernel_name() << endl;
+    for(auto [name, reads] : vector<pair<string, vector<string>*>>{{"dense", &dense_reads}, {"sparse", &sparse_reads}}){
+        double decoding = threshold_reads_per_second(SBWT, coloring, *reads, false);
+        color_counting::force_scalar_kernel(true);
+        double scalar = threshold_reads_per_second(SBWT, coloring, *reads, true);
+        color_counting::force_scalar_kernel(false);
+        double vectorized = threshold_reads_per_second(SBWT, coloring, *reads, true);
+        cout << name << ": " << decoding << " reads/s decoding colors, "
+             << scalar << " reads/s with the scalar bitmap kernel, "
+             << vectorized << " reads/s with the vector bitmap kernel, speedup " << vectorized / decoding << "x" << endl;
+    }
+}
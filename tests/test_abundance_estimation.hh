@@ -0,0 +1,62 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <gtest/gtest.h>
+#include "globals.hh"
+#include "abundance_estimation.hh"
+
+using namespace abundance;
+
+TEST(ABUNDANCE_ESTIMATION, merge_equivalence_classes){
+    vector<Equivalence_Class_Counter> counters(3);
+    counters[0].add({0,1});
+    counters[0].add({0,1});
+    counters[0].add({2});
+    counters[0].add({});
+    counters[1].add({2});
+    counters[1].add({0,1,2});
+    counters[2].add({0,1});
+    counters[2].add({});
+    ASSERT_EQ(counters[0].classes.size(), 2);
+    ASSERT_EQ(counters[0].n_unassigned, 1);
+
+    for(int64_t n_threads : {1, 2, 5}){
+        vector<Equivalence_Class> classes = merge_equivalence_classes(counters, n_threads);
+        vector<pair<vector<int64_t>, int64_t>> got;
+        for(const Equivalence_Class& ec : classes) got.push_back({ec.colors, ec.count});
+        std::sort(got.begin(), got.end());
+        vector<pair<vector<int64_t>, int64_t>> expected = {{{0,1}, 3}, {{0,1,2}, 1}, {{2}, 2}};
+        ASSERT_EQ(got, expected);
+    }
+}
+
+TEST(ABUNDANCE_ESTIMATION, em){
+    for(int64_t n_threads : {1, 3}){
+        // Unique classes only: the estimates are the counts
+        vector<double> a = estimate_abundances({{{0}, 10}, {{1}, 30}}, 3, n_threads);
+        ASSERT_NEAR(a[0], 10, 1e-3);
+        ASSERT_NEAR(a[1], 30, 1e-3);
+        ASSERT_NEAR(a[2], 0, 1e-3);
+
+        // Shared reads go in proportion to the unique reads
+        a = estimate_abundances({{{0}, 10}, {{1}, 30}, {{0,1}, 40}}, 2, n_threads);
+        ASSERT_NEAR(a[0], 20, 1e-3);
+        ASSERT_NEAR(a[1], 60, 1e-3);
+
+        // A color with no unique evidence loses the shared reads to the color with unique evidence
+        a = estimate_abundances({{{0}, 10}, {{0,1}, 20}}, 2, n_threads, 100000, 1e-12);
+        ASSERT_NEAR(a[0], 30, 0.01);
+        ASSERT_NEAR(a[1], 0, 0.01);
+
+        // Without any unique evidence, the symmetric starting point is kept
+        a = estimate_abundances({{{0,1}, 20}}, 2, n_threads);
+        ASSERT_NEAR(a[0], 10, 1e-3);
+        ASSERT_NEAR(a[1], 10, 1e-3);
+
+        // No reads
+        a = estimate_abundances({}, 2, n_threads);
+        ASSERT_EQ(a, vector<double>(2, 0));
+    }
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <gtest/gtest.h>
+#include "setup_tests.hh"
+#include "globals.hh"
+#include "test_tools.hh"
+#include "sbwt/SBWT.hh"
+#include "pseudoalign.hh"
+#include "coloring/Coloring.hh"
+#include "coloring/Coloring_Builder.hh"
+
+// Counts calls to the global operator new so that tests can check that some code path
+// does not allocate heap memory. The replacement is global for the whole test binary,
+// so this header must be included only once (from test_main.cpp).
+std::atomic<int64_t> n_heap_allocations = 0;
+
+void* operator new(std::size_t size){
+    n_heap_allocations++;
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if(ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept{
+    std::free(ptr);
+}
+
+// Runs the queries through the worker a few times and returns the number of heap allocations
+// done after the first round. The first round lets the scratch buffers grow to their working size.
+template<typename worker_t>
+int64_t count_steady_state_allocations(worker_t& worker, const vector<string>& queries){
+    for(int64_t i = 0; i < (int64_t)queries.size(); i++)
+        worker.process_sequence(queries[i].c_str(), queries[i].size(), i);
+
+    int64_t allocations_before = n_heap_allocations;
+    for(int64_t rep = 0; rep < 3; rep++){
+        for(int64_t i = 0; i < (int64_t)queries.size(); i++)
+            worker.process_sequence(queries[i].c_str(), queries[i].size(), i);
+    }
+    return n_heap_allocations - allocations_before;
+}
+
+template<typename colorset_t>
+void test_steady_state_allocations(){
+    int64_t k = 15;
+    srand(4729);
+
+    vector<string> refs;
+    vector<int64_t> colors;
+    for(int64_t i = 0; i < 20; i++){
+        refs.push_back(get_random_dna_string(1000, 4));
+        colors.push_back(i % 7);
+    }
+
+    // Queries: exact substrings, substrings with a mismatch, reverse complements and random sequences
+    vector<string> queries;
+    for(int64_t i = 0; i < 200; i++){
+        const string& ref = refs[rand() % refs.size()];
+        string Q = ref.substr(rand() % (ref.size() - 150), 150);
+        if(i % 4 == 1) Q[rand() % Q.size()] = 'N';
+        if(i % 4 == 2) Q = sbwt::get_rc(Q);
+        if(i % 4 == 3) Q = get_random_dna_string(150, 4);
+        queries.push_back(Q);
+    }
+
+    string fastafile = get_temp_file_manager().create_filename("refs-",".fna");
+    write_as_fasta(refs, fastafile);
+
+    plain_matrix_sbwt_t SBWT;
+    build_nodeboss_in_memory<plain_matrix_sbwt_t>(refs, SBWT, k, true);
+
+    Coloring<colorset_t> coloring;
+    Coloring_Builder<colorset_t> cb;
+    seq_io::Reader<> reader(fastafile);
+    cb.build_coloring(coloring, SBWT, reader, colors, 2048, 3, 3);
+
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+
+    // With a cache that is large enough to never evict, every color set is in the cache after the first round
+    for(int64_t cache_bytes : {0, 1 << 24}){
+        for(bool rc : {false, true}){
+            for(double threshold : {1.0, 0.7}){
+                pseudoalignment::WorkerContext<Coloring<colorset_t>> context = {&SBWT, &coloring, rc, threshold, true, true, 1 << 16, &total_length, &total_bytes, &writer, true, 0, false, false, cache_bytes, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+                int64_t allocations;
+                if(threshold == 1){
+                    pseudoalignment::IntersectionWorker<Coloring<colorset_t>> worker(context);
+                    allocations = count_steady_state_allocations(worker, queries);
+                } else{
+                    pseudoalignment::ThresholdWorker<Coloring<colorset_t>> worker(context);
+                    allocations = count_steady_state_allocations(worker, queries);
+                }
+                logger << "cache bytes = " << cache_bytes << ", rc = " << rc << ", threshold = " << threshold << ": " << allocations << " allocations" << endl;
+                ASSERT_EQ(allocations, 0);
+            }
+        }
+    }
+}
+
+TEST(TEST_ALLOCATIONS, pseudoalign_steady_state_sdsl){
+    test_steady_state_allocations<SDSL_Variant_Color_Set>();
+}
+
+TEST(TEST_ALLOCATIONS, pseudoalign_steady_state_roaring){
+    test_steady_state_allocations<Roaring_Color_Set>();
+}
+
+// Fills batches like push_work_batches and destroys them like the workers do. After the first
+// batch, the buffers come from the pool and filling a batch does not allocate.
+TEST(TEST_ALLOCATIONS, work_batch_pool_steady_state){
+    auto pool = make_shared<Batch_Pool<pseudoalignment::WorkBatch>>();
+    string read = get_random_dna_string(150, 4);
+    auto fill_and_process_batches = [&](){
+        for(int64_t b = 0; b < 4; b++){
+            pseudoalignment::WorkBatch wb = pseudoalignment::get_pooled_work_batch(pool, 0, false);
+            for(int64_t i = 0; i < 1000; i++){
+                wb.starts->push_back(wb.seqs_concat->size());
+                wb.seq_ids->push_back(i);
+                wb.seqs_concat->insert(wb.seqs_concat->end(), read.begin(), read.end());
+            }
+            std::optional<pseudoalignment::WorkBatch> in_queue = std::move(wb); // Like the work queue
+            pseudoalignment::WorkBatch processed = std::move(*in_queue); // Like the worker
+            ASSERT_EQ(processed.seqs_concat->size(), 150 * 1000);
+        }
+    };
+
+    fill_and_process_batches();
+    int64_t allocations_before = n_heap_allocations;
+    fill_and_process_batches();
+    fill_and_process_batches();
+    ASSERT_EQ(n_heap_allocations - allocations_before, 0);
+    ASSERT_EQ(pool->n_free(), 1); // Every batch was given back before the next one was taken
+}
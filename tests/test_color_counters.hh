@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <gtest/gtest.h>
+#include "globals.hh"
+#include "Color_Counters.hh"
+
+static map<int64_t, int64_t> color_counters_to_map(const Color_Counters& counters){
+    map<int64_t, int64_t> result;
+    counters.for_each_nonzero([&](int64_t color, int64_t count){
+        ASSERT_EQ(result.count(color), 0); // Every color is reported once
+        result[color] = count;
+    });
+    return result;
+}
+
+TEST(COLOR_COUNTERS, random_against_map){
+    srand(1234);
+    int64_t n_colors = 5000;
+    Color_Counters counters(n_colors);
+    for(int64_t round = 0; round < 50; round++){
+        // Some rounds touch few colors and stay in the hash table, others switch to the dense array
+        int64_t n_adds = (round % 3 == 0) ? 20 : (round % 3 == 1) ? 2000 : 200;
+        map<int64_t, int64_t> expected;
+        for(int64_t i = 0; i < n_adds; i++){
+            int64_t color = rand() % n_colors;
+            int64_t value = 1 + rand() % 5;
+            counters.add(color, value);
+            expected[color] += value;
+        }
+        if(round % 5 == 4){
+            // Bitmap in the middle of a bit vector
+            sdsl::bit_vector bits(100 + 300, 0);
+            for(int64_t i = 0; i < 300; i++) bits[100 + i] = rand() % 2;
+            counters.add_bitmap_union(bits, 100, 300, nullptr, 0, 0, 3);
+            for(int64_t i = 0; i < 300; i++) if(bits[100 + i]) expected[i] += 3;
+            ASSERT_TRUE(counters.is_dense());
+        }
+        ASSERT_EQ(color_counters_to_map(counters), expected);
+        counters.clear();
+        ASSERT_FALSE(counters.is_dense());
+        ASSERT_TRUE(color_counters_to_map(counters).empty());
+    }
+}
+
+TEST(COLOR_COUNTERS, memory_scales_with_touched_colors){
+    // Reads that touch few colors must not allocate a counter for every color
+    Color_Counters counters(2000000);
+    for(int64_t color : {5, 1999999, 123456}) counters.add(color, 1);
+    ASSERT_FALSE(counters.is_dense());
+    ASSERT_LT(counters.bytes_allocated(), 10000);
+    ASSERT_EQ(color_counters_to_map(counters), (map<int64_t, int64_t>{{5, 1}, {123456, 1}, {1999999, 1}}));
+}
+
+TEST(COLOR_COUNTERS, dense_array_covers_only_counted_colors){
+    // A bitmap of small colors switches to the dense array, but must not allocate a counter for every color
+    Color_Counters counters(2000000);
+    sdsl::bit_vector bits(200, 0);
+    for(int64_t i = 0; i < 200; i += 3) bits[i] = 1;
+    counters.add_bitmap_union(bits, 0, 200, nullptr, 0, 0, 2);
+    counters.add(150, 1);
+    ASSERT_TRUE(counters.is_dense());
+    ASSERT_LT(counters.bytes_allocated(), 10000);
+
+    map<int64_t, int64_t> expected;
+    for(int64_t i = 0; i < 200; i += 3) expected[i] = 2;
+    expected[150] += 1;
+    ASSERT_EQ(color_counters_to_map(counters), expected);
+
+    // A large color in dense mode grows the array
+    counters.add(1999999, 4);
+    expected[1999999] = 4;
+    ASSERT_EQ(color_counters_to_map(counters), expected);
+    counters.clear();
+    ASSERT_TRUE(color_counters_to_map(counters).empty());
+}
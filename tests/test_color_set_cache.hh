@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <gtest/gtest.h>
+#include "setup_tests.hh"
+#include "globals.hh"
+#include "Color_Set_Cache.hh"
+
+// Deterministic color set for a key, so that cached values can be checked
+vector<int64_t> color_set_for_key(int64_t fw_id, int64_t rc_id){
+    vector<int64_t> colors;
+    int64_t n = (fw_id * 7 + rc_id * 3 + 100) % 50;
+    for(int64_t i = 0; i < n; i++) colors.push_back(fw_id + i * (rc_id + 2));
+    return colors;
+}
+
+TEST(COLOR_SET_CACHE, random_operations){
+    srand(2131);
+    for(int64_t max_bytes : {0, 1000, 10000, 1 << 22}){
+        Color_Set_Cache cache(max_bytes);
+        int64_t n_lookups = 100000;
+        for(int64_t i = 0; i < n_lookups; i++){
+            // Skewed key distribution so that some keys are hot
+            int64_t fw_id = (rand() % 2 == 0) ? rand() % 10 : rand() % 1000;
+            int64_t rc_id = (rand() % 3 == 0) ? -1 : rand() % 5;
+            const vector<int64_t>* cached = cache.get(fw_id, rc_id);
+            if(cached != nullptr){
+                ASSERT_EQ(*cached, color_set_for_key(fw_id, rc_id));
+            } else{
+                cache.put(fw_id, rc_id, color_set_for_key(fw_id, rc_id));
+            }
+            ASSERT_LE(cache.size_in_bytes(), max_bytes);
+        }
+        ASSERT_EQ(cache.n_hits + cache.n_misses, n_lookups);
+        if(max_bytes == 0) ASSERT_EQ(cache.n_hits, 0);
+        if(max_bytes == (1 << 22)) ASSERT_EQ(cache.n_evictions, 0); // Everything fits
+        if(max_bytes == 10000){
+            ASSERT_GT(cache.n_evictions, 0);
+            ASSERT_GT(cache.n_hits, 0);
+        }
+        logger << "Budget " << max_bytes << ": " << cache.n_hits << " hits, " << cache.n_misses << " misses, " << cache.n_evictions << " evictions" << endl;
+    }
+}
@@ -12,6 +12,7 @@
 #include "extract_unitigs.hh"
 #include "DBG.hh"
 #include "coloring/Coloring.hh"
+#include "coloring/Lookup_Walk_Profile.hh"
 #include "coloring/Coloring_Builder.hh"
 #include "coloring/Coloring_builder_from_ggcat.hh"
 
@@ -119,6 +120,218 @@ TEST(COLORING_TESTS, random_testcases){
     }
 }
 
+TEST(COLORING_TESTS, memory_mapped_load){
+    srand(2525);
+    for(ColoringTestCase tcase : generate_testcases()){
+        string fastafilename = get_temp_file_manager().create_filename("ctest",".fna");
+        sbwt::throwing_ofstream fastafile(fastafilename);
+        fastafile << tcase.fasta_data;
+        fastafile.close();
+        plain_matrix_sbwt_t SBWT;
+        build_nodeboss_in_memory<plain_matrix_sbwt_t>(tcase.references, SBWT, tcase.k, true);
+
+        Coloring<> coloring;
+        Coloring_Builder<> cb;
+        seq_io::Reader<> reader(fastafilename);
+        cb.build_coloring(coloring, SBWT, reader, tcase.seq_id_to_color_id, 2048, 3, rand() % 3);
+
+        string colors_file = get_temp_file_manager().create_filename("", ".tcolors");
+        coloring.serialize(colors_file);
+
+        Coloring<> mapped; // From the memory-mapped file
+        mapped.load(colors_file, SBWT);
+        Coloring<> streamed; // Copied from a stream
+        sbwt::throwing_ifstream in(colors_file, ios::binary);
+        streamed.load(in.stream, SBWT);
+
+        // Overwriting the file must not affect the coloring that is mapped from it
+        coloring.serialize(colors_file);
+
+        ASSERT_EQ(mapped.number_of_distinct_color_sets(), coloring.number_of_distinct_color_sets());
+        ASSERT_EQ(mapped.largest_color(), coloring.largest_color());
+        ASSERT_EQ(mapped.sum_of_all_distinct_color_set_lengths(), coloring.sum_of_all_distinct_color_set_lengths());
+        for(int64_t v = 0; v < SBWT.number_of_subsets(); v++){
+            if(!coloring.is_core_kmer(v)) continue;
+            ASSERT_TRUE(mapped.is_core_kmer(v));
+            ASSERT_EQ(mapped.get_color_set_id(v), coloring.get_color_set_id(v));
+            ASSERT_EQ(mapped.get_color_set_of_node_as_vector(v), coloring.get_color_set_of_node_as_vector(v));
+            ASSERT_EQ(streamed.get_color_set_of_node_as_vector(v), coloring.get_color_set_of_node_as_vector(v));
+        }
+    }
+}
+
+TEST(COLORING_TESTS, batched_color_set_id_lookup){
+    srand(2121);
+    for(ColoringTestCase tcase : generate_testcases()){
+        string fastafilename = get_temp_file_manager().create_filename("ctest",".fna");
+        sbwt::throwing_ofstream fastafile(fastafilename);
+        fastafile << tcase.fasta_data;
+        fastafile.close();
+        plain_matrix_sbwt_t SBWT;
+        build_nodeboss_in_memory<plain_matrix_sbwt_t>(tcase.references, SBWT, tcase.k, true);
+
+        Coloring<> coloring;
+        Coloring_Builder<> cb;
+        seq_io::Reader<> reader(fastafilename);
+        cb.build_coloring(coloring, SBWT, reader, tcase.seq_id_to_color_id, 2048, 3, rand() % 3);
+
+        // The nodes of the k-mers in random order with repeats, so that walks of different lengths are mixed
+        vector<int64_t> nodes;
+        for(int64_t i = 0; i < 3 * tcase.colex_kmers.size(); i++)
+            nodes.push_back(SBWT.search(tcase.colex_kmers[rand() % tcase.colex_kmers.size()]));
+
+        vector<int64_t> expected;
+        for(int64_t v : nodes) expected.push_back(coloring.get_color_set_id(v));
+        for(int64_t batch_size : {1, 5, 16, 100}){
+            vector<int64_t> ids(nodes.size(), -3);
+            for(int64_t i = 0; i < nodes.size(); i += batch_size)
+                coloring.get_color_set_ids(nodes.data() + i, min(batch_size, (int64_t)nodes.size() - i), ids.data() + i);
+            ASSERT_EQ(ids, expected);
+        }
+    }
+}
+
+TEST(COLORING_TESTS, color_set_pointer_layouts){
+    srand(2222);
+    for(ColoringTestCase tcase : generate_testcases()){
+        string fastafilename = get_temp_file_manager().create_filename("ctest",".fna");
+        sbwt::throwing_ofstream fastafile(fastafilename);
+        fastafile << tcase.fasta_data;
+        fastafile.close();
+        plain_matrix_sbwt_t SBWT;
+        build_nodeboss_in_memory<plain_matrix_sbwt_t>(tcase.references, SBWT, tcase.k, true);
+
+        Coloring<> coloring;
+        Coloring_Builder<> cb;
+        seq_io::Reader<> reader(fastafilename);
+        cb.build_coloring(coloring, SBWT, reader, tcase.seq_id_to_color_id, 2048, 3, rand() % 3);
+
+        for(Sparse_Uint_Array_Layout layout : {Sparse_Uint_Array_Layout::interleaved, Sparse_Uint_Array_Layout::elias_fano}){
+            Coloring<> converted = coloring;
+            converted.set_node_id_to_colorset_id_layout(layout);
+            string colors_file = get_temp_file_manager().create_filename("", ".tcolors");
+            converted.serialize(colors_file);
+
+            Coloring<> mapped; // From the memory-mapped file
+            mapped.load(colors_file, SBWT);
+            Coloring<> streamed; // Copied from a stream
+            sbwt::throwing_ifstream in(colors_file, ios::binary);
+            streamed.load(in.stream, SBWT);
+            ASSERT_EQ(mapped.get_node_id_to_colorset_id_structure().get_layout(), layout);
+            ASSERT_EQ(streamed.get_node_id_to_colorset_id_structure().get_layout(), layout);
+
+            vector<int64_t> nodes;
+            for(const string& kmer : tcase.colex_kmers) nodes.push_back(SBWT.search(kmer));
+            vector<int64_t> expected(nodes.size()), batched(nodes.size());
+            coloring.get_color_set_ids(nodes.data(), nodes.size(), expected.data());
+            mapped.get_color_set_ids(nodes.data(), nodes.size(), batched.data());
+            ASSERT_EQ(batched, expected);
+            for(int64_t v = 0; v < SBWT.number_of_subsets(); v++){
+                ASSERT_EQ(mapped.is_core_kmer(v), coloring.is_core_kmer(v));
+                if(!coloring.is_core_kmer(v)) continue;
+                ASSERT_EQ(mapped.get_color_set_id(v), coloring.get_color_set_id(v));
+                ASSERT_EQ(streamed.get_color_set_of_node_as_vector(v), coloring.get_color_set_of_node_as_vector(v));
+            }
+        }
+    }
+}
+
+TEST(COLORING_TESTS, frequency_ordered_color_sets){
+    srand(2424);
+    for(ColoringTestCase tcase : generate_testcases()){
+        string fastafilename = get_temp_file_manager().create_filename("ctest",".fna");
+        sbwt::throwing_ofstream fastafile(fastafilename);
+        fastafile << tcase.fasta_data;
+        fastafile.close();
+        plain_matrix_sbwt_t SBWT;
+        build_nodeboss_in_memory<plain_matrix_sbwt_t>(tcase.references, SBWT, tcase.k, true);
+
+        Coloring<> coloring;
+        Coloring_Builder<> cb;
+        seq_io::Reader<> reader(fastafilename);
+        cb.build_coloring(coloring, SBWT, reader, tcase.seq_id_to_color_id, 2048, 3, rand() % 3);
+
+        for(Sparse_Uint_Array_Layout layout : {Sparse_Uint_Array_Layout::separate, Sparse_Uint_Array_Layout::elias_fano}){
+            Coloring<> ordered = coloring;
+            ordered.set_node_id_to_colorset_id_layout(layout);
+            ordered.order_color_sets_by_frequency();
+            ASSERT_EQ(ordered.get_node_id_to_colorset_id_structure().get_layout(), layout);
+            ASSERT_EQ(ordered.number_of_distinct_color_sets(), coloring.number_of_distinct_color_sets());
+
+            // The number of pointers to each id is non-increasing
+            const Sparse_Uint_Array& pointers = ordered.get_node_id_to_colorset_id_structure();
+            vector<int64_t> n_pointers(ordered.number_of_distinct_color_sets(), 0);
+            for(int64_t v = 0; v < pointers.size(); v++) if(pointers.has_index(v)) n_pointers[pointers.get(v)]++;
+            for(int64_t i = 1; i < n_pointers.size(); i++) ASSERT_GE(n_pointers[i-1], n_pointers[i]);
+
+            for(int64_t v = 0; v < SBWT.number_of_subsets(); v++){
+                ASSERT_EQ(ordered.is_core_kmer(v), coloring.is_core_kmer(v));
+                if(!coloring.is_core_kmer(v)) continue;
+                ASSERT_EQ(ordered.get_color_set_of_node_as_vector(v), coloring.get_color_set_of_node_as_vector(v));
+            }
+        }
+    }
+}
+
+TEST(COLORING_TESTS, hot_pointers){
+    srand(2525);
+    for(ColoringTestCase tcase : generate_testcases()){
+        string fastafilename = get_temp_file_manager().create_filename("ctest",".fna");
+        sbwt::throwing_ofstream fastafile(fastafilename);
+        fastafile << tcase.fasta_data;
+        fastafile.close();
+        plain_matrix_sbwt_t SBWT;
+        build_nodeboss_in_memory<plain_matrix_sbwt_t>(tcase.references, SBWT, tcase.k, true);
+
+        Coloring<> coloring;
+        Coloring_Builder<> cb;
+        seq_io::Reader<> reader(fastafilename);
+        cb.build_coloring(coloring, SBWT, reader, tcase.seq_id_to_color_id, 2048, 3, 5); // Sparse pointers so that there are walks
+
+        // Queries are random substrings of the references
+        vector<vector<int64_t>> queries;
+        for(int64_t i = 0; i < 3 * tcase.references.size(); i++){
+            const string& ref = tcase.references[rand() % tcase.references.size()];
+            if(ref.size() < tcase.k) continue;
+            int64_t start = rand() % (ref.size() - tcase.k + 1);
+            int64_t len = tcase.k + rand() % (ref.size() - start - tcase.k + 1);
+            queries.push_back(SBWT.streaming_search(ref.substr(start, len)));
+        }
+
+        // Only the k-mers that pseudoalign looks up are recorded: the core k-mers and the last k-mer of a run
+        Lookup_Walk_Profile<Coloring<>> profile(coloring);
+        Lookup_Walk_Profile<Coloring<>> expected_profile(coloring);
+        for(const vector<int64_t>& ranks : queries){
+            profile.add_query_lookups(ranks);
+            for(int64_t i = 0; i < ranks.size(); i++)
+                if(i + 1 == ranks.size() || ranks[i+1] == -1 || coloring.is_core_kmer(ranks[i])) expected_profile.add_lookup(ranks[i]);
+        }
+        ASSERT_EQ(profile.number_of_lookups(), expected_profile.number_of_lookups());
+        ASSERT_EQ(profile.number_of_steps(), expected_profile.number_of_steps());
+
+        int64_t steps_before = profile.number_of_steps();
+        int64_t max_nodes = 1 + rand() % 10;
+        auto [nodes, saved_steps] = profile.choose_nodes(max_nodes);
+        ASSERT_LE(nodes.size(), max_nodes);
+        if(steps_before > 0) ASSERT_GT(saved_steps, 0); // Any walk can be cut short
+
+        Coloring<> updated = coloring;
+        updated.add_node_id_to_color_set_id_pointers(nodes);
+        ASSERT_EQ(updated.get_node_id_to_colorset_id_structure().number_of_values(),
+                  coloring.get_node_id_to_colorset_id_structure().number_of_values() + nodes.size());
+
+        Lookup_Walk_Profile<Coloring<>> profile_after(updated);
+        for(const vector<int64_t>& ranks : queries) profile_after.add_query_lookups(ranks);
+        ASSERT_EQ(profile_after.number_of_steps(), steps_before - saved_steps);
+        if(nodes.size() > 0) ASSERT_LT(profile_after.number_of_steps(), steps_before);
+
+        for(const string& kmer : tcase.colex_kmers){
+            int64_t v = SBWT.search(kmer);
+            ASSERT_EQ(updated.get_color_set_of_node_as_vector(v), coloring.get_color_set_of_node_as_vector(v));
+        }
+    }
+}
+
 bool is_valid_kmer(const char* S, int64_t k){
     for(int64_t i = 0; i < k; i++){
         char c = S[i];
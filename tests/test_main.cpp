@@ -24,6 +24,13 @@
 #include "test_coloring.hh"
 #include "test_color_set.hh"
 #include "test_color_set_storage.hh"
+#include "test_color_set_cache.hh"
+#include "test_read_deduplicator.hh"
+#include "test_color_counters.hh"
+#include "test_parallel_gzip.hh"
+#include "test_abundance_estimation.hh"
+#include "test_serve.hh"
+#include "test_allocations.hh"
 
 int main(int argc, char **argv) {
     try{
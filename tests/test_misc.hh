@@ -17,6 +17,7 @@
 #include "setup_tests.hh"
 #include "test_tools.hh"
 #include "commands.hh"
+#include "numa.hh"
 #include <cassert>
 
 using namespace sbwt;
@@ -122,3 +123,20 @@ TEST(MISC_TEST, string_to_integer_safe){
 
     ASSERT_EQ(string_to_integer_safe("  \n\t  \r 1234567890\n  \r\n"), 1234567890);
 }
+
+TEST(MISC_TEST, numa_worker_placement){
+    ASSERT_EQ(numa::parse_cpu_list("0-3,8,10-11\n"), vector<int>({0,1,2,3,8,10,11}));
+    ASSERT_EQ(numa::parse_cpu_list(""), vector<int>());
+
+    // Two nodes with four and two CPUs
+    vector<vector<int>> nodes = {{0,1,2,3}, {4,5}};
+    numa::Worker_Placement P = numa::place_workers(nodes, 7);
+    ASSERT_EQ(P.n_nodes, 2);
+    ASSERT_EQ(P.worker_node, vector<int64_t>({0,1,0,1,0,1,0}));
+    ASSERT_EQ(P.worker_cpu, vector<int>({0,4,1,5,2,4,3})); // The second node runs out of CPUs
+
+    // The real topology must have at least one node with at least one CPU
+    vector<vector<int>> real_nodes = numa::node_cpus();
+    ASSERT_GE(real_nodes.size(), 1);
+    for(const vector<int>& cpus : real_nodes) ASSERT_GE(cpus.size(), 1);
+}
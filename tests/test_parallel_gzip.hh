@@ -0,0 +1,93 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <gtest/gtest.h>
+#include "globals.hh"
+#include "parallel_gzip.hh"
+#include "test_tools.hh"
+#include "sbwt/globals.hh"
+
+static string write_temp_gz(const string& bytes){
+    string filename = sbwt::get_temp_file_manager().create_filename("", ".fq.gz");
+    ofstream out(filename, ios::binary);
+    out.write(bytes.data(), bytes.size());
+    return filename;
+}
+
+static string read_all_decompressed(Parallel_Gzip_ifstream& in){
+    string result;
+    vector<char> buf(10007); // Not a divisor of any of the sizes
+    while(true){
+        in.read(buf.data(), buf.size());
+        if(in.gcount() == 0) break;
+        result.append(buf.data(), in.gcount());
+    }
+    return result;
+}
+
+static string random_fastq(int64_t n_reads){
+    string fastq;
+    for(int64_t i = 0; i < n_reads; i++)
+        fastq += "@read" + to_string(i) + "\n" + get_random_dna_string(100, 4) + "\n+\n" + string(100, 'I') + "\n";
+    return fastq;
+}
+
+TEST(PARALLEL_GZIP, same_output_as_sequential){
+    srand(4242);
+    string fastq = random_fastq(20000); // About 4 MB
+    int64_t chunk_bytes = 1 << 16; // Small chunks to get many of them
+
+    struct Case{ string name; string gz; bool parallel_expected; };
+    vector<Case> cases = {
+        {"single member", gzip_member(fastq, false), false},
+        {"many members", gzip_members(fastq, 200000, false), true},
+        {"bgzf", gzip_members(fastq, 65280, true) + gzip_member("", true), true}, // BGZF ends with an empty block
+        {"members of one byte", gzip_members(fastq.substr(0, 50000), 1, false), true},
+    };
+
+    for(const Case& c : cases){
+        string filename = write_temp_gz(c.gz);
+        for(int64_t n_threads : {1, 2, 4}){
+            Parallel_Gzip_ifstream in(filename, n_threads, chunk_bytes);
+            ASSERT_TRUE(in.good());
+            string decompressed = read_all_decompressed(in);
+            string expected = c.name == "members of one byte" ? fastq.substr(0, 50000) : fastq;
+            ASSERT_EQ(decompressed, expected) << c.name << ", " << n_threads << " threads";
+            if(n_threads == 1 || !c.parallel_expected){
+                ASSERT_EQ(in.n_chunks_from_helpers(), 0) << c.name;
+            } else{
+                ASSERT_GT(in.n_chunks_from_helpers(), 0) << c.name;
+            }
+        }
+    }
+}
+
+TEST(PARALLEL_GZIP, uncompressed_and_empty_input){
+    string text = "@read\nACGT\n+\nIIII\n";
+    for(string bytes : {text, string("")}){
+        string filename = write_temp_gz(bytes);
+        for(int64_t n_threads : {1, 4}){
+            Parallel_Gzip_ifstream in(filename, n_threads);
+            ASSERT_EQ(read_all_decompressed(in), bytes);
+        }
+    }
+}
+
+TEST(PARALLEL_GZIP, corrupt_input_throws){
+    srand(4243);
+    string gz = gzip_members(random_fastq(5000), 50000, false);
+    gz[gz.size() / 2] ^= 0x55; // Flip bits in the middle of some member
+    string filename = write_temp_gz(gz);
+    for(int64_t n_threads : {1, 4}){
+        Parallel_Gzip_ifstream in(filename, n_threads, 1 << 16);
+        ASSERT_THROW(read_all_decompressed(in), std::runtime_error);
+    }
+
+    string truncated_filename = write_temp_gz(gzip_member(random_fastq(100), false).substr(0, 1000));
+    for(int64_t n_threads : {1, 4}){
+        Parallel_Gzip_ifstream in(truncated_filename, n_threads);
+        ASSERT_THROW(read_all_decompressed(in), std::runtime_error);
+    }
+}
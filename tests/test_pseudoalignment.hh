@@ -3,10 +3,12 @@
 #include <iostream>
 #include <vector>
 #include <unordered_map>
+#include <tuple>
 #include "globals.hh"
 #include "sbwt/globals.hh"
 #include "sbwt/throwing_streams.hh"
 #include "pseudoalign.hh"
+#include "coloring/Coloring_Builder.hh"
 #include "zstr.hpp"
 #include "test_tools.hh"
 #include "setup_tests.hh"
@@ -124,6 +126,32 @@ vector<int64_t> pseudoalign_to_colors_trivial(string& query, TestCase& tcase, bo
     return ans;
 }
 
+// Thresholded pseudoalignment looking only at the k-mers at positions 0, stride, 2*stride, ... of the query.
+// Returns the colors found in at least the threshold fraction of those k-mers, where k-mers without colors
+// are counted only if include_unknown is true.
+vector<int64_t> pseudoalign_sampled_kmers_trivial(string& query, TestCase& tcase, bool reverse_complements, int64_t stride, double threshold, bool include_unknown){
+    vector<int64_t> counts(tcase.n_colors);
+    int64_t n_sampled = 0, n_with_colors = 0;
+    for(int64_t i = 0; i + tcase.k <= query.size(); i += stride){
+        string kmer = query.substr(i, tcase.k);
+        set<int64_t> colorset = tcase.node_to_color_ids[kmer];
+        if(reverse_complements){
+            set<int64_t> colorset_rc = tcase.node_to_color_ids[sbwt::get_rc(kmer)];
+            for(int64_t color : colorset_rc) colorset.insert(color);
+        }
+        for(int64_t color : colorset) counts[color]++;
+        n_sampled++;
+        n_with_colors += colorset.size() > 0;
+    }
+
+    int64_t effective_kmers = include_unknown ? n_sampled : n_with_colors;
+    vector<int64_t> ans;
+    for(int64_t color = 0; color < tcase.n_colors; color++){
+        if(counts[color] > 0 && counts[color] >= effective_kmers * threshold) ans.push_back(color);
+    }
+    return ans;
+}
+
 TEST(TEST_PSEUDOALIGN, coli3_parallelism){
     std::string seqfile = "testcases/coli3.fna";
     std::string colorfile = "testcases/colors.txt";
@@ -344,3 +372,557 @@ TEST(TEST_PSEUDOALIGN, thresholded){
 
     //void pseudoalign_thresholded(const plain_matrix_sbwt_t& SBWT, const coloring_t& coloring, int64_t n_threads, sequence_reader_t& reader, std::string outfile, bool reverse_complements, int64_t buffer_size, bool gzipped, bool sorted_output)
 }
+
+vector<string> read_all_lines(const string& filename){
+    vector<string> lines;
+    sbwt::throwing_ifstream in(filename);
+    string line;
+    while(in.getline(line)) lines.push_back(line);
+    return lines;
+}
+
+// Writes the genomes and the color file of the test case to disk and builds an index from them.
+// Returns the prefix of the index files.
+string build_test_index(const TestCase& tcase, const string& extra_build_args = "--forward-strand-only"){
+    string genomes_outfilename = get_temp_file_manager().create_filename("genomes-",".fna");
+    string colorfile_outfilename = get_temp_file_manager().create_filename("colorfile-",".txt");
+    string index_prefix = get_temp_file_manager().create_filename("index-");
+    write_as_fasta(tcase.genomes, genomes_outfilename);
+
+    sbwt::throwing_ofstream colors_out(colorfile_outfilename);
+    for(int64_t i = 0; i < tcase.seq_to_color_id.size(); i++){
+        colors_out << tcase.seq_to_color_id[i] << "\n";
+    }
+    colors_out.close();
+
+    Argv build_argv(split("build -k " + to_string(tcase.k) + " -i " + genomes_outfilename + " -c " + colorfile_outfilename + " -o " + index_prefix + " --temp-dir " + get_temp_file_manager().get_dir() + " " + extra_build_args));
+    if(build_index_main(build_argv.size, build_argv.array) != 0)
+        throw std::runtime_error("Building the test index failed");
+    return index_prefix;
+}
+
+TEST(TEST_PSEUDOALIGN, paired_end){
+    int64_t ref_length = 100;
+    int64_t n_refs = 30;
+    int64_t n_queries = 2000; // Consecutive queries are used as read pairs
+    int64_t query_length = 20;
+    int64_t n_colors = 5;
+    for(TestCase tcase : generate_testcases(ref_length, n_refs, n_queries, query_length, 4, 10, n_colors)){
+        vector<string> mates1, mates2;
+        for(int64_t i = 0; i + 1 < tcase.queries.size(); i += 2){
+            mates1.push_back(tcase.queries[i]);
+            mates2.push_back(tcase.queries[i+1]);
+        }
+
+        string mates1_outfilename = get_temp_file_manager().create_filename("mates1-",".fna");
+        string mates2_outfilename = get_temp_file_manager().create_filename("mates2-",".fna");
+        write_as_fasta(mates1, mates1_outfilename);
+        write_as_fasta(mates2, mates2_outfilename);
+        string index_prefix = build_test_index(tcase, "--n-threads 2 --mem-megas 2048 --colorset-pointer-tradeoff 3 --forward-strand-only");
+
+        for(string extra_options : {"--threshold 1", "--rc --threshold 1", "--rc --threshold 0.999999"}){
+            string outfile = get_temp_file_manager().create_filename("paired-out-");
+            stringstream pseudoalign_argstring;
+            pseudoalign_argstring << "pseudoalign --paired -q " << mates1_outfilename << " --query-file-2 " << mates2_outfilename << " -i " << index_prefix << " -o " << outfile << " --n-threads " << 3 << " --temp-dir " << get_temp_file_manager().get_dir() << " --buffer-size-megas 0.0001 --sort-output --sort-hits " << extra_options; // Small buffer to expose race conditions
+            Argv pseudoalign_argv(split(pseudoalign_argstring.str()));
+            ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+
+            vector<vector<int64_t> > results = parse_pseudoalignment_output_format_from_disk(outfile);
+            ASSERT_EQ(results.size(), mates1.size());
+
+            bool rc = extra_options.find("--rc") != string::npos;
+            for(int64_t i = 0; i < mates1.size(); i++){
+                // The k-mers spanning the separator character are not in the index, so this
+                // takes into account exactly the k-mers of the two mates.
+                string fragment = mates1[i] + "N" + mates2[i];
+                vector<int64_t> brute = pseudoalign_to_colors_trivial(fragment, tcase, rc);
+                ASSERT_EQ(brute, results[i]);
+            }
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, binary_output){
+    int64_t ref_length = 100;
+    int64_t n_refs = 30;
+    int64_t n_queries = 1000;
+    int64_t query_length = 20;
+    int64_t n_colors = 5;
+    for(TestCase tcase : generate_testcases(ref_length, n_refs, n_queries, query_length, 4, 6, n_colors)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase, "--n-threads 2 --mem-megas 2048");
+
+        for(string extra_options : {"--threshold 1", "--threshold 0.7 --report-relevant-kmer-count"}){
+            string common_options = " -q " + queries_outfilename + " -i " + index_prefix + " --n-threads 3 --temp-dir " + get_temp_file_manager().get_dir() + " --buffer-size-megas 0.0001 " + extra_options; // Small buffer to get many blocks
+
+            string text_outfile = get_temp_file_manager().create_filename("text-out-");
+            Argv text_argv(split("pseudoalign -o " + text_outfile + " --sort-output --sort-hits" + common_options));
+            ASSERT_EQ(pseudoalign_main(text_argv.size, text_argv.array),0);
+            vector<string> text_lines = read_all_lines(text_outfile);
+            ASSERT_EQ(text_lines.size(), tcase.queries.size());
+
+            for(bool gzip : {false, true}){
+                string binary_outfile = get_temp_file_manager().create_filename("binary-out-");
+                Argv binary_argv(split("pseudoalign -o " + binary_outfile + " --binary-output" + (gzip ? " --gzip-output" : "") + common_options));
+                ASSERT_EQ(pseudoalign_main(binary_argv.size, binary_argv.array),0);
+                if(gzip) binary_outfile += ".gz";
+
+                // Decode with the reader API and print in the text format
+                binary_format::Binary_Pseudoalignment_Reader reader(binary_outfile);
+                ASSERT_EQ(reader.has_relevant_kmer_counts(), extra_options.find("--report-relevant-kmer-count") != string::npos);
+                vector<string> decoded_lines(tcase.queries.size());
+                int64_t read_id, n_relevant_kmers;
+                vector<int64_t> hits;
+                int64_t n_records = 0;
+                while(reader.next(read_id, hits, n_relevant_kmers)){
+                    ASSERT_TRUE(read_id >= 0 && read_id < tcase.queries.size());
+                    ASSERT_TRUE(std::is_sorted(hits.begin(), hits.end()));
+                    string line = to_string(read_id);
+                    for(int64_t x : hits) line += " " + to_string(x);
+                    if(reader.has_relevant_kmer_counts()) line += "; " + to_string(n_relevant_kmers);
+                    decoded_lines[read_id] = line;
+                    n_records++;
+                }
+                ASSERT_EQ(n_records, tcase.queries.size());
+                ASSERT_EQ(decoded_lines, text_lines);
+
+                // Decode with the decode-output command. The lines are in arbitrary order.
+                string decoded_outfile = get_temp_file_manager().create_filename("decoded-out-");
+                Argv decode_argv(split("decode-output -i " + binary_outfile + " -o " + decoded_outfile));
+                ASSERT_EQ(decode_output_main(decode_argv.size, decode_argv.array),0);
+                vector<string> command_lines = read_all_lines(decoded_outfile);
+                vector<string> sorted_text_lines = text_lines;
+                std::sort(command_lines.begin(), command_lines.end());
+                std::sort(sorted_text_lines.begin(), sorted_text_lines.end());
+                ASSERT_EQ(command_lines, sorted_text_lines);
+            }
+
+            // With --sort-output, the records are in order of read id
+            string sorted_binary_outfile = get_temp_file_manager().create_filename("sorted-binary-out-");
+            Argv sorted_binary_argv(split("pseudoalign -o " + sorted_binary_outfile + " --binary-output --sort-output" + common_options));
+            ASSERT_EQ(pseudoalign_main(sorted_binary_argv.size, sorted_binary_argv.array),0);
+            binary_format::Binary_Pseudoalignment_Reader reader(sorted_binary_outfile);
+            int64_t read_id, n_relevant_kmers;
+            vector<int64_t> hits;
+            int64_t expected_read_id = 0;
+            while(reader.next(read_id, hits, n_relevant_kmers)){
+                ASSERT_EQ(read_id, expected_read_id);
+                expected_read_id++;
+            }
+            ASSERT_EQ(expected_read_id, tcase.queries.size());
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, binary_output_corrupt_block_size){
+    // A block header with a huge size or number of records must fail as corrupt without allocating the size
+    for(auto [n_bytes, n_records] : vector<pair<uint64_t, uint64_t>>{{(uint64_t)1 << 60, 1}, {4, (uint64_t)1 << 40}}){
+        string filename = get_temp_file_manager().create_filename("corrupt-binary-");
+        {
+            ofstream out(filename, ios::binary);
+            string header = binary_format::file_header(false);
+            char block_header[binary_format::BLOCK_HEADER_BYTES];
+            binary_format::write_uint64_le(n_bytes, block_header);
+            binary_format::write_uint64_le(n_records, block_header + 8);
+            out.write(header.data(), header.size());
+            out.write(block_header, binary_format::BLOCK_HEADER_BYTES);
+            out.write("\x00\x01\x02\x00", 4); // One record with one hit, then the file ends
+        }
+        binary_format::Binary_Pseudoalignment_Reader reader(filename);
+        int64_t read_id, n_relevant_kmers;
+        vector<int64_t> hits;
+        try{
+            reader.next(read_id, hits, n_relevant_kmers);
+            FAIL() << "No error from a corrupt block size";
+        } catch(const std::runtime_error& e){
+            ASSERT_NE(string(e.what()).find("Corrupt binary pseudoalignment output"), string::npos);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, color_set_cache){
+    // The results must not depend on the cache, also when the cache is so small that it evicts all the time
+    for(TestCase tcase : generate_testcases(100, 30, 1000, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        for(string extra_options : {"--threshold 1 --rc", "--threshold 0.7 --rc", "--threshold 0.7"}){
+            vector<vector<vector<int64_t>>> results;
+            for(string cache_megas : {"0", "0.001", "100"}){
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --n-threads 2 --temp-dir " + get_temp_file_manager().get_dir() + " --sort-hits --color-set-cache-megas " + cache_megas + " " + extra_options));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+                results.push_back(parse_pseudoalignment_output_format_from_disk(outfile));
+            }
+            ASSERT_EQ(results[0], results[1]);
+            ASSERT_EQ(results[0], results[2]);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, dedup_reads){
+    for(TestCase tcase : generate_testcases(100, 30, 300, 30, 4, 6, 5)){
+        // Add exact copies and reverse complements of the queries
+        vector<string> queries;
+        for(int64_t i = 0; i < tcase.queries.size(); i++){
+            queries.push_back(tcase.queries[i]);
+            if(i % 3 == 0) queries.push_back(tcase.queries[i]);
+            if(i % 4 == 0) queries.push_back(sbwt::get_rc(tcase.queries[i]));
+            if(i % 5 == 0) queries.push_back(tcase.queries[i / 2]);
+        }
+
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        // The last ones check that the unsorted hits of reverse complement copies are printed in their own order
+        for(string extra_options : {"--threshold 1 --sort-hits", "--threshold 1 --rc --sort-hits", "--threshold 0.7 --rc --sort-hits", "--threshold 0.7 --report-relevant-kmer-count --sort-hits", "--threshold 1 --rc --relevant-kmers-fraction 0.5 --sort-hits", "--threshold 0.7 --rc --kmer-stride 3 --sort-hits", "--threshold 0.5 --rc --max-kmers-per-read 4 --sort-hits", "--threshold 0.5 --rc", "--threshold 1 --rc"}){
+            vector<vector<string>> outputs;
+            for(string dedup : {"", "--dedup-reads"}){
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --n-threads 2 --buffer-size-megas 0.001 --sort-output --temp-dir " + get_temp_file_manager().get_dir() + " " + dedup + " " + extra_options));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+                outputs.push_back(read_all_lines(outfile));
+            }
+            ASSERT_EQ(outputs[0], outputs[1]);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, relevant_kmer_counts_with_early_exit){
+    // The intersection worker stops intersecting when the intersection becomes empty, but it must still
+    // report the same numbers of k-mers with colors as the threshold worker, which looks at every k-mer
+    for(TestCase tcase : generate_testcases(100, 30, 1000, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        for(string rc : {"", "--rc"}){
+            vector<vector<string>> outputs;
+            for(string threshold : {"1", "0.999999"}){
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --sort-output --sort-hits --report-relevant-kmer-count --temp-dir " + get_temp_file_manager().get_dir() + " --threshold " + threshold + " " + rc));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+                outputs.push_back(read_all_lines(outfile));
+            }
+            ASSERT_EQ(outputs[0], outputs[1]);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, kmer_stride){
+    // With stride 1 and a per-read limit that is never reached, the approximate mode looks up every k-mer
+    // and must give exactly the same results as the exact mode. With longer strides the results must be
+    // those of the sampled k-mers. Strides shorter than k stream through the query, and longer strides
+    // search each sampled k-mer separately.
+    for(TestCase tcase : generate_testcases(100, 30, 300, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        // Options, threshold, reverse complements, include unknown k-mers
+        for(auto [extra_options, threshold, rc, include_unknown] : vector<tuple<string, double, bool, bool>>{
+                {"--threshold 0.7", 0.7, false, false},
+                {"--threshold 0.7 --rc", 0.7, true, false},
+                {"--threshold 1 --rc", 1, true, false},
+                {"--threshold 0.5 --rc --include-unknown-kmers", 0.5, true, true}}){
+            vector<vector<string>> outputs;
+            for(string sampling : {"", "--kmer-stride 1 --max-kmers-per-read 1000000"}){
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --sort-output --sort-hits --report-relevant-kmer-count --temp-dir " + get_temp_file_manager().get_dir() + " " + sampling + " " + extra_options));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+                outputs.push_back(read_all_lines(outfile));
+            }
+            ASSERT_EQ(outputs[0], outputs[1]);
+
+            for(auto [kmer_stride, max_kmers_per_read] : vector<pair<int64_t, int64_t>>{{3, 0}, {50, 0}, {1, 4}, {2, 1}}){
+                string sampling = "--kmer-stride " + to_string(kmer_stride) + " --max-kmers-per-read " + to_string(max_kmers_per_read);
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --sort-output --sort-hits --temp-dir " + get_temp_file_manager().get_dir() + " " + sampling + " " + extra_options));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+
+                vector<vector<int64_t>> results = parse_pseudoalignment_output_format_from_disk(outfile);
+                ASSERT_EQ(results.size(), tcase.queries.size());
+                for(int64_t i = 0; i < tcase.queries.size(); i++){
+                    int64_t n_kmers = tcase.queries[i].size() - tcase.k + 1;
+                    int64_t stride = kmer_stride;
+                    if(max_kmers_per_read > 0) stride = max(stride, (n_kmers + max_kmers_per_read - 1) / max_kmers_per_read);
+                    ASSERT_EQ(results[i], pseudoalign_sampled_kmers_trivial(tcase.queries[i], tcase, rc, stride, threshold, include_unknown)) << sampling << " " << extra_options;
+                }
+            }
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, abundance_estimation){
+    for(TestCase tcase : generate_testcases(100, 30, 300, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        for(string extra_options : {"--threshold 1 --rc", "--threshold 0.7 --n-threads 3"}){
+            // With and without per-read output
+            string outfile = get_temp_file_manager().create_filename("out-");
+            string abundance_outfile1 = get_temp_file_manager().create_filename("abundances-");
+            string abundance_outfile2 = get_temp_file_manager().create_filename("abundances-");
+            Argv argv1(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --abundance-out " + abundance_outfile1 + " --temp-dir " + get_temp_file_manager().get_dir() + " " + extra_options));
+            ASSERT_EQ(pseudoalign_main(argv1.size, argv1.array),0);
+            Argv argv2(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " --abundance-out " + abundance_outfile2 + " --temp-dir " + get_temp_file_manager().get_dir() + " " + extra_options));
+            ASSERT_EQ(pseudoalign_main(argv2.size, argv2.array),0);
+
+            vector<string> abundance_lines = read_all_lines(abundance_outfile1);
+            ASSERT_EQ(abundance_lines, read_all_lines(abundance_outfile2));
+
+            // Reads with hits and the colors that appear in some hit set
+            int64_t n_reads_with_hits = 0;
+            set<int64_t> colors_with_hits;
+            for(const vector<int64_t>& hits : parse_pseudoalignment_output_format_from_disk(outfile)){
+                if(hits.size() > 0) n_reads_with_hits++;
+                for(int64_t c : hits) colors_with_hits.insert(c);
+            }
+
+            ASSERT_EQ(abundance_lines[0], "color\treads\trelative_abundance");
+            double total = 0;
+            for(int64_t i = 1; i < abundance_lines.size(); i++){
+                vector<string> tokens = split(abundance_lines[i], '\t');
+                ASSERT_EQ(tokens.size(), 3);
+                int64_t color = stoll(tokens[0]);
+                double reads = stod(tokens[1]);
+                ASSERT_EQ(color, i-1);
+                if(!colors_with_hits.count(color)) ASSERT_EQ(reads, 0);
+                total += reads;
+            }
+            ASSERT_NEAR(total, n_reads_with_hits, 0.01 * abundance_lines.size());
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, concurrent_files){
+    // Pseudoaligning many files at once with the same workers must give the same output for each file
+    // as pseudoaligning them one by one
+    for(TestCase tcase : generate_testcases(100, 30, 300, 30, 4, 6, 5)){
+        string index_prefix = build_test_index(tcase);
+
+        // Split the queries into files of different sizes
+        int64_t n_files = 5;
+        vector<vector<string>> file_queries(n_files);
+        for(int64_t i = 0; i < tcase.queries.size(); i++) file_queries[(i * i) % n_files].push_back(tcase.queries[i]);
+        string query_list = get_temp_file_manager().create_filename("query-list-");
+        sbwt::throwing_ofstream query_list_out(query_list);
+        for(int64_t f = 0; f < n_files; f++){
+            string query_file = get_temp_file_manager().create_filename("queries-",".fna");
+            write_as_fasta(file_queries[f], query_file);
+            query_list_out << query_file << "\n";
+        }
+        query_list_out.close();
+
+        for(string extra_options : {"--sort-output --threshold 1 --rc", "--sort-output --threshold 0.7 --dedup-reads", "--threshold 1 --binary-output --sort-output"}){
+            vector<vector<vector<string>>> outputs; // Run -> file -> lines
+            for(string concurrency : {"--max-concurrent-files 1", "--max-concurrent-files 3"}){
+                string out_list = get_temp_file_manager().create_filename("out-list-");
+                vector<string> outfiles;
+                sbwt::throwing_ofstream out_list_out(out_list);
+                for(int64_t f = 0; f < n_files; f++){
+                    outfiles.push_back(get_temp_file_manager().create_filename("out-"));
+                    out_list_out << outfiles.back() << "\n";
+                }
+                out_list_out.close();
+
+                Argv pseudoalign_argv(split("pseudoalign --query-file-list " + query_list + " -i " + index_prefix + " --out-file-list " + out_list + " --n-threads 3 --buffer-size-megas 0.0001 --sort-hits --temp-dir " + get_temp_file_manager().get_dir() + " " + concurrency + " " + extra_options));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+
+                outputs.emplace_back();
+                for(string outfile : outfiles) outputs.back().push_back(read_all_lines(outfile));
+            }
+            ASSERT_EQ(outputs[0], outputs[1]);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, metrics_out){
+    // Collecting metrics must not change the output, and the summary must have the right counts
+    for(TestCase tcase : generate_testcases(20, 30, 300, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        int64_t n_bases = 0, n_kmers = 0;
+        for(const string& Q : tcase.queries){
+            n_bases += Q.size();
+            n_kmers += max((int64_t)0, (int64_t)Q.size() - tcase.k + 1);
+        }
+
+        for(string extra_options : {"--threshold 1 --rc", "--threshold 0.7 --sort-output"}){
+            vector<vector<string>> outputs;
+            string metrics_file = get_temp_file_manager().create_filename("metrics-",".jsonl");
+            for(string metrics : {"", "--metrics-out " + metrics_file + " --metrics-interval 0.001"}){
+                string outfile = get_temp_file_manager().create_filename("out-");
+                Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --n-threads 2 --buffer-size-megas 0.001 --sort-hits --temp-dir " + get_temp_file_manager().get_dir() + " " + extra_options + " " + metrics));
+                ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+                vector<string> lines = read_all_lines(outfile);
+                sort(lines.begin(), lines.end());
+                outputs.push_back(lines);
+            }
+            ASSERT_EQ(outputs[0], outputs[1]);
+
+            vector<string> metrics_lines = read_all_lines(metrics_file);
+            ASSERT_GE(metrics_lines.size(), 1);
+            for(const string& line : metrics_lines) ASSERT_EQ(line.front(), '{');
+            const string& summary = metrics_lines.back();
+            ASSERT_NE(summary.find("\"type\": \"summary\""), string::npos);
+            ASSERT_NE(summary.find("\"reads\": " + to_string(tcase.queries.size()) + ","), string::npos);
+            ASSERT_NE(summary.find("\"bases\": " + to_string(n_bases) + ","), string::npos);
+            ASSERT_NE(summary.find("\"kmers\": " + to_string(n_kmers) + ","), string::npos);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, fused_rc_lookup){
+    // The one-pass lookup of both strands must fill the same color set id buffers as the two-pass lookup
+    int64_t k = 15;
+    srand(8123);
+    vector<string> refs;
+    vector<int64_t> colors;
+    for(int64_t i = 0; i < 10; i++){
+        refs.push_back(get_random_dna_string(500, 4));
+        colors.push_back(i % 4);
+    }
+    string fastafile = get_temp_file_manager().create_filename("refs-",".fna");
+    write_as_fasta(refs, fastafile);
+
+    plain_matrix_sbwt_t SBWT;
+    build_nodeboss_in_memory<plain_matrix_sbwt_t>(refs, SBWT, k, true);
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    Coloring_Builder<SDSL_Variant_Color_Set> cb;
+    seq_io::Reader<> reader(fastafile);
+    cb.build_coloring(coloring, SBWT, reader, colors, 2048, 2, 3);
+
+    // Substrings of references, some with an N or reverse complemented, random sequences and too short sequences
+    vector<string> queries;
+    for(int64_t i = 0; i < 100; i++){
+        const string& ref = refs[rand() % refs.size()];
+        int64_t len = 1 + rand() % 150;
+        string Q = ref.substr(rand() % (ref.size() - len), len);
+        if(i % 4 == 1) Q[rand() % Q.size()] = 'N';
+        if(i % 4 == 2) Q = sbwt::get_rc(Q);
+        if(i % 4 == 3) Q = get_random_dna_string(len, 4);
+        queries.push_back(Q);
+    }
+
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+    pseudoalignment::WorkerContext<Coloring<SDSL_Variant_Color_Set>> context = {&SBWT, &coloring, true, 1, true, false, 1 << 16, &total_length, &total_bytes, &writer, false, 0, false, false, 0, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+    pseudoalignment::IntersectionWorker<Coloring<SDSL_Variant_Color_Set>> fused(context);
+    pseudoalignment::IntersectionWorker<Coloring<SDSL_Variant_Color_Set>> two_pass(context);
+    two_pass.fused_rc_lookup = false;
+
+    for(int64_t i = 0; i < queries.size(); i++){
+        const string& Q1 = queries[i];
+        const string& Q2 = queries[(i * 7 + 3) % queries.size()];
+
+        fused.lookup_color_set_ids(Q1.c_str(), Q1.size());
+        two_pass.lookup_color_set_ids(Q1.c_str(), Q1.size());
+        ASSERT_EQ(fused.color_set_id_buffer, two_pass.color_set_id_buffer);
+        ASSERT_EQ(fused.rc_color_set_id_buffer, two_pass.rc_color_set_id_buffer);
+
+        fused.lookup_color_set_ids_of_pair(Q1.c_str(), Q1.size(), Q2.c_str(), Q2.size());
+        two_pass.lookup_color_set_ids_of_pair(Q1.c_str(), Q1.size(), Q2.c_str(), Q2.size());
+        ASSERT_EQ(fused.color_set_id_buffer, two_pass.color_set_id_buffer);
+        ASSERT_EQ(fused.rc_color_set_id_buffer, two_pass.rc_color_set_id_buffer);
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, threshold_bitmap_counting){
+    // Counting bitmap color sets word-at-a-time must give the same hits as counting decoded colors one by one
+    int64_t k = 15;
+    srand(2291);
+    string core = get_random_dna_string(300, 4);
+    string half_core = get_random_dna_string(300, 4);
+    vector<string> refs;
+    vector<int64_t> colors;
+    for(int64_t i = 0; i < 300; i++){
+        // All references share the core, and half of them share another segment, so that there are
+        // bitmaps and arrays of colors of different densities
+        string ref = get_random_dna_string(100, 4) + core + get_random_dna_string(100, 4);
+        if(i % 2 == 0) ref += half_core;
+        refs.push_back(ref);
+        colors.push_back(i);
+    }
+    string fastafile = get_temp_file_manager().create_filename("refs-",".fna");
+    write_as_fasta(refs, fastafile);
+
+    plain_matrix_sbwt_t SBWT;
+    build_nodeboss_in_memory<plain_matrix_sbwt_t>(refs, SBWT, k, true);
+    Coloring<SDSL_Variant_Color_Set> coloring;
+    Coloring_Builder<SDSL_Variant_Color_Set> cb;
+    seq_io::Reader<> reader(fastafile);
+    cb.build_coloring(coloring, SBWT, reader, colors, 1 << 20, 2, 3);
+
+    // Reads that span the boundaries of the shared segments, some reverse complemented
+    vector<string> queries;
+    for(int64_t i = 0; i < 200; i++){
+        const string& ref = refs[rand() % refs.size()];
+        string Q = ref.substr(rand() % (ref.size() - 100), 100);
+        if(i % 3 == 1) Q = sbwt::get_rc(Q);
+        queries.push_back(Q);
+    }
+
+    ParallelNullWriter writer;
+    atomic<int64_t> total_length = 0;
+    atomic<int64_t> total_bytes = 0;
+    for(bool rc : {false, true}){
+        for(double threshold : {0.3, 0.8}){
+            pseudoalignment::WorkerContext<Coloring<SDSL_Variant_Color_Set>> context = {&SBWT, &coloring, rc, threshold, false, true, 1 << 16, &total_length, &total_bytes, &writer, false, 0, false, false, 0, nullptr, false, 1, 0, nullptr, true, nullptr, nullptr};
+            pseudoalignment::ThresholdWorker<Coloring<SDSL_Variant_Color_Set>> bitmap_worker(context);
+            pseudoalignment::ThresholdWorker<Coloring<SDSL_Variant_Color_Set>> decoding_worker(context);
+            decoding_worker.bitmap_counting = false;
+            for(bool force_scalar : {false, true}){
+                color_counting::force_scalar_kernel(force_scalar);
+                for(int64_t i = 0; i < queries.size(); i++){
+                    bitmap_worker.process_sequence(queries[i].c_str(), queries[i].size(), i);
+                    decoding_worker.process_sequence(queries[i].c_str(), queries[i].size(), i);
+                    ASSERT_EQ(bitmap_worker.hits, decoding_worker.hits);
+                }
+            }
+            color_counting::force_scalar_kernel(false);
+        }
+    }
+}
+
+TEST(TEST_PSEUDOALIGN, numa_pinning_and_replicas){
+    // Pinning the threads and replicating the index must not change the output
+    for(TestCase tcase : generate_testcases(10, 30, 300, 30, 4, 6, 5)){
+        string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+        write_as_fasta(tcase.queries, queries_outfilename);
+        string index_prefix = build_test_index(tcase);
+
+        vector<vector<string>> outputs;
+        for(string numa_options : {"", "--pin-threads", "--numa-replicate-index"}){
+            string outfile = get_temp_file_manager().create_filename("out-");
+            Argv pseudoalign_argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --n-threads 3 --buffer-size-megas 0.001 --sort-hits --sort-output --threshold 0.7 --temp-dir " + get_temp_file_manager().get_dir() + " " + numa_options));
+            ASSERT_EQ(pseudoalign_main(pseudoalign_argv.size, pseudoalign_argv.array),0);
+            outputs.push_back(read_all_lines(outfile));
+        }
+        ASSERT_EQ(outputs[0], outputs[1]);
+        ASSERT_EQ(outputs[0], outputs[2]);
+
+        // The replicas must be identical to the index even on a machine with one node
+        plain_matrix_sbwt_t SBWT;
+        SBWT.load(index_prefix + ".tdbg");
+        std::variant<Coloring<SDSL_Variant_Color_Set>, Coloring<Roaring_Color_Set>> coloring;
+        load_coloring(index_prefix + ".tcolors", SBWT, coloring);
+        Index_Replicas replicas(index_prefix + ".tdbg", index_prefix + ".tcolors", 3);
+        const Coloring<SDSL_Variant_Color_Set>& original = std::get<Coloring<SDSL_Variant_Color_Set>>(coloring);
+        for(int64_t node = 0; node < replicas.placement.n_nodes; node++){
+            const Coloring<SDSL_Variant_Color_Set>* copy = replicas.get_coloring<Coloring<SDSL_Variant_Color_Set>>(node);
+            ASSERT_EQ(replicas.SBWTs[node]->number_of_subsets(), SBWT.number_of_subsets());
+            for(int64_t v = 0; v < SBWT.number_of_subsets(); v++){
+                if(!original.is_core_kmer(v)) continue;
+                ASSERT_EQ(copy->get_color_set_of_node_as_vector(v), original.get_color_set_of_node_as_vector(v));
+            }
+        }
+    }
+}
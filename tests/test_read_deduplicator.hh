@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <gtest/gtest.h>
+#include "globals.hh"
+#include "Read_Deduplicator.hh"
+
+TEST(READ_DEDUPLICATOR, single_reads){
+    vector<string> reads = {"ACGTT", "ACGTT", "AACGT", "ACGTA", "acgtt", "ACNTT", "ACNTT", "AANGT", "ACGT"};
+
+    // Without reverse complements only exact copies are duplicates
+    Read_Deduplicator fw_only(false);
+    fw_only.start_batch(reads.size());
+    vector<int64_t> expected_fw = {-1, 0, -1, -1, -1, -1, 4, -1, -1};
+    for(int64_t i = 0; i < reads.size(); i++)
+        ASSERT_EQ(fw_only.find_or_insert(reads[i].data(), reads[i].size(), nullptr, 0), expected_fw[i]);
+
+    // AACGT is the reverse complement of ACGTT. Reads with other characters than ACGT only match exact copies.
+    Read_Deduplicator both(true);
+    both.start_batch(reads.size());
+    vector<int64_t> expected_both = {-1, 0, 0, -1, -1, -1, 3, -1, -1};
+    for(int64_t i = 0; i < reads.size(); i++)
+        ASSERT_EQ(both.find_or_insert(reads[i].data(), reads[i].size(), nullptr, 0), expected_both[i]);
+    ASSERT_EQ(both.n_duplicates, 3);
+
+    // A new batch forgets the old reads
+    both.start_batch(1);
+    ASSERT_EQ(both.find_or_insert(reads[0].data(), reads[0].size(), nullptr, 0), -1);
+}
+
+TEST(READ_DEDUPLICATOR, pairs_and_results){
+    string A = "AACCG", B = "GTTTA";
+    string rcA = "CGGTT", rcB = "TAAAC";
+
+    Read_Deduplicator dedup(true);
+    dedup.start_batch(4);
+    ASSERT_EQ(dedup.find_or_insert(A.data(), A.size(), B.data(), B.size()), -1);
+    ASSERT_EQ(dedup.find_or_insert(B.data(), B.size(), A.data(), A.size()), -1); // Swapped mates are different
+    ASSERT_EQ(dedup.find_or_insert(rcB.data(), rcB.size(), rcA.data(), rcA.size()), 0); // Reverse complement of the pair
+    ASSERT_EQ(dedup.find_or_insert(A.data(), A.size(), nullptr, 0), -1); // A single read is not a pair
+
+    vector<int64_t> hits;
+    int64_t n_relevant;
+    ASSERT_FALSE(dedup.get_result(0, hits, n_relevant));
+    dedup.set_result(0, {3, 5, 8}, 7);
+    dedup.set_result(1, {}, 0);
+    ASSERT_TRUE(dedup.get_result(0, hits, n_relevant));
+    ASSERT_EQ(hits, vector<int64_t>({3, 5, 8}));
+    ASSERT_EQ(n_relevant, 7);
+    ASSERT_TRUE(dedup.get_result(1, hits, n_relevant));
+    ASSERT_TRUE(hits.empty());
+}
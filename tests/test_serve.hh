@@ -0,0 +1,108 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <sstream>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include "globals.hh"
+#include "commands.hh"
+#include "serve.hh"
+#include "test_tools.hh"
+
+TEST(TEST_SERVE, jobs_match_pseudoalign){
+    TestCase tcase = generate_testcases(100, 30, 300, 30, 4, 6, 5)[0];
+    string queries_outfilename = get_temp_file_manager().create_filename("queries-",".fna");
+    write_as_fasta(tcase.queries, queries_outfilename);
+    string index_prefix = build_test_index(tcase);
+
+    string socket_path = get_temp_file_manager().create_filename("sock-");
+    std::thread server([&](){
+        Argv serve_argv(split("serve -i " + index_prefix + " --socket " + socket_path + " --temp-dir " + get_temp_file_manager().get_dir() + " -t 3"));
+        serve_main(serve_argv.size, serve_argv.array);
+    });
+    while(!std::filesystem::exists(socket_path)) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    vector<string> options_list = {"--threshold 1 --rc", "--threshold 0.7 --report-relevant-kmer-count", "--threshold 0.5 -t 2"};
+
+    // Expected outputs from the pseudoalign command
+    vector<string> expected;
+    for(string options : options_list){
+        string outfile = get_temp_file_manager().create_filename("out-");
+        Argv argv(split("pseudoalign -q " + queries_outfilename + " -i " + index_prefix + " -o " + outfile + " --sort-output --sort-hits --temp-dir " + get_temp_file_manager().get_dir() + " " + options));
+        ASSERT_EQ(pseudoalign_main(argv.size, argv.array), 0);
+        string contents;
+        for(string line : read_all_lines(outfile)) contents += line + "\n";
+        expected.push_back(contents);
+    }
+
+    // Inline sequences, with the output sent back. The jobs run at the same time.
+    string queries_fasta;
+    for(const string& S : tcase.queries) queries_fasta += ">\n" + S + "\n";
+    vector<string> results(options_list.size());
+    vector<std::thread> clients;
+    for(int64_t i = 0; i < options_list.size(); i++){
+        clients.push_back(std::thread([&, i](){
+            std::stringstream out;
+            serve::run_client_job(socket_path, split(options_list[i] + " --sort-output-lines --sort-hits"), queries_fasta, out);
+            results[i] = out.str();
+        }));
+    }
+    for(std::thread& t : clients) t.join();
+    ASSERT_EQ(results, expected);
+
+    // A query file and an output file
+    string outfile = get_temp_file_manager().create_filename("out-");
+    std::stringstream ignored;
+    serve::run_client_job(socket_path, split("-q " + queries_outfilename + " -o " + outfile + " --sort-output-lines --sort-hits " + options_list[0]), "", ignored);
+    string contents;
+    for(string line : read_all_lines(outfile)) contents += line + "\n";
+    ASSERT_EQ(contents, expected[0]);
+
+    // Relative paths are made absolute by the client, also in the form --option=path
+    string relative_outfile = std::filesystem::relative(get_temp_file_manager().create_filename("out-")).string();
+    string relative_queries = std::filesystem::relative(queries_outfilename).string();
+    vector<string> job_args = split("--query-file=" + relative_queries + " -o" + relative_outfile + " --sort-output-lines --sort-hits " + options_list[0]);
+    ASSERT_TRUE(serve::make_paths_absolute(job_args));
+    ASSERT_EQ(job_args[0], "--query-file=" + std::filesystem::absolute(relative_queries).string());
+    ASSERT_EQ(job_args[1], "-o" + std::filesystem::absolute(relative_outfile).string());
+    serve::run_client_job(socket_path, job_args, "", ignored);
+    contents.clear();
+    for(string line : read_all_lines(std::filesystem::absolute(relative_outfile).string())) contents += line + "\n";
+    ASSERT_EQ(contents, expected[0]);
+
+    vector<string> separate_args = split("-q " + relative_queries + " --threshold 0.5 --out-file " + relative_outfile);
+    ASSERT_TRUE(serve::make_paths_absolute(separate_args));
+    ASSERT_EQ(separate_args, split("-q " + std::filesystem::absolute(relative_queries).string() + " --threshold 0.5 --out-file " + std::filesystem::absolute(relative_outfile).string()));
+    vector<string> no_query_args = split("--threshold 0.5 --out-file=" + relative_outfile);
+    ASSERT_FALSE(serve::make_paths_absolute(no_query_args));
+
+    // Options that act on the whole server process are rejected
+    for(string process_option : {"--pin-threads", "--verbose", "--metrics-out " + outfile})
+        ASSERT_THROW(serve::run_client_job(socket_path, split(process_option), queries_fasta, ignored), std::runtime_error);
+
+    // A failing job does not stop the server
+    ASSERT_THROW(serve::run_client_job(socket_path, split("-q nonexistent_file.fna"), "", ignored), std::runtime_error);
+
+    // Neither do jobs that fail while the input is being read: a FASTQ file that ends in the middle of a
+    // read, and paired-end files with different numbers of reads
+    string broken_fastq = get_temp_file_manager().create_filename("broken-", ".fastq");
+    {
+        sbwt::throwing_ofstream broken_out(broken_fastq);
+        for(const string& S : tcase.queries) broken_out << "@\n" << S << "\n+\n" << string(S.size(), 'I') << "\n";
+        broken_out << "@truncated\n";
+    }
+    ASSERT_THROW(serve::run_client_job(socket_path, split("-q " + broken_fastq + " -t 2"), "", ignored), std::runtime_error);
+
+    string fewer_mates = get_temp_file_manager().create_filename("mates-", ".fna");
+    write_as_fasta(vector<string>(tcase.queries.begin(), tcase.queries.begin() + tcase.queries.size() / 2), fewer_mates);
+    ASSERT_THROW(serve::run_client_job(socket_path, split("--paired -q " + queries_outfilename + " --query-file-2 " + fewer_mates), "", ignored), std::runtime_error);
+
+    std::stringstream after_errors;
+    serve::run_client_job(socket_path, split(options_list[0] + " --sort-output-lines --sort-hits"), queries_fasta, after_errors);
+    ASSERT_EQ(after_errors.str(), expected[0]);
+
+    serve::send_shutdown_request(socket_path);
+    server.join();
+}
@@ -2,6 +2,7 @@
 
 #include "setup_tests.hh"
 #include <gtest/gtest.h>
+#include <sstream>
 #include "globals.hh"
 #include "sbwt/globals.hh"
 #include "coloring/Sparse_Uint_Array.hh"
@@ -39,4 +40,73 @@ TEST(TEST_SPARSE_UINT_ARRAY, random_test){
         else
             ASSERT_EQ(A.get(i), reference[i]);
     }
-}
\ No newline at end of file
+}
+// Checks that random arrays with one value per density cells on average have the same content in the
+// given layout as in the separate layout, also after converting back and after the stream format
+void check_sparse_uint_array_layout(Sparse_Uint_Array_Layout layout, const vector<int64_t>& densities){
+    for(int64_t length : {0, 1, 64, 65, 1000, 20000}){
+        for(int64_t density : densities){
+            for(int64_t max_value : vector<int64_t>{0, 1, 8000, 1LL << 40}){
+                sdsl::bit_vector marks(length, 0);
+                vector<int64_t> reference(length, -1);
+                for(int64_t i = 0; i < length; i++) marks[i] = rand() % density == 0;
+                int64_t n_values = 0;
+                for(int64_t i = 0; i < length; i++) n_values += marks[i];
+                int64_t width = 1;
+                while(width < 64 && (max_value >> width) > 0) width++;
+                sdsl::int_vector<> values(n_values, 0, width);
+                int64_t j = 0;
+                for(int64_t i = 0; i < length; i++){
+                    if(!marks[i]) continue;
+                    values[j] = ((uint64_t)rand() * rand()) % (max_value + 1);
+                    reference[i] = values[j++];
+                }
+
+                Sparse_Uint_Array A(marks, values, max_value);
+                Sparse_Uint_Array B = A.with_layout(layout);
+                Sparse_Uint_Array C = B.with_layout(Sparse_Uint_Array_Layout::separate);
+                Sparse_Uint_Array D; // From the image, like when memory-mapped
+                D.load_image(B.get_image(), layout);
+                stringstream ss; // The stream format is always the separate layout
+                B.serialize(ss);
+                Sparse_Uint_Array E;
+                E.load(ss);
+
+                ASSERT_EQ(B.get_layout(), layout);
+                ASSERT_EQ(B.size(), length);
+                ASSERT_EQ(B.number_of_values(), n_values);
+                ASSERT_EQ(B.get_max_value(), max_value);
+                for(const Sparse_Uint_Array* X : {&B, &C, &D, &E}){
+                    for(int64_t i = 0; i < length; i++){
+                        ASSERT_EQ(X->get(i), reference[i]);
+                        ASSERT_EQ(X->has_index(i), reference[i] != -1);
+                        if(reference[i] != -1) ASSERT_EQ(X->get_value_at(X->value_position(i)), reference[i]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(TEST_SPARSE_UINT_ARRAY, interleaved_layout){
+    srand(2222);
+    // Densities that give each block size, and widths that do and do not fill the cache line evenly
+    check_sparse_uint_array_layout(Sparse_Uint_Array_Layout::interleaved, {1, 3, 50});
+}
+
+TEST(TEST_SPARSE_UINT_ARRAY, elias_fano_layout){
+    srand(2323);
+    // From no low bits to buckets that are further apart than the sampling interval
+    check_sparse_uint_array_layout(Sparse_Uint_Array_Layout::elias_fano, {1, 3, 50, 1000});
+
+    // Converting between the two compact layouts goes through the separate layout
+    sdsl::bit_vector marks(5000, 0);
+    for(int64_t i = 0; i < 5000; i += 7) marks[i] = 1;
+    sdsl::int_vector<> values(715, 0, 10);
+    for(int64_t i = 0; i < 715; i++) values[i] = i;
+    Sparse_Uint_Array A(marks, values, 714);
+    Sparse_Uint_Array B = A.with_layout(Sparse_Uint_Array_Layout::interleaved).with_layout(Sparse_Uint_Array_Layout::elias_fano);
+    ASSERT_EQ(B.get_layout(), Sparse_Uint_Array_Layout::elias_fano);
+    for(int64_t i = 0; i < 5000; i++) ASSERT_EQ(B.get(i), A.get(i));
+    ASSERT_LT(B.space_breakdown()["marks-elias-fano"], A.plain_marks_size_in_bytes());
+}
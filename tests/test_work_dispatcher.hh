@@ -3,9 +3,13 @@
 #include <gtest/gtest.h>
 #include <vector>
 #include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <filesystem>
 #include "setup_tests.hh"
 #include "globals.hh"
 #include "WorkDispatcher.hh"
+#include "parallel_gzip.hh"
 #include "SeqIO/SeqIO.hh"
 
 class DispatcherConsumerTestCallback : DispatcherConsumerCallback{
@@ -105,3 +109,154 @@ TEST(WORK_DISPATCHER, basic_test){
         delete callbacks[i];
 
 }
+
+// Collects everything written to it into a string
+class StringParallelWriter : public ParallelBaseWriter{
+    public:
+    string data;
+    std::mutex mutex;
+    virtual void write(const string& S){
+        write(S.data(), S.size());
+    }
+    virtual void write(const char* S, int64_t S_length){
+        std::lock_guard<std::mutex> lg(mutex);
+        data.append(S, S_length);
+    }
+    virtual void flush(){}
+};
+
+TEST(WORK_DISPATCHER, reordering_writer){
+    srand(1234);
+
+    // Batches of one line per sequence. Some batches have no output at all.
+    int64_t n_batches = 2000;
+    vector<int64_t> batch_starts = {0};
+    vector<string> batch_data;
+    string expected;
+    for(int64_t i = 0; i < n_batches; i++){
+        int64_t n_seqs = 1 + rand() % 5;
+        string data;
+        if(rand() % 10 != 0){
+            for(int64_t j = 0; j < n_seqs; j++) data += to_string(batch_starts.back() + j) + "\n";
+        }
+        batch_data.push_back(data);
+        expected += data;
+        batch_starts.push_back(batch_starts.back() + n_seqs);
+    }
+
+    for(int64_t max_pending_bytes : {0, 100, 1 << 20}){
+        unique_ptr<StringParallelWriter> inner = make_unique<StringParallelWriter>();
+        StringParallelWriter* inner_ptr = inner.get();
+        ParallelReorderingWriter writer(std::move(inner), max_pending_bytes);
+
+        // The threads take batches in order like the thread pool does, but finish them in random order
+        std::atomic<int64_t> next_batch = 0;
+        vector<std::thread> threads;
+        for(int64_t t = 0; t < 8; t++){
+            threads.push_back(std::thread([&](){
+                int64_t busywork = 0;
+                while(true){
+                    int64_t i = next_batch++;
+                    if(i >= n_batches) break;
+                    int64_t work = rand() % 10000;
+                    for(int64_t j = 0; j < work; j++) busywork += j;
+                    writer.write_batch(batch_starts[i], batch_starts[i+1] - batch_starts[i], batch_data[i].data(), batch_data[i].size());
+                }
+                ASSERT_GE(busywork, 0);
+            }));
+        }
+        for(std::thread& t : threads) t.join();
+
+        ASSERT_EQ(inner_ptr->data, expected);
+    }
+}
+
+TEST(WORK_DISPATCHER, block_writer){
+    srand(2020);
+
+    // Batches of one line per sequence, after a header written with a plain write
+    int64_t n_batches = 2000;
+    string header = "header\n";
+    vector<int64_t> batch_starts = {0};
+    vector<string> batch_data;
+    string expected = header;
+    for(int64_t i = 0; i < n_batches; i++){
+        int64_t n_seqs = 1 + rand() % 5;
+        string data;
+        if(rand() % 10 != 0){
+            for(int64_t j = 0; j < n_seqs; j++) data += to_string(batch_starts.back() + j) + "\n";
+        }
+        batch_data.push_back(data);
+        expected += data;
+        batch_starts.push_back(batch_starts.back() + n_seqs);
+    }
+
+    for(bool gzipped : {false, true}){
+        for(bool ordered : {false, true}){
+            for(int64_t max_queued_bytes : {0, 100, 1 << 20}){
+                string filename = get_temp_file_manager().create_filename("", gzipped ? ".txt.gz" : ".txt");
+                {
+                    unique_ptr<ParallelBaseWriter> block_writer = make_unique<ParallelBlockWriter>(filename, gzipped, max_queued_bytes);
+                    if(ordered) block_writer = make_unique<ParallelReorderingWriter>(std::move(block_writer), max_queued_bytes);
+                    ParallelBaseWriter& writer = *block_writer;
+                    writer.write(header);
+
+                    // The threads take batches in order like the thread pool does, but finish them in random order
+                    std::atomic<int64_t> next_batch = 0;
+                    vector<std::thread> threads;
+                    for(int64_t t = 0; t < 8; t++){
+                        threads.push_back(std::thread([&](){
+                            int64_t busywork = 0;
+                            while(true){
+                                int64_t i = next_batch++;
+                                if(i >= n_batches) break;
+                                int64_t work = rand() % 10000;
+                                for(int64_t j = 0; j < work; j++) busywork += j;
+                                writer.write_batch(batch_starts[i], batch_starts[i+1] - batch_starts[i], batch_data[i].data(), batch_data[i].size());
+                            }
+                            ASSERT_GE(busywork, 0);
+                        }));
+                    }
+                    for(std::thread& t : threads) t.join();
+                } // The writer finishes when it is destroyed
+
+                string written;
+                if(gzipped){
+                    Parallel_Gzip_ifstream in(filename, 1);
+                    vector<char> buf(4096);
+                    while(true){
+                        in.read(buf.data(), buf.size());
+                        if(in.gcount() == 0) break;
+                        written.append(buf.data(), in.gcount());
+                    }
+                } else{
+                    ifstream in(filename, ios::binary);
+                    written.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                }
+
+                if(ordered) ASSERT_EQ(written, expected);
+                else{
+                    vector<string> written_lines = split(written, '\n');
+                    vector<string> expected_lines = split(expected, '\n');
+                    sort(written_lines.begin(), written_lines.end());
+                    sort(expected_lines.begin(), expected_lines.end());
+                    ASSERT_EQ(written_lines, expected_lines);
+                }
+            }
+        }
+    }
+}
+
+TEST(WORK_DISPATCHER, block_writer_write_error){
+    // Every write to /dev/full fails with no space left on the device
+    if(!std::filesystem::exists("/dev/full")) GTEST_SKIP();
+    string data(1 << 16, 'A');
+    for(bool gzipped : {false, true}){
+        for(bool ordered : {false, true}){
+            unique_ptr<ParallelBaseWriter> writer = make_unique<ParallelBlockWriter>("/dev/full", gzipped, 1 << 20);
+            if(ordered) writer = make_unique<ParallelReorderingWriter>(std::move(writer), 1 << 20);
+            for(int64_t i = 0; i < 100; i++) writer->write_batch(i, 1, data.data(), data.size());
+            ASSERT_THROW(writer->close(), std::runtime_error);
+        }
+    }
+}